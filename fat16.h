@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
@@ -80,9 +81,60 @@ typedef struct
   DWORD DataOffset;           // 数据区域的偏移量（字节）
   DWORD FatSize;              // 单个FAT的大小
   DWORD ClusterSize;          // 单个簇的大小(字节)
+  pthread_mutex_t FatLock;    // 修改FAT表时持有（递归锁）
+  pthread_rwlock_t ChainLock; // 读写文件数据、修改簇链或使用目录项偏移量时持有读锁，在线整理搬移簇、压缩目录时持有写锁
+  WORD *FatCache;             // 第一个FAT表的内存镜像，见fat16_alloc.c
+  DWORD ClusterCount;         // 簇号上限（不含），即数据簇数+2
   BPB_BS Bpb;
 } FAT16;  // 存储发文件系统所需要的元数据的数据结构
 
+/* 挂载选项（-o name=value） */
+typedef struct
+{
+  int deferred_free;       // unlink只将簇链加入待回收队列，由后台线程释放
+  unsigned reclaim_batch;  // 后台回收每批最多释放的簇数
+  unsigned reclaim_delay;  // 后台回收每批之间的间隔（毫秒）
+  int writeback;                    // 文件数据先写入内存，由后台线程回写
+  unsigned dirty_limit;             // 脏数据上限（MiB），达到后写入者被节流
+  unsigned dirty_background_ratio;  // 脏数据超过上限的该百分比时开始后台回写
+  unsigned dirty_expire;            // 脏数据在内存中停留的最长时间（毫秒）
+  int delalloc;                     // 写入超出已分配簇的部分暂存在内存中，之后一次性分配簇（同样受dirty_limit和dirty_expire限制）
+  int prealloc;                     // 连续追加时在文件末尾之后预分配簇，关闭文件时释放未用部分
+  unsigned prealloc_max;            // 每次最多预分配的簇数
+  int defrag;                       // 后台线程整理不连续的文件
+  unsigned defrag_batch;            // 在线整理每个事务最多搬移的簇数
+  unsigned defrag_delay;            // 在线整理每批之间的间隔（毫秒）
+  int dircompact;                   // unlink、rmdir之后由后台线程压缩已删除目录项过多的目录
+  unsigned dircompact_ratio;        // 已删除目录项达到目录项总数的该百分比时压缩
+  int readahead;                    // 检测顺序读，由后台线程把之后的簇预读到内存
+  unsigned readahead_max;           // 预读窗口的上限（KiB）
+  unsigned readahead_cache;         // 预读缓存的大小（MiB）
+  int uring;                        // 每个操作写入镜像的数据通过io_uring一次提交
+  unsigned uring_depth;             // 每个线程的ring的大小，也是一次提交的最大请求数
+  int odirect;                      // 以O_DIRECT打开镜像，绕过宿主机的页缓存
+  unsigned odirect_align;           // O_DIRECT的对齐字节数，为0时自动检测
+  int keep_cache;                   // 文件自上次打开后没有被修改时，内核保留缓存的页
+  double attr_timeout;              // 内核缓存文件属性的时间（秒），交给libfuse
+  double entry_timeout;             // 内核缓存文件名查找结果的时间（秒），交给libfuse
+  unsigned direct_io_min;           // 不小于该大小（MiB）的文件以direct_io打开，为0时只有O_DIRECT打开的文件使用
+  unsigned workers;                 // 处理请求的固定工作线程数，为0时使用fuse_main的请求循环
+  int pin_workers;                  // 工作线程固定在不同的CPU上
+  unsigned worker_queue;            // 读出但还没有处理完的请求数上限，为0时取工作线程数的4倍
+  unsigned bulk_workers;            // 同时处理大块读写的工作线程数上限，为0时取工作线程数减一
+  int iosched;                      // 读写镜像之前经过调度器，元数据优先于文件数据
+  unsigned iosched_depth;           // 同时进行的镜像读写数上限
+  unsigned meta_latency;            // 元数据读写的等待时间目标（毫秒），超过后减少同时进行的数据读写
+  unsigned alloc_groups;            // 数据区划分的分配组数，并行的写入者在不同的组中分配，为0时不分组
+  unsigned smallfile_cache;         // 小文件内容缓存的大小（MiB），为0时不缓存
+  unsigned smallfile_max;           // 缓存的小文件的大小上限（KiB）
+  int sidecar;                      // 卸载时把FAT镜像等内存结构写入索引文件，下次挂载时镜像未被修改则直接映射
+  int mount_scan;                   // 没有可用的索引文件时，挂载前并行检查FAT表并遍历目录树
+  unsigned scan_threads;            // 挂载扫描的线程数，为0时取在线的CPU数
+  int read_only;                    // 只读打开镜像，不重放日志、不读入待回收队列（离线分析工具使用，不是挂载选项）
+} FAT16_OPTIONS;
+
+extern FAT16_OPTIONS fat16_opts;
+
 void sector_read(FILE *fd, unsigned int secnum, void *buffer);
 void sector_write(FILE *fd, unsigned int secnum, const void *buffer);
 size_t io_read(FILE *fd, void *buf, long offset, size_t size);
@@ -96,12 +148,30 @@ char **org_path_split(char *pathInput);
 char *get_prt_path(const char *path, const char **orgPaths, int pathDepth);
 
 
+/* 镜像文件中的一段连续区域，由若干个簇号相邻的簇组成 */
+typedef struct
+{
+  long offset;  // 在镜像文件中的偏移量（字节）
+  size_t size;  // 长度（字节）
+} FAT16_EXTENT;
+
 FAT16 *pre_init_fat16(const char* imageFilePath);
 WORD fat_entry_by_cluster(FAT16 *fat16_ins, WORD ClusterN);
 void first_sector_by_cluster(FAT16 *fat16_ins, WORD ClusterN, WORD *FatClusEntryVal, WORD *FirstSectorofCluster, BYTE *buffer);
 long get_cluster_offset(FAT16 *fat16_ins, uint16_t cluster);
 int dir_entry_create(FAT16 *fat16_ins, int sectorNum, int offset, char *Name, BYTE attr, WORD firstClusterNum, DWORD fileSize);
+void dir_entry_delete(FAT16 *fat16_ins, off_t offset);
 int free_cluster(FAT16 *fat16_ins, int ClusterNum);
+int free_chain(FAT16 *fat16_ins, WORD first);
+int free_chain_partial(FAT16 *fat16_ins, WORD first, uint max, WORD *rest);
+int write_fat_entry(FAT16 *fat16_ins, WORD clusterN, WORD data);
+WORD alloc_clusters(FAT16 *fat16_ins, uint32_t n);
+WORD alloc_clusters_near(FAT16 *fat16_ins, uint32_t n, WORD goal);
+int is_cluster_inuse(uint16_t cluster_num);
+WORD file_last_cluster(FAT16 *fat16_ins, DIR_ENTRY *Dir, int64_t *count);
+int file_new_cluster(FAT16 *fat16_ins, DIR_ENTRY *Dir, WORD last_cluster, DWORD count);
+int file_prepare_write(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, off_t offset, size_t length, DWORD *new_size);
+int file_extent_map(FAT16 *fat16_ins, WORD firstCluster, off_t offset, size_t size, FAT16_EXTENT **extents);
 
 void *fat16_init(struct fuse_conn_info *conn);
 void fat16_destroy(void *data);
@@ -110,6 +180,8 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
                   off_t offset, struct fuse_file_info *fi);
 int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
                struct fuse_file_info *fi);
+int fat16_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                   struct fuse_file_info *fi);
 int fat16_mknod(const char *path, mode_t mode, dev_t devNum);
 int fat16_unlink(const char *path);
 int fat16_utimens(const char *path, const struct timespec tv[2]);
@@ -117,7 +189,227 @@ int fat16_mkdir(const char *path, mode_t mode);
 int fat16_rmdir(const char *path);
 int fat16_write(const char *path, const char *data, size_t size, off_t offset,
                 struct fuse_file_info *fi);
+int fat16_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                    struct fuse_file_info *fi);
 int fat16_truncate(const char *path, off_t size);
+int fat16_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int fat16_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi);
+int fat16_release(const char *path, struct fuse_file_info *fi);
+int fat16_getxattr(const char *path, const char *name, char *value, size_t size);
+int fat16_listxattr(const char *path, char *list, size_t size);
+
+/* 元数据日志（fat16_journal.c） */
+int journal_open(FAT16 *fat16_ins, const char *imageFilePath);
+int journal_pending(const char *imageFilePath);
+int journal_close(FAT16 *fat16_ins);
+void journal_begin(void);
+int journal_end(void);
+int journal_sync(void);
+int journal_sector_read(unsigned int secnum, void *buffer);
+int journal_sector_write(unsigned int secnum, const void *buffer);
+void journal_revoke(unsigned int secnum, unsigned int count);
+void journal_wrap_operations(struct fuse_operations *oper);
+void journal_log_orphan(WORD cluster, int add);
+DWORD crc32_checksum(DWORD crc, const void *data, size_t size);
+
+/* 后台簇回收（fat16_reclaim.c） */
+int reclaim_load(FAT16 *fat16_ins, const char *imageFilePath);
+int reclaim_save_queue(void);
+void reclaim_orphan_update(WORD cluster, int add);
+void reclaim_drain(FAT16 *fat16_ins);
+void reclaim_sync(FAT16 *fat16_ins);
+void reclaim_start(FAT16 *fat16_ins);
+void reclaim_stop(void);
+
+/* 文件数据回写缓存（fat16_writeback.c） */
+void writeback_start(FAT16 *fat16_ins);
+void writeback_stop(void);
+int writeback_sync(void);
+size_t writeback_write(FAT16 *fat16_ins, const void *buf, long pos, size_t size);
+size_t writeback_read(FAT16 *fat16_ins, void *buf, long pos, size_t size);
+void writeback_flush_range(FAT16 *fat16_ins, long pos, size_t size);
+void writeback_discard(WORD cluster);
+int writeback_stats(char *buf, size_t size);
+
+/* 延迟分配（fat16_delalloc.c） */
+int delalloc_write(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, const void *buff, off_t offset, size_t length);
+void delalloc_update_size(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, DWORD end);
+int delalloc_lookup(off_t offset_dir, DWORD *size, DWORD *base);
+int delalloc_read(off_t offset_dir, void *buf, off_t offset, size_t size);
+int delalloc_flush_file(off_t offset_dir);
+void delalloc_discard(off_t offset_dir);
+void delalloc_relocate(off_t from, off_t to);
+void delalloc_start(FAT16 *fat16_ins);
+void delalloc_stop(void);
+int delalloc_stats(char *buf, size_t size);
+
+/* 追加写入的簇链缓存与预分配（fat16_prealloc.c） */
+int prealloc_extend(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, off_t offset, int64_t new_cluster_count);
+void prealloc_release(off_t offset_dir);
+void prealloc_forget(off_t offset_dir);
+void prealloc_relocate(off_t from, off_t to);
+void prealloc_stop(void);
+int prealloc_stats(char *buf, size_t size);
+
+/* 目录树遍历（fat16_walk.c） */
+typedef struct
+{
+  /* 对每个有效的目录项调用 */
+  int (*entry)(FAT16 *fat16_ins, const char *path, DIR_ENTRY *Dir, off_t offset_dir, void *ctx);
+  /* 每个目录遍历完后调用，slots为结束标记之前的目录项数，deleted为其中已删除（0xE5）的个数 */
+  int (*dir)(FAT16 *fat16_ins, const char *path, DWORD slots, DWORD used, DWORD deleted, void *ctx);
+} FAT16_WALKER;
+
+int fat16_walk(FAT16 *fat16_ins, const FAT16_WALKER *fn, void *ctx);
+void chain_extents(FAT16 *fat16_ins, WORD first, DWORD *clusters, DWORD *extents);
+
+/* 碎片整理（fat16_defrag.c） */
+typedef struct
+{
+  DWORD files;             // 普通文件数
+  DWORD fragmented;        // 簇链不连续的文件数
+  DWORD clusters;          // 文件占用的簇数
+  DWORD extents;           // 文件的连续段总数
+  DWORD free_clusters;
+  DWORD free_runs;         // 空闲段数
+  DWORD largest_free_run;  // 最长空闲段的簇数
+} DEFRAG_REPORT;
+
+void defrag_report(FAT16 *fat16_ins, DEFRAG_REPORT *report);
+DWORD defrag_pass(FAT16 *fat16_ins, DWORD batch, unsigned delay, DEFRAG_REPORT *before, DEFRAG_REPORT *after);
+int defrag_format_report(const DEFRAG_REPORT *report, char *buf, size_t size);
+void defrag_start(FAT16 *fat16_ins);
+void defrag_stop(void);
+void defrag_wrap_operations(FAT16 *fat16_ins, struct fuse_operations *oper);
+int defrag_stats(char *buf, size_t size);
+
+/* 空闲目录项分配与目录扩展（fat16_dirslot.c） */
+int dir_lookup_cluster(FAT16 *fat16_ins, const char *dirPath);
+void dir_cluster_zero(FAT16 *fat16_ins, WORD cluster);
+int dir_alloc_slot(FAT16 *fat16_ins, WORD dirCluster, off_t *offset);
+void dir_slot_freed(FAT16 *fat16_ins, WORD dirCluster, off_t offset);
+void dir_slot_forget(WORD dirCluster);
+void *dir_slot_export(size_t *size);
+void dir_slot_import(const void *data, size_t size);
+int dirslot_stats(char *buf, size_t size);
+
+/* 目录压缩（fat16_dircompact.c） */
+int dir_compact(FAT16 *fat16_ins, WORD firstCluster, unsigned minRatio, DWORD *purged);
+void dircompact_note(WORD dirCluster);
+void dircompact_start(FAT16 *fat16_ins);
+void dircompact_stop(void);
+int fat16_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+int dircompact_stats(char *buf, size_t size);
+
+/* 顺序读检测与异步预读（fat16_readahead.c） */
+uint64_t readahead_open(void);
+void readahead_release(uint64_t fh);
+void readahead_note(FAT16 *fat16_ins, uint64_t fh, off_t offset_dir, WORD firstCluster, DWORD mappedSize, off_t offset, size_t size);
+void readahead_dir(FAT16 *fat16_ins, WORD firstCluster);
+size_t readahead_read(FILE *fd, void *buf, long pos, size_t size);
+void readahead_invalidate(long pos, size_t size);
+void readahead_forget(off_t offset_dir);
+void readahead_relocate(off_t from, off_t to);
+void readahead_start(FAT16 *fat16_ins);
+void readahead_stop(void);
+int readahead_stats(char *buf, size_t size);
+
+/* 镜像文件的批量I/O（fat16_uring.c） */
+void io_batch_begin(void);
+int io_batch_end(void);
+int io_batch_flush(void);
+int io_batch_write(int fd, const void *buf, long offset, size_t size);
+void io_batch_before_read(int fd, long offset, size_t size);
+size_t io_read_extents(FILE *fd, void *buf, const FAT16_EXTENT *extents, int count);
+void uring_start(void);
+void uring_stop(void);
+int uring_stats(char *buf, size_t size);
+
+/* 以O_DIRECT打开镜像（fat16_direct.c） */
+FILE *io_open_image(const char *imageFilePath);
+void io_direct_check_layout(FAT16 *fat16_ins);
+int io_direct_enabled(void);
+void *io_alloc(size_t size);
+int io_direct_unaligned(const void *buf, long offset, size_t size);
+size_t io_direct_read(FILE *fd, void *buf, long offset, size_t size);
+size_t io_direct_write(FILE *fd, const void *buf, long offset, size_t size);
+int direct_stats(char *buf, size_t size);
+
+/* 目录的读写锁（fat16_dirlock.c） */
+void dirlock_lock(WORD dir, int write);
+void dirlock_unlock(WORD dir);
+int dirlock_lock_parent(FAT16 *fat16_ins, const char *path, int write);
+void dirlock_sector_lock(DWORD secnum);
+void dirlock_sector_unlock(DWORD secnum);
+int dirlock_stats(char *buf, size_t size);
+
+/* 路径查找缓存（fat16_dcache.c） */
+int dcache_lookup(FAT16 *fat16_ins, const char *path, DIR_ENTRY *Dir, off_t *offset_dir);
+DWORD dcache_generation(void);
+void dcache_insert(const char *path, const BYTE *name, off_t offset_dir, DWORD gen);
+void dcache_invalidate(void);
+void *dcache_export(size_t *size);
+void dcache_import(const void *data, size_t size);
+int dcache_stats(char *buf, size_t size);
+
+/* 与内核页缓存的配合（fat16_kcache.c） */
+int fat16_open(const char *path, struct fuse_file_info *fi);
+void kcache_changed(off_t offset_dir);
+void kcache_forget(off_t offset_dir);
+void kcache_relocate(off_t from, off_t to);
+int kcache_stats(char *buf, size_t size);
+
+/* 镜像I/O的调度（fat16_iosched.c） */
+#define IOSCHED_META 0 // 保留扇区、FAT表、根目录区、目录扇区和日志
+#define IOSCHED_DATA 1 // 文件数据
+void iosched_start(FAT16 *fat16_ins);
+void iosched_set_stream(off_t offset_dir);
+void iosched_meta_begin(void);
+void iosched_meta_end(void);
+int iosched_class(long offset);
+void iosched_begin(int cls, size_t size);
+void iosched_end(int cls);
+int iosched_stats(char *buf, size_t size);
+
+/* 小文件内容缓存（fat16_sfcache.c） */
+int sfcache_lookup(WORD first, DWORD size, void *buf, off_t offset, size_t len, DWORD *gen);
+void sfcache_insert(WORD first, DWORD gen, const void *data, DWORD size);
+void sfcache_invalidate(WORD first);
+int sfcache_stats(char *buf, size_t size);
+
+/* 挂载索引文件（fat16_sidecar.c） */
+int sidecar_load(FAT16 *fat16_ins, const char *imageFilePath);
+int sidecar_save(FAT16 *fat16_ins);
+int sidecar_loaded(void);
+int sidecar_stats(char *buf, size_t size);
+
+/* 挂载时的并行元数据扫描（fat16_mountscan.c） */
+int mountscan_load_fat(FAT16 *fat16_ins);
+int mountscan_run(FAT16 *fat16_ins);
+int mountscan_stats(char *buf, size_t size);
+
+/* 固定线程池的请求循环（fat16_session.c） */
+int session_main(struct fuse_args *args, const struct fuse_operations *op, void *user_data);
+int session_stats(char *buf, size_t size);
+
+/* FAT表内存镜像与簇分配策略（fat16_alloc.c） */
+int fat_cache_load(FAT16 *fat16_ins);
+void alloc_groups_count_free(FAT16 *fat16_ins, DWORD start, DWORD end);
+void fat_cache_flush_sector(FAT16 *fat16_ins, uint fatSec);
+void fat_cache_set(FAT16 *fat16_ins, WORD cluster, WORD value);
+uint alloc_find_clusters(FAT16 *fat16_ins, uint n, WORD goal, WORD *clusters);
+WORD alloc_find_run(FAT16 *fat16_ins, uint n);
+uint alloc_group_find(FAT16 *fat16_ins, uint n, WORD goal, WORD *clusters, uint64_t *held);
+uint64_t alloc_group_lock_range(FAT16 *fat16_ins, WORD first, DWORD n);
+void alloc_group_unlock(uint64_t held);
+void alloc_free_space(FAT16 *fat16_ins, DWORD *freeClusters, DWORD *freeRuns, DWORD *largestRun);
+#define ALLOC_HIST_BUCKETS 17 // 空闲段长度直方图的桶数，第i个桶统计长度在[2^i, 2^(i+1))之间的段
+void alloc_free_histogram(FAT16 *fat16_ins, DWORD hist[ALLOC_HIST_BUCKETS]);
+int alloc_stats(FAT16 *fat16_ins, char *buf, size_t size);
+
+/* 运行统计（fat16_stats.c） */
+int stats_format(FAT16 *fat16_ins, char *buf, size_t size);
 
 void run_tests();
 
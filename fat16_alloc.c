@@ -0,0 +1,591 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * FAT表的内存镜像与簇分配策略
+ *
+ * 挂载时（pre_init_fat16）将第一个FAT表整个读入fat16_ins->FatCache（开启mount_scan时由扫描线程分段并行读入，
+ * 见fat16_mountscan.c），之后：
+ *   - fat_entry_by_cluster直接读内存；
+ *   - 修改FAT时先改内存，再用fat_cache_flush_sector把所在的整个扇区写入每个FAT表。
+ * 修改FatCache需要持有fat16_ins->FatLock（或分配组的锁，见下）；读取不加锁，表项用__atomic_load_n/fat_cache_set按WORD原子地读写。
+ *
+ * 分配n个簇时（alloc_find_clusters）依次尝试：
+ *   1. goal开始的n个簇（文件扩展时goal为文件最后一个簇的下一个簇），使文件保持连续；
+ *   2. 长度不小于n的空闲段中最短的一段（best fit），减少对大段空闲空间的切割；
+ *   3. 没有足够长的空闲段时，从最长的空闲段开始依次取用，使分段数尽量少。
+ *
+ * 开启alloc_groups后，数据区划分为若干个分配组，每组有自己的锁和空闲簇数，并行的写入者在不同的组中分配：
+ *   - 组的边界按FAT扇区对齐，不同组的表项不在同一个FAT扇区中；
+ *   - 文件扩展时先试goal（文件最后一个簇的下一个簇），新的簇链轮流从各组开始，
+ *     同时写入的多个文件各自在一个组中保持连续，不会交错；
+ *   - goal已被占用（多半是另一个写入者在同一组中）时改到空闲簇最多的组，在组内best fit，
+ *     之后的扩展在那里继续；组内没有足够长的空闲段时依次尝试其它组，都不行时锁住所有的组，按上面不分组的策略拆成多段；
+ *   - 分配只持有组的锁，不持有FatLock。FatCache的修改都经过fat_cache_set，同时维护各组的空闲簇数；
+ *     写回FAT扇区时持有该扇区的扇区锁，不同线程写回同一扇区时，后写回的一定包含之前的修改；
+ *   - 在线整理占用空闲段之前用alloc_group_lock_range锁住目标所在的组。
+ */
+
+#define ALLOC_FIRST_CLUSTER 0x04 // 分配从该簇开始扫描
+#define ALLOC_MAX_GROUPS 64
+#define ALLOC_GROUP_ALIGN (BYTES_PER_SECTOR / sizeof(WORD)) // 一个FAT扇区中的表项数，分配组的大小是它的倍数
+
+/* 一段连续的空闲簇 */
+typedef struct
+{
+  WORD start;
+  DWORD length;
+} FREE_RUN;
+
+static struct
+{
+  pthread_mutex_t lock;
+  uint64_t requests;      // 分配请求数
+  uint64_t goal_hits;     // 在goal处连续分配成功的次数
+  uint64_t best_fits;     // 由单个best fit空闲段满足的次数
+  uint64_t split;         // 只能拆成多段分配的次数
+  uint64_t extents;       // 分配出的连续段总数
+  uint64_t clusters;      // 分配出的簇总数
+  uint64_t group_local;   // 在首选的组中分配成功的次数
+  uint64_t group_other;   // 首选的组空间不足、在其它组中分配的次数
+  uint64_t group_global;  // 所有组都没有足够长的空闲段、锁住所有组拆分分配的次数
+} alloc_stat = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* 一个分配组，包含簇号[start, end) */
+typedef struct
+{
+  pthread_mutex_t lock;  // 在组内查找并占用空闲簇时持有
+  DWORD start, end;
+  DWORD free;            // 空闲簇数，由fat_cache_set原子地维护
+} __attribute__((aligned(64))) ALLOC_GROUP;
+
+static struct
+{
+  ALLOC_GROUP groups[ALLOC_MAX_GROUPS];
+  uint count;  // 组数，未开启alloc_groups时为1（只用于统计空闲簇数）
+  DWORD size;  // 每组的簇数
+  uint rotor;  // 新的簇链从哪个组开始
+} ag;
+
+/**
+ * @brief 把数据区划分为分配组，空闲簇数由alloc_groups_count_free统计
+ */
+static void alloc_groups_init(FAT16 *fat16_ins)
+{
+  uint count = fat16_opts.alloc_groups > 0 ? fat16_opts.alloc_groups : 1;
+  if (count > ALLOC_MAX_GROUPS)
+    count = ALLOC_MAX_GROUPS;
+  DWORD size = (fat16_ins->ClusterCount + count - 1) / count;
+  size = (size + ALLOC_GROUP_ALIGN - 1) / ALLOC_GROUP_ALIGN * ALLOC_GROUP_ALIGN;
+
+  ag.count = 0;
+  ag.size = size;
+  for (DWORD start = 0; start < fat16_ins->ClusterCount; start += size)
+  {
+    ALLOC_GROUP *g = &ag.groups[ag.count++];
+    pthread_mutex_init(&g->lock, NULL);
+    g->start = start < ALLOC_FIRST_CLUSTER ? ALLOC_FIRST_CLUSTER : start;
+    g->end = start + size < fat16_ins->ClusterCount ? start + size : fat16_ins->ClusterCount;
+    g->free = 0;
+  }
+}
+
+/**
+ * @brief 统计FatCache中簇号[start, end)的空闲簇，计入所在分配组的空闲簇数。
+ *        不同线程可以同时统计不相交的范围（挂载扫描分段读入FAT表时）。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param start     起始簇号
+ * @param end       结束簇号（不含）
+ */
+void alloc_groups_count_free(FAT16 *fat16_ins, DWORD start, DWORD end)
+{
+  if (start < ALLOC_FIRST_CLUSTER)
+    start = ALLOC_FIRST_CLUSTER;
+  while (start < end)
+  {
+    /* 范围可能跨越多个组，每组累计完再原子地加上 */
+    uint g = start / ag.size;
+    DWORD groupEnd = (g + 1) * ag.size < end ? (g + 1) * ag.size : end;
+    DWORD free = 0;
+    for (DWORD c = start; c < groupEnd; c++)
+      free += fat16_ins->FatCache[c] == CLUSTER_FREE;
+    __atomic_add_fetch(&ag.groups[g].free, free, __ATOMIC_RELAXED);
+    start = groupEnd;
+  }
+}
+
+/**
+ * @brief 读入第一个FAT表，建立内存镜像（已由sidecar_load映射时不再读取），并统计各分配组的空闲簇数。
+ *        开启mount_scan时由扫描线程并行读入和统计。需要在日志重放之后调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @return int      成功返回0
+ */
+int fat_cache_load(FAT16 *fat16_ins)
+{
+  DWORD TotSec = fat16_ins->Bpb.BPB_TotSec16 != 0 ? fat16_ins->Bpb.BPB_TotSec16 : fat16_ins->Bpb.BPB_TotSec32;
+  DWORD DataClusters = (TotSec - fat16_ins->FirstDataSector) / fat16_ins->Bpb.BPB_SecPerClus;
+
+  /* 可用的簇号为[CLUSTER_MIN, ClusterCount) */
+  fat16_ins->ClusterCount = DataClusters + CLUSTER_MIN;
+  if (fat16_ins->ClusterCount > fat16_ins->FatSize / sizeof(WORD))
+    fat16_ins->ClusterCount = fat16_ins->FatSize / sizeof(WORD);
+  if (fat16_ins->ClusterCount > CLUSTER_MAX + 1)
+    fat16_ins->ClusterCount = CLUSTER_MAX + 1;
+
+  alloc_groups_init(fat16_ins);
+
+  /* 索引文件有效时sidecar_load已经映射了FAT镜像 */
+  if (fat16_ins->FatCache != NULL)
+  {
+    alloc_groups_count_free(fat16_ins, 0, fat16_ins->ClusterCount);
+    return 0;
+  }
+
+  fat16_ins->FatCache = malloc(fat16_ins->FatSize);
+  if (fat16_opts.mount_scan && mountscan_load_fat(fat16_ins) == 0)
+    return 0;
+  for (DWORD sec = 0; sec < fat16_ins->Bpb.BPB_FATSz16; sec++)
+  {
+    sector_read(fat16_ins->fd, fat16_ins->Bpb.BPB_RsvdSecCnt + sec, (BYTE *)fat16_ins->FatCache + sec * BYTES_PER_SECTOR);
+  }
+  alloc_groups_count_free(fat16_ins, 0, fat16_ins->ClusterCount);
+  return 0;
+}
+
+/**
+ * @brief 修改FAT内存镜像中的一个表项，维护所在分配组的空闲簇数，释放簇时作废以它为首簇的小文件缓存。
+ *        调用者持有FatLock或表项所在组的锁。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param cluster   簇号
+ * @param value     新的表项
+ */
+void fat_cache_set(FAT16 *fat16_ins, WORD cluster, WORD value)
+{
+  WORD old = __atomic_exchange_n(&fat16_ins->FatCache[cluster], value, __ATOMIC_RELAXED);
+  /* 被释放的簇可能是某个文件的首簇，之后被其它文件重新使用 */
+  if (value == CLUSTER_FREE && old != CLUSTER_FREE)
+    sfcache_invalidate(cluster);
+  if ((old == CLUSTER_FREE) != (value == CLUSTER_FREE) && cluster >= ALLOC_FIRST_CLUSTER && ag.count > 0)
+  {
+    DWORD *free = &ag.groups[cluster / ag.size].free;
+    if (value == CLUSTER_FREE)
+      __atomic_add_fetch(free, 1, __ATOMIC_RELAXED);
+    else
+      __atomic_sub_fetch(free, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief 将FAT内存镜像中第fatSec个扇区写入每个FAT表。调用者持有FatLock。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param fatSec    FAT表内的扇区序号（从0开始）
+ */
+void fat_cache_flush_sector(FAT16 *fat16_ins, uint fatSec)
+{
+  const BYTE *data = (const BYTE *)fat16_ins->FatCache + fatSec * BYTES_PER_SECTOR;
+  dirlock_sector_lock(fat16_ins->Bpb.BPB_RsvdSecCnt + fatSec);
+  for (uint i = 0; i < fat16_ins->Bpb.BPB_NumFATS; i++)
+  {
+    sector_write(fat16_ins->fd, fat16_ins->Bpb.BPB_RsvdSecCnt + i * fat16_ins->Bpb.BPB_FATSz16 + fatSec, data);
+  }
+  dirlock_sector_unlock(fat16_ins->Bpb.BPB_RsvdSecCnt + fatSec);
+}
+
+/**
+ * @brief 返回从start开始的连续空闲簇的个数，最多数到limit个
+ */
+static DWORD free_run_length(FAT16 *fat16_ins, DWORD start, DWORD limit)
+{
+  DWORD len = 0;
+  while (len < limit && start + len < fat16_ins->ClusterCount && fat16_ins->FatCache[start + len] == CLUSTER_FREE)
+    len++;
+  return len;
+}
+
+static int free_run_cmp_desc(const void *a, const void *b)
+{
+  const FREE_RUN *x = a, *y = b;
+  if (x->length != y->length)
+    return x->length < y->length ? 1 : -1;
+  return (int)x->start - (int)y->start;
+}
+
+/**
+ * @brief 记录一次成功的分配
+ */
+static void alloc_stat_note(uint n, int goal_hit, int best_fit, uint extents)
+{
+  pthread_mutex_lock(&alloc_stat.lock);
+  alloc_stat.requests++;
+  alloc_stat.goal_hits += goal_hit;
+  alloc_stat.best_fits += best_fit;
+  alloc_stat.split += extents > 1;
+  alloc_stat.extents += extents;
+  alloc_stat.clusters += n;
+  pthread_mutex_unlock(&alloc_stat.lock);
+}
+
+/**
+ * @brief 按上述策略挑选n个空闲簇，按分配顺序存入clusters。不修改FAT，调用者持有FatLock。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param n         需要的簇数
+ * @param goal      希望开始的簇号，为0时不指定
+ * @param clusters  输出参数，至少能容纳n个簇号
+ * @return uint     找到的簇数，小于n表示空间不足
+ */
+uint alloc_find_clusters(FAT16 *fat16_ins, uint n, WORD goal, WORD *clusters)
+{
+  uint found = 0;
+  uint extents = 0;
+  int goal_hit = 0, best_fit = 0;
+
+  /* 1. 紧接在文件末尾之后 */
+  if (goal >= ALLOC_FIRST_CLUSTER && free_run_length(fat16_ins, goal, n) == n)
+  {
+    for (; found < n; found++)
+      clusters[found] = goal + found;
+    extents = 1;
+    goal_hit = 1;
+  }
+
+  /* 2. 收集所有空闲段，找长度不小于n的最短段 */
+  FREE_RUN *runs = NULL;
+  uint runCnt = 0, runCap = 0;
+  long best = -1;
+  for (DWORD c = ALLOC_FIRST_CLUSTER; found < n && c < fat16_ins->ClusterCount;)
+  {
+    DWORD len = free_run_length(fat16_ins, c, UINT32_MAX);
+    if (len == 0)
+    {
+      c++;
+      continue;
+    }
+    if (runCnt == runCap)
+    {
+      runCap = runCap ? runCap * 2 : 64;
+      runs = realloc(runs, runCap * sizeof(FREE_RUN));
+    }
+    runs[runCnt].start = c;
+    runs[runCnt].length = len;
+    if (len >= n && (best < 0 || len < runs[best].length))
+      best = runCnt;
+    runCnt++;
+    /* 恰好等长的段不可能被更好的段取代 */
+    if (len == n)
+      break;
+    c += len;
+  }
+
+  if (found < n && best >= 0)
+  {
+    for (; found < n; found++)
+      clusters[found] = runs[best].start + found;
+    extents = 1;
+    best_fit = 1;
+  }
+
+  /* 3. 从最长的空闲段开始依次取用 */
+  if (found < n)
+  {
+    qsort(runs, runCnt, sizeof(FREE_RUN), free_run_cmp_desc);
+    for (uint r = 0; r < runCnt && found < n; r++)
+    {
+      for (DWORD k = 0; k < runs[r].length && found < n; k++)
+        clusters[found++] = runs[r].start + k;
+      extents++;
+    }
+  }
+  free(runs);
+
+  if (found == n)
+    alloc_stat_note(n, goal_hit, best_fit, extents);
+  return found;
+}
+
+/**
+ * @brief 在簇号[lo, hi)中找能容纳n个簇的最短空闲段（best fit）
+ *
+ * @return uint 找到时返回n，否则返回0
+ */
+static uint alloc_find_in_range(FAT16 *fat16_ins, uint n, DWORD lo, DWORD hi, WORD *clusters)
+{
+  DWORD start = CLUSTER_END, bestLen = UINT32_MAX;
+  for (DWORD c = lo; c < hi;)
+  {
+    DWORD len = free_run_length(fat16_ins, c, hi - c);
+    if (len == 0)
+    {
+      c++;
+      continue;
+    }
+    if (len >= n && len < bestLen)
+    {
+      start = c;
+      bestLen = len;
+      if (len == n)
+        break;
+    }
+    c += len;
+  }
+  if (start == CLUSTER_END)
+    return 0;
+  for (uint i = 0; i < n; i++)
+    clusters[i] = start + i;
+  return n;
+}
+
+/**
+ * @brief 开启alloc_groups时代替alloc_find_clusters：在分配组中挑选n个空闲簇。
+ *        返回时持有held中各组的锁，调用者修改完FAT后用alloc_group_unlock释放。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param n         需要的簇数
+ * @param goal      希望开始的簇号，为0时不指定
+ * @param clusters  输出参数，至少能容纳n个簇号
+ * @param held      输出参数，持有锁的组的位图
+ * @return uint     找到的簇数，小于n表示空间不足
+ */
+uint alloc_group_find(FAT16 *fat16_ins, uint n, WORD goal, WORD *clusters, uint64_t *held)
+{
+  /* 1. 紧接在文件末尾之后 */
+  if (goal >= ALLOC_FIRST_CLUSTER && goal < fat16_ins->ClusterCount)
+  {
+    uint g = goal / ag.size;
+    pthread_mutex_lock(&ag.groups[g].lock);
+    DWORD end = ag.groups[g].end;
+    if (free_run_length(fat16_ins, goal, end - goal < n ? end - goal : n) == n)
+    {
+      for (uint i = 0; i < n; i++)
+        clusters[i] = goal + i;
+      *held = 1ULL << g;
+      alloc_stat_note(n, 1, 0, 1);
+      pthread_mutex_lock(&alloc_stat.lock);
+      alloc_stat.group_local++;
+      pthread_mutex_unlock(&alloc_stat.lock);
+      return n;
+    }
+    pthread_mutex_unlock(&ag.groups[g].lock);
+  }
+
+  /* 2. 新的簇链轮流从各组开始；文件末尾之后已被占用（多半是其它写入者在同一组中），
+   *    改到空闲簇最多的组，之后的扩展在那里继续保持连续 */
+  uint first = 0;
+  if (goal >= ALLOC_FIRST_CLUSTER && goal < fat16_ins->ClusterCount)
+  {
+    for (uint g = 1; g < ag.count; g++)
+      if (__atomic_load_n(&ag.groups[g].free, __ATOMIC_RELAXED) > __atomic_load_n(&ag.groups[first].free, __ATOMIC_RELAXED))
+        first = g;
+  }
+  else
+  {
+    first = __atomic_fetch_add(&ag.rotor, 1, __ATOMIC_RELAXED) % ag.count;
+  }
+
+  for (uint k = 0; k < ag.count; k++)
+  {
+    uint g = (first + k) % ag.count;
+    ALLOC_GROUP *grp = &ag.groups[g];
+    if (__atomic_load_n(&grp->free, __ATOMIC_RELAXED) < n)
+      continue;
+
+    pthread_mutex_lock(&grp->lock);
+    if (alloc_find_in_range(fat16_ins, n, grp->start, grp->end, clusters) == n)
+    {
+      *held = 1ULL << g;
+      alloc_stat_note(n, 0, 1, 1);
+      pthread_mutex_lock(&alloc_stat.lock);
+      if (k == 0)
+        alloc_stat.group_local++;
+      else
+        alloc_stat.group_other++;
+      pthread_mutex_unlock(&alloc_stat.lock);
+      return n;
+    }
+    pthread_mutex_unlock(&grp->lock);
+  }
+
+  /* 没有一个组有足够长的空闲段，锁住所有的组后拆成多段分配 */
+  *held = 0;
+  for (uint g = 0; g < ag.count; g++)
+  {
+    pthread_mutex_lock(&ag.groups[g].lock);
+    *held |= 1ULL << g;
+  }
+  pthread_mutex_lock(&alloc_stat.lock);
+  alloc_stat.group_global++;
+  pthread_mutex_unlock(&alloc_stat.lock);
+  return alloc_find_clusters(fat16_ins, n, goal, clusters);
+}
+
+/**
+ * @brief 锁住簇号[first, first + n)所在的分配组。未开启alloc_groups时什么都不做。
+ *
+ * @return uint64_t 持有锁的组的位图，交给alloc_group_unlock
+ */
+uint64_t alloc_group_lock_range(FAT16 *fat16_ins, WORD first, DWORD n)
+{
+  if (!fat16_opts.alloc_groups || n == 0)
+    return 0;
+  uint64_t held = 0;
+  for (uint g = first / ag.size; g < ag.count && g <= (first + n - 1) / ag.size; g++)
+  {
+    pthread_mutex_lock(&ag.groups[g].lock);
+    held |= 1ULL << g;
+  }
+  return held;
+}
+
+/**
+ * @brief 释放alloc_group_find或alloc_group_lock_range加的组锁
+ *
+ * @param held 持有锁的组的位图
+ */
+void alloc_group_unlock(uint64_t held)
+{
+  for (uint g = 0; g < ag.count; g++)
+  {
+    if (held & (1ULL << g))
+      pthread_mutex_unlock(&ag.groups[g].lock);
+  }
+}
+
+/**
+ * @brief 返回能容纳n个簇的最短空闲段（best fit）的第一个簇。调用者持有FatLock。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param n         需要的簇数
+ * @return WORD     空闲段的第一个簇号，没有足够长的空闲段时返回CLUSTER_END
+ */
+WORD alloc_find_run(FAT16 *fat16_ins, uint n)
+{
+  WORD best = CLUSTER_END;
+  DWORD bestLen = UINT32_MAX;
+  for (DWORD c = ALLOC_FIRST_CLUSTER; c < fat16_ins->ClusterCount;)
+  {
+    DWORD len = free_run_length(fat16_ins, c, UINT32_MAX);
+    if (len == 0)
+    {
+      c++;
+      continue;
+    }
+    if (len >= n && len < bestLen)
+    {
+      best = c;
+      bestLen = len;
+      if (len == n)
+        break;
+    }
+    c += len;
+  }
+  return best;
+}
+
+/**
+ * @brief 统计空闲空间：空闲簇数、空闲段数和最长空闲段的长度
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param freeClusters  输出参数，空闲簇数
+ * @param freeRuns      输出参数，空闲段数
+ * @param largestRun    输出参数，最长空闲段的簇数
+ */
+void alloc_free_space(FAT16 *fat16_ins, DWORD *freeClusters, DWORD *freeRuns, DWORD *largestRun)
+{
+  *freeClusters = *freeRuns = *largestRun = 0;
+  for (DWORD c = ALLOC_FIRST_CLUSTER; c < fat16_ins->ClusterCount;)
+  {
+    DWORD len = free_run_length(fat16_ins, c, UINT32_MAX);
+    if (len == 0)
+    {
+      c++;
+      continue;
+    }
+    *freeClusters += len;
+    (*freeRuns)++;
+    if (len > *largestRun)
+      *largestRun = len;
+    c += len;
+  }
+}
+
+/**
+ * @brief 统计空闲段长度的分布，第i个桶为长度在[2^i, 2^(i+1))之间的空闲段数
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param hist      输出参数，ALLOC_HIST_BUCKETS个桶
+ */
+void alloc_free_histogram(FAT16 *fat16_ins, DWORD hist[ALLOC_HIST_BUCKETS])
+{
+  memset(hist, 0, ALLOC_HIST_BUCKETS * sizeof(DWORD));
+  for (DWORD c = ALLOC_FIRST_CLUSTER; c < fat16_ins->ClusterCount;)
+  {
+    DWORD len = free_run_length(fat16_ins, c, UINT32_MAX);
+    if (len == 0)
+    {
+      c++;
+      continue;
+    }
+    int b = 0;
+    while (b < ALLOC_HIST_BUCKETS - 1 && (len >> (b + 1)) != 0)
+      b++;
+    hist[b]++;
+    c += len;
+  }
+}
+
+/**
+ * @brief 输出分配器和空闲空间碎片化的统计信息
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param buf       输出缓冲区
+ * @param size      缓冲区大小
+ * @return int      写入的字符数（不含结尾的'\0'）
+ */
+int alloc_stats(FAT16 *fat16_ins, char *buf, size_t size)
+{
+  DWORD freeClusters, freeRuns, largestRun;
+  alloc_free_space(fat16_ins, &freeClusters, &freeRuns, &largestRun);
+
+  pthread_mutex_lock(&alloc_stat.lock);
+  double extentsPerAlloc = alloc_stat.requests ? (double)alloc_stat.extents / alloc_stat.requests : 0;
+  int n = snprintf(buf, size,
+                   "alloc.requests %llu\n"
+                   "alloc.goal_hits %llu\n"
+                   "alloc.best_fits %llu\n"
+                   "alloc.split %llu\n"
+                   "alloc.clusters %llu\n"
+                   "alloc.extents_per_request %.3f\n"
+                   "free.clusters %u\n"
+                   "free.runs %u\n"
+                   "free.largest_run %u\n"
+                   "alloc.groups %u\n"
+                   "alloc.group_local %llu\n"
+                   "alloc.group_other %llu\n"
+                   "alloc.group_global %llu\n",
+                   (unsigned long long)alloc_stat.requests,
+                   (unsigned long long)alloc_stat.goal_hits,
+                   (unsigned long long)alloc_stat.best_fits,
+                   (unsigned long long)alloc_stat.split,
+                   (unsigned long long)alloc_stat.clusters,
+                   extentsPerAlloc,
+                   freeClusters, freeRuns, largestRun,
+                   fat16_opts.alloc_groups ? ag.count : 0,
+                   (unsigned long long)alloc_stat.group_local,
+                   (unsigned long long)alloc_stat.group_other,
+                   (unsigned long long)alloc_stat.group_global);
+  pthread_mutex_unlock(&alloc_stat.lock);
+
+  /* 各组的空闲簇数 */
+  for (uint g = 0; fat16_opts.alloc_groups && g < ag.count && (size_t)n < size; g++)
+    n += snprintf(buf + n, size - n, "alloc.group.%u.free %u\n", g, __atomic_load_n(&ag.groups[g].free, __ATOMIC_RELAXED));
+  return n;
+}
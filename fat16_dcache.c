@@ -0,0 +1,258 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 路径查找缓存（无锁读取）
+ *
+ * getattr、read等只读操作都要经过find_root从根目录逐级扫描目录。查找缓存记录路径对应的目录项偏移量，
+ * 命中时只需读出目录项所在的一个扇区：
+ *   - 缓存按路径的哈希直接映射，冲突时覆盖。每个槽有一个序列号（seqlock），更新槽时序列号先变为奇数，
+ *     写完后再加一变为偶数；读者复制槽的内容之后序列号没有变化才使用，否则重试，读者不写任何共享的内存；
+ *   - 缓存只给出偏移量，目录项本身每次从扇区读取（见journal_sector_read的无锁读取），
+ *     名字不再相同或已被删除时视为未命中，因此文件大小、首簇的修改和unlink都不需要使缓存失效；
+ *   - 目录的簇被释放（rmdir）或目录项被移动（目录压缩）后，偏移量可能指向其它目录中同名的目录项，
+ *     此时调用dcache_invalidate增加全局的代数，之前插入的槽全部作废。
+ * FAT表的内存镜像同样不加锁读取（见fat_entry_by_cluster），整个查找过程不持有任何互斥锁。
+ */
+
+#define DCACHE_SLOTS 4096
+#define DCACHE_PATH_MAX 120 // 更长的路径不缓存
+#define DCACHE_RETRIES 4    // 读者遇到并发更新时的重试次数，之后按未命中处理
+#define DCACHE_SHARDS 16    // 统计计数器的分片数，不同线程的计数不在同一缓存行
+
+typedef struct
+{
+  unsigned seq;                 // 为奇数时正在更新
+  DWORD gen;                    // 插入时的代数
+  off_t offset_dir;             // 目录项在镜像文件中的偏移量
+  BYTE name[11];                // 路径最后一级的FAT文件名，用于校验目录项
+  char path[DCACHE_PATH_MAX];
+} DCACHE_SLOT;
+
+/* 导出到索引文件的一个槽 */
+typedef struct
+{
+  off_t offset_dir;
+  BYTE name[11];
+  char path[DCACHE_PATH_MAX];
+} DCACHE_RECORD;
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t retries;
+  uint64_t inserts;
+} __attribute__((aligned(64))) DCACHE_COUNTERS;
+
+static struct
+{
+  DCACHE_SLOT slots[DCACHE_SLOTS];
+  DWORD gen __attribute__((aligned(64)));  // 全局代数，dcache_invalidate时加一
+  DCACHE_COUNTERS counters[DCACHE_SHARDS];
+  unsigned next_shard;
+  uint64_t invalidations;
+} dc;
+
+static __thread DCACHE_COUNTERS *dc_counters;
+
+static DCACHE_COUNTERS *dc_stat(void)
+{
+  if (dc_counters == NULL)
+    dc_counters = &dc.counters[__atomic_fetch_add(&dc.next_shard, 1, __ATOMIC_RELAXED) % DCACHE_SHARDS];
+  return dc_counters;
+}
+
+#define DC_COUNT(stat, field) __atomic_add_fetch(&(stat)->field, 1, __ATOMIC_RELAXED)
+
+static DWORD dc_hash(const char *path)
+{
+  DWORD h = 2166136261u; // FNV-1a
+  for (; *path; path++)
+    h = (h ^ (BYTE)*path) * 16777619u;
+  return h;
+}
+
+/**
+ * @brief 在缓存中查找路径，命中时读出并校验目录项
+ *
+ * @param fat16_ins   文件系统元数据指针
+ * @param path        路径
+ * @param Dir         输出参数，路径对应的目录项
+ * @param offset_dir  输出参数，目录项在镜像文件中的偏移量（字节）
+ * @return int        命中返回1，否则返回0，调用者应扫描目录
+ */
+int dcache_lookup(FAT16 *fat16_ins, const char *path, DIR_ENTRY *Dir, off_t *offset_dir)
+{
+  size_t len = strlen(path);
+  if (len >= DCACHE_PATH_MAX)
+    return 0;
+
+  DCACHE_SLOT *slot = &dc.slots[dc_hash(path) % DCACHE_SLOTS];
+  DCACHE_COUNTERS *stat = dc_stat();
+  DWORD gen = __atomic_load_n(&dc.gen, __ATOMIC_ACQUIRE);
+  off_t offset = -1;
+  BYTE name[11];
+
+  for (int tries = 0; tries < DCACHE_RETRIES; tries++)
+  {
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+    {
+      DC_COUNT(stat, retries);
+      continue;
+    }
+    int match = slot->gen == gen && memcmp(slot->path, path, len + 1) == 0;
+    off_t o = slot->offset_dir;
+    memcpy(name, slot->name, sizeof(name));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+      DC_COUNT(stat, retries);
+      continue;
+    }
+    if (match)
+      offset = o;
+    break;
+  }
+
+  if (offset >= 0)
+  {
+    BYTE buffer[BYTES_PER_SECTOR];
+    sector_read(fat16_ins->fd, offset / BYTES_PER_SECTOR, buffer);
+    memcpy(Dir, buffer + offset % BYTES_PER_SECTOR, BYTES_PER_DIR);
+    if (Dir->DIR_Name[0] != 0x00 && Dir->DIR_Name[0] != 0xE5 &&
+        memcmp(Dir->DIR_Name, name, sizeof(name)) == 0 &&
+        (Dir->DIR_Attr == ATTR_ARCHIVE || Dir->DIR_Attr == ATTR_DIRECTORY) &&
+        __atomic_load_n(&dc.gen, __ATOMIC_ACQUIRE) == gen)
+    {
+      *offset_dir = offset;
+      DC_COUNT(stat, hits);
+      return 1;
+    }
+  }
+  DC_COUNT(stat, misses);
+  return 0;
+}
+
+/**
+ * @brief 返回当前的代数。扫描目录之前取得，插入时传给dcache_insert，
+ *        扫描期间缓存被作废时插入的槽也随之作废。
+ */
+DWORD dcache_generation(void)
+{
+  return __atomic_load_n(&dc.gen, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief 记录扫描目录找到的路径。槽正在被其它线程更新时放弃插入。
+ *
+ * @param path        路径
+ * @param name        路径最后一级的FAT文件名（11字节）
+ * @param offset_dir  目录项在镜像文件中的偏移量
+ * @param gen         扫描之前dcache_generation的返回值
+ */
+void dcache_insert(const char *path, const BYTE *name, off_t offset_dir, DWORD gen)
+{
+  size_t len = strlen(path);
+  if (len >= DCACHE_PATH_MAX)
+    return;
+
+  DCACHE_SLOT *slot = &dc.slots[dc_hash(path) % DCACHE_SLOTS];
+  unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  slot->gen = gen;
+  slot->offset_dir = offset_dir;
+  memcpy(slot->name, name, sizeof(slot->name));
+  memcpy(slot->path, path, len + 1);
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+  DC_COUNT(dc_stat(), inserts);
+}
+
+/**
+ * @brief 目录的簇将被释放或目录项将被移动，作废缓存中所有的槽。需要在修改之前调用。
+ */
+void dcache_invalidate(void)
+{
+  __atomic_add_fetch(&dc.gen, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&dc.invalidations, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 导出当前代数下有效的槽，卸载时由sidecar_save保存到索引文件
+ *
+ * @param size    输出参数，导出的字节数
+ * @return void*  malloc分配的DCACHE_RECORD数组
+ */
+void *dcache_export(size_t *size)
+{
+  DCACHE_RECORD *records = malloc(sizeof(DCACHE_RECORD) * DCACHE_SLOTS);
+  DWORD gen = __atomic_load_n(&dc.gen, __ATOMIC_ACQUIRE);
+  size_t count = 0;
+  for (int i = 0; i < DCACHE_SLOTS; i++)
+  {
+    DCACHE_SLOT *slot = &dc.slots[i];
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || seq == 0 || slot->gen != gen)
+      continue;
+    DCACHE_RECORD *r = &records[count];
+    r->offset_dir = slot->offset_dir;
+    memcpy(r->name, slot->name, sizeof(r->name));
+    memcpy(r->path, slot->path, sizeof(r->path));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+      count++;
+  }
+  *size = count * sizeof(DCACHE_RECORD);
+  return records;
+}
+
+/**
+ * @brief 挂载时插入dcache_export导出的槽。目录项在查找时仍会校验，索引文件只在镜像未被修改时使用。
+ */
+void dcache_import(const void *data, size_t size)
+{
+  const DCACHE_RECORD *records = data;
+  DWORD gen = dcache_generation();
+  for (size_t i = 0; i < size / sizeof(DCACHE_RECORD); i++)
+  {
+    if (memchr(records[i].path, '\0', DCACHE_PATH_MAX) != NULL)
+      dcache_insert(records[i].path, records[i].name, records[i].offset_dir, gen);
+  }
+}
+
+/**
+ * @brief 输出查找缓存的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int dcache_stats(char *buf, size_t size)
+{
+  uint64_t hits = 0, misses = 0, retries = 0, inserts = 0;
+  for (int i = 0; i < DCACHE_SHARDS; i++)
+  {
+    hits += dc.counters[i].hits;
+    misses += dc.counters[i].misses;
+    retries += dc.counters[i].retries;
+    inserts += dc.counters[i].inserts;
+  }
+  return snprintf(buf, size,
+                  "dcache.hits %llu\n"
+                  "dcache.misses %llu\n"
+                  "dcache.retries %llu\n"
+                  "dcache.inserts %llu\n"
+                  "dcache.invalidations %llu\n",
+                  (unsigned long long)hits,
+                  (unsigned long long)misses,
+                  (unsigned long long)retries,
+                  (unsigned long long)inserts,
+                  (unsigned long long)dc.invalidations);
+}
@@ -0,0 +1,598 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 碎片整理
+ *
+ * defrag_pass遍历目录树，找出簇链不连续的普通文件，按段数从多到少依次搬到能容纳整个文件的空闲段中：
+ *   - 每次搬移至多batch个簇，作为一个日志事务提交：复制数据并fdatasync镜像，
+ *     再把新簇接入簇链（首簇变化时更新目录项的DIR_FstClusLO），旧簇断开成一条单独的簇链加入待回收队列。
+ *     旧簇在事务提交后才由回收线程释放（与deferred_free的unlink相同），提交之前不会被分配给其它文件，
+ *     崩溃后重放出的簇链不会指向已经写入了其它文件数据的簇。
+ *     每批提交后簇链都是完整有效的，中途停止或崩溃只会使文件部分连续；
+ *   - 每批开始前重新读取目录项和簇链，文件被删除、大小改变或目标簇已被占用时放弃该文件。
+ * 目录本身不搬移（子目录的".."等目录项引用了它的首簇）。
+ *
+ * 离线使用fat16_defrag工具；挂载时开启defrag选项后由后台线程执行，
+ * 每批之间休眠defrag_delay毫秒，每批持有ChainLock的写锁，与文件读写互斥。
+ */
+
+#define DEFRAG_RESCAN_SEC 60 // 在线整理两遍之间的间隔（秒）
+
+/* 待整理的文件 */
+typedef struct
+{
+  off_t offset_dir;
+  BYTE name[11];
+  WORD first;
+  DWORD clusters;
+  DWORD extents;
+} DEFRAG_FILE;
+
+typedef struct
+{
+  DEFRAG_REPORT report;
+  DEFRAG_FILE *files;   // 不连续的文件
+  uint count;
+  uint capacity;
+} DEFRAG_SCAN;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  int running;
+  int stop;
+
+  /* 统计 */
+  uint64_t passes;
+  uint64_t moved_files;
+  uint64_t moved_clusters;
+  DEFRAG_REPORT before;   // 最近一遍整理前
+  DEFRAG_REPORT after;    // 最近一遍整理后
+} df = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+static int defrag_scan_entry(FAT16 *fat16_ins, const char *path, DIR_ENTRY *Dir, off_t offset_dir, void *ctx)
+{
+  DEFRAG_SCAN *scan = ctx;
+  if (Dir->DIR_Attr & ATTR_DIRECTORY)
+    return 0;
+
+  DWORD clusters, extents;
+  chain_extents(fat16_ins, Dir->DIR_FstClusLO, &clusters, &extents);
+  scan->report.files++;
+  scan->report.clusters += clusters;
+  scan->report.extents += extents;
+  if (extents <= 1)
+    return 0;
+
+  scan->report.fragmented++;
+  if (scan->count == scan->capacity)
+  {
+    scan->capacity = scan->capacity ? scan->capacity * 2 : 64;
+    scan->files = realloc(scan->files, scan->capacity * sizeof(DEFRAG_FILE));
+  }
+  DEFRAG_FILE *f = &scan->files[scan->count++];
+  f->offset_dir = offset_dir;
+  memcpy(f->name, Dir->DIR_Name, sizeof(f->name));
+  f->first = Dir->DIR_FstClusLO;
+  f->clusters = clusters;
+  f->extents = extents;
+  return 0;
+}
+
+static int defrag_file_cmp(const void *a, const void *b)
+{
+  const DEFRAG_FILE *x = a, *y = b;
+  if (x->extents != y->extents)
+    return x->extents < y->extents ? 1 : -1;
+  return x->clusters < y->clusters ? 1 : (x->clusters > y->clusters ? -1 : 0);
+}
+
+/**
+ * @brief 统计整个卷的碎片情况，可选地收集不连续的文件
+ */
+static void defrag_scan(FAT16 *fat16_ins, DEFRAG_SCAN *scan)
+{
+  static const FAT16_WALKER walker = {.entry = defrag_scan_entry};
+  memset(scan, 0, sizeof(*scan));
+  fat16_walk(fat16_ins, &walker, scan);
+  pthread_mutex_lock(&fat16_ins->FatLock);
+  alloc_free_space(fat16_ins, &scan->report.free_clusters, &scan->report.free_runs, &scan->report.largest_free_run);
+  pthread_mutex_unlock(&fat16_ins->FatLock);
+}
+
+/**
+ * @brief 统计整个卷的碎片情况。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param report    输出参数
+ */
+void defrag_report(FAT16 *fat16_ins, DEFRAG_REPORT *report)
+{
+  DEFRAG_SCAN scan;
+  defrag_scan(fat16_ins, &scan);
+  free(scan.files);
+  *report = scan.report;
+}
+
+/**
+ * @brief 将文件簇链中从第index个簇开始的至多batch个簇搬到target + index开始的位置。
+ *        持有ChainLock写锁和FatLock，作为一个日志事务提交。
+ *
+ * @return int 搬移的簇数，文件已改变或目标被占用时返回-EAGAIN
+ */
+static int defrag_move_batch(FAT16 *fat16_ins, DEFRAG_FILE *f, WORD target, DWORD index, DWORD batch)
+{
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  int ret = -EAGAIN;
+  uint64_t groups = 0;
+
+  pthread_rwlock_wrlock(&fat16_ins->ChainLock);
+  pthread_mutex_lock(&fat16_ins->FatLock);
+  journal_begin();
+
+  /* 重新读取目录项，确认文件没有被删除或替换 */
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DIR_ENTRY Dir;
+  sector_read(fat16_ins->fd, f->offset_dir / BYTES_PER_SECTOR, sector_buffer);
+  memcpy(&Dir, sector_buffer + f->offset_dir % BYTES_PER_SECTOR, sizeof(DIR_ENTRY));
+  DWORD clusters, extents;
+  chain_extents(fat16_ins, Dir.DIR_FstClusLO, &clusters, &extents);
+  if (memcmp(Dir.DIR_Name, f->name, sizeof(f->name)) != 0 || clusters != f->clusters)
+    goto out;
+
+  /* 找到第index个簇和它的前一个簇 */
+  WORD prev = CLUSTER_END, cur = Dir.DIR_FstClusLO;
+  for (DWORD i = 0; i < index; i++)
+  {
+    prev = cur;
+    cur = fat_entry_by_cluster(fat16_ins, cur);
+  }
+
+  if (batch > f->clusters - index)
+    batch = f->clusters - index;
+  /* 开启分配组时，其它线程的分配不持有FatLock，占用目标之前锁住所在的组 */
+  groups = alloc_group_lock_range(fat16_ins, target + index, batch);
+  for (DWORD i = 0; i < batch; i++)
+  {
+    if (fat_entry_by_cluster(fat16_ins, target + index + i) != CLUSTER_FREE)
+      goto out;
+  }
+
+  /* 复制数据，并在修改簇链之前持久化 */
+  WORD *old = malloc(batch * sizeof(WORD));
+  BYTE *data = io_alloc(ClusterSize);
+  for (DWORD i = 0; i < batch; i++)
+  {
+    old[i] = cur;
+    WORD dst = target + index + i;
+    writeback_read(fat16_ins, data, get_cluster_offset(fat16_ins, cur), ClusterSize);
+    io_write(fat16_ins->fd, data, get_cluster_offset(fat16_ins, dst), ClusterSize);
+    journal_revoke((dst - 2) * fat16_ins->Bpb.BPB_SecPerClus + fat16_ins->FirstDataSector,
+                   fat16_ins->Bpb.BPB_SecPerClus);
+    cur = fat_entry_by_cluster(fat16_ins, cur);
+  }
+  free(data);
+  io_batch_flush();
+  fdatasync(fileno(fat16_ins->fd));
+
+  /* 把新簇接入簇链，再释放旧簇 */
+  for (DWORD i = 0; i < batch; i++)
+    write_fat_entry(fat16_ins, target + index + i, i + 1 < batch ? target + index + i + 1 : cur);
+  alloc_group_unlock(groups);
+  groups = 0;
+  if (prev == CLUSTER_END)
+  {
+    dir_entry_create(fat16_ins, f->offset_dir / BYTES_PER_SECTOR, f->offset_dir % BYTES_PER_SECTOR,
+                     (char *)Dir.DIR_Name, Dir.DIR_Attr, target, Dir.DIR_FileSize);
+  }
+  else
+  {
+    write_fat_entry(fat16_ins, prev, target + index);
+  }
+  /* 旧簇本来就按簇链顺序相连，在最后一个旧簇处截断，整段作为待回收的簇链 */
+  for (DWORD i = 0; i < batch; i++)
+    writeback_discard(old[i]);
+  write_fat_entry(fat16_ins, old[batch - 1], CLUSTER_END);
+  journal_log_orphan(old[0], 1);
+  free(old);
+  prealloc_forget(f->offset_dir);
+  ret = batch;
+
+out:
+  alloc_group_unlock(groups);
+  journal_end();
+  pthread_mutex_unlock(&fat16_ins->FatLock);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+/**
+ * @brief 整理一个文件：找到能容纳整个文件的空闲段，分批搬移。
+ *
+ * @return int 搬移的簇数
+ */
+static DWORD defrag_file(FAT16 *fat16_ins, DEFRAG_FILE *f, DWORD batch, unsigned delay)
+{
+  pthread_mutex_lock(&fat16_ins->FatLock);
+  WORD target = alloc_find_run(fat16_ins, f->clusters);
+  pthread_mutex_unlock(&fat16_ins->FatLock);
+  if (target == CLUSTER_END)
+    return 0;
+
+  DWORD moved = 0;
+  while (moved < f->clusters)
+  {
+    if (df.running && df.stop)
+      break;
+    int ret = defrag_move_batch(fat16_ins, f, target, moved, batch);
+    if (ret <= 0)
+      break;
+    moved += ret;
+    if (delay > 0 && moved < f->clusters)
+      usleep(delay * 1000);
+  }
+  return moved;
+}
+
+/**
+ * @brief 整理一遍整个卷。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param batch     每个事务最多搬移的簇数
+ * @param delay     每批之间休眠的毫秒数
+ * @param before    输出参数，可以为NULL，整理前的碎片情况
+ * @param after     输出参数，可以为NULL，整理后的碎片情况
+ * @return DWORD    搬移的簇数
+ */
+DWORD defrag_pass(FAT16 *fat16_ins, DWORD batch, unsigned delay, DEFRAG_REPORT *before, DEFRAG_REPORT *after)
+{
+  DEFRAG_SCAN scan;
+  defrag_scan(fat16_ins, &scan);
+  if (before != NULL)
+    *before = scan.report;
+
+  /* 段数最多的文件先整理 */
+  qsort(scan.files, scan.count, sizeof(DEFRAG_FILE), defrag_file_cmp);
+  DWORD moved = 0;
+  for (uint i = 0; i < scan.count && !(df.running && df.stop); i++)
+  {
+    DWORD n = defrag_file(fat16_ins, &scan.files[i], batch > 0 ? batch : 1, delay);
+    if (n > 0)
+    {
+      /* 旧簇在待回收队列中，离线时立即回收，之后的文件可以使用这些空间 */
+      reclaim_sync(fat16_ins);
+      moved += n;
+      pthread_mutex_lock(&df.lock);
+      df.moved_files++;
+      df.moved_clusters += n;
+      pthread_mutex_unlock(&df.lock);
+    }
+  }
+  free(scan.files);
+
+  if (after != NULL)
+    defrag_report(fat16_ins, after);
+  return moved;
+}
+
+/**
+ * @brief 以一行文本输出碎片情况
+ *
+ * @param report  碎片情况
+ * @param buf     输出缓冲区
+ * @param size    缓冲区大小
+ * @return int    写入的字符数（不含结尾的'\0'）
+ */
+int defrag_format_report(const DEFRAG_REPORT *report, char *buf, size_t size)
+{
+  return snprintf(buf, size,
+                  "%u files, %u fragmented, %u extents in %u clusters (%.2f extents per file), "
+                  "%u free clusters in %u runs (largest %u)",
+                  report->files, report->fragmented, report->extents, report->clusters,
+                  report->files ? (double)report->extents / report->files : 0,
+                  report->free_clusters, report->free_runs, report->largest_free_run);
+}
+
+static void *defrag_thread(void *arg)
+{
+  FAT16 *fat16_ins = arg;
+
+  pthread_mutex_lock(&df.lock);
+  while (!df.stop)
+  {
+    pthread_mutex_unlock(&df.lock);
+    DEFRAG_REPORT before, after;
+    DWORD moved = defrag_pass(fat16_ins, fat16_opts.defrag_batch, fat16_opts.defrag_delay, &before, &after);
+    if (moved > 0)
+    {
+      char text[2][256];
+      defrag_format_report(&before, text[0], sizeof(text[0]));
+      defrag_format_report(&after, text[1], sizeof(text[1]));
+      fprintf(stderr, "defrag: moved %u cluster(s)\n  before: %s\n  after:  %s\n", moved, text[0], text[1]);
+    }
+    pthread_mutex_lock(&df.lock);
+    df.passes++;
+    df.before = before;
+    df.after = after;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DEFRAG_RESCAN_SEC;
+    while (!df.stop && pthread_cond_timedwait(&df.wakeup, &df.lock, &deadline) == 0)
+      ;
+  }
+  pthread_mutex_unlock(&df.lock);
+  return NULL;
+}
+
+/**
+ * @brief 启动在线整理线程。需要在fat16_init中调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void defrag_start(FAT16 *fat16_ins)
+{
+  df.fat16_ins = fat16_ins;
+  df.stop = 0;
+  if (pthread_create(&df.thread, NULL, defrag_thread, fat16_ins) == 0)
+    df.running = 1;
+}
+
+/**
+ * @brief 停止在线整理线程。正在搬移的文件在当前批次提交后停止。
+ */
+void defrag_stop(void)
+{
+  if (!df.running)
+    return;
+
+  pthread_mutex_lock(&df.lock);
+  df.stop = 1;
+  pthread_cond_signal(&df.wakeup);
+  pthread_mutex_unlock(&df.lock);
+  pthread_join(df.thread, NULL);
+  df.running = 0;
+}
+
+/* 在线整理搬移簇、压缩目录移动目录项时，读写文件数据、修改簇链或使用目录项偏移量的操作需要持有ChainLock的读锁 */
+
+static struct fuse_operations defrag_inner;
+
+static int defrag_getattr(const char *path, struct stat *stbuf)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.getattr(path, stbuf);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.readdir(path, buffer, filler, offset, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_mknod(const char *path, mode_t mode, dev_t devNum)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.mknod(path, mode, devNum);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_mkdir(const char *path, mode_t mode)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.mkdir(path, mode);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_rmdir(const char *path)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.rmdir(path);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_utimens(const char *path, const struct timespec tv[2])
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.utimens(path, tv);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_open(const char *path, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.open(path, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_read(const char *path, char *buffer, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.read(path, buffer, size, offset, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                           struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.read_buf(path, bufp, size, offset, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_write(const char *path, const char *data, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.write(path, data, size, offset, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.write_buf(path, buf, offset, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_truncate(const char *path, off_t size)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.truncate(path, size);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_fallocate(const char *path, int mode, off_t offset, off_t length,
+                            struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.fallocate(path, mode, offset, length, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_unlink(const char *path)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.unlink(path);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_release(const char *path, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.release(path, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+static int defrag_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = df.fat16_ins;
+  pthread_rwlock_rdlock(&fat16_ins->ChainLock);
+  int ret = defrag_inner.fsync(path, datasync, fi);
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  return ret;
+}
+
+/**
+ * @brief 包装oper中读写文件数据、修改簇链或使用目录项偏移量的操作，使它们与在线整理的搬移、目录压缩互斥。
+ *        需要在journal_wrap_operations之前调用，使ChainLock在日志事务之内获取。
+ *        defrag和dircompact都没有开启时没有ChainLock的写者，不包装，读写路径上不会争用同一个读写锁。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param oper      要包装的文件系统操作表
+ */
+void defrag_wrap_operations(FAT16 *fat16_ins, struct fuse_operations *oper)
+{
+  df.fat16_ins = fat16_ins;
+  if (!fat16_opts.defrag && !fat16_opts.dircompact)
+    return;
+  defrag_inner = *oper;
+  if (oper->getattr)
+    oper->getattr = defrag_getattr;
+  if (oper->readdir)
+    oper->readdir = defrag_readdir;
+  if (oper->mknod)
+    oper->mknod = defrag_mknod;
+  if (oper->mkdir)
+    oper->mkdir = defrag_mkdir;
+  if (oper->rmdir)
+    oper->rmdir = defrag_rmdir;
+  if (oper->utimens)
+    oper->utimens = defrag_utimens;
+  if (oper->open)
+    oper->open = defrag_open;
+  if (oper->read)
+    oper->read = defrag_read;
+  if (oper->read_buf)
+    oper->read_buf = defrag_read_buf;
+  if (oper->write)
+    oper->write = defrag_write;
+  if (oper->write_buf)
+    oper->write_buf = defrag_write_buf;
+  if (oper->truncate)
+    oper->truncate = defrag_truncate;
+  if (oper->fallocate)
+    oper->fallocate = defrag_fallocate;
+  if (oper->unlink)
+    oper->unlink = defrag_unlink;
+  if (oper->release)
+    oper->release = defrag_release;
+  if (oper->fsync)
+    oper->fsync = defrag_fsync;
+}
+
+/**
+ * @brief 输出碎片整理的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int defrag_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&df.lock);
+  int n = snprintf(buf, size,
+                   "defrag.enabled %d\n"
+                   "defrag.passes %llu\n"
+                   "defrag.moved_files %llu\n"
+                   "defrag.moved_clusters %llu\n"
+                   "defrag.before.fragmented_files %u\n"
+                   "defrag.before.extents %u\n"
+                   "defrag.after.fragmented_files %u\n"
+                   "defrag.after.extents %u\n",
+                   df.running,
+                   (unsigned long long)df.passes,
+                   (unsigned long long)df.moved_files,
+                   (unsigned long long)df.moved_clusters,
+                   df.before.fragmented, df.before.extents,
+                   df.after.fragmented, df.after.extents);
+  pthread_mutex_unlock(&df.lock);
+  return n;
+}
@@ -0,0 +1,501 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 延迟分配
+ *
+ * 开启delalloc挂载选项后，写入超出文件已分配簇的部分不立即分配簇，而是保存在内存中该文件的待分配区里，
+ * 目录项也暂不修改（getattr和read通过delalloc_lookup/delalloc_read看到内存中的大小和数据）。
+ * 以下情况下一次性为整个待分配区调用file_new_cluster，得到一段连续的簇，再写入数据并更新目录项：
+ *   - fsync、truncate；
+ *   - 待分配数据总量超过dirty_limit（内存压力）；
+ *   - 待分配区存在超过dirty_expire毫秒（由后台线程检查）；
+ *   - 卸载。
+ * 文件在此之前被删除时，直接丢弃待分配区，不会涉及FAT表。
+ *
+ * 文件以目录项在镜像中的位置（find_root返回的offset_dir）标识。
+ * 待分配区覆盖文件的[base, size)，base为创建时文件已分配簇的总长度，base之前的写入仍直接写入已有的簇。
+ * 这些写入照常由write_file完成，但目录项中的大小通过delalloc_update_size在da.lock下更新，
+ * 与后台线程分配待分配区时对目录项的更新互斥，双方都重新读取目录项后再写入。
+ */
+
+#define DELALLOC_INTERVAL_MS 100 // 后台线程检查过期待分配区的间隔
+
+typedef struct DELALLOC_FILE
+{
+  off_t offset_dir;          // 目录项在镜像中的偏移量
+  BYTE name[11];             // 目录项中的文件名，写回前用于确认目录项未被替换
+  DWORD base;                // 待分配区在文件中的起始位置（簇对齐）
+  DWORD size;                // 文件的逻辑大小，即base + 待分配区长度
+  BYTE *data;                // 待分配区的数据
+  size_t capacity;
+  uint64_t since;            // 创建时间（毫秒）
+  struct DELALLOC_FILE *next;
+} DELALLOC_FILE;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  DELALLOC_FILE *files;      // 按创建时间排列，最早的在前
+  uint64_t pending_bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  int running;
+  int stop;
+
+  /* 统计 */
+  uint64_t flushes;          // 完成分配的待分配区个数
+  uint64_t flushed_bytes;
+  uint64_t discards;         // 未分配即被删除的待分配区个数
+  uint64_t discarded_bytes;
+} da = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static DELALLOC_FILE **da_find(off_t offset_dir)
+{
+  DELALLOC_FILE **p = &da.files;
+  while (*p != NULL && (*p)->offset_dir != offset_dir)
+    p = &(*p)->next;
+  return p;
+}
+
+static void da_remove(DELALLOC_FILE **p)
+{
+  DELALLOC_FILE *f = *p;
+  *p = f->next;
+  da.pending_bytes -= f->size - f->base;
+  free(f->data);
+  free(f);
+}
+
+/**
+ * @brief 为待分配区一次性分配簇，写入数据并更新目录项，然后移除待分配区。调用者持有da.lock。
+ *
+ * @return int 成功返回0，失败返回POSIX错误代码的负值（待分配区保留）
+ */
+static int da_flush_locked(DELALLOC_FILE **p)
+{
+  FAT16 *fat16_ins = da.fat16_ins;
+  DELALLOC_FILE *f = *p;
+
+  /* 重新读取目录项，文件可能已经被写入过base之前的部分 */
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DIR_ENTRY Dir;
+  sector_read(fat16_ins->fd, f->offset_dir / BYTES_PER_SECTOR, sector_buffer);
+  memcpy(&Dir, sector_buffer + f->offset_dir % BYTES_PER_SECTOR, sizeof(DIR_ENTRY));
+  if (memcmp(Dir.DIR_Name, f->name, sizeof(f->name)) != 0)
+  {
+    da_remove(p);
+    return 0;
+  }
+
+  journal_begin();
+  int64_t cur_cluster_count;
+  WORD last_cluster = file_last_cluster(fat16_ins, &Dir, &cur_cluster_count);
+  int64_t new_cluster_count = ((int64_t)f->size + fat16_ins->ClusterSize - 1) / fat16_ins->ClusterSize;
+  if (new_cluster_count > cur_cluster_count)
+  {
+    int ret = file_new_cluster(fat16_ins, &Dir, last_cluster, new_cluster_count - cur_cluster_count);
+    if (ret < 0)
+    {
+      journal_end();
+      return ret;
+    }
+  }
+
+  FAT16_EXTENT *extents;
+  int extentCnt = file_extent_map(fat16_ins, Dir.DIR_FstClusLO, f->base, f->size - f->base, &extents);
+  if (extentCnt < 0)
+  {
+    journal_end();
+    return extentCnt;
+  }
+  /* 数据写入失败时不更新目录项，新分配的簇留在簇链末尾，待分配区保留，之后重试时不需要再分配 */
+  size_t done = 0;
+  for (int i = 0; i < extentCnt; i++)
+  {
+    if (writeback_write(fat16_ins, f->data + done, extents[i].offset, extents[i].size) != extents[i].size)
+    {
+      free(extents);
+      journal_end();
+      return -EIO;
+    }
+    done += extents[i].size;
+  }
+  free(extents);
+
+  DWORD new_size = f->size > Dir.DIR_FileSize ? f->size : Dir.DIR_FileSize;
+  dir_entry_create(fat16_ins, f->offset_dir / BYTES_PER_SECTOR, f->offset_dir % BYTES_PER_SECTOR, (char *)Dir.DIR_Name, 0x20, Dir.DIR_FstClusLO, new_size);
+  int ret = journal_end();
+
+  da.flushes++;
+  da.flushed_bytes += f->size - f->base;
+  da_remove(p);
+  return ret;
+}
+
+/**
+ * @brief 为所有创建时间早于expire_before的待分配区分配簇。调用者持有da.lock。
+ */
+static int da_flush_all_locked(uint64_t expire_before)
+{
+  int err = 0;
+  DELALLOC_FILE **p = &da.files;
+  while (*p != NULL && (*p)->since <= expire_before)
+  {
+    int ret = da_flush_locked(p);
+    if (ret < 0)
+    {
+      /* 空间不足等错误，保留该待分配区，继续处理后面的 */
+      err = ret;
+      p = &(*p)->next;
+    }
+  }
+  return err;
+}
+
+/**
+ * @brief 延迟分配模式下处理一次写入。写入范围全部位于已分配的簇中时不做处理，由调用者照常写入；
+ *        否则超出已分配簇的部分保存到待分配区，之前的部分直接写入已有的簇。
+ *
+ * @param fat16_ins   文件系统元数据指针
+ * @param Dir         文件的目录项
+ * @param offset_dir  find_root返回的目录项偏移量
+ * @param buff        要写入的数据
+ * @param offset      文件要写入的位置
+ * @param length      要写入的数据长度（字节）
+ * @return int        已处理时返回写入的字节数，需要调用者照常写入时返回0，失败返回POSIX错误代码的负值
+ */
+int delalloc_write(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, const void *buff, off_t offset, size_t length)
+{
+  if (offset + length < offset || offset + length > UINT32_MAX)
+    return -EFBIG;
+
+  pthread_mutex_lock(&da.lock);
+  DELALLOC_FILE **p = da_find(offset_dir);
+  DELALLOC_FILE *f = *p;
+  if (f == NULL)
+  {
+    int64_t cur_cluster_count;
+    file_last_cluster(fat16_ins, Dir, &cur_cluster_count);
+    DWORD allocated = cur_cluster_count * fat16_ins->ClusterSize;
+    if (offset + length <= allocated)
+    {
+      pthread_mutex_unlock(&da.lock);
+      return 0;
+    }
+
+    f = calloc(1, sizeof(DELALLOC_FILE));
+    f->offset_dir = offset_dir;
+    memcpy(f->name, Dir->DIR_Name, sizeof(f->name));
+    f->base = allocated;
+    f->size = allocated;
+    f->since = now_ms();
+    *p = f; // 新的待分配区在链表末尾
+  }
+  else if (offset + length <= f->base)
+  {
+    pthread_mutex_unlock(&da.lock);
+    return 0;
+  }
+
+  /* base之前的部分写入已有的簇 */
+  size_t head = offset < f->base ? f->base - offset : 0;
+  if (head > 0)
+  {
+    FAT16_EXTENT *extents;
+    int extentCnt = file_extent_map(fat16_ins, Dir->DIR_FstClusLO, offset, head, &extents);
+    if (extentCnt < 0)
+    {
+      pthread_mutex_unlock(&da.lock);
+      return extentCnt;
+    }
+    size_t done = 0;
+    for (int i = 0; i < extentCnt; i++)
+    {
+      if (writeback_write(fat16_ins, (const BYTE *)buff + done, extents[i].offset, extents[i].size) != extents[i].size)
+      {
+        free(extents);
+        pthread_mutex_unlock(&da.lock);
+        return -EIO;
+      }
+      done += extents[i].size;
+    }
+    free(extents);
+  }
+
+  /* 其余部分复制到待分配区，中间的空洞填0 */
+  DWORD start = offset + head - f->base;
+  DWORD end = offset + length - f->base;
+  if (end > f->capacity)
+  {
+    size_t capacity = f->capacity ? f->capacity : fat16_ins->ClusterSize;
+    while (capacity < end)
+      capacity *= 2;
+    f->data = realloc(f->data, capacity);
+    f->capacity = capacity;
+  }
+  DWORD len = f->size - f->base;
+  if (start > len)
+    memset(f->data + len, 0, start - len);
+  memcpy(f->data + start, (const BYTE *)buff + head, end - start);
+  if (end > len)
+  {
+    da.pending_bytes += end - len;
+    f->size = f->base + end;
+  }
+
+  /* 内存压力：待分配数据超过dirty_limit时全部分配 */
+  if (da.pending_bytes > ((uint64_t)fat16_opts.dirty_limit << 20))
+    da_flush_all_locked(UINT64_MAX);
+  pthread_mutex_unlock(&da.lock);
+  return length;
+}
+
+/**
+ * @brief 延迟分配模式下，写入位于已分配的簇中（delalloc_write返回0）时由write_file调用，更新目录项中的文件大小。
+ *        在da.lock下重新读取目录项，不会覆盖后台线程刚写入的更大的大小。
+ *
+ * @param fat16_ins   文件系统元数据指针
+ * @param Dir         文件的目录项，更新为写入后的内容
+ * @param offset_dir  find_root返回的目录项偏移量
+ * @param end         本次写入的结束位置，文件大小至少为end
+ */
+void delalloc_update_size(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, DWORD end)
+{
+  pthread_mutex_lock(&da.lock);
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DIR_ENTRY cur;
+  sector_read(fat16_ins->fd, offset_dir / BYTES_PER_SECTOR, sector_buffer);
+  memcpy(&cur, sector_buffer + offset_dir % BYTES_PER_SECTOR, sizeof(DIR_ENTRY));
+  /* 目录项已被删除或替换时不再写入 */
+  if (memcmp(cur.DIR_Name, Dir->DIR_Name, sizeof(cur.DIR_Name)) == 0)
+  {
+    if (cur.DIR_FileSize < end)
+      cur.DIR_FileSize = end;
+    dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, (char *)cur.DIR_Name, 0x20, cur.DIR_FstClusLO, cur.DIR_FileSize);
+    *Dir = cur;
+  }
+  pthread_mutex_unlock(&da.lock);
+}
+
+/**
+ * @brief 查询文件是否有待分配的数据。
+ *
+ * @param offset_dir  find_root返回的目录项偏移量
+ * @param size        输入目录项中的文件大小，有待分配区时改为内存中的文件大小
+ * @param base        输出参数，可以为NULL，待分配区的起始位置
+ * @return int        有待分配区时返回1，否则返回0
+ */
+int delalloc_lookup(off_t offset_dir, DWORD *size, DWORD *base)
+{
+  if (!fat16_opts.delalloc)
+    return 0;
+
+  pthread_mutex_lock(&da.lock);
+  DELALLOC_FILE *f = *da_find(offset_dir);
+  if (f != NULL)
+  {
+    if (f->size > *size)
+      *size = f->size;
+    if (base != NULL)
+      *base = f->base;
+  }
+  pthread_mutex_unlock(&da.lock);
+  return f != NULL;
+}
+
+/**
+ * @brief 从待分配区读取文件[offset, offset + size)的数据，该范围必须位于待分配区内。
+ *
+ * @return int 成功返回0；待分配区已经分配完毕时返回-ENOENT，此时数据已在簇中
+ */
+int delalloc_read(off_t offset_dir, void *buf, off_t offset, size_t size)
+{
+  pthread_mutex_lock(&da.lock);
+  DELALLOC_FILE *f = *da_find(offset_dir);
+  if (f == NULL || offset < f->base)
+  {
+    pthread_mutex_unlock(&da.lock);
+    return -ENOENT;
+  }
+  DWORD start = offset - f->base;
+  DWORD len = f->size - f->base;
+  size_t avail = start < len ? len - start : 0;
+  if (avail > size)
+    avail = size;
+  memcpy(buf, f->data + start, avail);
+  memset((BYTE *)buf + avail, 0, size - avail);
+  pthread_mutex_unlock(&da.lock);
+  return 0;
+}
+
+/**
+ * @brief 立即为文件的待分配区分配簇（fsync、truncate时调用）。
+ *
+ * @param offset_dir  find_root返回的目录项偏移量
+ * @return int        分配了簇并更新了目录项时返回1，没有待分配区时返回0，失败返回POSIX错误代码的负值
+ */
+int delalloc_flush_file(off_t offset_dir)
+{
+  if (!fat16_opts.delalloc)
+    return 0;
+
+  pthread_mutex_lock(&da.lock);
+  DELALLOC_FILE **p = da_find(offset_dir);
+  int ret = *p != NULL ? da_flush_locked(p) : 0;
+  if (ret == 0 && *p != NULL)
+    ret = 1;
+  pthread_mutex_unlock(&da.lock);
+  return ret;
+}
+
+/**
+ * @brief 文件被删除时丢弃其待分配区。
+ *
+ * @param offset_dir  find_root返回的目录项偏移量
+ */
+void delalloc_discard(off_t offset_dir)
+{
+  if (!fat16_opts.delalloc)
+    return;
+
+  pthread_mutex_lock(&da.lock);
+  DELALLOC_FILE **p = da_find(offset_dir);
+  if (*p != NULL)
+  {
+    da.discards++;
+    da.discarded_bytes += (*p)->size - (*p)->base;
+    da_remove(p);
+  }
+  pthread_mutex_unlock(&da.lock);
+}
+
+/**
+ * @brief 目录压缩移动了文件的目录项后，待分配区改用新的目录项偏移量。
+ *
+ * @param from  原来的目录项偏移量
+ * @param to    新的目录项偏移量
+ */
+void delalloc_relocate(off_t from, off_t to)
+{
+  if (!fat16_opts.delalloc)
+    return;
+
+  pthread_mutex_lock(&da.lock);
+  DELALLOC_FILE *f = *da_find(from);
+  if (f != NULL)
+    f->offset_dir = to;
+  pthread_mutex_unlock(&da.lock);
+}
+
+static void *da_thread(void *arg)
+{
+  pthread_mutex_lock(&da.lock);
+  while (!da.stop)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DELALLOC_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&da.wakeup, &da.lock, &deadline);
+
+    /* 创建时间不晚于cutoff的待分配区已经过期；单调时钟小于dirty_expire时（刚开机）还没有过期的 */
+    uint64_t now = now_ms();
+    uint64_t cutoff = now > fat16_opts.dirty_expire ? now - fat16_opts.dirty_expire : 0;
+    if (da.files != NULL && da.files->since <= cutoff)
+    {
+      /* 分配簇时与在线整理互斥，ChainLock需要在da.lock之前获取 */
+      pthread_mutex_unlock(&da.lock);
+      pthread_rwlock_rdlock(&da.fat16_ins->ChainLock);
+      pthread_mutex_lock(&da.lock);
+      da_flush_all_locked(cutoff);
+      pthread_mutex_unlock(&da.lock);
+      pthread_rwlock_unlock(&da.fat16_ins->ChainLock);
+      pthread_mutex_lock(&da.lock);
+    }
+  }
+  pthread_mutex_unlock(&da.lock);
+  return NULL;
+}
+
+/**
+ * @brief 启动检查过期待分配区的后台线程。需要在fat16_init中调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void delalloc_start(FAT16 *fat16_ins)
+{
+  da.fat16_ins = fat16_ins;
+  da.stop = 0;
+  if (pthread_create(&da.thread, NULL, da_thread, NULL) == 0)
+    da.running = 1;
+}
+
+/**
+ * @brief 为所有待分配区分配簇并停止后台线程。需要在回写缓存和日志关闭之前调用。
+ */
+void delalloc_stop(void)
+{
+  if (!da.running)
+    return;
+
+  pthread_mutex_lock(&da.lock);
+  da.stop = 1;
+  pthread_cond_signal(&da.wakeup);
+  pthread_mutex_unlock(&da.lock);
+  pthread_join(da.thread, NULL);
+  da.running = 0;
+
+  pthread_mutex_lock(&da.lock);
+  if (da_flush_all_locked(UINT64_MAX) < 0)
+    fprintf(stderr, "delalloc: cannot allocate clusters for pending data, %llu byte(s) lost\n",
+            (unsigned long long)da.pending_bytes);
+  pthread_mutex_unlock(&da.lock);
+}
+
+/**
+ * @brief 输出延迟分配的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int delalloc_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&da.lock);
+  uint files = 0;
+  for (DELALLOC_FILE *f = da.files; f != NULL; f = f->next)
+    files++;
+  int n = snprintf(buf, size,
+                   "delalloc.enabled %d\n"
+                   "delalloc.pending_files %u\n"
+                   "delalloc.pending_bytes %llu\n"
+                   "delalloc.flushes %llu\n"
+                   "delalloc.flushed_bytes %llu\n"
+                   "delalloc.discards %llu\n"
+                   "delalloc.discarded_bytes %llu\n",
+                   da.running, files,
+                   (unsigned long long)da.pending_bytes,
+                   (unsigned long long)da.flushes,
+                   (unsigned long long)da.flushed_bytes,
+                   (unsigned long long)da.discards,
+                   (unsigned long long)da.discarded_bytes);
+  pthread_mutex_unlock(&da.lock);
+  return n;
+}
@@ -0,0 +1,377 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 目录压缩
+ *
+ * unlink和rmdir只把目录项的第一个字节改为0xE5，频繁创建删除文件的目录中会积累大量已删除的目录项，
+ * 之后的查找、readdir和mknod都要逐个跳过它们，目录占用的簇也不会减少。
+ * dir_compact把目录中有效的目录项按原来的顺序紧凑地移到目录开头，结束标记（0x00）随之前移，
+ * 子目录末尾不再需要的簇被释放（至少保留一个簇，根目录区大小固定）。
+ *   - 整个压缩持有ChainLock的写锁，并作为一个日志事务提交。所有通过find_root得到目录项偏移量的操作
+ *     都持有ChainLock的读锁（见defrag_wrap_operations），不会在压缩中途使用过时的偏移量；
+ *   - 以目录项偏移量为键的缓存（延迟分配、预分配）在压缩后改用新的偏移量，打开的文件不受影响；
+ *   - 子目录的首簇不变，"."和".."始终是前两个目录项，子目录中的".."无需修改。
+ *
+ * 触发方式：
+ *   - 开启dircompact挂载选项后，unlink和rmdir把父目录交给后台线程，已删除的目录项占目录项总数的比例
+ *     不低于dircompact_ratio（百分比）且至少有DIRCOMPACT_MIN_DELETED个时压缩；
+ *   - 随时可以对目录设置扩展属性"user.fat16.compact"立即压缩，例如：
+ *         setfattr -n user.fat16.compact <目录>
+ *   - 离线使用fat16_defrag -d压缩镜像中所有的目录。
+ */
+
+extern FAT16 *get_fat16_ins();
+
+#define DIRCOMPACT_XATTR_NAME "user.fat16.compact"
+#define DIRCOMPACT_MIN_DELETED 16 // 自动压缩至少需要的已删除目录项数（一个扇区）
+#define DIRCOMPACT_QUEUE 64       // 等待后台线程检查的目录数上限
+
+/* 一个被移动的目录项 */
+typedef struct
+{
+  off_t from;
+  off_t to;
+} DIRCOMPACT_MOVE;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  int running;
+  int stop;
+  WORD queue[DIRCOMPACT_QUEUE]; // 待检查目录的首簇，根目录为0
+  uint queued;
+
+  /* 统计 */
+  uint64_t compactions;     // 压缩的次数
+  uint64_t purged;          // 清除的已删除目录项数
+  uint64_t moved;           // 移动的有效目录项数
+  uint64_t freed_clusters;  // 释放的目录簇数
+  uint64_t dropped;         // 队列已满而没有检查的目录数
+} dc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief 列出目录占用的所有扇区
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param firstCluster  目录的首簇，根目录为0
+ * @param clusters      输出参数，子目录的簇数，根目录为0
+ * @return DWORD*       malloc分配的扇区号数组，以0结尾
+ */
+static DWORD *dc_sectors(FAT16 *fat16_ins, WORD firstCluster, DWORD *clusters)
+{
+  DWORD SecPerClus = fat16_ins->Bpb.BPB_SecPerClus;
+  DWORD count = 0, capacity;
+  DWORD *sectors;
+
+  *clusters = 0;
+  if (firstCluster == 0)
+  {
+    DWORD RootDirSectors = fat16_ins->Bpb.BPB_RootEntCnt * BYTES_PER_DIR / BYTES_PER_SECTOR;
+    sectors = malloc((RootDirSectors + 1) * sizeof(DWORD));
+    for (; count < RootDirSectors; count++)
+      sectors[count] = fat16_ins->FirstRootDirSecNum + count;
+    sectors[count] = 0;
+    return sectors;
+  }
+
+  capacity = SecPerClus * 4 + 1;
+  sectors = malloc(capacity * sizeof(DWORD));
+  for (WORD cur = firstCluster; is_cluster_inuse(cur) && *clusters < fat16_ins->ClusterCount;
+       cur = fat_entry_by_cluster(fat16_ins, cur))
+  {
+    if (count + SecPerClus + 1 > capacity)
+    {
+      capacity *= 2;
+      sectors = realloc(sectors, capacity * sizeof(DWORD));
+    }
+    for (DWORD s = 0; s < SecPerClus; s++)
+      sectors[count++] = fat16_ins->FirstDataSector + (cur - 2) * SecPerClus + s;
+    (*clusters)++;
+  }
+  sectors[count] = 0;
+  return sectors;
+}
+
+/**
+ * @brief 压缩目录，清除其中已删除的目录项
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param firstCluster  目录的首簇，根目录为0
+ * @param minRatio      已删除的目录项占结束标记之前目录项的百分比低于该值、或少于DIRCOMPACT_MIN_DELETED个时不压缩；
+ *                      为0时只要有已删除的目录项就压缩
+ * @param purged        输出参数，清除的已删除目录项数，可为NULL
+ * @return int          成功（包括无需压缩）返回0，firstCluster不再是目录时返回-ENOTDIR，日志提交失败时返回其错误
+ */
+int dir_compact(FAT16 *fat16_ins, WORD firstCluster, unsigned minRatio, DWORD *purged)
+{
+  if (purged != NULL)
+    *purged = 0;
+
+  pthread_rwlock_wrlock(&fat16_ins->ChainLock);
+
+  DWORD clusters;
+  DWORD *sectors = dc_sectors(fat16_ins, firstCluster, &clusters);
+  DWORD secCount = 0;
+  while (sectors[secCount] != 0)
+    secCount++;
+
+  BYTE *old = malloc((size_t)secCount * BYTES_PER_SECTOR);
+  for (DWORD s = 0; s < secCount; s++)
+    sector_read(fat16_ins->fd, sectors[s], old + (size_t)s * BYTES_PER_SECTOR);
+
+  int ret = 0;
+  BYTE *buf = NULL;
+  DIRCOMPACT_MOVE *moves = NULL;
+
+  /* 子目录的第一个目录项必须是指向自己的"."，否则该簇已经不属于这个目录（目录被删除后簇被重新分配）。
+   * 早先的mkdir写入的"."首簇为0xFFFF，也接受 */
+  if (firstCluster != 0)
+  {
+    DIR_ENTRY *dot = (DIR_ENTRY *)old;
+    if (secCount == 0 || dot->DIR_Name[0] != '.' || !(dot->DIR_Attr & ATTR_DIRECTORY) ||
+        (dot->DIR_FstClusLO != firstCluster && dot->DIR_FstClusLO != CLUSTER_END))
+    {
+      ret = -ENOTDIR;
+      goto out;
+    }
+  }
+
+  /* 统计结束标记之前的目录项 */
+  DWORD total = secCount * (BYTES_PER_SECTOR / BYTES_PER_DIR);
+  DWORD end = 0, deleted = 0;
+  for (; end < total && old[end * BYTES_PER_DIR] != 0x00; end++)
+    if (old[end * BYTES_PER_DIR] == 0xE5)
+      deleted++;
+  if (deleted == 0)
+    goto out;
+  if (minRatio > 0 && (deleted < DIRCOMPACT_MIN_DELETED || (uint64_t)deleted * 100 < (uint64_t)minRatio * end))
+    goto out;
+
+  /* 有效的目录项依次前移，之后的位置全部清零 */
+  buf = malloc((size_t)secCount * BYTES_PER_SECTOR);
+  memcpy(buf, old, (size_t)secCount * BYTES_PER_SECTOR);
+  moves = malloc((end - deleted) * sizeof(DIRCOMPACT_MOVE));
+  DWORD live = 0, moveCnt = 0;
+  for (DWORD i = 0; i < end; i++)
+  {
+    if (buf[i * BYTES_PER_DIR] == 0xE5)
+      continue;
+    if (i != live)
+    {
+      memcpy(buf + live * BYTES_PER_DIR, buf + i * BYTES_PER_DIR, BYTES_PER_DIR);
+      moves[moveCnt].from = (off_t)sectors[i * BYTES_PER_DIR / BYTES_PER_SECTOR] * BYTES_PER_SECTOR + i * BYTES_PER_DIR % BYTES_PER_SECTOR;
+      moves[moveCnt].to = (off_t)sectors[live * BYTES_PER_DIR / BYTES_PER_SECTOR] * BYTES_PER_SECTOR + live * BYTES_PER_DIR % BYTES_PER_SECTOR;
+      moveCnt++;
+    }
+    live++;
+  }
+  memset(buf + live * BYTES_PER_DIR, 0, (end - live) * BYTES_PER_DIR);
+
+  /* 目录项移动、末尾的簇被释放之后，查找缓存中的偏移量不再可靠 */
+  dcache_invalidate();
+  journal_begin();
+  for (DWORD s = 0; s < secCount; s++)
+  {
+    size_t pos = (size_t)s * BYTES_PER_SECTOR;
+    if (memcmp(buf + pos, old + pos, BYTES_PER_SECTOR) != 0)
+      sector_write(fat16_ins->fd, sectors[s], buf + pos);
+  }
+
+  /* 释放子目录末尾不再需要的簇 */
+  DWORD freed = 0;
+  if (firstCluster != 0)
+  {
+    DWORD keep = ((uint64_t)live * BYTES_PER_DIR + fat16_ins->ClusterSize - 1) / fat16_ins->ClusterSize;
+    if (keep == 0)
+      keep = 1;
+    if (keep < clusters)
+    {
+      WORD cur = firstCluster;
+      for (DWORD i = 1; i < keep; i++)
+        cur = fat_entry_by_cluster(fat16_ins, cur);
+      WORD rest = fat_entry_by_cluster(fat16_ins, cur);
+      write_fat_entry(fat16_ins, cur, CLUSTER_END);
+      freed = free_chain(fat16_ins, rest);
+    }
+  }
+  ret = journal_end();
+  dir_slot_forget(firstCluster);
+
+  /* 打开的文件以目录项偏移量为键的缓存改用新的位置。目录项按顺序前移，
+   * 新位置原来的有效目录项此前已经被移走，依次改键不会冲突 */
+  for (DWORD m = 0; m < moveCnt; m++)
+  {
+    delalloc_relocate(moves[m].from, moves[m].to);
+    prealloc_relocate(moves[m].from, moves[m].to);
+    readahead_relocate(moves[m].from, moves[m].to);
+    kcache_relocate(moves[m].from, moves[m].to);
+  }
+
+  pthread_mutex_lock(&dc.lock);
+  dc.compactions++;
+  dc.purged += deleted;
+  dc.moved += moveCnt;
+  dc.freed_clusters += freed;
+  pthread_mutex_unlock(&dc.lock);
+  if (purged != NULL)
+    *purged = deleted;
+
+out:
+  pthread_rwlock_unlock(&fat16_ins->ChainLock);
+  free(moves);
+  free(buf);
+  free(old);
+  free(sectors);
+  return ret;
+}
+
+/**
+ * @brief unlink和rmdir删除目录项后调用，把目录交给后台线程检查是否需要压缩
+ *
+ * @param dirCluster  被删除的目录项所在目录的首簇，根目录为0
+ */
+void dircompact_note(WORD dirCluster)
+{
+  if (!dc.running)
+    return;
+
+  pthread_mutex_lock(&dc.lock);
+  uint i = 0;
+  while (i < dc.queued && dc.queue[i] != dirCluster)
+    i++;
+  if (i == dc.queued)
+  {
+    if (dc.queued < DIRCOMPACT_QUEUE)
+    {
+      dc.queue[dc.queued++] = dirCluster;
+      pthread_cond_signal(&dc.wakeup);
+    }
+    else
+    {
+      dc.dropped++;
+    }
+  }
+  pthread_mutex_unlock(&dc.lock);
+}
+
+static void *dircompact_thread(void *arg)
+{
+  FAT16 *fat16_ins = arg;
+
+  pthread_mutex_lock(&dc.lock);
+  while (!dc.stop)
+  {
+    if (dc.queued == 0)
+    {
+      pthread_cond_wait(&dc.wakeup, &dc.lock);
+      continue;
+    }
+    WORD cluster = dc.queue[--dc.queued];
+    pthread_mutex_unlock(&dc.lock);
+
+    DWORD purged;
+    dir_compact(fat16_ins, cluster, fat16_opts.dircompact_ratio, &purged);
+
+    pthread_mutex_lock(&dc.lock);
+  }
+  pthread_mutex_unlock(&dc.lock);
+  return NULL;
+}
+
+/**
+ * @brief 启动自动压缩线程。需要在fat16_init中调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void dircompact_start(FAT16 *fat16_ins)
+{
+  dc.fat16_ins = fat16_ins;
+  dc.stop = 0;
+  dc.queued = 0;
+  if (pthread_create(&dc.thread, NULL, dircompact_thread, fat16_ins) == 0)
+    dc.running = 1;
+}
+
+/**
+ * @brief 停止自动压缩线程，队列中尚未检查的目录被丢弃。
+ */
+void dircompact_stop(void)
+{
+  if (!dc.running)
+    return;
+
+  pthread_mutex_lock(&dc.lock);
+  dc.stop = 1;
+  pthread_cond_signal(&dc.wakeup);
+  pthread_mutex_unlock(&dc.lock);
+  pthread_join(dc.thread, NULL);
+  dc.running = 0;
+}
+
+/**
+ * @brief 设置扩展属性，目前只有目录的user.fat16.compact，设置时立即压缩该目录（属性值被忽略）。
+ *        没有开启dircompact时操作没有被ChainLock包装，不能在线搬移目录项，返回-ENOTSUP。
+ *
+ * @param path  文件路径
+ * @param name  扩展属性名
+ * @param value 属性值
+ * @param size  属性值长度
+ * @param flags XATTR_CREATE或XATTR_REPLACE，忽略
+ * @return int  成功返回0，失败返回POSIX错误代码的负值
+ */
+int fat16_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+  FAT16 *fat16_ins = get_fat16_ins();
+  if (strcmp(name, DIRCOMPACT_XATTR_NAME) != 0 || !fat16_opts.dircompact)
+    return -ENOTSUP;
+
+  WORD cluster = 0;
+  if (strcmp(path, "/") != 0)
+  {
+    DIR_ENTRY Dir;
+    off_t offset_dir;
+    if (find_root(fat16_ins, &Dir, path, &offset_dir) != 0)
+      return -ENOENT;
+    if (!(Dir.DIR_Attr & ATTR_DIRECTORY))
+      return -ENOTDIR;
+    cluster = Dir.DIR_FstClusLO;
+  }
+  return dir_compact(fat16_ins, cluster, 0, NULL);
+}
+
+/**
+ * @brief 输出目录压缩的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int dircompact_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&dc.lock);
+  int n = snprintf(buf, size,
+                   "dircompact.enabled %d\n"
+                   "dircompact.compactions %llu\n"
+                   "dircompact.purged_entries %llu\n"
+                   "dircompact.moved_entries %llu\n"
+                   "dircompact.freed_clusters %llu\n"
+                   "dircompact.dropped %llu\n",
+                   dc.running,
+                   (unsigned long long)dc.compactions,
+                   (unsigned long long)dc.purged,
+                   (unsigned long long)dc.moved,
+                   (unsigned long long)dc.freed_clusters,
+                   (unsigned long long)dc.dropped);
+  pthread_mutex_unlock(&dc.lock);
+  return n;
+}
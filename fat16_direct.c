@@ -0,0 +1,281 @@
+#define _GNU_SOURCE // O_DIRECT
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 以O_DIRECT打开镜像
+ *
+ * 开启odirect挂载选项后，镜像以O_DIRECT打开，读写绕过宿主机的页缓存，文件数据只在FUSE的页缓存中缓存一次。
+ * O_DIRECT要求缓冲区地址、文件偏移量和长度都按块大小对齐（块设备取逻辑块大小，普通文件取文件系统的块大小，
+ * 可以用odirect_align指定）：
+ *   - 回写缓存、预读缓存、批量I/O等以簇为单位的缓冲区用io_alloc按对齐分配；
+ *   - io_read/io_write遇到未对齐的请求（单个扇区、簇内的部分写入、调用者的缓冲区）时经过对齐的中转缓冲区，
+ *     写入不完整的块时先读出整块，修改后再写回（read-modify-write）。read-modify-write之间互斥；
+ *   - 回写缓存的pwritev和io_uring的对齐写入不经过read-modify-write的锁，因此要求簇大小和数据区的起始位置
+ *     都按块对齐，使每个块只属于一个簇，对齐的写入不会与相邻簇的read-modify-write共用一个块。
+ *     镜像不满足时（io_direct_check_layout）退回普通的读写；
+ *   - splice要求对齐，read_buf/write_buf改为复制到内存缓冲区。
+ * 文件系统不支持O_DIRECT（例如tmpfs）时退回普通的读写。
+ */
+
+#define DIRECT_DEFAULT_ALIGN 4096
+
+static struct
+{
+  int enabled;          // 镜像以O_DIRECT打开
+  size_t align;         // 对齐的字节数
+  pthread_mutex_t rmw_lock;
+  pthread_mutex_t lock;
+
+  /* 统计 */
+  uint64_t bounced_reads;   // 经过中转缓冲区的读取数
+  uint64_t bounced_writes;  // 经过中转缓冲区的写入数
+  uint64_t rmw;             // 需要先读出不完整块的写入数
+} direct = {
+    .align = 1,
+    .rmw_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * @brief 打开镜像文件，开启odirect时使用O_DIRECT，read_only时只读打开
+ *
+ * @param imageFilePath 镜像文件路径
+ * @return FILE*        镜像文件指针，失败时返回NULL
+ */
+FILE *io_open_image(const char *imageFilePath)
+{
+  const char *mode = fat16_opts.read_only ? "rb" : "rb+";
+  if (!fat16_opts.odirect)
+    return fopen(imageFilePath, mode);
+
+  int fd = open(imageFilePath, (fat16_opts.read_only ? O_RDONLY : O_RDWR) | O_DIRECT);
+  if (fd < 0 && errno == EINVAL)
+  {
+    fprintf(stderr, "odirect: %s does not support O_DIRECT, using buffered I/O\n", imageFilePath);
+    return fopen(imageFilePath, mode);
+  }
+  if (fd < 0)
+    return NULL;
+
+  size_t align = fat16_opts.odirect_align;
+  if (align == 0)
+  {
+    struct stat st;
+    int sectorSize;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &sectorSize) == 0)
+      align = sectorSize;
+    else if (fstat(fd, &st) == 0 && st.st_blksize > 0)
+      align = st.st_blksize;
+    else
+      align = DIRECT_DEFAULT_ALIGN;
+  }
+  if (align < BYTES_PER_SECTOR || (align & (align - 1)) != 0)
+    align = DIRECT_DEFAULT_ALIGN;
+
+  direct.enabled = 1;
+  direct.align = align;
+  return fdopen(fd, mode);
+}
+
+/**
+ * @brief 读取引导扇区后调用：簇或数据区的起始位置没有按块对齐时，一个块可能属于两个簇，
+ *        对齐的写入会覆盖相邻簇并发的read-modify-write，此时关闭O_DIRECT。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void io_direct_check_layout(FAT16 *fat16_ins)
+{
+  if (!direct.enabled)
+    return;
+  if (fat16_ins->ClusterSize % direct.align == 0 && fat16_ins->DataOffset % direct.align == 0)
+    return;
+
+  int fd = fileno(fat16_ins->fd);
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0)
+  {
+    perror("odirect: F_SETFL");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "odirect: clusters of %u bytes at offset %u are not aligned to %zu bytes, using buffered I/O\n",
+          fat16_ins->ClusterSize, fat16_ins->DataOffset, direct.align);
+  direct.enabled = 0;
+  direct.align = 1;
+}
+
+/**
+ * @brief 镜像是否以O_DIRECT打开
+ */
+int io_direct_enabled(void)
+{
+  return direct.enabled;
+}
+
+/**
+ * @brief 分配I/O缓冲区，开启odirect时按块大小对齐。用free释放。
+ *
+ * @param size  字节数
+ * @return void* 缓冲区指针
+ */
+void *io_alloc(size_t size)
+{
+  if (!direct.enabled)
+    return malloc(size);
+  void *p;
+  if (posix_memalign(&p, direct.align, size > 0 ? size : 1) != 0)
+    return NULL;
+  return p;
+}
+
+/**
+ * @brief 请求是否需要经过中转缓冲区
+ */
+int io_direct_unaligned(const void *buf, long offset, size_t size)
+{
+  size_t mask = direct.align - 1;
+  return direct.enabled && ((((size_t)buf) & mask) || (offset & mask) || (size & mask));
+}
+
+/**
+ * @brief 对齐的pread/pwrite，处理EINTR和部分完成
+ */
+static size_t direct_rw(int fd, BYTE *buf, long offset, size_t size, int write)
+{
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t ret = write ? pwrite(fd, buf + done, size - done, offset + done)
+                        : pread(fd, buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    done += ret;
+  }
+  return done;
+}
+
+/**
+ * @brief 经过对齐的中转缓冲区读取
+ *
+ * @param fd      镜像文件指针
+ * @param buf     数据要存储到的缓冲区
+ * @param offset  镜像文件中的偏移量（字节）
+ * @param size    需要读取的字节数
+ * @return size_t 实际读取的字节数
+ */
+size_t io_direct_read(FILE *fd, void *buf, long offset, size_t size)
+{
+  long start = offset & ~(long)(direct.align - 1);
+  long end = (offset + size + direct.align - 1) & ~(long)(direct.align - 1);
+  io_batch_before_read(fileno(fd), start, end - start);
+  BYTE *bounce = io_alloc(end - start);
+
+  size_t got = direct_rw(fileno(fd), bounce, start, end - start, 0);
+  size_t ret = 0;
+  if (got > (size_t)(offset - start))
+  {
+    ret = got - (offset - start);
+    if (ret > size)
+      ret = size;
+    memcpy(buf, bounce + (offset - start), ret);
+  }
+  free(bounce);
+
+  pthread_mutex_lock(&direct.lock);
+  direct.bounced_reads++;
+  pthread_mutex_unlock(&direct.lock);
+  return ret;
+}
+
+/**
+ * @brief 经过对齐的中转缓冲区写入，首尾不完整的块先读出再修改
+ *
+ * @param fd      镜像文件指针
+ * @param buf     需要写入的数据
+ * @param offset  镜像文件中的偏移量（字节）
+ * @param size    需要写入的字节数
+ * @return size_t 实际写入的字节数
+ */
+size_t io_direct_write(FILE *fd, const void *buf, long offset, size_t size)
+{
+  size_t align = direct.align;
+  long start = offset & ~(long)(align - 1);
+  long end = (offset + size + align - 1) & ~(long)(align - 1);
+  int headPartial = start != offset;
+  int tailPartial = end != (long)(offset + size);
+  BYTE *bounce = io_alloc(end - start);
+  size_t ret = 0;
+
+  /* 本线程批次中对同一块的写入必须先落盘，否则之后提交时会覆盖这次写入 */
+  io_batch_before_read(fileno(fd), start, end - start);
+
+  int rmw = headPartial || tailPartial;
+  if (rmw)
+  {
+    pthread_mutex_lock(&direct.rmw_lock);
+    if (headPartial)
+    {
+      memset(bounce, 0, align);
+      direct_rw(fileno(fd), bounce, start, align, 0);
+    }
+    if (tailPartial && (end - align > start || !headPartial))
+    {
+      memset(bounce + (end - start) - align, 0, align);
+      direct_rw(fileno(fd), bounce + (end - start) - align, end - align, align, 0);
+    }
+  }
+  memcpy(bounce + (offset - start), buf, size);
+  size_t written = direct_rw(fileno(fd), bounce, start, end - start, 1);
+  if (rmw)
+    pthread_mutex_unlock(&direct.rmw_lock);
+  free(bounce);
+
+  if (written > (size_t)(offset - start))
+  {
+    ret = written - (offset - start);
+    if (ret > size)
+      ret = size;
+  }
+
+  pthread_mutex_lock(&direct.lock);
+  direct.bounced_writes++;
+  direct.rmw += rmw;
+  pthread_mutex_unlock(&direct.lock);
+  return ret;
+}
+
+/**
+ * @brief 输出O_DIRECT的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int direct_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&direct.lock);
+  int n = snprintf(buf, size,
+                   "odirect.enabled %d\n"
+                   "odirect.align %zu\n"
+                   "odirect.bounced_reads %llu\n"
+                   "odirect.bounced_writes %llu\n"
+                   "odirect.read_modify_write %llu\n",
+                   direct.enabled,
+                   direct.align,
+                   (unsigned long long)direct.bounced_reads,
+                   (unsigned long long)direct.bounced_writes,
+                   (unsigned long long)direct.rmw);
+  pthread_mutex_unlock(&direct.lock);
+  return n;
+}
@@ -0,0 +1,221 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 目录的读写锁
+ *
+ * 挂载以多线程运行，目录的修改按目录加锁，不同目录中的创建、删除可以并行：
+ *   - 每个目录一个读写锁，以目录的首簇区分，根目录区为0。锁在第一次使用时创建，没有线程使用时释放；
+ *   - mknod、mkdir、unlink、rmdir持有父目录的写锁，查找空闲目录项、扩展目录、写入或删除目录项之间不会穿插
+ *     同一目录中的其它修改；readdir持有目录的读锁，同一目录的多个readdir可以并行；
+ *   - 路径查找（find_root）不加目录锁：扇区整块读写，查找只会看到目录项修改之前或之后的内容，
+ *     同一目录中的查找、getattr和读写文件互不阻塞；
+ *   - 修改文件大小、首簇时只改写自己的目录项，不持有目录锁，但与同一扇区中的其它目录项的修改
+ *     要互斥（读出扇区、修改、写回），由按扇区号散列的dirlock_sector_lock保护；
+ *   - FAT表的修改仍由FatLock保护，与目录锁无关。
+ * 加锁顺序：ChainLock → 目录锁 → FatLock → 扇区锁 → 日志。同时锁两个目录时先锁父目录后锁子目录（rmdir），
+ * 没有祖先关系的两个目录（例如rename的源目录和目标目录）按首簇从小到大加锁。
+ * 取得父目录的锁之后重新查找一次父目录，确认它没有在加锁之前被删除或替换。
+ */
+
+#define DIRLOCK_BUCKETS 256
+#define DIRLOCK_SECTOR_LOCKS 64 // 扇区锁的个数，按扇区号散列
+
+typedef struct DIRLOCK
+{
+  WORD dir;              // 目录的首簇，根目录为0
+  int refs;              // 持有或等待这个锁的线程数，为0时释放
+  pthread_rwlock_t rw;
+  struct DIRLOCK *next;  // 哈希链
+} DIRLOCK;
+
+static struct
+{
+  pthread_mutex_t lock;  // 保护哈希表和引用计数
+  DIRLOCK *buckets[DIRLOCK_BUCKETS];
+  pthread_mutex_t sectors[DIRLOCK_SECTOR_LOCKS];
+
+  /* 统计 */
+  uint64_t read_locks;   // 加读锁的次数
+  uint64_t write_locks;  // 加写锁的次数
+  uint64_t contended;    // 需要等待其它线程释放的次数
+  uint64_t retries;      // 加锁后发现父目录已经改变、重新查找的次数
+} dl = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_once_t dl_once = PTHREAD_ONCE_INIT;
+
+static void dl_init(void)
+{
+  for (int i = 0; i < DIRLOCK_SECTOR_LOCKS; i++)
+    pthread_mutex_init(&dl.sectors[i], NULL);
+}
+
+/**
+ * @brief 找到目录的锁并增加引用计数，不存在时创建
+ */
+static DIRLOCK *dl_get(WORD dir)
+{
+  pthread_mutex_lock(&dl.lock);
+  DIRLOCK **slot = &dl.buckets[dir % DIRLOCK_BUCKETS];
+  DIRLOCK *l = *slot;
+  while (l != NULL && l->dir != dir)
+    l = l->next;
+  if (l == NULL)
+  {
+    l = malloc(sizeof(DIRLOCK));
+    l->dir = dir;
+    l->refs = 0;
+    pthread_rwlock_init(&l->rw, NULL);
+    l->next = *slot;
+    *slot = l;
+  }
+  l->refs++;
+  pthread_mutex_unlock(&dl.lock);
+  return l;
+}
+
+/**
+ * @brief 减少引用计数，没有线程使用时释放
+ */
+static void dl_put(DIRLOCK *l)
+{
+  pthread_mutex_lock(&dl.lock);
+  if (--l->refs == 0)
+  {
+    DIRLOCK **p = &dl.buckets[l->dir % DIRLOCK_BUCKETS];
+    while (*p != l)
+      p = &(*p)->next;
+    *p = l->next;
+    pthread_rwlock_destroy(&l->rw);
+    free(l);
+  }
+  pthread_mutex_unlock(&dl.lock);
+}
+
+/**
+ * @brief 加目录锁
+ *
+ * @param dir   目录的首簇，根目录为0
+ * @param write 非0时加写锁，否则加读锁
+ */
+void dirlock_lock(WORD dir, int write)
+{
+  DIRLOCK *l = dl_get(dir);
+  int busy = write ? pthread_rwlock_trywrlock(&l->rw) : pthread_rwlock_tryrdlock(&l->rw);
+  if (busy)
+  {
+    if (write)
+      pthread_rwlock_wrlock(&l->rw);
+    else
+      pthread_rwlock_rdlock(&l->rw);
+  }
+
+  pthread_mutex_lock(&dl.lock);
+  if (write)
+    dl.write_locks++;
+  else
+    dl.read_locks++;
+  dl.contended += busy != 0;
+  pthread_mutex_unlock(&dl.lock);
+}
+
+/**
+ * @brief 释放dirlock_lock加的目录锁
+ *
+ * @param dir 目录的首簇，根目录为0
+ */
+void dirlock_unlock(WORD dir)
+{
+  pthread_mutex_lock(&dl.lock);
+  DIRLOCK *l = dl.buckets[dir % DIRLOCK_BUCKETS];
+  while (l->dir != dir)
+    l = l->next;
+  pthread_mutex_unlock(&dl.lock);
+
+  pthread_rwlock_unlock(&l->rw);
+  dl_put(l);
+}
+
+/**
+ * @brief 找到path的父目录并加锁。加锁之后重新查找父目录，它在加锁之前被删除或替换时重试。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param path      文件或目录的路径
+ * @param write     非0时加写锁，否则加读锁
+ * @return int      成功返回父目录的首簇（根目录为0），此时持有它的锁；失败返回POSIX错误代码的负值，不持有锁
+ */
+int dirlock_lock_parent(FAT16 *fat16_ins, const char *path, int write)
+{
+  /* 父目录的路径是最后一个'/'之前的部分，"/name"的父目录为"/" */
+  char prtPath[strlen(path) + 2];
+  strcpy(prtPath, path);
+  char *slash = strrchr(prtPath, '/');
+  if (slash == NULL)
+    return -ENOENT;
+  slash[slash == prtPath ? 1 : 0] = '\0';
+
+  int parent = dir_lookup_cluster(fat16_ins, prtPath);
+  while (parent >= 0)
+  {
+    dirlock_lock(parent, write);
+    int again = dir_lookup_cluster(fat16_ins, prtPath);
+    if (again == parent)
+      break;
+    dirlock_unlock(parent);
+    parent = again;
+
+    pthread_mutex_lock(&dl.lock);
+    dl.retries++;
+    pthread_mutex_unlock(&dl.lock);
+  }
+  return parent;
+}
+
+/**
+ * @brief 读出、修改、写回目录项所在的扇区之前加锁，与同一扇区中其它目录项的修改互斥
+ *
+ * @param secnum 目录项所在的扇区号
+ */
+void dirlock_sector_lock(DWORD secnum)
+{
+  pthread_once(&dl_once, dl_init);
+  pthread_mutex_lock(&dl.sectors[secnum % DIRLOCK_SECTOR_LOCKS]);
+}
+
+/**
+ * @brief 释放dirlock_sector_lock加的锁
+ *
+ * @param secnum 目录项所在的扇区号
+ */
+void dirlock_sector_unlock(DWORD secnum)
+{
+  pthread_mutex_unlock(&dl.sectors[secnum % DIRLOCK_SECTOR_LOCKS]);
+}
+
+/**
+ * @brief 输出目录锁的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int dirlock_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&dl.lock);
+  int n = snprintf(buf, size,
+                   "dirlock.read_locks %llu\n"
+                   "dirlock.write_locks %llu\n"
+                   "dirlock.contended %llu\n"
+                   "dirlock.retries %llu\n",
+                   (unsigned long long)dl.read_locks,
+                   (unsigned long long)dl.write_locks,
+                   (unsigned long long)dl.contended,
+                   (unsigned long long)dl.retries);
+  pthread_mutex_unlock(&dl.lock);
+  return n;
+}
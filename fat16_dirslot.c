@@ -0,0 +1,320 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 目录的空闲目录项分配与目录扩展
+ *
+ * mknod和mkdir通过dir_alloc_slot在父目录中取得一个空闲目录项（0x00或0xE5）：
+ *   - 子目录没有空闲目录项时，分配一个清零的新簇接到目录簇链的末尾；根目录区大小固定，满了返回-ENOSPC；
+ *   - 每个目录记录一个提示（DIRSLOT_HINT）：上次分配出去的目录项位置，它及之前的目录项都已被占用，
+ *     下次从它之后开始找，连续创建文件时每次只需读一个扇区，与目录中已有的目录项数无关；
+ *   - unlink、rmdir删除目录项后调用dir_slot_freed，被删除的目录项在提示之前时把提示移回去，使其被重新利用；
+ *     目录被压缩或删除后调用dir_slot_forget丢弃提示。
+ * 提示只是加速，丢失或失效时从目录开头重新查找。提示表按目录首簇直接映射，冲突时覆盖。
+ */
+
+#define DIRSLOT_HINTS 256 // 提示表的大小
+
+typedef struct
+{
+  int valid;
+  WORD dir;      // 目录的首簇，根目录为0
+  DWORD slot;    // 上次分配的目录项序号，它及之前的目录项都已被占用
+  WORD cluster;  // slot所在的簇（子目录）
+} DIRSLOT_HINT;
+
+static struct
+{
+  pthread_mutex_t lock;
+  DIRSLOT_HINT hints[DIRSLOT_HINTS];
+
+  /* 统计 */
+  uint64_t allocs;         // 分配的目录项数
+  uint64_t hint_hits;      // 从提示开始查找的次数
+  uint64_t scans;          // 从目录开头查找的次数
+  uint64_t slots_scanned;  // 查找时检查过的目录项总数
+  uint64_t extends;        // 为扩展目录分配的簇数
+} ds = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static DIRSLOT_HINT *ds_hint(WORD dir)
+{
+  return &ds.hints[dir % DIRSLOT_HINTS];
+}
+
+/**
+ * @brief 返回目录路径对应目录的首簇
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param dirPath   目录路径
+ * @return int      根目录返回0，否则返回首簇；路径不存在返回-ENOENT，不是目录返回-ENOTDIR
+ */
+int dir_lookup_cluster(FAT16 *fat16_ins, const char *dirPath)
+{
+  if (strcmp(dirPath, "/") == 0)
+    return 0;
+
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, dirPath, &offset_dir) != 0)
+    return -ENOENT;
+  if (!(Dir.DIR_Attr & ATTR_DIRECTORY) || !is_cluster_inuse(Dir.DIR_FstClusLO))
+    return -ENOTDIR;
+  return Dir.DIR_FstClusLO;
+}
+
+/**
+ * @brief 将簇的所有扇区清零。目录的簇经过日志写入。
+ */
+void dir_cluster_zero(FAT16 *fat16_ins, WORD cluster)
+{
+  BYTE zero[BYTES_PER_SECTOR];
+  memset(zero, 0, sizeof(zero));
+  DWORD first = fat16_ins->FirstDataSector + (cluster - 2) * fat16_ins->Bpb.BPB_SecPerClus;
+  for (DWORD s = 0; s < fat16_ins->Bpb.BPB_SecPerClus; s++)
+    sector_write(fat16_ins->fd, first + s, zero);
+}
+
+/**
+ * @brief 在目录簇链末尾接上一个清零的新簇
+ *
+ * @return WORD 新簇的簇号，空间不足时返回CLUSTER_END
+ */
+static WORD ds_extend(FAT16 *fat16_ins, WORD last)
+{
+  WORD cluster = alloc_clusters_near(fat16_ins, 1, last + 1);
+  if (cluster == CLUSTER_END)
+    return CLUSTER_END;
+  dir_cluster_zero(fat16_ins, cluster);
+  write_fat_entry(fat16_ins, last, cluster);
+  return cluster;
+}
+
+/**
+ * @brief 在目录中找一个空闲目录项，必要时扩展目录。返回的目录项被视为已占用，调用者应随即写入。
+ *        调用者持有目录的写锁，查找期间只在读取和更新提示时持有ds.lock，不同目录的创建可以并行。
+ *
+ * @param fat16_ins   文件系统元数据指针
+ * @param dirCluster  目录的首簇，根目录为0
+ * @param offset      输出参数，空闲目录项在镜像文件中的偏移量（字节）
+ * @return int        成功返回0，目录已满且无法扩展时返回-ENOSPC
+ */
+int dir_alloc_slot(FAT16 *fat16_ins, WORD dirCluster, off_t *offset)
+{
+  const DWORD SlotsPerSec = BYTES_PER_SECTOR / BYTES_PER_DIR;
+  const DWORD SlotsPerClus = fat16_ins->ClusterSize / BYTES_PER_DIR;
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DWORD cachedSec = 0;
+  DWORD scanned = 0, extends = 0;
+  int ret = 0;
+
+  pthread_mutex_lock(&ds.lock);
+  DIRSLOT_HINT *h = ds_hint(dirCluster);
+
+  /* 循环开始时，若s是簇的第一个目录项，cluster为前一个簇，否则为s所在的簇 */
+  DWORD s = 0;
+  WORD cluster = dirCluster;
+  if (h->valid && h->dir == dirCluster && (dirCluster == 0 || is_cluster_inuse(h->cluster)))
+  {
+    s = h->slot + 1;
+    cluster = h->cluster;
+    ds.hint_hits++;
+  }
+  else
+  {
+    ds.scans++;
+  }
+  pthread_mutex_unlock(&ds.lock);
+
+  for (;; s++)
+  {
+    DWORD secnum;
+    if (dirCluster == 0)
+    {
+      if (s >= fat16_ins->Bpb.BPB_RootEntCnt)
+      {
+        ret = -ENOSPC;
+        break;
+      }
+      secnum = fat16_ins->FirstRootDirSecNum + s / SlotsPerSec;
+    }
+    else
+    {
+      if (s != 0 && s % SlotsPerClus == 0)
+      {
+        WORD next = fat_entry_by_cluster(fat16_ins, cluster);
+        if (!is_cluster_inuse(next))
+        {
+          next = ds_extend(fat16_ins, cluster);
+          extends += next != CLUSTER_END;
+        }
+        if (next == CLUSTER_END)
+        {
+          ret = -ENOSPC;
+          break;
+        }
+        cluster = next;
+      }
+      secnum = fat16_ins->FirstDataSector + (cluster - 2) * fat16_ins->Bpb.BPB_SecPerClus + s % SlotsPerClus / SlotsPerSec;
+    }
+
+    if (secnum != cachedSec)
+    {
+      sector_read(fat16_ins->fd, secnum, sector_buffer);
+      cachedSec = secnum;
+    }
+    scanned++;
+    BYTE first = sector_buffer[s % SlotsPerSec * BYTES_PER_DIR];
+    if (first == 0x00 || first == 0xE5)
+    {
+      *offset = (off_t)secnum * BYTES_PER_SECTOR + s % SlotsPerSec * BYTES_PER_DIR;
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&ds.lock);
+  if (ret == 0)
+  {
+    h->valid = 1;
+    h->dir = dirCluster;
+    h->slot = s;
+    h->cluster = cluster;
+    ds.allocs++;
+  }
+  ds.slots_scanned += scanned;
+  ds.extends += extends;
+  pthread_mutex_unlock(&ds.lock);
+  return ret;
+}
+
+/**
+ * @brief 目录项被删除后调用，使之后的创建可以重新利用它
+ *
+ * @param fat16_ins   文件系统元数据指针
+ * @param dirCluster  目录的首簇，根目录为0
+ * @param offset      被删除的目录项在镜像文件中的偏移量（字节）
+ */
+void dir_slot_freed(FAT16 *fat16_ins, WORD dirCluster, off_t offset)
+{
+  const DWORD SlotsPerClus = fat16_ins->ClusterSize / BYTES_PER_DIR;
+
+  pthread_mutex_lock(&ds.lock);
+  DIRSLOT_HINT *h = ds_hint(dirCluster);
+  if (!h->valid || h->dir != dirCluster)
+    goto out;
+
+  /* 计算被删除的目录项的序号 */
+  DWORD slot;
+  WORD prevCluster = dirCluster; // slot - 1所在的簇
+  if (dirCluster == 0)
+  {
+    slot = (offset - fat16_ins->RootOffset) / BYTES_PER_DIR;
+  }
+  else
+  {
+    DWORD k = 0;
+    WORD cur = dirCluster;
+    for (; is_cluster_inuse(cur) && k < fat16_ins->ClusterCount; k++)
+    {
+      off_t start = fat16_ins->DataOffset + (off_t)(cur - 2) * fat16_ins->ClusterSize;
+      if (offset >= start && offset < start + fat16_ins->ClusterSize)
+        break;
+      prevCluster = cur;
+      cur = fat_entry_by_cluster(fat16_ins, cur);
+    }
+    if (!is_cluster_inuse(cur))
+    { // 不在目录中，提示可能已经失效
+      h->valid = 0;
+      goto out;
+    }
+    slot = k * SlotsPerClus + (offset - fat16_ins->DataOffset - (off_t)(cur - 2) * fat16_ins->ClusterSize) / BYTES_PER_DIR;
+    if (slot % SlotsPerClus != 0)
+      prevCluster = cur;
+  }
+
+  if (slot > h->slot)
+    goto out;
+  if (slot == 0)
+  {
+    h->valid = 0;
+  }
+  else
+  {
+    h->slot = slot - 1;
+    h->cluster = prevCluster;
+  }
+
+out:
+  pthread_mutex_unlock(&ds.lock);
+}
+
+/**
+ * @brief 目录被压缩或删除后丢弃它的提示
+ *
+ * @param dirCluster  目录的首簇，根目录为0
+ */
+void dir_slot_forget(WORD dirCluster)
+{
+  pthread_mutex_lock(&ds.lock);
+  DIRSLOT_HINT *h = ds_hint(dirCluster);
+  if (h->dir == dirCluster)
+    h->valid = 0;
+  pthread_mutex_unlock(&ds.lock);
+}
+
+/**
+ * @brief 导出提示表，卸载时由sidecar_save保存到索引文件
+ *
+ * @param size    输出参数，导出的字节数
+ * @return void*  malloc分配的提示表副本
+ */
+void *dir_slot_export(size_t *size)
+{
+  void *data = malloc(sizeof(ds.hints));
+  pthread_mutex_lock(&ds.lock);
+  memcpy(data, ds.hints, sizeof(ds.hints));
+  pthread_mutex_unlock(&ds.lock);
+  *size = sizeof(ds.hints);
+  return data;
+}
+
+/**
+ * @brief 挂载时恢复dir_slot_export导出的提示表，大小不符（提示表的格式改变）时忽略
+ */
+void dir_slot_import(const void *data, size_t size)
+{
+  if (size != sizeof(ds.hints))
+    return;
+  pthread_mutex_lock(&ds.lock);
+  memcpy(ds.hints, data, sizeof(ds.hints));
+  pthread_mutex_unlock(&ds.lock);
+}
+
+/**
+ * @brief 输出目录项分配的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int dirslot_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&ds.lock);
+  int n = snprintf(buf, size,
+                   "dirslot.allocs %llu\n"
+                   "dirslot.hint_hits %llu\n"
+                   "dirslot.scans %llu\n"
+                   "dirslot.slots_scanned %llu\n"
+                   "dirslot.extended_clusters %llu\n",
+                   (unsigned long long)ds.allocs,
+                   (unsigned long long)ds.hint_hits,
+                   (unsigned long long)ds.scans,
+                   (unsigned long long)ds.slots_scanned,
+                   (unsigned long long)ds.extends);
+  pthread_mutex_unlock(&ds.lock);
+  return n;
+}
@@ -0,0 +1,335 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 镜像I/O的调度
+ *
+ * 一个客户端流式写入大文件时，每次写入都是若干个簇的pwrite，其它客户端的getattr、readdir读取目录扇区时
+ * 要在宿主机的设备队列中排在这些写入之后。开启iosched挂载选项后，每次读写镜像之前先取得调度器的许可：
+ *   - 请求分为元数据（保留扇区、FAT表、根目录区，以及经过sector_read/sector_write和日志的目录扇区）
+ *     和文件数据两类，各自排队；同时进行的读写不超过iosched_depth个；
+ *   - 有元数据请求在等待时不再放行数据请求。元数据请求的等待时间（指数平均）超过meta_latency时，
+ *     同时进行的数据请求数减半，低于目标的一半后逐个恢复到iosched_depth；
+ *   - 数据请求按文件（目录项偏移量）做加权公平排队：每个文件有自己的虚拟时间，每次读写按字节数除以权重推进，
+ *     总是先放行起始虚拟时间最小的请求，流式写入的大文件不会让其它文件的读写一直等待。
+ *     前台读写的权重为IOSCHED_FG_WEIGHT，后台线程（回写、预读）的权重为1；
+ *   - 同一线程嵌套的读写（例如回写失败后逐簇重写）沿用外层的许可。
+ * read_buf返回给libfuse的镜像区域由libfuse在返回后splice，不经过调度器。
+ */
+
+#define IOSCHED_STREAMS 256     // 文件虚拟时间表的大小，按目录项偏移量直接映射
+#define IOSCHED_FG_WEIGHT 4     // 前台读写相对后台线程的权重
+#define IOSCHED_IDLE_MS 100     // 超过该时间没有元数据请求时，不再限制数据请求
+
+/* 一个等待许可的请求，在等待线程的栈上 */
+typedef struct IOSCHED_WAITER
+{
+  struct IOSCHED_WAITER *next;
+  int cls;
+  uint64_t tag;          // 数据请求的起始虚拟时间
+  uint64_t arrival;      // 开始等待的时间（微秒）
+  int granted;
+  pthread_cond_t cond;
+} IOSCHED_WAITER;
+
+/* 一个文件的虚拟时间 */
+typedef struct
+{
+  off_t stream;
+  uint64_t finish;  // 上一个请求的结束虚拟时间
+} IOSCHED_STREAM;
+
+/* 一类请求的统计 */
+typedef struct
+{
+  uint64_t requests;
+  uint64_t bytes;
+  uint64_t waited;       // 需要排队的请求数
+  uint64_t wait_us;      // 排队的总时间
+  uint64_t max_wait_us;
+  unsigned queued;       // 正在排队的请求数
+  unsigned max_queued;
+  unsigned active;       // 正在进行的请求数
+} IOSCHED_CLASS;
+
+static struct
+{
+  int started;
+  long data_offset;      // 数据区在镜像文件中的偏移量，之前都是元数据
+  unsigned depth;        // 同时进行的读写数上限
+  unsigned data_limit;   // 当前同时进行的数据请求数上限
+  uint64_t target_us;    // 元数据请求的等待时间目标
+  uint64_t meta_ewma_us; // 元数据请求等待时间的指数平均
+  uint64_t last_meta;    // 上一个元数据请求放行的时间（微秒）
+  uint64_t vtime;        // 最近放行的数据请求的起始虚拟时间
+  pthread_mutex_t lock;
+  IOSCHED_WAITER *meta_head, *meta_tail;  // 元数据请求按到达顺序排队
+  IOSCHED_WAITER *data;                   // 数据请求按起始虚拟时间排序
+  IOSCHED_STREAM streams[IOSCHED_STREAMS];
+  IOSCHED_CLASS cls[2];
+
+  /* 统计 */
+  uint64_t throttles;    // 因元数据等待超过目标而减小data_limit的次数
+} ios = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread off_t io_stream = -1;  // 当前线程读写的文件，-1为后台线程
+static __thread int io_meta;           // 大于0时当前线程的读写都是元数据
+static __thread int io_held;           // 当前线程持有许可的层数
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 在fat16_init中启动调度器
+ */
+void iosched_start(FAT16 *fat16_ins)
+{
+  ios.data_offset = (long)fat16_ins->FirstDataSector * BYTES_PER_SECTOR;
+  ios.depth = fat16_opts.iosched_depth > 0 ? fat16_opts.iosched_depth : 1;
+  ios.data_limit = ios.depth;
+  ios.target_us = (uint64_t)fat16_opts.meta_latency * 1000;
+  ios.started = 1;
+}
+
+/**
+ * @brief 设置当前线程正在读写的文件，之后的数据请求按这个文件公平排队
+ *
+ * @param offset_dir  文件目录项的偏移量
+ */
+void iosched_set_stream(off_t offset_dir)
+{
+  io_stream = offset_dir;
+}
+
+/**
+ * @brief 当前线程之后的读写都是元数据（目录扇区、日志检查点），与iosched_meta_end配对，可以嵌套
+ */
+void iosched_meta_begin(void)
+{
+  io_meta++;
+}
+
+void iosched_meta_end(void)
+{
+  io_meta--;
+}
+
+/**
+ * @brief 镜像文件offset处的读写属于哪一类
+ */
+int iosched_class(long offset)
+{
+  return io_meta > 0 || offset < ios.data_offset ? IOSCHED_META : IOSCHED_DATA;
+}
+
+/**
+ * @brief 一类请求现在是否可以放行
+ */
+static int ios_can_run(int cls)
+{
+  unsigned active = ios.cls[IOSCHED_META].active + ios.cls[IOSCHED_DATA].active;
+  if (active >= ios.depth)
+    return 0;
+  if (cls == IOSCHED_META)
+    return 1;
+  return ios.meta_head == NULL && ios.cls[IOSCHED_DATA].active < ios.data_limit;
+}
+
+/**
+ * @brief 记录放行的请求，调整数据请求的上限
+ */
+static void ios_admit(int cls, uint64_t arrival, uint64_t now)
+{
+  IOSCHED_CLASS *c = &ios.cls[cls];
+  c->active++;
+  if (arrival == 0)
+    return;
+
+  uint64_t wait = now - arrival;
+  c->waited++;
+  c->wait_us += wait;
+  if (wait > c->max_wait_us)
+    c->max_wait_us = wait;
+  if (cls == IOSCHED_META)
+  {
+    ios.meta_ewma_us = (ios.meta_ewma_us * 7 + wait) / 8;
+    ios.last_meta = now;
+    if (ios.meta_ewma_us > ios.target_us && ios.data_limit > 1)
+    {
+      ios.data_limit /= 2;
+      ios.throttles++;
+    }
+  }
+}
+
+/**
+ * @brief 依次放行排队的请求，直到没有空闲的名额
+ */
+static void ios_dispatch(void)
+{
+  uint64_t now = now_us();
+  for (;;)
+  {
+    IOSCHED_WAITER *w;
+    if (ios.meta_head != NULL && ios_can_run(IOSCHED_META))
+    {
+      w = ios.meta_head;
+      ios.meta_head = w->next;
+      if (ios.meta_head == NULL)
+        ios.meta_tail = NULL;
+    }
+    else if (ios.data != NULL && ios_can_run(IOSCHED_DATA))
+    {
+      w = ios.data;
+      ios.data = w->next;
+      ios.vtime = w->tag;
+    }
+    else
+      break;
+    ios.cls[w->cls].queued--;
+    ios_admit(w->cls, w->arrival, now);
+    w->granted = 1;
+    pthread_cond_signal(&w->cond);
+  }
+}
+
+/**
+ * @brief 取得一次读写镜像的许可，与iosched_end配对
+ *
+ * @param cls   IOSCHED_META或IOSCHED_DATA，一般由iosched_class给出
+ * @param size  读写的字节数
+ */
+void iosched_begin(int cls, size_t size)
+{
+  if (!ios.started || io_held++ > 0)
+    return;
+
+  pthread_mutex_lock(&ios.lock);
+  IOSCHED_CLASS *c = &ios.cls[cls];
+  c->requests++;
+  c->bytes += size;
+
+  /* 数据请求的起始虚拟时间：不早于当前虚拟时间，也不早于同一文件上一个请求的结束 */
+  uint64_t tag = 0;
+  if (cls == IOSCHED_DATA)
+  {
+    IOSCHED_STREAM *s = &ios.streams[(uint64_t)(io_stream / BYTES_PER_DIR) % IOSCHED_STREAMS];
+    if (s->stream != io_stream)
+    {
+      s->stream = io_stream;
+      s->finish = 0;
+    }
+    tag = s->finish > ios.vtime ? s->finish : ios.vtime;
+    s->finish = tag + size / (io_stream >= 0 ? IOSCHED_FG_WEIGHT : 1);
+  }
+
+  int queueEmpty = cls == IOSCHED_META ? ios.meta_head == NULL : ios.data == NULL;
+  if (queueEmpty && ios_can_run(cls))
+  {
+    if (cls == IOSCHED_DATA)
+      ios.vtime = tag;
+    ios_admit(cls, 0, 0);
+    pthread_mutex_unlock(&ios.lock);
+    return;
+  }
+
+  IOSCHED_WAITER w = {.cls = cls, .tag = tag, .arrival = now_us()};
+  pthread_cond_init(&w.cond, NULL);
+  if (cls == IOSCHED_META)
+  {
+    if (ios.meta_tail != NULL)
+      ios.meta_tail->next = &w;
+    else
+      ios.meta_head = &w;
+    ios.meta_tail = &w;
+  }
+  else
+  {
+    IOSCHED_WAITER **p = &ios.data;
+    while (*p != NULL && (*p)->tag <= tag)
+      p = &(*p)->next;
+    w.next = *p;
+    *p = &w;
+  }
+  if (++c->queued > c->max_queued)
+    c->max_queued = c->queued;
+
+  while (!w.granted)
+    pthread_cond_wait(&w.cond, &ios.lock);
+  pthread_mutex_unlock(&ios.lock);
+  pthread_cond_destroy(&w.cond);
+}
+
+/**
+ * @brief 读写完成，归还iosched_begin取得的许可
+ *
+ * @param cls 与iosched_begin相同
+ */
+void iosched_end(int cls)
+{
+  if (!ios.started || --io_held > 0)
+    return;
+
+  pthread_mutex_lock(&ios.lock);
+  ios.cls[cls].active--;
+  if (cls == IOSCHED_DATA && ios.data_limit < ios.depth &&
+      (ios.meta_ewma_us < ios.target_us / 2 || now_us() - ios.last_meta > IOSCHED_IDLE_MS * 1000))
+    ios.data_limit++;
+  ios_dispatch();
+  pthread_mutex_unlock(&ios.lock);
+}
+
+/**
+ * @brief 输出I/O调度的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int iosched_stats(char *buf, size_t size)
+{
+  static const char *names[2] = {"meta", "data"};
+  pthread_mutex_lock(&ios.lock);
+  int n = snprintf(buf, size,
+                   "iosched.enabled %d\n"
+                   "iosched.depth %u\n"
+                   "iosched.data_limit %u\n"
+                   "iosched.meta_latency_us %llu\n"
+                   "iosched.throttles %llu\n",
+                   ios.started,
+                   ios.depth,
+                   ios.data_limit,
+                   (unsigned long long)ios.meta_ewma_us,
+                   (unsigned long long)ios.throttles);
+  for (int i = 0; i < 2 && (size_t)n < size; i++)
+  {
+    IOSCHED_CLASS *c = &ios.cls[i];
+    n += snprintf(buf + n, size - n,
+                  "iosched.%s.requests %llu\n"
+                  "iosched.%s.bytes %llu\n"
+                  "iosched.%s.queued %u\n"
+                  "iosched.%s.max_queued %u\n"
+                  "iosched.%s.waited %llu\n"
+                  "iosched.%s.avg_wait_us %llu\n"
+                  "iosched.%s.max_wait_us %llu\n",
+                  names[i], (unsigned long long)c->requests,
+                  names[i], (unsigned long long)c->bytes,
+                  names[i], c->queued,
+                  names[i], c->max_queued,
+                  names[i], (unsigned long long)c->waited,
+                  names[i], (unsigned long long)(c->waited ? c->wait_us / c->waited : 0),
+                  names[i], (unsigned long long)c->max_wait_us);
+  }
+  pthread_mutex_unlock(&ios.lock);
+  return n;
+}
@@ -0,0 +1,941 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fat16.h"
+
+/**
+ * 元数据日志（write-ahead journal）
+ *
+ * 所有经过sector_write的写入（FAT表、根目录区、子目录的目录项）都是元数据。
+ * 开启日志后，这些写入不再直接落盘，而是先写入内存中的扇区覆盖表（overlay），
+ * sector_read优先从覆盖表读取。一个FUSE操作中修改过的扇区构成一个事务，
+ * 操作结束时事务被追加到镜像旁的日志文件（<镜像>.journal）中。
+ *
+ * 并发的操作采用组提交：第一个到达的线程成为leader，将此刻所有待提交的事务一次写入日志并fdatasync，
+ * 其余线程等待leader完成。日志超过JOURNAL_CHECKPOINT_SIZE后，已提交的扇区才被写回镜像（检查点），
+ * 然后清空日志。挂载时（pre_init_fat16）会重放日志中所有完整的事务。
+ *
+ * 覆盖表中的扇区被多个操作共享（例如同一个FAT扇区中的表项属于不同的文件），扇区的当前内容可能含有
+ * 其它仍在进行中的操作未完成的修改。因此每个扇区记录有几个未结束的事务修改过它（holders），
+ * 事务结束时先并入“运行中的复合事务”（journal->running），只有其中所有扇区都不再被未结束的事务修改时，
+ * 复合事务才作为一条记录提交（与jbd2的复合事务相同）；否则结束的事务不等待，留给最后一个结束的相关事务一起提交。
+ * 这样日志中的每条记录都只包含已结束的操作的全部修改，重放时不会出现半个操作。
+ * fsync（journal_sync）等待复合事务中的扇区都不再被修改后强制提交它。
+ *
+ * leader写日志之前先fdatasync镜像，事务中写入的文件数据先于引用它们的簇链和目录项持久化。
+ * 写日志失败后日志进入失败状态：已提交的长度不变，之后的事务不再写入日志，包装的操作返回-EIO，
+ * 也不再做检查点，下次挂载时重放失败之前的记录。
+ *
+ * sector_read不加锁读取覆盖表：覆盖表有一个序列号（seqlock），修改覆盖表（写入、撤销、检查点移除扇区）时
+ * 序列号先变为奇数，改完后变为偶数；读者复制扇区之后序列号没有变化才使用，否则重试，多次失败后才加锁。
+ * 从覆盖表移除的扇区不释放，放入空闲链表供之后的写入重用，读者沿哈希链访问到的内存始终有效。
+ *
+ * 簇被重新分配为文件数据时，需要调用journal_revoke撤销日志中这些扇区的旧内容，
+ * 否则重放时旧的目录项会覆盖新写入的文件数据。
+ * 文件数据本身不经过日志。
+ *
+ * 待回收簇链队列（fat16_reclaim.c）的增删也作为不带扇区数据的TAG记入事务，
+ * 这样延迟释放的unlink中“删除目录项”和“簇链入队”是原子的。
+ * 队列在事务提交后才真正更新：写日志的leader在唤醒其它线程之前为整批记录更新队列，
+ * 检查点清空日志前会先把队列保存到自己的文件中，此时日志中所有记录的队列操作都已经应用。
+ */
+
+#define JOURNAL_MAGIC 0x4a363146          // "F16J"
+#define JOURNAL_BUCKETS 4096              // 覆盖表的哈希桶个数
+#define JOURNAL_CHECKPOINT_SIZE (4 << 20) // 日志超过该大小后做检查点（字节）
+#define JOURNAL_READ_RETRIES 8            // 无锁读取覆盖表的重试次数，之后加锁读取
+#define JOURNAL_READ_MAX_CHAIN 4096       // 无锁读取时沿哈希链最多前进的步数，超过视为遇到并发修改
+
+#define TAG_REVOKE 0x1       // 该扇区被撤销，重放时忽略此前对它的写入
+#define TAG_ORPHAN_ADD 0x2   // secnum为簇号，该簇链加入待回收队列
+#define TAG_ORPHAN_DEL 0x4   // secnum为簇号，该簇链移出待回收队列
+#define TAG_NO_DATA (TAG_REVOKE | TAG_ORPHAN_ADD | TAG_ORPHAN_DEL) // 这些TAG之后没有扇区数据
+
+/* 日志中一个事务记录的头部，之后紧跟count个JOURNAL_TAG，普通TAG之后是一个扇区的数据 */
+typedef struct
+{
+  DWORD magic;
+  DWORD count;
+  DWORD checksum; // 所有TAG和扇区数据的CRC32
+  DWORD size;     // TAG和扇区数据的总长度（字节）
+} __attribute__((packed)) JOURNAL_HEADER;
+
+typedef struct
+{
+  DWORD secnum;
+  DWORD flags;
+} __attribute__((packed)) JOURNAL_TAG;
+
+/* 覆盖表中的一个扇区 */
+typedef struct JOURNAL_SECTOR
+{
+  DWORD secnum;
+  int revoked;                           // 被撤销的扇区不再从覆盖表读取，也不会写回镜像
+  int has_logged;                        // logged中是否保存了已写入日志的内容
+  int holders;                           // 修改过该扇区、尚未结束的事务个数，不为0时不能提交该扇区
+  DWORD version;                         // 每次sector_write加一
+  DWORD logged_version;                  // 最近一次写入日志时的version
+  BYTE data[BYTES_PER_SECTOR];           // 最新内容
+  BYTE logged[BYTES_PER_SECTOR];         // 最近一次写入日志的内容，检查点时写回镜像
+  struct JOURNAL_SECTOR *next;
+} JOURNAL_SECTOR;
+
+/* 事务中修改过的一个扇区，或对待回收队列的一次修改 */
+typedef struct
+{
+  DWORD secnum;
+  DWORD flags;
+} JOURNAL_TXN_ENTRY;
+
+typedef struct
+{
+  int depth; // journal_begin的嵌套层数
+  JOURNAL_TXN_ENTRY *entries;
+  int count;
+  int capacity;
+} JOURNAL_TXN;
+
+typedef struct
+{
+  FILE *image;     // 镜像文件
+  int log_fd;      // 日志文件描述符
+  off_t log_size;  // 日志文件中已提交的长度
+  JOURNAL_SECTOR *buckets[JOURNAL_BUCKETS];
+  JOURNAL_SECTOR *free_list; // 从覆盖表移除的扇区，供之后重用
+  unsigned seq;              // 覆盖表的序列号，为奇数时正在修改
+
+  pthread_mutex_t lock;
+  pthread_cond_t committed;
+  BYTE *pending;       // 等待组提交的事务记录
+  size_t pending_size;
+  size_t pending_capacity;
+  JOURNAL_TXN pending_orphans; // pending中的记录对待回收队列的修改，由写入它们的leader应用
+  uint64_t next_seq;      // 最后一个加入pending的事务序号
+  uint64_t committed_seq; // 已持久化的最大事务序号
+  int committing;         // 是否有leader正在写日志
+  int failed;             // 写日志或检查点失败后为1，之后不再写日志
+  JOURNAL_TXN running;    // 已结束、等待与仍在进行的事务一起提交的复合事务
+  uint64_t running_gen;   // running被取出提交（或失败时丢弃）的次数
+} JOURNAL;
+
+static JOURNAL *journal = NULL;
+static __thread JOURNAL_TXN txn;
+
+/**
+ * @brief 计算CRC32校验和（多项式0xEDB88320）
+ *
+ * @param crc   初始值，首次调用传0，分段计算时传入上一段的返回值
+ * @param data  数据
+ * @param size  数据长度（字节）
+ * @return DWORD 校验和
+ */
+DWORD crc32_checksum(DWORD crc, const void *data, size_t size)
+{
+  const BYTE *p = data;
+  crc = ~crc;
+  while (size--)
+  {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static JOURNAL_SECTOR *journal_lookup(DWORD secnum)
+{
+  JOURNAL_SECTOR *s = journal->buckets[secnum % JOURNAL_BUCKETS];
+  while (s != NULL && s->secnum != secnum)
+    s = s->next;
+  return s;
+}
+
+/**
+ * @brief 开始修改覆盖表，调用者需持有journal->lock。无锁的读者看到奇数的序列号时重试。
+ */
+static void overlay_write_begin(void)
+{
+  __atomic_store_n(&journal->seq, journal->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void overlay_write_end(void)
+{
+  __atomic_store_n(&journal->seq, journal->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 找到扇区在覆盖表中的位置，不存在时加入。需要在overlay_write_begin/end之间调用。
+ */
+static JOURNAL_SECTOR *journal_lookup_or_create(DWORD secnum)
+{
+  JOURNAL_SECTOR *s = journal_lookup(secnum);
+  if (s == NULL)
+  {
+    if (journal->free_list != NULL)
+    {
+      s = journal->free_list;
+      journal->free_list = s->next;
+      memset(s, 0, sizeof(JOURNAL_SECTOR));
+    }
+    else
+    {
+      s = calloc(1, sizeof(JOURNAL_SECTOR));
+    }
+    s->secnum = secnum;
+    s->next = journal->buckets[secnum % JOURNAL_BUCKETS];
+    journal->buckets[secnum % JOURNAL_BUCKETS] = s;
+  }
+  return s;
+}
+
+/**
+ * @brief 在事务t中记录一个扇区或一次队列操作
+ *
+ * @return int 扇区第一次记入t时返回1，否则返回0
+ */
+static int txn_add(JOURNAL_TXN *t, DWORD secnum, DWORD flags)
+{
+  /* 扇区在同一事务中只记录一次；队列操作有先后顺序，逐条记录 */
+  int is_orphan = flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL);
+  for (int i = 0; i < t->count && !is_orphan; i++)
+  {
+    if (t->entries[i].secnum == secnum && !(t->entries[i].flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL)))
+    {
+      t->entries[i].flags = flags;
+      return 0;
+    }
+  }
+  if (t->count == t->capacity)
+  {
+    t->capacity = t->capacity ? t->capacity * 2 : 16;
+    t->entries = realloc(t->entries, t->capacity * sizeof(JOURNAL_TXN_ENTRY));
+  }
+  t->entries[t->count].secnum = secnum;
+  t->entries[t->count].flags = flags;
+  t->count++;
+  return !is_orphan;
+}
+
+/**
+ * @brief 在当前线程的事务中记录修改过的扇区s，或一次队列操作（s为NULL）。调用者需持有journal->lock。
+ */
+static void txn_touch(JOURNAL_SECTOR *s, DWORD secnum, DWORD flags)
+{
+  if (txn_add(&txn, secnum, flags) && s != NULL)
+    s->holders++;
+}
+
+static void pending_append(const void *data, size_t size)
+{
+  if (journal->pending_size + size > journal->pending_capacity)
+  {
+    journal->pending_capacity = (journal->pending_size + size) * 2;
+    journal->pending = realloc(journal->pending, journal->pending_capacity);
+  }
+  memcpy(journal->pending + journal->pending_size, data, size);
+  journal->pending_size += size;
+}
+
+/**
+ * @brief 进入失败状态。调用者需持有journal->lock。
+ */
+static void journal_fail(const char *what)
+{
+  if (!journal->failed)
+    fprintf(stderr, "journal: %s failed, metadata changes are rejected until the next mount\n", what);
+  __atomic_store_n(&journal->failed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 将所有已提交的扇区写回镜像，然后清空日志。调用者需持有journal->lock，
+ *        且此时没有正在提交或等待提交的事务。写回失败时保留日志，下次挂载时重放。
+ */
+static void journal_checkpoint_locked(void)
+{
+  int fd = fileno(journal->image);
+  if (journal->failed)
+    return;
+
+  /* 所有扇区的写回作为一次提交 */
+  int ok = 1;
+  io_batch_begin();
+  iosched_meta_begin();
+  for (int b = 0; b < JOURNAL_BUCKETS; b++)
+  {
+    for (JOURNAL_SECTOR *s = journal->buckets[b]; s != NULL; s = s->next)
+    {
+      if (s->has_logged && !s->revoked &&
+          io_write(journal->image, s->logged, (long)s->secnum * BYTES_PER_SECTOR, BYTES_PER_SECTOR) != BYTES_PER_SECTOR)
+        ok = 0;
+    }
+  }
+  if (io_batch_end() != 0)
+    ok = 0;
+  iosched_meta_end();
+  if (!ok || fdatasync(fd) != 0)
+  {
+    journal_fail("checkpoint");
+    return;
+  }
+  /* 日志中的队列操作即将被清空，先保存队列 */
+  reclaim_save_queue();
+  if (ftruncate(journal->log_fd, 0) == 0)
+    fdatasync(journal->log_fd);
+  journal->log_size = 0;
+
+  /* 已写回且没有被后续事务修改过的扇区可以从覆盖表中移除 */
+  overlay_write_begin();
+  for (int b = 0; b < JOURNAL_BUCKETS; b++)
+  {
+    JOURNAL_SECTOR **link = &journal->buckets[b];
+    while (*link != NULL)
+    {
+      JOURNAL_SECTOR *s = *link;
+      if (s->holders == 0 && (s->revoked || s->version == s->logged_version))
+      {
+        *link = s->next;
+        s->next = journal->free_list;
+        journal->free_list = s;
+      }
+      else
+      {
+        s->has_logged = 0;
+        link = &s->next;
+      }
+    }
+  }
+  overlay_write_end();
+}
+
+/**
+ * @brief 重放日志：按顺序读取所有校验和正确的事务，得到每个扇区的最终内容后写回镜像，最后清空日志。
+ *        遇到不完整或校验失败的记录即停止，该记录及其之后的内容属于崩溃时未提交的事务。
+ */
+static void journal_replay(void)
+{
+  JOURNAL_SECTOR **replayed = calloc(JOURNAL_BUCKETS, sizeof(JOURNAL_SECTOR *));
+  JOURNAL_HEADER header;
+  off_t pos = 0;
+  int txnCnt = 0;
+
+  while (pread(journal->log_fd, &header, sizeof(header), pos) == sizeof(header) &&
+         header.magic == JOURNAL_MAGIC)
+  {
+    size_t size = header.size;
+    BYTE *body = malloc(size);
+    if (pread(journal->log_fd, body, size, pos + sizeof(header)) != (ssize_t)size ||
+        crc32_checksum(0, body, size) != header.checksum)
+    {
+      free(body);
+      break;
+    }
+
+    BYTE *p = body;
+    for (DWORD i = 0; i < header.count; i++)
+    {
+      JOURNAL_TAG *tag = (JOURNAL_TAG *)p;
+      p += sizeof(JOURNAL_TAG);
+      if (tag->flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL))
+      {
+        reclaim_orphan_update(tag->secnum, tag->flags & TAG_ORPHAN_ADD);
+        continue;
+      }
+
+      JOURNAL_SECTOR *s = replayed[tag->secnum % JOURNAL_BUCKETS];
+      while (s != NULL && s->secnum != tag->secnum)
+        s = s->next;
+      if (s == NULL)
+      {
+        s = calloc(1, sizeof(JOURNAL_SECTOR));
+        s->secnum = tag->secnum;
+        s->next = replayed[tag->secnum % JOURNAL_BUCKETS];
+        replayed[tag->secnum % JOURNAL_BUCKETS] = s;
+      }
+      s->revoked = tag->flags & TAG_REVOKE;
+      if (!(tag->flags & TAG_NO_DATA))
+      {
+        memcpy(s->data, p, BYTES_PER_SECTOR);
+        p += BYTES_PER_SECTOR;
+      }
+    }
+    free(body);
+    pos += sizeof(header) + size;
+    txnCnt++;
+  }
+
+  for (int b = 0; b < JOURNAL_BUCKETS; b++)
+  {
+    while (replayed[b] != NULL)
+    {
+      JOURNAL_SECTOR *s = replayed[b];
+      if (!s->revoked)
+        io_write(journal->image, s->data, (long)s->secnum * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+      replayed[b] = s->next;
+      free(s);
+    }
+  }
+  free(replayed);
+
+  if (pos > 0)
+  {
+    fprintf(stderr, "journal: replayed %d transaction(s)\n", txnCnt);
+    fdatasync(fileno(journal->image));
+    reclaim_save_queue();
+  }
+  if (ftruncate(journal->log_fd, 0) == 0)
+    fdatasync(journal->log_fd);
+}
+
+/**
+ * @brief 打开（或创建）镜像对应的日志文件，重放其中已提交的事务，之后的元数据写入都经过日志。
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param imageFilePath 镜像文件路径，日志文件为"<imageFilePath>.journal"
+ * @return int          成功返回0，失败返回POSIX错误代码的负值（此时不使用日志）
+ */
+int journal_open(FAT16 *fat16_ins, const char *imageFilePath)
+{
+  char *logPath = malloc(strlen(imageFilePath) + sizeof(".journal"));
+  sprintf(logPath, "%s.journal", imageFilePath);
+  int fd = open(logPath, O_RDWR | O_CREAT, 0644);
+  free(logPath);
+  if (fd < 0)
+    return -errno;
+
+  JOURNAL *j = calloc(1, sizeof(JOURNAL));
+  j->image = fat16_ins->fd;
+  j->log_fd = fd;
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->committed, NULL);
+  journal = j;
+
+  journal_replay();
+  return 0;
+}
+
+/**
+ * @brief 镜像对应的日志文件中是否有还没有重放的内容。只读打开镜像时不能重放，用它检查。
+ *
+ * @param imageFilePath 镜像文件路径
+ * @return int          日志文件存在且不为空时返回1，否则返回0
+ */
+int journal_pending(const char *imageFilePath)
+{
+  char *logPath = malloc(strlen(imageFilePath) + sizeof(".journal"));
+  sprintf(logPath, "%s.journal", imageFilePath);
+  struct stat st;
+  int pending = stat(logPath, &st) == 0 && st.st_size > 0;
+  free(logPath);
+  return pending;
+}
+
+/**
+ * @brief 卸载时调用：做最后一次检查点并关闭日志。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @return int      成功返回0，日志处于失败状态（镜像不是最新的，需要下次挂载时重放）时返回-EIO
+ */
+int journal_close(FAT16 *fat16_ins)
+{
+  if (journal == NULL)
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+  journal_checkpoint_locked();
+  int ret = journal->failed ? -EIO : 0;
+  pthread_mutex_unlock(&journal->lock);
+
+  close(journal->log_fd);
+  for (int b = 0; b < JOURNAL_BUCKETS; b++)
+  {
+    while (journal->buckets[b] != NULL)
+    {
+      JOURNAL_SECTOR *s = journal->buckets[b];
+      journal->buckets[b] = s->next;
+      free(s);
+    }
+  }
+  while (journal->free_list != NULL)
+  {
+    JOURNAL_SECTOR *s = journal->free_list;
+    journal->free_list = s->next;
+    free(s);
+  }
+  free(journal->pending);
+  free(journal->pending_orphans.entries);
+  free(journal->running.entries);
+  free(journal);
+  journal = NULL;
+  return ret;
+}
+
+/**
+ * @brief 开始当前线程的事务。可以嵌套，最外层的journal_end才会提交。
+ */
+void journal_begin(void)
+{
+  io_batch_begin();
+  txn.depth++;
+}
+
+/**
+ * @brief 运行中的复合事务中是否还有扇区被未结束的事务修改。调用者需持有journal->lock。
+ */
+static int running_held(void)
+{
+  JOURNAL_TXN *run = &journal->running;
+  for (int i = 0; i < run->count; i++)
+  {
+    if (run->entries[i].flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL))
+      continue;
+    JOURNAL_SECTOR *s = journal_lookup(run->entries[i].secnum);
+    if (s != NULL && s->holders > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief 取出运行中的复合事务，作为一条记录加入待提交队列，并等待其持久化（组提交）。
+ *        调用者需持有journal->lock，且复合事务中的扇区都不再被未结束的事务修改。
+ *
+ * @return int 成功返回0，写日志失败返回-EIO
+ */
+static int journal_commit_running(void)
+{
+  /* 取出复合事务，等待持久化期间其它事务可以开始新的复合事务 */
+  JOURNAL_TXN entries = journal->running;
+  memset(&journal->running, 0, sizeof(JOURNAL_TXN));
+  journal->running_gen++;
+  if (journal->failed)
+  {
+    free(entries.entries);
+    pthread_cond_broadcast(&journal->committed);
+    return -EIO;
+  }
+
+  /* 生成复合事务的记录：修改过的扇区取当前内容，撤销的扇区和队列操作只记录编号 */
+  BYTE *body = malloc(entries.count * (sizeof(JOURNAL_TAG) + BYTES_PER_SECTOR));
+  BYTE *p = body;
+  for (int i = 0; i < entries.count; i++)
+  {
+    JOURNAL_TAG tag = {entries.entries[i].secnum, entries.entries[i].flags};
+    JOURNAL_SECTOR *s = NULL;
+    if (!(tag.flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL)))
+    {
+      s = journal_lookup(tag.secnum);
+      if (s == NULL || s->revoked)
+        tag.flags = TAG_REVOKE;
+    }
+    memcpy(p, &tag, sizeof(tag));
+    p += sizeof(tag);
+    if (!(tag.flags & TAG_NO_DATA))
+    {
+      memcpy(p, s->data, BYTES_PER_SECTOR);
+      p += BYTES_PER_SECTOR;
+      memcpy(s->logged, s->data, BYTES_PER_SECTOR);
+      s->logged_version = s->version;
+      s->has_logged = 1;
+    }
+  }
+  size_t bodySize = p - body;
+  JOURNAL_HEADER header = {JOURNAL_MAGIC, entries.count, crc32_checksum(0, body, bodySize), bodySize};
+  pending_append(&header, sizeof(header));
+  pending_append(body, bodySize);
+  free(body);
+  for (int i = 0; i < entries.count; i++)
+  {
+    if (entries.entries[i].flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL))
+      txn_add(&journal->pending_orphans, entries.entries[i].secnum, entries.entries[i].flags);
+  }
+  free(entries.entries);
+  uint64_t seq = ++journal->next_seq;
+
+  /* 组提交 */
+  while (journal->committed_seq < seq)
+  {
+    if (journal->committing)
+    {
+      pthread_cond_wait(&journal->committed, &journal->lock);
+      continue;
+    }
+
+    journal->committing = 1;
+    BYTE *batch = journal->pending;
+    size_t batchSize = journal->pending_size;
+    uint64_t batchSeq = journal->next_seq;
+    JOURNAL_TXN orphans = journal->pending_orphans;
+    journal->pending = NULL;
+    journal->pending_size = journal->pending_capacity = 0;
+    memset(&journal->pending_orphans, 0, sizeof(JOURNAL_TXN));
+    off_t pos = journal->log_size;
+    pthread_mutex_unlock(&journal->lock);
+
+    /* 文件数据先于引用它的元数据持久化，之后才写日志 */
+    int ok = fdatasync(fileno(journal->image)) == 0;
+    if (ok)
+    {
+      iosched_begin(IOSCHED_META, batchSize);
+      ok = pwrite(journal->log_fd, batch, batchSize, pos) == (ssize_t)batchSize &&
+           fdatasync(journal->log_fd) == 0;
+      iosched_end(IOSCHED_META);
+    }
+    free(batch);
+
+    pthread_mutex_lock(&journal->lock);
+    /* 失败时不推进日志长度，之后的记录不能写在残缺的记录后面 */
+    if (ok)
+      journal->log_size += batchSize;
+    else
+      journal_fail("log write");
+    /* 整批记录已持久化，此时才更新待回收队列；在唤醒其它线程之前完成，之后的检查点保存的队列包含它们 */
+    for (int i = 0; ok && i < orphans.count; i++)
+      reclaim_orphan_update(orphans.entries[i].secnum, orphans.entries[i].flags & TAG_ORPHAN_ADD);
+    free(orphans.entries);
+    journal->committed_seq = batchSeq;
+    journal->committing = 0;
+    pthread_cond_broadcast(&journal->committed);
+  }
+  if (journal->failed)
+    return -EIO;
+
+  /* 惰性检查点：只在日志足够大且没有其它待提交记录时进行 */
+  if (journal->log_size > JOURNAL_CHECKPOINT_SIZE && !journal->committing &&
+      journal->committed_seq == journal->next_seq)
+  {
+    journal_checkpoint_locked();
+  }
+  return 0;
+}
+
+/**
+ * @brief 结束当前线程的事务：并入运行中的复合事务。复合事务中的扇区都不再被未结束的事务修改时，
+ *        将其作为一条记录加入待提交队列，并等待其持久化；否则直接返回，由最后结束的相关事务提交。
+ *        若当前没有正在进行的提交，本线程成为leader，把所有线程待提交的记录一次写入日志。
+ *
+ * @return int 成功返回0，写日志失败（或日志已处于失败状态）返回-EIO
+ */
+int journal_end(void)
+{
+  /* 事务中写入镜像的数据在这里写出，leader写日志之前再fdatasync镜像 */
+  int ret = io_batch_end();
+
+  if (--txn.depth > 0)
+    return ret;
+  if (journal == NULL || txn.count == 0)
+  {
+    txn.count = 0;
+    return ret;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+
+  /* 本事务不再修改这些扇区，并入复合事务 */
+  JOURNAL_TXN *run = &journal->running;
+  for (int i = 0; i < txn.count; i++)
+  {
+    if (!(txn.entries[i].flags & (TAG_ORPHAN_ADD | TAG_ORPHAN_DEL)))
+      journal_lookup(txn.entries[i].secnum)->holders--;
+    txn_add(run, txn.entries[i].secnum, txn.entries[i].flags);
+  }
+  txn.count = 0;
+
+  /* 还有扇区含有未结束事务的修改时，留给那个事务提交；等待中的journal_sync需要重新检查 */
+  if (running_held())
+  {
+    pthread_cond_broadcast(&journal->committed);
+    ret = journal->failed ? -EIO : ret;
+    pthread_mutex_unlock(&journal->lock);
+    return ret;
+  }
+
+  int cret = journal_commit_running();
+  pthread_mutex_unlock(&journal->lock);
+  return cret < 0 ? cret : ret;
+}
+
+/**
+ * @brief fsync时调用：强制提交运行中的复合事务。等待其中的扇区不再被未结束的事务修改后提交，
+ *        并等待此前所有待提交的记录持久化。
+ *
+ * @return int 成功返回0，写日志失败返回-EIO
+ */
+int journal_sync(void)
+{
+  if (journal == NULL)
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+  int ret = 0;
+  uint64_t gen = journal->running_gen;
+  while (!journal->failed && journal->running.count > 0 && journal->running_gen == gen && running_held())
+    pthread_cond_wait(&journal->committed, &journal->lock);
+
+  if (journal->running.count > 0 && journal->running_gen == gen)
+  {
+    ret = journal_commit_running();
+  }
+  else
+  {
+    /* 复合事务已被其它线程取出（或为空），等待它和之前的记录写入日志 */
+    uint64_t seq = journal->next_seq;
+    while (journal->committed_seq < seq)
+      pthread_cond_wait(&journal->committed, &journal->lock);
+  }
+  if (journal->failed)
+    ret = -EIO;
+  pthread_mutex_unlock(&journal->lock);
+  return ret;
+}
+
+/**
+ * @brief 从覆盖表中读取扇区。先不加锁读取，复制期间覆盖表被修改时重试。
+ *
+ * @param secnum  扇区号
+ * @param buffer  数据要存储到的缓冲区指针
+ * @return int    扇区在覆盖表中返回1，否则返回0，调用者应从镜像读取
+ */
+int journal_sector_read(unsigned int secnum, void *buffer)
+{
+  if (journal == NULL)
+    return 0;
+
+  for (int tries = 0; tries < JOURNAL_READ_RETRIES; tries++)
+  {
+    unsigned seq = __atomic_load_n(&journal->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    /* 并发修改时哈希链可能经过被重用的扇区，步数有上限，结果由序列号检验 */
+    JOURNAL_SECTOR *s = journal->buckets[secnum % JOURNAL_BUCKETS];
+    int steps = 0;
+    while (s != NULL && s->secnum != secnum && steps++ < JOURNAL_READ_MAX_CHAIN)
+      s = s->next;
+    int hit = s != NULL && s->secnum == secnum && !s->revoked;
+    if (hit)
+      memcpy(buffer, s->data, BYTES_PER_SECTOR);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&journal->seq, __ATOMIC_RELAXED) == seq && steps <= JOURNAL_READ_MAX_CHAIN)
+      return hit;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  JOURNAL_SECTOR *s = journal_lookup(secnum);
+  int hit = s != NULL && !s->revoked;
+  if (hit)
+    memcpy(buffer, s->data, BYTES_PER_SECTOR);
+  pthread_mutex_unlock(&journal->lock);
+  return hit;
+}
+
+/**
+ * @brief 将扇区写入覆盖表，并记入当前线程的事务；不在事务中时自成一个事务并立即提交。
+ *
+ * @param secnum  扇区号
+ * @param buffer  需要写入的数据
+ * @return int    日志开启时返回1，否则返回0，调用者应直接写镜像
+ */
+int journal_sector_write(unsigned int secnum, const void *buffer)
+{
+  if (journal == NULL)
+    return 0;
+
+  journal_begin();
+  pthread_mutex_lock(&journal->lock);
+  overlay_write_begin();
+  JOURNAL_SECTOR *s = journal_lookup_or_create(secnum);
+  memcpy(s->data, buffer, BYTES_PER_SECTOR);
+  s->revoked = 0;
+  s->version++;
+  overlay_write_end();
+  txn_touch(s, secnum, 0);
+  pthread_mutex_unlock(&journal->lock);
+  journal_end();
+  return 1;
+}
+
+/**
+ * @brief 撤销从secnum开始的count个扇区在日志中的内容。簇被分配给文件数据之前调用，
+ *        防止重放时该簇原来作为目录时的内容覆盖文件数据。
+ *
+ * @param secnum  起始扇区号
+ * @param count   扇区个数
+ */
+void journal_revoke(unsigned int secnum, unsigned int count)
+{
+  if (journal == NULL)
+    return;
+
+  journal_begin();
+  pthread_mutex_lock(&journal->lock);
+  overlay_write_begin();
+  for (unsigned int i = 0; i < count; i++)
+  {
+    JOURNAL_SECTOR *s = journal_lookup(secnum + i);
+    if (s == NULL)
+      continue;
+    s->revoked = 1;
+    txn_touch(s, secnum + i, TAG_REVOKE);
+  }
+  overlay_write_end();
+  pthread_mutex_unlock(&journal->lock);
+  journal_end();
+}
+
+/**
+ * @brief 在当前事务中将簇链加入或移出待回收队列，事务提交后队列才会更新。
+ *        未开启日志时立即更新队列并保存。
+ *
+ * @param cluster 簇链的第一个簇号
+ * @param add     1:加入队列，0:移出队列
+ */
+void journal_log_orphan(WORD cluster, int add)
+{
+  if (journal == NULL)
+  {
+    reclaim_orphan_update(cluster, add);
+    reclaim_save_queue();
+    return;
+  }
+
+  journal_begin();
+  pthread_mutex_lock(&journal->lock);
+  txn_touch(NULL, cluster, add ? TAG_ORPHAN_ADD : TAG_ORPHAN_DEL);
+  pthread_mutex_unlock(&journal->lock);
+  journal_end();
+}
+
+// ===========================按FUSE操作划分事务===============================
+
+static struct fuse_operations journal_inner;
+
+/**
+ * @brief 开始一个操作的事务。日志处于失败状态时拒绝会修改元数据的操作。
+ *
+ * @return int 可以继续返回0，否则返回-EIO
+ */
+static int journal_op_begin(void)
+{
+  if (journal != NULL && __atomic_load_n(&journal->failed, __ATOMIC_ACQUIRE))
+    return -EIO;
+  journal_begin();
+  return 0;
+}
+
+/**
+ * @brief 结束一个操作的事务，操作本身成功但提交失败时返回提交的错误
+ */
+static int journal_op_end(int ret)
+{
+  int jr = journal_end();
+  return ret >= 0 && jr < 0 ? jr : ret;
+}
+
+static int journal_mknod(const char *path, mode_t mode, dev_t devNum)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.mknod(path, mode, devNum);
+  return journal_op_end(ret);
+}
+
+static int journal_unlink(const char *path)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.unlink(path);
+  return journal_op_end(ret);
+}
+
+static int journal_mkdir(const char *path, mode_t mode)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.mkdir(path, mode);
+  return journal_op_end(ret);
+}
+
+static int journal_rmdir(const char *path)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.rmdir(path);
+  return journal_op_end(ret);
+}
+
+static int journal_write(const char *path, const char *data, size_t size, off_t offset,
+                         struct fuse_file_info *fi)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.write(path, data, size, offset, fi);
+  return journal_op_end(ret);
+}
+
+static int journal_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                             struct fuse_file_info *fi)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.write_buf(path, buf, offset, fi);
+  return journal_op_end(ret);
+}
+
+static int journal_truncate(const char *path, off_t size)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.truncate(path, size);
+  return journal_op_end(ret);
+}
+
+static int journal_fallocate(const char *path, int mode, off_t offset, off_t length,
+                             struct fuse_file_info *fi)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.fallocate(path, mode, offset, length, fi);
+  return journal_op_end(ret);
+}
+
+static int journal_release(const char *path, struct fuse_file_info *fi)
+{
+  if (journal_op_begin() != 0)
+    return -EIO;
+  int ret = journal_inner.release(path, fi);
+  return journal_op_end(ret);
+}
+
+/**
+ * @brief 包装oper中会修改元数据的操作，使每个操作的全部元数据修改成为一个事务。
+ *
+ * @param oper 要包装的文件系统操作表
+ */
+void journal_wrap_operations(struct fuse_operations *oper)
+{
+  journal_inner = *oper;
+  if (oper->mknod)
+    oper->mknod = journal_mknod;
+  if (oper->unlink)
+    oper->unlink = journal_unlink;
+  if (oper->mkdir)
+    oper->mkdir = journal_mkdir;
+  if (oper->rmdir)
+    oper->rmdir = journal_rmdir;
+  if (oper->write)
+    oper->write = journal_write;
+  if (oper->write_buf)
+    oper->write_buf = journal_write_buf;
+  if (oper->truncate)
+    oper->truncate = journal_truncate;
+  if (oper->fallocate)
+    oper->fallocate = journal_fallocate;
+  if (oper->release)
+    oper->release = journal_release;
+}
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE // O_DIRECT
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+extern FAT16 *get_fat16_ins();
+
+/**
+ * 与内核页缓存的配合
+ *
+ * 镜像只由本进程修改，每次修改文件数据都经过fat16_write/fat16_write_buf/fat16_truncate/fat16_fallocate，
+ * 因此本进程知道文件的内容何时改变：
+ *   - 每个文件（与延迟分配一样按目录项偏移量区分）有一个修改代数，每次修改加一；
+ *   - 打开文件时记下当时的代数。开启keep_cache挂载选项后，如果上一次打开之后文件没有被修改过，
+ *     设置fi->keep_cache，内核保留上次读入的页，重复读取热文件时不再调用fat16_read；
+ *     修改过（可能是direct_io的写入绕过了内核的页缓存），或者状态已被覆盖时，让内核丢弃缓存的页；
+ *   - 以O_DIRECT打开，或者大小不小于direct_io_min的文件设置fi->direct_io，流式读写不经过内核的页缓存，
+ *     也不挤出其它文件的缓存页；
+ *   - attr_timeout/entry_timeout原样交给libfuse，由于属性只会经过本进程改变，可以设得比默认的1秒更长。
+ * 与libfuse的auto_cache不同，判断不依赖修改时间和大小，同一秒内大小不变的修改也会使缓存失效。
+ */
+
+#define KCACHE_FILES 1024 // 修改代数表的大小，按目录项偏移量直接映射，冲突时覆盖
+
+/* 一个文件的修改代数 */
+typedef struct
+{
+  int valid;
+  off_t offset_dir;
+  uint64_t generation;  // 文件内容的修改代数
+  uint64_t cached;      // 上一次打开时的代数，内核缓存的页不会比它旧
+} KCACHE_FILE;
+
+static struct
+{
+  KCACHE_FILE files[KCACHE_FILES];
+  pthread_mutex_t lock;
+
+  /* 统计 */
+  uint64_t opens;        // 打开文件的次数
+  uint64_t kept;         // 设置了keep_cache的打开次数
+  uint64_t dropped;      // 文件被修改过、让内核丢弃缓存页的打开次数
+  uint64_t direct;       // 设置了direct_io的打开次数
+  uint64_t changes;      // 文件内容的修改次数
+} kc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static KCACHE_FILE *kc_file(off_t offset_dir)
+{
+  return &kc.files[(offset_dir / BYTES_PER_DIR) % KCACHE_FILES];
+}
+
+/**
+ * @brief 打开文件，决定内核是否保留缓存的页、是否绕过页缓存
+ *
+ * @param path  文件路径
+ * @param fi    打开文件的信息，设置其中的keep_cache和direct_io
+ * @return int  成功返回0，失败返回POSIX错误代码的负值
+ */
+int fat16_open(const char *path, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = get_fat16_ins();
+
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) != 0)
+    return -ENOENT;
+  if (Dir.DIR_Attr == ATTR_DIRECTORY)
+    return -EISDIR;
+
+  DWORD fileSize = Dir.DIR_FileSize;
+  delalloc_lookup(offset_dir, &fileSize, NULL);
+  fi->direct_io = (fi->flags & O_DIRECT) != 0 ||
+                  (fat16_opts.direct_io_min > 0 && fileSize >= (uint64_t)fat16_opts.direct_io_min << 20);
+
+  pthread_mutex_lock(&kc.lock);
+  kc.opens++;
+  if (fi->direct_io)
+  {
+    kc.direct++;
+  }
+  else if (fat16_opts.keep_cache)
+  {
+    KCACHE_FILE *f = kc_file(offset_dir);
+    if (f->valid && f->offset_dir == offset_dir && f->generation == f->cached)
+    {
+      fi->keep_cache = 1;
+      kc.kept++;
+    }
+    else
+    {
+      if (!f->valid || f->offset_dir != offset_dir)
+      {
+        f->valid = 1;
+        f->offset_dir = offset_dir;
+        f->generation = 0;
+      }
+      f->cached = f->generation;
+      kc.dropped++;
+    }
+  }
+  pthread_mutex_unlock(&kc.lock);
+
+  /* 每个文件句柄有自己的顺序读状态，在fat16_release中释放 */
+  fi->fh = readahead_open();
+  return 0;
+}
+
+/**
+ * @brief 文件的内容或大小被修改，下一次打开时内核需要丢弃缓存的页
+ *
+ * @param offset_dir  文件目录项的偏移量
+ */
+void kcache_changed(off_t offset_dir)
+{
+  if (!fat16_opts.keep_cache)
+    return;
+
+  pthread_mutex_lock(&kc.lock);
+  KCACHE_FILE *f = kc_file(offset_dir);
+  if (f->valid && f->offset_dir == offset_dir)
+    f->generation++;
+  kc.changes++;
+  pthread_mutex_unlock(&kc.lock);
+}
+
+/**
+ * @brief 文件被删除，目录项偏移量之后可能属于新的文件，丢弃它的修改代数
+ *
+ * @param offset_dir  文件目录项的偏移量
+ */
+void kcache_forget(off_t offset_dir)
+{
+  pthread_mutex_lock(&kc.lock);
+  KCACHE_FILE *f = kc_file(offset_dir);
+  if (f->valid && f->offset_dir == offset_dir)
+    f->valid = 0;
+  pthread_mutex_unlock(&kc.lock);
+}
+
+/**
+ * @brief 目录压缩移动了文件的目录项后，修改代数改用新的目录项偏移量。
+ *
+ * @param from  原来的目录项偏移量
+ * @param to    新的目录项偏移量
+ */
+void kcache_relocate(off_t from, off_t to)
+{
+  pthread_mutex_lock(&kc.lock);
+  KCACHE_FILE *f = kc_file(from);
+  if (f->valid && f->offset_dir == from)
+  {
+    KCACHE_FILE moved = *f;
+    f->valid = 0;
+    moved.offset_dir = to;
+    *kc_file(to) = moved;
+  }
+  pthread_mutex_unlock(&kc.lock);
+}
+
+/**
+ * @brief 输出与内核页缓存配合的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int kcache_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&kc.lock);
+  int n = snprintf(buf, size,
+                   "kcache.keep_cache %d\n"
+                   "kcache.opens %llu\n"
+                   "kcache.kept %llu\n"
+                   "kcache.dropped %llu\n"
+                   "kcache.direct_io %llu\n"
+                   "kcache.changes %llu\n",
+                   fat16_opts.keep_cache,
+                   (unsigned long long)kc.opens,
+                   (unsigned long long)kc.kept,
+                   (unsigned long long)kc.dropped,
+                   (unsigned long long)kc.direct,
+                   (unsigned long long)kc.changes);
+  pthread_mutex_unlock(&kc.lock);
+  return n;
+}
@@ -0,0 +1,127 @@
+#include <stddef.h>
+
+#include "fat16.h"
+
+const char *FAT_FILE_NAME = "fat16.img";
+
+/* 挂载选项（-o name=value），默认值见simple_fat16_part1.c中的fat16_opts */
+#define FAT16_OPT(t, p, v) {t, offsetof(FAT16_OPTIONS, p), v}
+
+static const struct fuse_opt fat16_opt_spec[] = {
+    FAT16_OPT("deferred_free", deferred_free, 1),
+    FAT16_OPT("reclaim_batch=%u", reclaim_batch, 0),
+    FAT16_OPT("reclaim_delay=%u", reclaim_delay, 0),
+    FAT16_OPT("writeback", writeback, 1),
+    FAT16_OPT("dirty_limit=%u", dirty_limit, 0),
+    FAT16_OPT("dirty_background_ratio=%u", dirty_background_ratio, 0),
+    FAT16_OPT("dirty_expire=%u", dirty_expire, 0),
+    FAT16_OPT("delalloc", delalloc, 1),
+    FAT16_OPT("prealloc", prealloc, 1),
+    FAT16_OPT("prealloc_max=%u", prealloc_max, 0),
+    FAT16_OPT("defrag", defrag, 1),
+    FAT16_OPT("defrag_batch=%u", defrag_batch, 0),
+    FAT16_OPT("defrag_delay=%u", defrag_delay, 0),
+    FAT16_OPT("dircompact", dircompact, 1),
+    FAT16_OPT("dircompact_ratio=%u", dircompact_ratio, 0),
+    FAT16_OPT("readahead", readahead, 1),
+    FAT16_OPT("readahead_max=%u", readahead_max, 0),
+    FAT16_OPT("readahead_cache=%u", readahead_cache, 0),
+    FAT16_OPT("uring", uring, 1),
+    FAT16_OPT("uring_depth=%u", uring_depth, 0),
+    FAT16_OPT("odirect", odirect, 1),
+    FAT16_OPT("odirect_align=%u", odirect_align, 0),
+    FAT16_OPT("keep_cache", keep_cache, 1),
+    FAT16_OPT("attr_timeout=%lf", attr_timeout, 0),
+    FAT16_OPT("entry_timeout=%lf", entry_timeout, 0),
+    FAT16_OPT("direct_io_min=%u", direct_io_min, 0),
+    FAT16_OPT("workers=%u", workers, 0),
+    FAT16_OPT("pin_workers", pin_workers, 1),
+    FAT16_OPT("worker_queue=%u", worker_queue, 0),
+    FAT16_OPT("bulk_workers=%u", bulk_workers, 0),
+    FAT16_OPT("iosched", iosched, 1),
+    FAT16_OPT("iosched_depth=%u", iosched_depth, 0),
+    FAT16_OPT("meta_latency=%u", meta_latency, 0),
+    FAT16_OPT("alloc_groups=%u", alloc_groups, 0),
+    FAT16_OPT("smallfile_cache=%u", smallfile_cache, 0),
+    FAT16_OPT("smallfile_max=%u", smallfile_max, 0),
+    FAT16_OPT("sidecar", sidecar, 1),
+    FAT16_OPT("mount_scan", mount_scan, 1),
+    FAT16_OPT("scan_threads=%u", scan_threads, 0),
+    FUSE_OPT_END};
+
+struct fuse_operations fat16_oper = {
+    .init = fat16_init,
+    .destroy = fat16_destroy,
+    .getattr = fat16_getattr,
+
+    // TASK1: tree [dir] / ls [dir] ; cat [file] / tail [file] / head [file]
+    .readdir = fat16_readdir,
+    .open = fat16_open,
+    .read = fat16_read,
+    .read_buf = fat16_read_buf,
+
+    // TASK2: touch [file]; rm [file]
+    .mknod = fat16_mknod,
+    .unlink = fat16_unlink,
+    .utimens = fat16_utimens,
+
+    // TASK3: mkdir [dir] ; rm -r [dir]
+    .mkdir = fat16_mkdir,
+    .rmdir = fat16_rmdir,
+
+    // TASK4: echo "hello world!" > [file] ;  echo "hello world!" >> [file]
+    .write = fat16_write,
+    .write_buf = fat16_write_buf,
+    .fsync = fat16_fsync,
+    .truncate = fat16_truncate,
+    .fallocate = fat16_fallocate,
+    .release = fat16_release,
+
+    // 运行统计：getfattr -n user.fat16.stats [mountpoint]
+    .getxattr = fat16_getxattr,
+    .listxattr = fat16_listxattr,
+    // 目录压缩：setfattr -n user.fat16.compact [dir]
+    .setxattr = fat16_setxattr};
+
+int main(int argc, char *argv[])
+{
+  int ret;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+  if (fuse_opt_parse(&args, &fat16_opts, fat16_opt_spec, NULL) == -1)
+    return 1;
+
+  /* The kernel's attribute and lookup caching is configured by libfuse */
+  char timeouts[64];
+  snprintf(timeouts, sizeof timeouts, "-oattr_timeout=%g,entry_timeout=%g",
+           fat16_opts.attr_timeout, fat16_opts.entry_timeout);
+  fuse_opt_add_arg(&args, timeouts);
+
+  /* Starting a pre-initialization of the FAT16 volume */
+  FAT16 *fat16_ins = pre_init_fat16(FAT_FILE_NAME);
+
+  /* Finishes reclaiming chains left over from the last mount */
+  reclaim_drain(fat16_ins);
+
+  /* Without a sidecar index, walks the tree in parallel so that the mount
+   * only appears once the scan is done (the FAT was loaded and checked in
+   * parallel by pre_init_fat16) */
+  if (fat16_opts.mount_scan)
+    mountscan_run(fat16_ins);
+
+  /* Online defrag and directory compaction must not move clusters or
+   * directory entries under a running operation (no-op when both are off) */
+  defrag_wrap_operations(fat16_ins, &fat16_oper);
+
+  /* Each metadata-modifying operation becomes one journal transaction */
+  journal_wrap_operations(&fat16_oper);
+
+  /* A fixed worker pool replaces libfuse's thread-per-request loop when requested */
+  if (fat16_opts.workers > 0)
+    ret = session_main(&args, &fat16_oper, fat16_ins);
+  else
+    ret = fuse_main(args.argc, args.argv, &fat16_oper, fat16_ins);
+  fuse_opt_free_args(&args);
+
+  return ret;
+}
@@ -0,0 +1,504 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 挂载时的并行元数据扫描
+ *
+ * 开启mount_scan挂载选项、且没有可用的索引文件（见fat16_sidecar.c）时，在fuse_main之前检查整个文件系统，
+ * 扫描完成后才挂载，挂载点出现即表示文件系统已就绪：
+ *   1. FAT扫描：fat_cache_load读入FAT表时调用mountscan_load_fat，FAT表按扇区分成scan_threads段，
+ *      每个线程读入一段到FatCache，所有线程读完之后（pthread_barrier）各自统计本段所在分配组的空闲簇数，
+ *      检查每个表项指向的簇是否有效、是否空闲，并统计每个簇被指向的次数（大于1为交叉链接）。
+ *      读入失败时fat_cache_load改为顺序读入，mountscan_run再并行检查已读入的FatCache；
+ *   2. 目录树遍历：目录作为工作项放入共享队列，各线程取出一个目录，读取它的扇区，
+ *      沿每个目录项的簇链标记可达的簇（已被标记的簇同样是交叉链接），子目录放回队列；
+ *      找到的路径同时插入路径查找缓存（fat16_dcache.c），挂载后的第一次访问不需要扫描目录；
+ *   3. 使用中但不可达的簇为丢失的簇。
+ * 扫描只读取镜像，发现的问题输出到stderr并记入统计，不做修复。
+ * 扫描超过一秒时每秒向stderr报告一次进度，完成时输出一行"mount scan: ready ..."，编排系统据此判断挂载就绪。
+ */
+
+#define SCAN_MAX_THREADS 64
+#define SCAN_PATH_MAX 1024       // 更深的路径不再展开（防止损坏的镜像中目录成环）
+#define SCAN_REPORT_LIMIT 8      // 逐条输出到stderr的问题数上限
+#define SCAN_PROGRESS_MS 1000
+
+/* 目录队列中的一个目录 */
+typedef struct SCAN_DIR
+{
+  struct SCAN_DIR *next;
+  WORD cluster;  // 目录的首簇，根目录为0
+  char path[];
+} SCAN_DIR;
+
+/* 一个线程在FAT扫描中的结果 */
+typedef struct
+{
+  pthread_t thread;
+  DWORD first_sec;   // 读入的FAT扇区范围[first_sec, first_sec + sectors)，不读入时为0
+  DWORD sectors;
+  DWORD start, end;  // 扫描的簇号范围[start, end)
+  DWORD free;
+  DWORD bad;         // 标记为坏簇的簇数
+  DWORD bad_links;   // 指向无效或空闲簇的表项数
+} SCAN_RANGE;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  BYTE *refs;         // 每个簇被其它表项指向的次数（饱和于2）
+  BYTE *reached;      // 每个簇是否从某个目录项可达
+  DWORD gen;          // 插入路径查找缓存的代数
+
+  /* FAT扫描 */
+  pthread_barrier_t barrier; // 所有线程读入各自的一段FAT表之后才开始检查
+  int load_failed;
+  int fat_done;       // FAT扫描已经完成（mountscan_load_fat读入时已经检查过）
+
+  /* 目录队列 */
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;   // 有目录入队或遍历结束
+  pthread_cond_t finished; // 扫描结束，唤醒报告进度的线程
+  SCAN_DIR *queue;
+  unsigned busy;      // 正在处理目录的线程数，与空的队列一起表示遍历结束
+  int done;
+
+  /* 进度与结果，扫描线程原子地更新 */
+  const char *state;
+  unsigned threads;
+  DWORD clusters_scanned;
+  DWORD dirs_scanned;
+  DWORD dirs_queued;
+  DWORD dir_sectors;
+  DWORD files;
+  DWORD free;
+  DWORD bad;
+  DWORD bad_links;
+  DWORD cross_linked;
+  DWORD lost;
+  DWORD reports;
+  uint64_t fat_us;
+  uint64_t walk_us;
+  uint64_t total_us;
+} scan = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+    .state = "disabled",
+};
+
+#define SCAN_ADD(field, n) __atomic_add_fetch(&scan.field, (n), __ATOMIC_RELAXED)
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 报告一个问题，总数超过SCAN_REPORT_LIMIT后不再输出
+ */
+static void scan_report(const char *what, const char *path, WORD cluster)
+{
+  if (__atomic_fetch_add(&scan.reports, 1, __ATOMIC_RELAXED) < SCAN_REPORT_LIMIT)
+    fprintf(stderr, "mount scan: %s: %s (cluster %u)\n", what, path, cluster);
+}
+
+/**
+ * @brief FAT扫描线程，读入一段FAT表（sectors不为0时），统计分配组的空闲簇数，检查[start, end)中的表项
+ */
+static void *scan_fat_thread(void *arg)
+{
+  SCAN_RANGE *r = arg;
+  FAT16 *fat16_ins = scan.fat16_ins;
+  if (r->sectors > 0)
+  {
+    size_t len = (size_t)r->sectors * BYTES_PER_SECTOR;
+    long pos = (long)(fat16_ins->Bpb.BPB_RsvdSecCnt + r->first_sec) * BYTES_PER_SECTOR;
+    if (io_read(fat16_ins->fd, (BYTE *)fat16_ins->FatCache + (size_t)r->first_sec * BYTES_PER_SECTOR, pos, len) != len)
+      __atomic_store_n(&scan.load_failed, 1, __ATOMIC_RELAXED);
+  }
+
+  /* 表项可能指向其它线程的一段，等所有线程读完 */
+  pthread_barrier_wait(&scan.barrier);
+  if (__atomic_load_n(&scan.load_failed, __ATOMIC_RELAXED))
+    return NULL;
+  if (r->sectors > 0)
+    alloc_groups_count_free(fat16_ins, r->start, r->end);
+
+  for (DWORD c = r->start; c < r->end; c++)
+  {
+    WORD next = fat_entry_by_cluster(fat16_ins, c);
+    if (next == CLUSTER_FREE)
+      r->free++;
+    else if (next == 0xFFF7)
+      r->bad++;
+    else if (next >= 0xFFF8)
+      ; // 簇链结束
+    else if (next < CLUSTER_MIN || next >= fat16_ins->ClusterCount ||
+             fat_entry_by_cluster(fat16_ins, next) == CLUSTER_FREE)
+      r->bad_links++;
+    else if (__atomic_load_n(&scan.refs[next], __ATOMIC_RELAXED) < 2)
+      __atomic_add_fetch(&scan.refs[next], 1, __ATOMIC_RELAXED);
+  }
+  SCAN_ADD(clusters_scanned, r->end - r->start);
+  return NULL;
+}
+
+/**
+ * @brief 沿簇链标记可达的簇，遇到已被标记的簇（交叉链接）或无效的表项时停止
+ *
+ * @return int 首簇已被标记（目录成环或两个目录项共用簇链）返回-1，否则返回0
+ */
+static int scan_mark_chain(const char *path, WORD first)
+{
+  FAT16 *fat16_ins = scan.fat16_ins;
+  WORD cur = first;
+  for (DWORD n = 0; is_cluster_inuse(cur) && cur < fat16_ins->ClusterCount && n < fat16_ins->ClusterCount; n++)
+  {
+    if (__atomic_exchange_n(&scan.reached[cur], 1, __ATOMIC_RELAXED))
+    {
+      SCAN_ADD(cross_linked, 1);
+      scan_report("cross-linked chain", path, cur);
+      return cur == first ? -1 : 0;
+    }
+    cur = fat_entry_by_cluster(fat16_ins, cur);
+  }
+  return 0;
+}
+
+/**
+ * @brief 把目录放入队列。调用者持有scan.lock。
+ */
+static void scan_push(const char *path, WORD cluster)
+{
+  SCAN_DIR *d = malloc(sizeof(SCAN_DIR) + strlen(path) + 1);
+  d->cluster = cluster;
+  strcpy(d->path, path);
+  d->next = scan.queue;
+  scan.queue = d;
+  scan.dirs_queued++;
+  pthread_cond_signal(&scan.wakeup);
+}
+
+/**
+ * @brief 读取一个目录的所有扇区，标记文件的簇链，子目录放入队列
+ */
+static void scan_dir(SCAN_DIR *d)
+{
+  FAT16 *fat16_ins = scan.fat16_ins;
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DWORD RootDirSectors = fat16_ins->Bpb.BPB_RootEntCnt * BYTES_PER_DIR / BYTES_PER_SECTOR;
+  DWORD SecPerClus = fat16_ins->Bpb.BPB_SecPerClus;
+  size_t pathLen = strlen(d->path);
+
+  WORD cluster = d->cluster;
+  DWORD secIndex = 0, clusterCnt = 0;
+  for (;;)
+  {
+    DWORD secnum;
+    if (d->cluster == 0)
+    {
+      if (secIndex == RootDirSectors)
+        break;
+      secnum = fat16_ins->FirstRootDirSecNum + secIndex;
+    }
+    else
+    {
+      if (secIndex == SecPerClus)
+      {
+        cluster = fat_entry_by_cluster(fat16_ins, cluster);
+        secIndex = 0;
+        if (++clusterCnt >= fat16_ins->ClusterCount)
+          break;
+      }
+      if (!is_cluster_inuse(cluster) || cluster >= fat16_ins->ClusterCount)
+        break;
+      secnum = fat16_ins->FirstDataSector + (cluster - 2) * SecPerClus + secIndex;
+    }
+    secIndex++;
+
+    sector_read(fat16_ins->fd, secnum, sector_buffer);
+    SCAN_ADD(dir_sectors, 1);
+    for (int i = 0; i < BYTES_PER_SECTOR / BYTES_PER_DIR; i++)
+    {
+      DIR_ENTRY *Dir = (DIR_ENTRY *)(sector_buffer + i * BYTES_PER_DIR);
+      if (Dir->DIR_Name[0] == 0x00) // 目录结束
+        return;
+      if (Dir->DIR_Name[0] == 0xE5 || Dir->DIR_Attr == 0x0F || (Dir->DIR_Attr & 0x08) || Dir->DIR_Name[0] == '.')
+        continue;
+
+      BYTE *name = path_decode(Dir->DIR_Name);
+      char *path = malloc(pathLen + strlen((char *)name) + 2);
+      sprintf(path, "%s%s%s", d->path, pathLen == 1 ? "" : "/", name);
+      free(name);
+
+      off_t offset_dir = (off_t)secnum * BYTES_PER_SECTOR + i * BYTES_PER_DIR;
+      dcache_insert(path, Dir->DIR_Name, offset_dir, scan.gen);
+
+      /* 首簇不应被其它表项指向；簇链已被其它目录项标记过的子目录不再展开 */
+      WORD first = Dir->DIR_FstClusLO;
+      int valid = is_cluster_inuse(first) && first < fat16_ins->ClusterCount;
+      if (valid && scan.refs[first] > 0)
+      {
+        SCAN_ADD(cross_linked, 1);
+        scan_report("first cluster is inside another chain", path, first);
+      }
+      if (valid && scan_mark_chain(path, first) != 0)
+        valid = 0;
+      if ((Dir->DIR_Attr & ATTR_DIRECTORY) && valid && strlen(path) < SCAN_PATH_MAX)
+      {
+        pthread_mutex_lock(&scan.lock);
+        scan_push(path, first);
+        pthread_mutex_unlock(&scan.lock);
+      }
+      else if (!(Dir->DIR_Attr & ATTR_DIRECTORY))
+        SCAN_ADD(files, 1);
+      free(path);
+    }
+  }
+}
+
+/**
+ * @brief 目录遍历线程，从队列中取目录处理，队列为空且没有线程在处理目录时结束
+ */
+static void *scan_walk_thread(void *arg)
+{
+  pthread_mutex_lock(&scan.lock);
+  for (;;)
+  {
+    while (scan.queue == NULL && scan.busy > 0)
+      pthread_cond_wait(&scan.wakeup, &scan.lock);
+    if (scan.queue == NULL)
+      break;
+    SCAN_DIR *d = scan.queue;
+    scan.queue = d->next;
+    scan.busy++;
+    pthread_mutex_unlock(&scan.lock);
+
+    scan_dir(d);
+    free(d);
+    SCAN_ADD(dirs_scanned, 1);
+
+    pthread_mutex_lock(&scan.lock);
+    scan.busy--;
+  }
+  /* 唤醒其它等待的线程，它们同样会发现遍历已经结束 */
+  pthread_cond_broadcast(&scan.wakeup);
+  pthread_mutex_unlock(&scan.lock);
+  return NULL;
+}
+
+/**
+ * @brief 遍历线程运行期间每秒报告一次进度
+ */
+static void *scan_progress_thread(void *arg)
+{
+  uint64_t start = *(uint64_t *)arg;
+  pthread_mutex_lock(&scan.lock);
+  while (!scan.done)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += SCAN_PROGRESS_MS / 1000;
+    if (pthread_cond_timedwait(&scan.finished, &scan.lock, &ts) == ETIMEDOUT && !scan.done)
+      fprintf(stderr, "mount scan: %s, %u/%u cluster(s), %u/%u director(ies), %llu ms\n",
+              scan.state, scan.clusters_scanned, scan.fat16_ins->ClusterCount - CLUSTER_MIN,
+              scan.dirs_scanned, scan.dirs_queued, (unsigned long long)(now_us() - start) / 1000);
+  }
+  pthread_mutex_unlock(&scan.lock);
+  return NULL;
+}
+
+/**
+ * @brief 扫描线程数：scan_threads，为0时取在线的CPU数
+ */
+static unsigned scan_thread_count(void)
+{
+  unsigned threads = fat16_opts.scan_threads;
+  if (threads == 0)
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  return threads > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : threads;
+}
+
+/**
+ * @brief FAT扫描：FAT表按扇区分段，每个线程读入（load为1时）并检查一段
+ *
+ * @return int 成功返回0，读入失败返回-EIO，此时没有统计分配组的空闲簇数
+ */
+static int scan_fat(FAT16 *fat16_ins, int load)
+{
+  uint64_t start = now_us();
+  unsigned threads = scan_thread_count();
+  scan.fat16_ins = fat16_ins;
+  scan.threads = threads;
+  if (scan.refs == NULL)
+    scan.refs = calloc(fat16_ins->ClusterCount, 1);
+  scan.load_failed = 0;
+  scan.state = "fat";
+
+  /* 每段是整数个FAT扇区，读入整个FAT表（包括簇号范围之外的部分） */
+  SCAN_RANGE ranges[SCAN_MAX_THREADS];
+  memset(ranges, 0, sizeof(ranges));
+  DWORD FatSecs = fat16_ins->Bpb.BPB_FATSz16;
+  DWORD perSector = BYTES_PER_SECTOR / sizeof(WORD);
+  DWORD span = (FatSecs + threads - 1) / threads;
+  unsigned nranges = 0;
+  for (DWORD sec = 0; sec < FatSecs; sec += span)
+  {
+    SCAN_RANGE *r = &ranges[nranges++];
+    r->first_sec = sec;
+    r->sectors = load ? (sec + span < FatSecs ? span : FatSecs - sec) : 0;
+    DWORD first = sec * perSector, last = (sec + span) * perSector;
+    r->start = first < CLUSTER_MIN ? CLUSTER_MIN : first;
+    r->end = last < fat16_ins->ClusterCount ? last : fat16_ins->ClusterCount;
+    if (r->start > r->end)
+      r->start = r->end;
+  }
+  pthread_barrier_init(&scan.barrier, NULL, nranges);
+  for (unsigned i = 0; i < nranges; i++)
+    pthread_create(&ranges[i].thread, NULL, scan_fat_thread, &ranges[i]);
+  for (unsigned i = 0; i < nranges; i++)
+    pthread_join(ranges[i].thread, NULL);
+  pthread_barrier_destroy(&scan.barrier);
+  if (scan.load_failed)
+    return -EIO;
+
+  for (unsigned i = 0; i < nranges; i++)
+  {
+    scan.free += ranges[i].free;
+    scan.bad += ranges[i].bad;
+    scan.bad_links += ranges[i].bad_links;
+  }
+  if (scan.bad_links > 0)
+    fprintf(stderr, "mount scan: %u FAT entr(ies) point to invalid or free clusters\n", scan.bad_links);
+  scan.fat_us = now_us() - start;
+  scan.fat_done = 1;
+  return 0;
+}
+
+/**
+ * @brief 并行读入FAT表到fat16_ins->FatCache（已分配），统计各分配组的空闲簇数，同时完成FAT扫描。
+ *        由fat_cache_load在开启mount_scan、没有映射索引文件时调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @return int      成功返回0，读取镜像失败返回-EIO，调用者应顺序读入
+ */
+int mountscan_load_fat(FAT16 *fat16_ins)
+{
+  return scan_fat(fat16_ins, 1);
+}
+
+/**
+ * @brief 遍历目录树，完成挂载扫描。在reclaim_drain之后、fuse_main之前调用，
+ *        已经映射了索引文件时跳过。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @return int      发现的问题数（交叉链接、无效的表项和丢失的簇）
+ */
+int mountscan_run(FAT16 *fat16_ins)
+{
+  if (sidecar_loaded())
+  {
+    scan.state = "skipped";
+    return 0;
+  }
+
+  uint64_t start = now_us();
+  uint64_t loadUs = scan.fat_done ? scan.fat_us : 0;
+  scan.reached = calloc(fat16_ins->ClusterCount, 1);
+  scan.gen = dcache_generation();
+
+  pthread_t progress;
+  pthread_create(&progress, NULL, scan_progress_thread, &start);
+
+  /* 1. FAT表不是由扫描线程读入的（读取失败后顺序读入），检查已读入的FatCache */
+  if (!scan.fat_done)
+    scan_fat(fat16_ins, 0);
+  unsigned threads = scan.threads;
+
+  /* 2. 目录树遍历 */
+  uint64_t walkStart = now_us();
+  pthread_mutex_lock(&scan.lock);
+  scan.state = "directories";
+  scan_push("/", 0);
+  pthread_mutex_unlock(&scan.lock);
+  pthread_t walkers[SCAN_MAX_THREADS];
+  for (unsigned i = 0; i < threads; i++)
+    pthread_create(&walkers[i], NULL, scan_walk_thread, NULL);
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(walkers[i], NULL);
+  scan.walk_us = now_us() - walkStart;
+
+  /* 3. 使用中但不可达的簇 */
+  for (DWORD c = CLUSTER_MIN; c < fat16_ins->ClusterCount; c++)
+  {
+    WORD next = fat_entry_by_cluster(fat16_ins, c);
+    if (next != CLUSTER_FREE && next != 0xFFF7 && !scan.reached[c])
+      scan.lost++;
+  }
+  if (scan.lost > 0)
+    fprintf(stderr, "mount scan: %u lost cluster(s) not reachable from any directory entry\n", scan.lost);
+
+  pthread_mutex_lock(&scan.lock);
+  scan.state = "ready";
+  scan.done = 1;
+  pthread_cond_signal(&scan.finished);
+  pthread_mutex_unlock(&scan.lock);
+  pthread_join(progress, NULL);
+  free(scan.refs);
+  free(scan.reached);
+  scan.refs = scan.reached = NULL;
+
+  scan.total_us = loadUs + now_us() - start;
+  fprintf(stderr, "mount scan: ready in %llu ms (%u thread(s), %u director(ies), %u file(s), %u free cluster(s))\n",
+          (unsigned long long)scan.total_us / 1000, threads, scan.dirs_scanned, scan.files, scan.free);
+  return scan.bad_links + scan.cross_linked + (scan.lost > 0);
+}
+
+/**
+ * @brief 输出挂载扫描的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int mountscan_stats(char *buf, size_t size)
+{
+  return snprintf(buf, size,
+                  "mountscan.state %s\n"
+                  "mountscan.threads %u\n"
+                  "mountscan.fat_us %llu\n"
+                  "mountscan.walk_us %llu\n"
+                  "mountscan.total_us %llu\n"
+                  "mountscan.directories %u\n"
+                  "mountscan.dir_sectors %u\n"
+                  "mountscan.files %u\n"
+                  "mountscan.free_clusters %u\n"
+                  "mountscan.bad_clusters %u\n"
+                  "mountscan.bad_links %u\n"
+                  "mountscan.cross_linked %u\n"
+                  "mountscan.lost_clusters %u\n",
+                  scan.state,
+                  scan.threads,
+                  (unsigned long long)scan.fat_us,
+                  (unsigned long long)scan.walk_us,
+                  (unsigned long long)scan.total_us,
+                  scan.dirs_scanned,
+                  scan.dir_sectors,
+                  scan.files,
+                  scan.free,
+                  scan.bad,
+                  scan.bad_links,
+                  scan.cross_linked,
+                  scan.lost);
+}
@@ -0,0 +1,279 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 追加写入的簇链缓存与推测性预分配
+ *
+ * 开启prealloc挂载选项后，file_prepare_write通过prealloc_extend为文件分配簇：
+ *   - 缓存每个被写入文件的最后一个簇和簇数，扩展文件时不再调用file_last_cluster遍历整条簇链。
+ *     缓存以目录项偏移量（offset_dir）为键，使用前检查文件名和最后一个簇的FAT表项仍为CLUSTER_END；
+ *     truncate、unlink、fallocate会直接丢弃缓存。
+ *   - 连续第PREALLOC_STREAK次在文件末尾追加时，除本次写入需要的簇外，
+ *     再多分配与文件当前簇数相同（至多prealloc_max个）的簇，之后的追加直接写入这些簇，
+ *     预分配的长度随文件增长而倍增，追加的开销因此与文件大小无关。
+ *   - 文件关闭（release）或卸载时，释放文件大小之外未被用到的预分配簇。
+ * 预分配的簇在释放前属于文件的簇链，崩溃后会留在文件末尾，下次truncate时会被释放。
+ */
+
+#define PREALLOC_STREAK 2 // 连续追加多少次后开始预分配
+
+typedef struct PREALLOC_FILE
+{
+  off_t offset_dir;          // 目录项在镜像中的偏移量
+  BYTE name[11];             // 目录项中的文件名
+  WORD last_cluster;         // 簇链的最后一个簇，没有簇时为CLUSTER_END
+  int64_t count;             // 簇链中的簇数
+  int64_t keep;              // 释放预分配簇时至少保留的簇数（不含预分配部分）
+  uint streak;               // 连续在文件末尾追加的次数
+  struct PREALLOC_FILE *next;
+} PREALLOC_FILE;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  PREALLOC_FILE *files;
+  pthread_mutex_t lock;
+
+  /* 统计 */
+  uint64_t cache_hits;       // 扩展文件时命中缓存的次数
+  uint64_t chain_walks;      // 需要遍历簇链的次数
+  uint64_t preallocated;     // 累计预分配的簇数
+  uint64_t trimmed;          // 累计释放的未用预分配簇数
+} pa = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static PREALLOC_FILE **pa_find(off_t offset_dir)
+{
+  PREALLOC_FILE **p = &pa.files;
+  while (*p != NULL && (*p)->offset_dir != offset_dir)
+    p = &(*p)->next;
+  return p;
+}
+
+static void pa_remove(PREALLOC_FILE **p)
+{
+  PREALLOC_FILE *f = *p;
+  *p = f->next;
+  free(f);
+}
+
+/**
+ * @brief 检查缓存的簇链末尾是否仍然有效
+ */
+static int pa_valid(FAT16 *fat16_ins, PREALLOC_FILE *f, DIR_ENTRY *Dir)
+{
+  if (memcmp(f->name, Dir->DIR_Name, sizeof(f->name)) != 0)
+    return 0;
+  if (f->count == 0)
+    return !is_cluster_inuse(Dir->DIR_FstClusLO);
+  return is_cluster_inuse(Dir->DIR_FstClusLO) && fat_entry_by_cluster(fat16_ins, f->last_cluster) == CLUSTER_END;
+}
+
+/**
+ * @brief 释放文件大小之外未被用到的预分配簇。调用者持有pa.lock。
+ */
+static void pa_trim_locked(PREALLOC_FILE *f)
+{
+  FAT16 *fat16_ins = pa.fat16_ins;
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DIR_ENTRY Dir;
+  sector_read(fat16_ins->fd, f->offset_dir / BYTES_PER_SECTOR, sector_buffer);
+  memcpy(&Dir, sector_buffer + f->offset_dir % BYTES_PER_SECTOR, sizeof(DIR_ENTRY));
+  if (!pa_valid(fat16_ins, f, &Dir))
+    return;
+
+  int64_t keep = ((int64_t)Dir.DIR_FileSize + fat16_ins->ClusterSize - 1) / fat16_ins->ClusterSize;
+  if (keep < f->keep)
+    keep = f->keep;
+  if (keep >= f->count || keep == 0)
+    return;
+
+  journal_begin();
+  WORD cur = Dir.DIR_FstClusLO;
+  for (int64_t i = 1; i < keep; i++)
+    cur = fat_entry_by_cluster(fat16_ins, cur);
+  WORD rest = fat_entry_by_cluster(fat16_ins, cur);
+  write_fat_entry(fat16_ins, cur, CLUSTER_END);
+  pa.trimmed += free_chain(fat16_ins, rest);
+  journal_end();
+
+  f->last_cluster = cur;
+  f->count = keep;
+}
+
+/**
+ * @brief 为在文件offset处写入、使文件达到new_cluster_count个簇做准备，替代file_prepare_write中
+ *        file_last_cluster和file_new_cluster的调用。连续追加时额外预分配簇。
+ *
+ * @param fat16_ins         文件系统指针
+ * @param Dir               文件的目录项，分配首簇时会修改其DIR_FstClusLO
+ * @param offset_dir        find_root返回的目录项偏移量
+ * @param offset            本次写入在文件中的位置
+ * @param new_cluster_count 写入完成后文件至少需要的簇数
+ * @return int              成功返回0，失败返回POSIX错误代码的负值
+ */
+int prealloc_extend(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, off_t offset, int64_t new_cluster_count)
+{
+  pthread_mutex_lock(&pa.lock);
+  pa.fat16_ins = fat16_ins;
+
+  PREALLOC_FILE **p = pa_find(offset_dir);
+  PREALLOC_FILE *f = *p;
+  if (f != NULL && !pa_valid(fat16_ins, f, Dir))
+  {
+    pa_remove(p);
+    f = NULL;
+  }
+  if (f == NULL)
+  {
+    f = calloc(1, sizeof(PREALLOC_FILE));
+    f->offset_dir = offset_dir;
+    memcpy(f->name, Dir->DIR_Name, sizeof(f->name));
+    f->last_cluster = file_last_cluster(fat16_ins, Dir, &f->count);
+    f->keep = f->count;
+    f->next = pa.files;
+    pa.files = f;
+    pa.chain_walks++;
+  }
+  else
+  {
+    pa.cache_hits++;
+  }
+
+  if (offset == Dir->DIR_FileSize)
+    f->streak++;
+  else
+    f->streak = 0;
+
+  int ret = 0;
+  if (new_cluster_count > f->count)
+  {
+    DWORD need = new_cluster_count - f->count;
+    DWORD extra = 0;
+    if (f->streak >= PREALLOC_STREAK)
+    {
+      extra = f->count > 0 ? f->count : 1;
+      if (extra > fat16_opts.prealloc_max)
+        extra = fat16_opts.prealloc_max;
+    }
+
+    ret = file_new_cluster(fat16_ins, Dir, f->last_cluster, need + extra);
+    if (ret == -ENOSPC && extra > 0)
+    { // 空间不足以预分配时只分配需要的簇
+      extra = 0;
+      ret = file_new_cluster(fat16_ins, Dir, f->last_cluster, need);
+    }
+    if (ret >= 0)
+    {
+      /* 新分配的簇通常连续，沿FAT镜像找到新的最后一个簇 */
+      WORD cur = f->last_cluster == CLUSTER_END ? Dir->DIR_FstClusLO : fat_entry_by_cluster(fat16_ins, f->last_cluster);
+      for (DWORD i = 1; i < need + extra; i++)
+        cur = fat_entry_by_cluster(fat16_ins, cur);
+      f->last_cluster = cur;
+      f->count += need + extra;
+      f->keep = new_cluster_count;
+      pa.preallocated += extra;
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&pa.lock);
+  return ret;
+}
+
+/**
+ * @brief 文件关闭时释放其未用的预分配簇，并丢弃缓存。
+ *
+ * @param offset_dir  find_root返回的目录项偏移量
+ */
+void prealloc_release(off_t offset_dir)
+{
+  if (!fat16_opts.prealloc)
+    return;
+
+  pthread_mutex_lock(&pa.lock);
+  PREALLOC_FILE **p = pa_find(offset_dir);
+  if (*p != NULL)
+  {
+    pa_trim_locked(*p);
+    pa_remove(p);
+  }
+  pthread_mutex_unlock(&pa.lock);
+}
+
+/**
+ * @brief 文件的簇链被其它途径修改时（truncate、unlink、fallocate）丢弃缓存，不释放任何簇。
+ *
+ * @param offset_dir  find_root返回的目录项偏移量
+ */
+void prealloc_forget(off_t offset_dir)
+{
+  if (!fat16_opts.prealloc)
+    return;
+
+  pthread_mutex_lock(&pa.lock);
+  PREALLOC_FILE **p = pa_find(offset_dir);
+  if (*p != NULL)
+    pa_remove(p);
+  pthread_mutex_unlock(&pa.lock);
+}
+
+/**
+ * @brief 目录压缩移动了文件的目录项后，缓存改用新的目录项偏移量。
+ *
+ * @param from  原来的目录项偏移量
+ * @param to    新的目录项偏移量
+ */
+void prealloc_relocate(off_t from, off_t to)
+{
+  if (!fat16_opts.prealloc)
+    return;
+
+  pthread_mutex_lock(&pa.lock);
+  PREALLOC_FILE *f = *pa_find(from);
+  if (f != NULL)
+    f->offset_dir = to;
+  pthread_mutex_unlock(&pa.lock);
+}
+
+/**
+ * @brief 卸载时释放所有文件未用的预分配簇。需要在日志关闭之前调用。
+ */
+void prealloc_stop(void)
+{
+  pthread_mutex_lock(&pa.lock);
+  while (pa.files != NULL)
+  {
+    pa_trim_locked(pa.files);
+    pa_remove(&pa.files);
+  }
+  pthread_mutex_unlock(&pa.lock);
+}
+
+/**
+ * @brief 输出预分配的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int prealloc_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&pa.lock);
+  int n = snprintf(buf, size,
+                   "prealloc.enabled %d\n"
+                   "prealloc.cache_hits %llu\n"
+                   "prealloc.chain_walks %llu\n"
+                   "prealloc.preallocated_clusters %llu\n"
+                   "prealloc.trimmed_clusters %llu\n",
+                   fat16_opts.prealloc,
+                   (unsigned long long)pa.cache_hits,
+                   (unsigned long long)pa.chain_walks,
+                   (unsigned long long)pa.preallocated,
+                   (unsigned long long)pa.trimmed);
+  pthread_mutex_unlock(&pa.lock);
+  return n;
+}
@@ -0,0 +1,661 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 顺序读检测与异步预读
+ *
+ * 开启readahead挂载选项后，文件数据和子目录的簇经过一个以簇为单位的读缓存：
+ *   - 每个打开的文件句柄（fat16_open时分配，保存在fi->fh中）记录上一次读取的范围，同一个文件的多个读者
+ *     互不干扰；没有句柄的读取（fi为NULL）退回按目录项偏移量区分的状态表。读取紧接在上一次之后，
+ *     或落在已提交预读的范围内时视为顺序读；否则视为随机读，预读窗口清零，直到再次出现顺序读；
+ *   - 顺序读时，已预读但尚未读到的部分少于窗口的一半就沿FAT内存镜像中的簇链找出之后一个窗口的簇，
+ *     交给后台预读线程；每次提交时窗口加倍，直到readahead_max；
+ *   - 预读线程按镜像中的连续段用一次preadv读入缓存，读者遇到正在预读的簇时等待它读完，而不是重复读取；
+ *   - fat16_readdir开始时预读子目录的整条簇链，之后逐扇区的sector_read直接命中缓存。
+ * 缓存只保存镜像中已有的内容。写入镜像数据区（io_write、回写缓存的pwritev、write_buf的splice）之后
+ * 调用readahead_invalidate使对应的簇失效，正在预读的簇被标记为过期，读完后丢弃。缓存满时按LRU淘汰。
+ */
+
+#define READAHEAD_BUCKETS 4096
+#define READAHEAD_STREAMS 256   // 没有文件句柄时使用的顺序读状态表的大小，按目录项偏移量直接映射，冲突时覆盖
+#define READAHEAD_QUEUE 64      // 等待预读的请求数上限，队列满时丢弃新的请求
+#define READAHEAD_MAX_RUN 64    // 一次preadv最多读入的簇数
+
+typedef struct RA_CLUSTER
+{
+  WORD cluster;
+  int filling;                   // 正在被预读线程读入，读者需等待
+  int stale;                     // 预读期间镜像中的簇被写入，读完后丢弃
+  BYTE *data;                    // 整个簇的内容
+  struct RA_CLUSTER *next;       // 哈希链
+  struct RA_CLUSTER *lru_prev;   // LRU链表，表头为最近使用的簇
+  struct RA_CLUSTER *lru_next;
+} RA_CLUSTER;
+
+/* 一个文件句柄（或没有句柄时一个文件）的顺序读状态 */
+typedef struct
+{
+  int valid;
+  off_t offset_dir;
+  off_t prev;     // 上一次读取的开始位置
+  off_t next;     // 上一次读取的结束位置
+  off_t ahead;    // 已提交预读的范围的结束位置
+  DWORD window;   // 预读窗口（字节），为0时不预读
+  int async;      // 已经提交过预读，之后每次提交时窗口加倍
+} RA_STREAM;
+
+/* 一个预读请求：镜像中的若干连续段 */
+typedef struct
+{
+  FAT16_EXTENT *extents;
+  int count;
+} RA_REQUEST;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  RA_CLUSTER *buckets[READAHEAD_BUCKETS];
+  RA_CLUSTER *lru_head, *lru_tail;
+  uint count;                  // 缓存中的簇数
+  uint capacity;               // 缓存的簇数上限
+  RA_STREAM streams[READAHEAD_STREAMS];
+  RA_REQUEST queue[READAHEAD_QUEUE];
+  uint queue_head, queued;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;       // 有新的预读请求
+  pthread_cond_t filled;       // 一批簇预读完成，唤醒等待的读者
+  pthread_t thread;
+  int running;
+  int stop;
+
+  /* 统计 */
+  uint64_t hits;               // 命中缓存的簇数
+  uint64_t misses;             // 直接读取镜像的簇数
+  uint64_t waits;              // 读者等待预读完成的次数
+  uint64_t sequential;         // 被判定为顺序读的读取次数
+  uint64_t random;             // 顺序读被随机读打断、窗口清零的次数
+  uint64_t requests;           // 提交的预读请求数
+  uint64_t dropped;            // 队列满而丢弃的预读请求数
+  uint64_t dir_prefetches;     // readdir提交的目录预读数
+  uint64_t prefetched_bytes;   // 预读读入的字节数
+  uint64_t invalidated;        // 因写入而失效的簇数
+  uint64_t evicted;            // 被LRU淘汰的簇数
+} ra = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+};
+
+static RA_CLUSTER *ra_lookup(WORD cluster)
+{
+  RA_CLUSTER *c = ra.buckets[cluster % READAHEAD_BUCKETS];
+  while (c != NULL && c->cluster != cluster)
+    c = c->next;
+  return c;
+}
+
+static void ra_lru_unlink(RA_CLUSTER *c)
+{
+  if (c->lru_prev != NULL)
+    c->lru_prev->lru_next = c->lru_next;
+  else
+    ra.lru_head = c->lru_next;
+  if (c->lru_next != NULL)
+    c->lru_next->lru_prev = c->lru_prev;
+  else
+    ra.lru_tail = c->lru_prev;
+}
+
+static void ra_lru_push(RA_CLUSTER *c)
+{
+  c->lru_prev = NULL;
+  c->lru_next = ra.lru_head;
+  if (ra.lru_head != NULL)
+    ra.lru_head->lru_prev = c;
+  else
+    ra.lru_tail = c;
+  ra.lru_head = c;
+}
+
+static void ra_remove(RA_CLUSTER *target)
+{
+  RA_CLUSTER **link = &ra.buckets[target->cluster % READAHEAD_BUCKETS];
+  while (*link != target)
+    link = &(*link)->next;
+  *link = target->next;
+  ra_lru_unlink(target);
+  ra.count--;
+  free(target->data);
+  free(target);
+}
+
+/**
+ * @brief 为簇建立一个正在预读的缓存项，缓存已满时淘汰最久未使用的簇。调用者持有ra.lock。
+ *
+ * @return RA_CLUSTER*  新的缓存项，所有缓存项都在预读中而无法淘汰时返回NULL
+ */
+static RA_CLUSTER *ra_insert_locked(WORD cluster)
+{
+  while (ra.count >= ra.capacity)
+  {
+    RA_CLUSTER *victim = ra.lru_tail;
+    while (victim != NULL && victim->filling)
+      victim = victim->lru_prev;
+    if (victim == NULL)
+      return NULL;
+    ra_remove(victim);
+    ra.evicted++;
+  }
+
+  RA_CLUSTER *c = calloc(1, sizeof(RA_CLUSTER));
+  c->cluster = cluster;
+  c->filling = 1;
+  c->data = io_alloc(ra.fat16_ins->ClusterSize);
+  c->next = ra.buckets[cluster % READAHEAD_BUCKETS];
+  ra.buckets[cluster % READAHEAD_BUCKETS] = c;
+  ra_lru_push(c);
+  ra.count++;
+  return c;
+}
+
+/**
+ * @brief 把镜像中的一段连续区域所在的簇读入缓存，已在缓存中的簇被跳过
+ */
+static void ra_fill_extent(FAT16 *fat16_ins, const FAT16_EXTENT *e)
+{
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  DWORD first = (e->offset - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+  DWORD last = (e->offset + e->size - 1 - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+
+  for (DWORD c = first; c <= last;)
+  {
+    /* 先为一段不在缓存中的连续簇占位，读者会等待而不是重复读取 */
+    RA_CLUSTER *run[READAHEAD_MAX_RUN];
+    uint n = 0;
+    pthread_mutex_lock(&ra.lock);
+    while (c <= last && ra_lookup(c) != NULL)
+      c++;
+    while (c <= last && n < READAHEAD_MAX_RUN && ra_lookup(c) == NULL)
+    {
+      RA_CLUSTER *rc = ra_insert_locked(c);
+      if (rc == NULL)
+        break;
+      run[n++] = rc;
+      c++;
+    }
+    pthread_mutex_unlock(&ra.lock);
+    if (n == 0)
+      return;
+
+    struct iovec iov[READAHEAD_MAX_RUN];
+    for (uint i = 0; i < n; i++)
+    {
+      iov[i].iov_base = run[i]->data;
+      iov[i].iov_len = ClusterSize;
+    }
+    ssize_t got;
+    iosched_begin(IOSCHED_DATA, (size_t)n * ClusterSize);
+    do
+      got = preadv(fileno(fat16_ins->fd), iov, n, get_cluster_offset(fat16_ins, run[0]->cluster));
+    while (got < 0 && errno == EINTR);
+    /* O_DIRECT下簇小于对齐大小时preadv失败，逐簇经过中转缓冲区读取 */
+    if (got < 0 && errno == EINVAL)
+    {
+      got = 0;
+      for (uint i = 0; i < n && got == (ssize_t)(i * ClusterSize); i++)
+        got += io_read(fat16_ins->fd, run[i]->data, get_cluster_offset(fat16_ins, run[i]->cluster), ClusterSize);
+    }
+    iosched_end(IOSCHED_DATA);
+
+    pthread_mutex_lock(&ra.lock);
+    for (uint i = 0; i < n; i++)
+    {
+      if (run[i]->stale || got < (ssize_t)((i + 1) * ClusterSize))
+      {
+        ra_remove(run[i]);
+        continue;
+      }
+      run[i]->filling = 0;
+      ra.prefetched_bytes += ClusterSize;
+    }
+    pthread_cond_broadcast(&ra.filled);
+    pthread_mutex_unlock(&ra.lock);
+  }
+}
+
+static void *readahead_thread(void *arg)
+{
+  FAT16 *fat16_ins = arg;
+
+  pthread_mutex_lock(&ra.lock);
+  while (!ra.stop)
+  {
+    if (ra.queued == 0)
+    {
+      pthread_cond_wait(&ra.wakeup, &ra.lock);
+      continue;
+    }
+    RA_REQUEST req = ra.queue[ra.queue_head];
+    ra.queue_head = (ra.queue_head + 1) % READAHEAD_QUEUE;
+    ra.queued--;
+    pthread_mutex_unlock(&ra.lock);
+
+    for (int i = 0; i < req.count; i++)
+      ra_fill_extent(fat16_ins, &req.extents[i]);
+    free(req.extents);
+
+    pthread_mutex_lock(&ra.lock);
+  }
+  pthread_mutex_unlock(&ra.lock);
+  return NULL;
+}
+
+/**
+ * @brief 把一组连续段交给预读线程，extents由预读线程负责释放
+ */
+static void ra_submit(FAT16_EXTENT *extents, int count)
+{
+  pthread_mutex_lock(&ra.lock);
+  if (ra.queued == READAHEAD_QUEUE)
+  {
+    ra.dropped++;
+    free(extents);
+  }
+  else
+  {
+    RA_REQUEST *req = &ra.queue[(ra.queue_head + ra.queued) % READAHEAD_QUEUE];
+    req->extents = extents;
+    req->count = count;
+    ra.queued++;
+    ra.requests++;
+    pthread_cond_signal(&ra.wakeup);
+  }
+  pthread_mutex_unlock(&ra.lock);
+}
+
+static RA_STREAM *ra_stream(off_t offset_dir)
+{
+  return &ra.streams[(offset_dir / BYTES_PER_DIR) % READAHEAD_STREAMS];
+}
+
+/**
+ * @brief 打开文件时为文件句柄分配顺序读状态
+ *
+ * @return uint64_t 保存到fi->fh中的值，未开启预读时为0
+ */
+uint64_t readahead_open(void)
+{
+  if (!ra.running)
+    return 0;
+  return (uint64_t)(uintptr_t)calloc(1, sizeof(RA_STREAM));
+}
+
+/**
+ * @brief 关闭文件句柄时释放readahead_open分配的顺序读状态
+ *
+ * @param fh  fi->fh
+ */
+void readahead_release(uint64_t fh)
+{
+  free((RA_STREAM *)(uintptr_t)fh);
+}
+
+/**
+ * @brief 记录一次文件读取，判断是否为顺序读，需要时提交之后一个窗口的预读。需要在读取数据之前调用。
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param fh            readahead_open返回的文件句柄状态，为0时按offset_dir查找
+ * @param offset_dir    文件目录项的偏移量
+ * @param firstCluster  文件的首簇
+ * @param mappedSize    文件中已分配簇的部分的长度，预读不超过这里
+ * @param offset        读取的开始位置
+ * @param size          读取的长度
+ */
+void readahead_note(FAT16 *fat16_ins, uint64_t fh, off_t offset_dir, WORD firstCluster, DWORD mappedSize, off_t offset, size_t size)
+{
+  if (!ra.running || size == 0)
+    return;
+
+  DWORD maxWindow = fat16_opts.readahead_max << 10;
+  DWORD initWindow = size * 4 < maxWindow ? size * 4 : maxWindow;
+  off_t end = offset + size;
+  off_t start = 0;
+  size_t len = 0;
+
+  pthread_mutex_lock(&ra.lock);
+  RA_STREAM *s = fh != 0 ? (RA_STREAM *)(uintptr_t)fh : ra_stream(offset_dir);
+  if (!s->valid || s->offset_dir != offset_dir)
+  {
+    /* 第一次读取：从文件开头读视为顺序读的开始 */
+    memset(s, 0, sizeof(*s));
+    s->valid = 1;
+    s->offset_dir = offset_dir;
+    s->window = offset == 0 ? initWindow : 0;
+  }
+  else if (offset >= s->prev && offset <= (s->ahead > s->next ? s->ahead : s->next))
+  {
+    ra.sequential++;
+    if (s->window == 0)
+      s->window = initWindow;
+  }
+  else
+  {
+    if (s->window != 0)
+      ra.random++;
+    s->window = 0;
+    s->ahead = 0;
+    s->async = 0;
+  }
+  s->prev = offset;
+  s->next = end;
+
+  if (s->window != 0)
+  {
+    if (s->ahead < end)
+      s->ahead = end;
+    if (s->ahead - end < s->window / 2 && s->ahead < mappedSize)
+    {
+      if (s->async)
+        s->window = s->window * 2 < maxWindow ? s->window * 2 : maxWindow;
+      s->async = 1;
+      start = s->ahead;
+      len = mappedSize - start < s->window ? mappedSize - start : s->window;
+      s->ahead = start + len;
+    }
+  }
+  pthread_mutex_unlock(&ra.lock);
+
+  if (len == 0)
+    return;
+
+  /* 簇链在FAT内存镜像中，找出预读范围对应的连续段不需要读盘 */
+  FAT16_EXTENT *extents;
+  int extentCnt = file_extent_map(fat16_ins, firstCluster, start, len, &extents);
+  if (extentCnt > 0)
+    ra_submit(extents, extentCnt);
+  else if (extentCnt == 0)
+    free(extents);
+}
+
+/**
+ * @brief 预读子目录的整条簇链，fat16_readdir开始时调用
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param firstCluster  目录的首簇
+ */
+void readahead_dir(FAT16 *fat16_ins, WORD firstCluster)
+{
+  if (!ra.running || !is_cluster_inuse(firstCluster))
+    return;
+
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  DWORD limit = (fat16_opts.readahead_max << 10) / ClusterSize;
+  int extentCnt = 0, extentCap = 8;
+  FAT16_EXTENT *extents = malloc(extentCap * sizeof(FAT16_EXTENT));
+
+  WORD cur = firstCluster;
+  for (DWORD k = 0; is_cluster_inuse(cur) && k < limit && k < fat16_ins->ClusterCount; k++)
+  {
+    long pos = get_cluster_offset(fat16_ins, cur);
+    if (extentCnt > 0 && extents[extentCnt - 1].offset + extents[extentCnt - 1].size == pos)
+    {
+      extents[extentCnt - 1].size += ClusterSize;
+    }
+    else
+    {
+      if (extentCnt == extentCap)
+      {
+        extentCap *= 2;
+        extents = realloc(extents, extentCap * sizeof(FAT16_EXTENT));
+      }
+      extents[extentCnt].offset = pos;
+      extents[extentCnt].size = ClusterSize;
+      extentCnt++;
+    }
+    cur = fat_entry_by_cluster(fat16_ins, cur);
+  }
+  if (extentCnt == 0)
+  {
+    free(extents);
+    return;
+  }
+
+  pthread_mutex_lock(&ra.lock);
+  ra.dir_prefetches++;
+  pthread_mutex_unlock(&ra.lock);
+  ra_submit(extents, extentCnt);
+}
+
+/**
+ * @brief 从镜像的pos处读取数据，数据区中已预读的簇从缓存复制，其余部分直接读取镜像。
+ *        未开启预读时等同于io_read。
+ *
+ * @param fd    镜像文件指针
+ * @param buf   数据要存储到的缓冲区
+ * @param pos   镜像文件中的偏移量（字节）
+ * @param size  数据长度（字节）
+ * @return size_t 读取的字节数
+ */
+size_t readahead_read(FILE *fd, void *buf, long pos, size_t size)
+{
+  if (!ra.running || pos < (long)ra.fat16_ins->DataOffset)
+    return io_read(fd, buf, pos, size);
+
+  FAT16 *fat16_ins = ra.fat16_ins;
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  size_t done = 0;
+
+  pthread_mutex_lock(&ra.lock);
+  while (done < size)
+  {
+    WORD cluster = (pos + done - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+    size_t inCluster = (pos + done - fat16_ins->DataOffset) % ClusterSize;
+    size_t len = ClusterSize - inCluster;
+    if (len > size - done)
+      len = size - done;
+
+    RA_CLUSTER *c;
+    if ((c = ra_lookup(cluster)) != NULL && c->filling)
+    {
+      ra.waits++;
+      while ((c = ra_lookup(cluster)) != NULL && c->filling)
+        pthread_cond_wait(&ra.filled, &ra.lock);
+    }
+    if (c != NULL)
+    {
+      memcpy((BYTE *)buf + done, c->data + inCluster, len);
+      ra_lru_unlink(c);
+      ra_lru_push(c);
+      ra.hits++;
+      done += len;
+      continue;
+    }
+
+    /* 连续的不在缓存中的簇合并为一次读取 */
+    size_t missLen = len;
+    uint64_t missed = 1;
+    while (done + missLen < size)
+    {
+      WORD nextCluster = (pos + done + missLen - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+      if (ra_lookup(nextCluster) != NULL)
+        break;
+      missLen += size - done - missLen < ClusterSize ? size - done - missLen : ClusterSize;
+      missed++;
+    }
+    ra.misses += missed;
+    pthread_mutex_unlock(&ra.lock);
+    size_t got = io_read(fd, (BYTE *)buf + done, pos + done, missLen);
+    pthread_mutex_lock(&ra.lock);
+    done += got;
+    if (got < missLen)
+      break;
+  }
+  pthread_mutex_unlock(&ra.lock);
+  return done;
+}
+
+/**
+ * @brief 镜像中[pos, pos + size)被写入之后调用，丢弃缓存中对应的簇
+ *
+ * @param pos   镜像文件中的偏移量（字节）
+ * @param size  长度（字节）
+ */
+void readahead_invalidate(long pos, size_t size)
+{
+  if (!ra.running || size == 0)
+    return;
+
+  FAT16 *fat16_ins = ra.fat16_ins;
+  long end = pos + size;
+  if (end <= (long)fat16_ins->DataOffset)
+    return;
+  if (pos < (long)fat16_ins->DataOffset)
+    pos = fat16_ins->DataOffset;
+
+  DWORD first = (pos - fat16_ins->DataOffset) / fat16_ins->ClusterSize + CLUSTER_MIN;
+  DWORD last = (end - 1 - fat16_ins->DataOffset) / fat16_ins->ClusterSize + CLUSTER_MIN;
+  if (last >= fat16_ins->ClusterCount)
+    last = fat16_ins->ClusterCount - 1;
+
+  pthread_mutex_lock(&ra.lock);
+  for (DWORD cluster = first; cluster <= last && ra.count > 0; cluster++)
+  {
+    RA_CLUSTER *c = ra_lookup(cluster);
+    if (c == NULL)
+      continue;
+    if (c->filling)
+      c->stale = 1;
+    else
+      ra_remove(c);
+    ra.invalidated++;
+  }
+  pthread_mutex_unlock(&ra.lock);
+}
+
+/**
+ * @brief 文件被删除后丢弃它的顺序读状态
+ *
+ * @param offset_dir  文件目录项的偏移量
+ */
+void readahead_forget(off_t offset_dir)
+{
+  if (!ra.running)
+    return;
+
+  pthread_mutex_lock(&ra.lock);
+  RA_STREAM *s = ra_stream(offset_dir);
+  if (s->valid && s->offset_dir == offset_dir)
+    s->valid = 0;
+  pthread_mutex_unlock(&ra.lock);
+}
+
+/**
+ * @brief 目录压缩移动了文件的目录项后，顺序读状态改用新的目录项偏移量。
+ *
+ * @param from  原来的目录项偏移量
+ * @param to    新的目录项偏移量
+ */
+void readahead_relocate(off_t from, off_t to)
+{
+  if (!ra.running)
+    return;
+
+  pthread_mutex_lock(&ra.lock);
+  RA_STREAM *s = ra_stream(from);
+  if (s->valid && s->offset_dir == from)
+  {
+    RA_STREAM moved = *s;
+    s->valid = 0;
+    moved.offset_dir = to;
+    *ra_stream(to) = moved;
+  }
+  pthread_mutex_unlock(&ra.lock);
+}
+
+/**
+ * @brief 启动预读线程。需要在fat16_init中调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void readahead_start(FAT16 *fat16_ins)
+{
+  ra.fat16_ins = fat16_ins;
+  ra.capacity = ((uint64_t)fat16_opts.readahead_cache << 20) / fat16_ins->ClusterSize;
+  if (ra.capacity < 2 * READAHEAD_MAX_RUN)
+    ra.capacity = 2 * READAHEAD_MAX_RUN;
+  ra.stop = 0;
+  if (pthread_create(&ra.thread, NULL, readahead_thread, fat16_ins) == 0)
+    ra.running = 1;
+}
+
+/**
+ * @brief 停止预读线程并释放缓存，队列中尚未处理的预读请求被丢弃。
+ */
+void readahead_stop(void)
+{
+  if (!ra.running)
+    return;
+
+  pthread_mutex_lock(&ra.lock);
+  ra.stop = 1;
+  pthread_cond_signal(&ra.wakeup);
+  pthread_mutex_unlock(&ra.lock);
+  pthread_join(ra.thread, NULL);
+
+  pthread_mutex_lock(&ra.lock);
+  ra.running = 0;
+  for (; ra.queued > 0; ra.queued--)
+  {
+    free(ra.queue[ra.queue_head].extents);
+    ra.queue_head = (ra.queue_head + 1) % READAHEAD_QUEUE;
+  }
+  while (ra.lru_head != NULL)
+    ra_remove(ra.lru_head);
+  pthread_mutex_unlock(&ra.lock);
+}
+
+/**
+ * @brief 输出预读的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int readahead_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&ra.lock);
+  DWORD ClusterSize = ra.fat16_ins != NULL ? ra.fat16_ins->ClusterSize : 0;
+  int n = snprintf(buf, size,
+                   "readahead.enabled %d\n"
+                   "readahead.cache_bytes %llu\n"
+                   "readahead.hit_clusters %llu\n"
+                   "readahead.miss_clusters %llu\n"
+                   "readahead.waits %llu\n"
+                   "readahead.sequential %llu\n"
+                   "readahead.random %llu\n"
+                   "readahead.requests %llu\n"
+                   "readahead.dropped %llu\n"
+                   "readahead.dir_prefetches %llu\n"
+                   "readahead.prefetched_bytes %llu\n"
+                   "readahead.invalidated %llu\n"
+                   "readahead.evicted %llu\n",
+                   ra.running,
+                   (unsigned long long)ra.count * ClusterSize,
+                   (unsigned long long)ra.hits,
+                   (unsigned long long)ra.misses,
+                   (unsigned long long)ra.waits,
+                   (unsigned long long)ra.sequential,
+                   (unsigned long long)ra.random,
+                   (unsigned long long)ra.requests,
+                   (unsigned long long)ra.dropped,
+                   (unsigned long long)ra.dir_prefetches,
+                   (unsigned long long)ra.prefetched_bytes,
+                   (unsigned long long)ra.invalidated,
+                   (unsigned long long)ra.evicted);
+  pthread_mutex_unlock(&ra.lock);
+  return n;
+}
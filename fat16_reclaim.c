@@ -0,0 +1,280 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 后台簇回收
+ *
+ * 开启deferred_free挂载选项后，fat16_unlink只把目录项标记为0xE5，并把文件的首簇加入待回收队列，
+ * 不再同步遍历和释放整条簇链，因此unlink的耗时与文件大小无关。
+ * 后台线程每次从队首簇链释放至多reclaim_batch个簇，剩余部分作为新的簇链重新入队，
+ * 每批之间休眠reclaim_delay毫秒，避免长时间占用FAT锁。
+ * 在线碎片整理（defrag）搬走的旧簇同样经过这个队列，开启defrag时也会启动后台线程。
+ *
+ * 队列中的簇链在释放前FAT表项仍然是链接状态，所以分配器自然会把它们当作已占用的簇。
+ * 队列的修改通过日志（journal_log_orphan）与目录项的修改在同一个事务中提交，
+ * 日志做检查点时保存到"<镜像>.orphans"。挂载时会先同步回收队列中剩余的所有簇链。
+ */
+
+#define ORPHAN_MAGIC 0x4f363146 // "F16O"
+
+typedef struct
+{
+  DWORD magic;
+  DWORD count;
+  DWORD checksum; // 簇号数组的CRC32
+} __attribute__((packed)) ORPHAN_HEADER;
+
+static struct
+{
+  char *path;       // 队列文件路径
+  WORD *heads;      // 各条待回收簇链的首簇
+  uint count;
+  uint capacity;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  int running;
+  int stop;
+} reclaim = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief 读取镜像对应的待回收队列文件。需要在journal_open重放日志之前调用。
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param imageFilePath 镜像文件路径，队列文件为"<imageFilePath>.orphans"
+ * @return int          成功返回0，文件损坏时返回-EIO（队列视为空）
+ */
+int reclaim_load(FAT16 *fat16_ins, const char *imageFilePath)
+{
+  reclaim.path = malloc(strlen(imageFilePath) + sizeof(".orphans"));
+  sprintf(reclaim.path, "%s.orphans", imageFilePath);
+
+  FILE *fp = fopen(reclaim.path, "rb");
+  if (fp == NULL)
+    return 0;
+
+  int ret = 0;
+  ORPHAN_HEADER header;
+  if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == ORPHAN_MAGIC)
+  {
+    WORD *heads = malloc((header.count + 1) * sizeof(WORD));
+    if (fread(heads, sizeof(WORD), header.count, fp) == header.count &&
+        crc32_checksum(0, heads, header.count * sizeof(WORD)) == header.checksum)
+    {
+      reclaim.heads = heads;
+      reclaim.count = reclaim.capacity = header.count;
+    }
+    else
+    {
+      free(heads);
+      ret = -EIO;
+    }
+  }
+  fclose(fp);
+  return ret;
+}
+
+/**
+ * @brief 将当前队列写入队列文件（先写临时文件，再rename替换）。
+ *
+ * @return int 成功返回0，失败返回POSIX错误代码的负值
+ */
+int reclaim_save_queue(void)
+{
+  if (reclaim.path == NULL)
+    return 0;
+
+  char *tmpPath = malloc(strlen(reclaim.path) + sizeof(".tmp"));
+  sprintf(tmpPath, "%s.tmp", reclaim.path);
+
+  pthread_mutex_lock(&reclaim.lock);
+  ORPHAN_HEADER header = {ORPHAN_MAGIC, reclaim.count, crc32_checksum(0, reclaim.heads, reclaim.count * sizeof(WORD))};
+  int ret = 0;
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 ||
+      write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, reclaim.heads, reclaim.count * sizeof(WORD)) != (ssize_t)(reclaim.count * sizeof(WORD)) ||
+      fdatasync(fd) != 0)
+  {
+    ret = -EIO;
+  }
+  pthread_mutex_unlock(&reclaim.lock);
+
+  if (fd >= 0)
+    close(fd);
+  if (ret == 0 && rename(tmpPath, reclaim.path) != 0)
+    ret = -errno;
+  free(tmpPath);
+  return ret;
+}
+
+/**
+ * @brief 将簇链加入或移出内存中的队列。由日志在事务提交或重放时调用，其它地方应使用journal_log_orphan。
+ *
+ * @param cluster 簇链的第一个簇号
+ * @param add     1:加入队列，0:移出队列
+ */
+void reclaim_orphan_update(WORD cluster, int add)
+{
+  pthread_mutex_lock(&reclaim.lock);
+  if (add)
+  {
+    if (reclaim.count == reclaim.capacity)
+    {
+      reclaim.capacity = reclaim.capacity ? reclaim.capacity * 2 : 16;
+      reclaim.heads = realloc(reclaim.heads, reclaim.capacity * sizeof(WORD));
+    }
+    reclaim.heads[reclaim.count++] = cluster;
+    pthread_cond_signal(&reclaim.wakeup);
+  }
+  else
+  {
+    for (uint i = 0; i < reclaim.count; i++)
+    {
+      if (reclaim.heads[i] == cluster)
+      {
+        memmove(&reclaim.heads[i], &reclaim.heads[i + 1], (reclaim.count - i - 1) * sizeof(WORD));
+        reclaim.count--;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&reclaim.lock);
+}
+
+/**
+ * @brief 释放簇链head的前max个簇，作为一个事务提交：释放FAT表项，将head移出队列，剩余部分重新入队。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param head      待回收簇链的首簇
+ * @param max       本批最多释放的簇数
+ * @return int      本批释放的簇数
+ */
+static int reclaim_batch(FAT16 *fat16_ins, WORD head, uint max)
+{
+  WORD rest;
+  journal_begin();
+  int freed = free_chain_partial(fat16_ins, head, max, &rest);
+  journal_log_orphan(head, 0);
+  if (is_cluster_inuse(rest))
+    journal_log_orphan(rest, 1);
+  journal_end();
+  return freed;
+}
+
+/**
+ * @brief 同步回收队列中的所有簇链
+ *
+ * @param chains  输出参数，回收的簇链数
+ * @return uint   释放的簇数
+ */
+static uint reclaim_all(FAT16 *fat16_ins, uint *chains)
+{
+  uint clusters = 0;
+  *chains = 0;
+  for (;;)
+  {
+    pthread_mutex_lock(&reclaim.lock);
+    WORD head = reclaim.count > 0 ? reclaim.heads[0] : CLUSTER_END;
+    pthread_mutex_unlock(&reclaim.lock);
+    if (head == CLUSTER_END)
+      break;
+
+    if (is_cluster_inuse(head))
+      clusters += reclaim_batch(fat16_ins, head, UINT32_MAX);
+    else
+      journal_log_orphan(head, 0);
+    (*chains)++;
+  }
+  return clusters;
+}
+
+/**
+ * @brief 挂载时同步回收队列中剩余的所有簇链（上次卸载或崩溃时未完成的回收）。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void reclaim_drain(FAT16 *fat16_ins)
+{
+  uint chains;
+  uint clusters = reclaim_all(fat16_ins, &chains);
+  if (chains > 0)
+    fprintf(stderr, "reclaim: freed %u cluster(s) from %u pending chain(s)\n", clusters, chains);
+}
+
+/**
+ * @brief 没有后台回收线程时（离线工具）立即回收队列中的簇链，有后台线程时由它回收。
+ *        碎片整理搬移完一个文件后调用，使旧簇可以被之后的文件使用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void reclaim_sync(FAT16 *fat16_ins)
+{
+  uint chains;
+  if (!reclaim.running)
+    reclaim_all(fat16_ins, &chains);
+}
+
+static void *reclaim_thread(void *arg)
+{
+  FAT16 *fat16_ins = arg;
+
+  pthread_mutex_lock(&reclaim.lock);
+  while (!reclaim.stop)
+  {
+    if (reclaim.count == 0)
+    {
+      pthread_cond_wait(&reclaim.wakeup, &reclaim.lock);
+      continue;
+    }
+    WORD head = reclaim.heads[0];
+    pthread_mutex_unlock(&reclaim.lock);
+
+    if (is_cluster_inuse(head))
+      reclaim_batch(fat16_ins, head, fat16_opts.reclaim_batch);
+    else
+      journal_log_orphan(head, 0);
+    if (fat16_opts.reclaim_delay > 0)
+      usleep(fat16_opts.reclaim_delay * 1000);
+
+    pthread_mutex_lock(&reclaim.lock);
+  }
+  pthread_mutex_unlock(&reclaim.lock);
+  return NULL;
+}
+
+/**
+ * @brief 启动后台回收线程。需要在fat16_init中（fuse_main完成daemonize之后）调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void reclaim_start(FAT16 *fat16_ins)
+{
+  reclaim.stop = 0;
+  if (pthread_create(&reclaim.thread, NULL, reclaim_thread, fat16_ins) == 0)
+    reclaim.running = 1;
+}
+
+/**
+ * @brief 停止后台回收线程。队列中尚未回收的簇链会在下次挂载时回收。
+ */
+void reclaim_stop(void)
+{
+  if (!reclaim.running)
+    return;
+
+  pthread_mutex_lock(&reclaim.lock);
+  reclaim.stop = 1;
+  pthread_cond_signal(&reclaim.wakeup);
+  pthread_mutex_unlock(&reclaim.lock);
+  pthread_join(reclaim.thread, NULL);
+  reclaim.running = 0;
+}
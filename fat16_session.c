@@ -0,0 +1,442 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+
+#include "fat16.h"
+
+/**
+ * 固定线程池的请求循环
+ *
+ * fuse_main的多线程循环在所有线程都忙时为每个请求新建线程，线程数、CPU亲和性和排队都无法控制。
+ * 开启workers挂载选项后改用这里的循环：
+ *   - 主线程从/dev/fuse读取请求，按请求的节点号分到固定的工作线程的队列中，同一文件的请求由同一个线程处理；
+ *     工作线程自己的队列为空时从其它线程的队列中取（work stealing）；
+ *   - 读出但还没有处理完的请求数不超过worker_queue，达到上限后主线程停止读取，请求留在内核中排队（背压）；
+ *   - 不小于SESSION_BULK_MIN的读写是大块请求，其余（getattr、readdir、创建删除等）是元数据请求。
+ *     每个队列分别存放两类请求，元数据请求总是先取；同时处理大块请求的线程数不超过bulk_workers，
+ *     剩下的线程只处理元数据请求，大量的流式读写不会让元数据请求排队；
+ *   - 开启pin_workers后第i个工作线程固定在进程可用的第i个CPU上（按可用CPU数取模）。
+ * 请求在主线程读入内存缓冲区，不使用splice（splice的管道属于读取请求的线程）。
+ */
+
+#define SESSION_MAX_WORKERS 256
+#define SESSION_BULK_MIN (32 * 1024) // 读写长度不小于该值的请求按大块请求调度
+
+/* 内核请求的头部（linux/fuse.h中的struct fuse_in_header） */
+typedef struct
+{
+  uint32_t len;
+  uint32_t opcode;
+  uint64_t unique;
+  uint64_t nodeid;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t pid;
+  uint32_t padding;
+} SESSION_IN_HEADER;
+
+#define SESSION_OP_READ 15
+#define SESSION_OP_WRITE 16
+
+/* fuse_read_in/fuse_write_in的开头，两者的size字段位置相同 */
+typedef struct
+{
+  uint64_t fh;
+  uint64_t offset;
+  uint32_t size;
+} SESSION_RW_IN;
+
+enum
+{
+  SESSION_META = 0,
+  SESSION_BULK = 1,
+};
+
+typedef struct SESSION_REQ
+{
+  struct SESSION_REQ *next;
+  struct fuse_chan *ch;  // 读取请求的通道，回复也经过它
+  size_t len;
+  char buf[];            // 大小为fuse_chan_bufsize
+} SESSION_REQ;
+
+/* 一个工作线程和它的队列 */
+typedef struct
+{
+  pthread_t thread;
+  unsigned id;
+  int cpu;                        // 固定的CPU，未开启pin_workers时为-1
+  pthread_mutex_t lock;           // 保护队列
+  SESSION_REQ *head[2], *tail[2]; // 按SESSION_META、SESSION_BULK分开的队列
+} __attribute__((aligned(64))) SESSION_WORKER;
+
+static struct
+{
+  struct fuse_session *se;
+  SESSION_WORKER *workers;
+  unsigned nworkers;
+  unsigned depth;       // 读出未处理完的请求数上限
+  unsigned bulk_limit;  // 同时处理大块请求的线程数上限
+  size_t bufsize;
+
+  pthread_mutex_t lock;  // 保护以下的计数和空闲缓冲区
+  pthread_cond_t work;   // 有新请求，或者大块请求有了名额
+  pthread_cond_t room;   // 有请求处理完，可以继续读取
+  unsigned pending[2];   // 已入队、还没有被工作线程认领的请求数
+  unsigned bulk_active;  // 正在处理大块请求的线程数
+  unsigned inflight;     // 读出未处理完的请求数
+  SESSION_REQ *free;     // 空闲的请求缓冲区
+  int stop;
+
+  /* 统计 */
+  uint64_t requests[2];  // 处理的元数据/大块请求数
+  uint64_t stolen;       // 从其它线程的队列中取得的请求数
+  uint64_t throttled;    // 主线程因达到worker_queue而等待的次数
+  uint64_t deferred;     // 大块请求因达到bulk_workers而等待的次数
+  uint64_t max_inflight; // 读出未处理完的请求数的最大值
+} sess = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .room = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief 请求属于哪一类，以及应放入哪个工作线程的队列
+ */
+static int session_classify(const SESSION_REQ *req, unsigned *worker)
+{
+  const SESSION_IN_HEADER *in = (const SESSION_IN_HEADER *)req->buf;
+  *worker = req->len >= sizeof(*in) ? in->nodeid % sess.nworkers : 0;
+  if (req->len < sizeof(*in) + sizeof(SESSION_RW_IN) ||
+      (in->opcode != SESSION_OP_READ && in->opcode != SESSION_OP_WRITE))
+    return SESSION_META;
+  const SESSION_RW_IN *rw = (const SESSION_RW_IN *)(req->buf + sizeof(*in));
+  return rw->size >= SESSION_BULK_MIN ? SESSION_BULK : SESSION_META;
+}
+
+/**
+ * @brief 从工作线程w的队列中取出一个cls类的请求
+ */
+static SESSION_REQ *session_pop(SESSION_WORKER *w, int cls)
+{
+  pthread_mutex_lock(&w->lock);
+  SESSION_REQ *req = w->head[cls];
+  if (req != NULL)
+  {
+    w->head[cls] = req->next;
+    if (w->head[cls] == NULL)
+      w->tail[cls] = NULL;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return req;
+}
+
+/**
+ * @brief 认领一个请求：元数据请求优先，大块请求受bulk_workers限制。先取自己的队列，再依次取其它线程的队列。
+ *
+ * @return SESSION_REQ* 请求，sess.stop且所有队列为空时返回NULL
+ */
+static SESSION_REQ *session_take(SESSION_WORKER *self, int *cls)
+{
+  pthread_mutex_lock(&sess.lock);
+  for (;;)
+  {
+    if (sess.pending[SESSION_META] > 0)
+    {
+      *cls = SESSION_META;
+      break;
+    }
+    if (sess.pending[SESSION_BULK] > 0 && sess.bulk_active < sess.bulk_limit)
+    {
+      *cls = SESSION_BULK;
+      sess.bulk_active++;
+      break;
+    }
+    if (sess.stop && sess.pending[SESSION_BULK] == 0)
+    {
+      pthread_mutex_unlock(&sess.lock);
+      return NULL;
+    }
+    if (sess.pending[SESSION_BULK] > 0)
+      sess.deferred++;
+    pthread_cond_wait(&sess.work, &sess.lock);
+  }
+  sess.pending[*cls]--;
+  pthread_mutex_unlock(&sess.lock);
+
+  /* 认领之前请求已经入队，队列中一定有一个属于本线程；其它线程可能先取走了本线程看到的那个，因此重复查找 */
+  SESSION_REQ *req = session_pop(self, *cls);
+  while (req == NULL)
+  {
+    for (unsigned i = 1; i < sess.nworkers && req == NULL; i++)
+      req = session_pop(&sess.workers[(self->id + i) % sess.nworkers], *cls);
+    if (req != NULL)
+      __atomic_add_fetch(&sess.stolen, 1, __ATOMIC_RELAXED);
+    else
+      req = session_pop(self, *cls);
+  }
+  return req;
+}
+
+/**
+ * @brief 请求处理完，归还缓冲区，唤醒等待的主线程和等待大块请求名额的工作线程
+ */
+static void session_done(SESSION_REQ *req, int cls)
+{
+  pthread_mutex_lock(&sess.lock);
+  req->next = sess.free;
+  sess.free = req;
+  sess.inflight--;
+  sess.requests[cls]++;
+  pthread_cond_signal(&sess.room);
+  if (cls == SESSION_BULK)
+  {
+    sess.bulk_active--;
+    if (sess.pending[SESSION_BULK] > 0)
+      pthread_cond_signal(&sess.work);
+  }
+  pthread_mutex_unlock(&sess.lock);
+}
+
+static void *session_worker(void *arg)
+{
+  SESSION_WORKER *self = arg;
+  if (self->cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(self->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  int cls;
+  SESSION_REQ *req;
+  while ((req = session_take(self, &cls)) != NULL)
+  {
+    fuse_session_process(sess.se, req->buf, req->len, req->ch);
+    session_done(req, cls);
+  }
+  return NULL;
+}
+
+/**
+ * @brief 等待有空闲的名额后取得一个请求缓冲区
+ */
+static SESSION_REQ *session_get_buffer(void)
+{
+  pthread_mutex_lock(&sess.lock);
+  if (sess.inflight >= sess.depth)
+  {
+    sess.throttled++;
+    while (sess.inflight >= sess.depth)
+      pthread_cond_wait(&sess.room, &sess.lock);
+  }
+  sess.inflight++;
+  if (sess.inflight > sess.max_inflight)
+    sess.max_inflight = sess.inflight;
+  SESSION_REQ *req = sess.free;
+  if (req != NULL)
+    sess.free = req->next;
+  pthread_mutex_unlock(&sess.lock);
+
+  if (req == NULL)
+    req = malloc(sizeof(SESSION_REQ) + sess.bufsize);
+  return req;
+}
+
+static void session_put_buffer(SESSION_REQ *req)
+{
+  pthread_mutex_lock(&sess.lock);
+  req->next = sess.free;
+  sess.free = req;
+  sess.inflight--;
+  pthread_mutex_unlock(&sess.lock);
+}
+
+/**
+ * @brief 把请求放入工作线程的队列并唤醒一个等待的工作线程
+ */
+static void session_dispatch(SESSION_REQ *req)
+{
+  unsigned w;
+  int cls = session_classify(req, &w);
+  SESSION_WORKER *worker = &sess.workers[w];
+
+  req->next = NULL;
+  pthread_mutex_lock(&worker->lock);
+  if (worker->tail[cls] != NULL)
+    worker->tail[cls]->next = req;
+  else
+    worker->head[cls] = req;
+  worker->tail[cls] = req;
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_mutex_lock(&sess.lock);
+  sess.pending[cls]++;
+  pthread_cond_signal(&sess.work);
+  pthread_mutex_unlock(&sess.lock);
+}
+
+/**
+ * @brief 主线程读取请求，直到文件系统被卸载或收到退出信号
+ */
+static int session_loop(struct fuse_chan *ch)
+{
+  int res = 0;
+  while (!fuse_session_exited(sess.se))
+  {
+    SESSION_REQ *req = session_get_buffer();
+    struct fuse_chan *tmpch = ch;
+    res = fuse_chan_recv(&tmpch, req->buf, sess.bufsize);
+    if (res <= 0)
+    {
+      session_put_buffer(req);
+      if (res == -EINTR || res == -EAGAIN)
+        continue;
+      break;
+    }
+    req->ch = tmpch;
+    req->len = res;
+    session_dispatch(req);
+  }
+  fuse_session_reset(sess.se);
+  return res < 0 ? -1 : 0;
+}
+
+/**
+ * @brief 找出进程可以使用的CPU，pin_workers时工作线程依次固定在这些CPU上
+ */
+static void session_assign_cpus(void)
+{
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE], ncpus = 0;
+  if (fat16_opts.pin_workers && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    for (int c = 0; c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &allowed))
+        cpus[ncpus++] = c;
+
+  for (unsigned i = 0; i < sess.nworkers; i++)
+    sess.workers[i].cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+}
+
+/**
+ * @brief 代替fuse_main：挂载后用固定的工作线程池处理请求
+ *
+ * @param args       命令行参数（已去掉本文件系统的挂载选项）
+ * @param op         文件系统操作
+ * @param user_data  传给init的私有数据
+ * @return int       成功返回0，失败返回1
+ */
+int session_main(struct fuse_args *args, const struct fuse_operations *op, void *user_data)
+{
+  char *mountpoint;
+  int multithreaded, foreground;
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+    return 1;
+
+  struct fuse_chan *ch = fuse_mount(mountpoint, args);
+  if (ch == NULL)
+  {
+    free(mountpoint);
+    return 1;
+  }
+  struct fuse *f = fuse_new(ch, args, op, sizeof(*op), user_data);
+  if (f == NULL)
+  {
+    fuse_unmount(mountpoint, ch);
+    free(mountpoint);
+    return 1;
+  }
+  sess.se = fuse_get_session(f);
+  if (fuse_daemonize(foreground) == -1 || fuse_set_signal_handlers(sess.se) == -1)
+  {
+    fuse_unmount(mountpoint, ch);
+    fuse_destroy(f);
+    free(mountpoint);
+    return 1;
+  }
+
+  sess.nworkers = fat16_opts.workers < SESSION_MAX_WORKERS ? fat16_opts.workers : SESSION_MAX_WORKERS;
+  sess.depth = fat16_opts.worker_queue > 0 ? fat16_opts.worker_queue : 4 * sess.nworkers;
+  sess.bulk_limit = fat16_opts.bulk_workers > 0 ? fat16_opts.bulk_workers
+                    : sess.nworkers > 1 ? sess.nworkers - 1 : 1;
+  if (sess.bulk_limit > sess.nworkers)
+    sess.bulk_limit = sess.nworkers;
+  sess.bufsize = fuse_chan_bufsize(ch);
+  sess.workers = calloc(sess.nworkers, sizeof(SESSION_WORKER));
+  session_assign_cpus();
+
+  /* Signals are delivered to the receiving thread so that a blocked read returns EINTR */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (unsigned i = 0; i < sess.nworkers; i++)
+  {
+    sess.workers[i].id = i;
+    pthread_mutex_init(&sess.workers[i].lock, NULL);
+    pthread_create(&sess.workers[i].thread, NULL, session_worker, &sess.workers[i]);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  int ret = session_loop(ch);
+
+  pthread_mutex_lock(&sess.lock);
+  sess.stop = 1;
+  pthread_cond_broadcast(&sess.work);
+  pthread_mutex_unlock(&sess.lock);
+  for (unsigned i = 0; i < sess.nworkers; i++)
+    pthread_join(sess.workers[i].thread, NULL);
+
+  fuse_remove_signal_handlers(sess.se);
+  fuse_unmount(mountpoint, ch);
+  fuse_destroy(f);
+  free(mountpoint);
+
+  while (sess.free != NULL)
+  {
+    SESSION_REQ *next = sess.free->next;
+    free(sess.free);
+    sess.free = next;
+  }
+  return ret == -1 ? 1 : 0;
+}
+
+/**
+ * @brief 输出请求循环的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int session_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&sess.lock);
+  int n = snprintf(buf, size,
+                   "session.workers %u\n"
+                   "session.bulk_workers %u\n"
+                   "session.queue_depth %u\n"
+                   "session.inflight %u\n"
+                   "session.max_inflight %llu\n"
+                   "session.metadata_requests %llu\n"
+                   "session.bulk_requests %llu\n"
+                   "session.stolen %llu\n"
+                   "session.throttled %llu\n"
+                   "session.bulk_deferred %llu\n",
+                   sess.nworkers,
+                   sess.bulk_limit,
+                   sess.depth,
+                   sess.inflight,
+                   (unsigned long long)sess.max_inflight,
+                   (unsigned long long)sess.requests[SESSION_META],
+                   (unsigned long long)sess.requests[SESSION_BULK],
+                   (unsigned long long)__atomic_load_n(&sess.stolen, __ATOMIC_RELAXED),
+                   (unsigned long long)sess.throttled,
+                   (unsigned long long)sess.deferred);
+  pthread_mutex_unlock(&sess.lock);
+  return n;
+}
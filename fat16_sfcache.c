@@ -0,0 +1,272 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 小文件内容缓存
+ *
+ * 配置文件、清单等小文件会被反复读取，每次都要映射簇链、读取镜像。开启smallfile_cache后，
+ * 不大于smallfile_max的文件第一次被读取时整个读入内存，之后的读取直接复制：
+ *   - 缓存以文件的首簇为键。首簇按哈希分到桶中，每个桶有一个修改代数，
+ *     write_file、fat16_truncate、unlink以及簇被释放（fat_cache_set）时增加首簇所在桶的代数，不需要加锁；
+ *     缓存项记录插入时的代数，不相同时作废。代数在读取文件之前取得，读取期间文件被修改时读到的内容不会被使用；
+ *   - 同时记录文件大小，目录项中的大小不同时视为未命中；有延迟分配的待分配数据时不使用缓存；
+ *   - 用Count-Min Sketch近似统计每个文件的访问次数，计数器定期减半，使频率反映最近的访问。
+ *     缓存已满时，新文件的访问次数多于LRU末尾的文件才替换它（TinyLFU），偶尔读一次的文件不会挤出热文件；
+ *   - 缓存占用的字节数不超过smallfile_cache（MiB）。
+ */
+
+#define SFCACHE_BUCKETS 1024
+#define SFCACHE_SKETCH_ROWS 4
+#define SFCACHE_SKETCH_WIDTH 4096
+#define SFCACHE_SKETCH_RESET (SFCACHE_SKETCH_WIDTH * 8) // 记录这么多次访问后所有计数器减半
+
+typedef struct SFCACHE_ENTRY
+{
+  WORD first;                        // 文件的首簇
+  DWORD gen;                         // 插入时所在桶的代数
+  DWORD size;                        // 文件大小
+  struct SFCACHE_ENTRY *next;        // 哈希链
+  struct SFCACHE_ENTRY *prev_lru, *next_lru;
+  BYTE data[];
+} SFCACHE_ENTRY;
+
+static struct
+{
+  pthread_mutex_t lock;  // 保护哈希表、LRU链表和访问频率
+  SFCACHE_ENTRY *buckets[SFCACHE_BUCKETS];
+  DWORD gens[SFCACHE_BUCKETS];           // 每个桶的修改代数，原子地增加
+  SFCACHE_ENTRY *lru_head, *lru_tail;    // 头部为最近使用
+  BYTE sketch[SFCACHE_SKETCH_ROWS][SFCACHE_SKETCH_WIDTH];
+  DWORD accesses;                        // 上一次减半之后的访问次数
+  size_t bytes;
+  DWORD entries;
+
+  /* 统计 */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t admitted;      // 插入的文件数
+  uint64_t rejected;      // 访问次数不多于被替换者、未能插入的次数
+  uint64_t evicted;       // 被替换的文件数
+  uint64_t stale;         // 查找时发现已作废的缓存项数
+  uint64_t invalidations; // 增加桶代数的次数
+} sf = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static DWORD sf_bucket(WORD first)
+{
+  return (first * 2654435761u) % SFCACHE_BUCKETS;
+}
+
+/**
+ * @brief 记录一次访问，返回首簇为first的文件的近似访问次数。调用者持有sf.lock。
+ */
+static uint sf_touch(WORD first, int count)
+{
+  uint freq = 255;
+  for (int r = 0; r < SFCACHE_SKETCH_ROWS; r++)
+  {
+    BYTE *c = &sf.sketch[r][((first + 1) * (2654435761u + r * 40503u) >> 7) % SFCACHE_SKETCH_WIDTH];
+    if (count && *c < 255)
+      (*c)++;
+    if (*c < freq)
+      freq = *c;
+  }
+  if (count && ++sf.accesses >= SFCACHE_SKETCH_RESET)
+  {
+    for (int r = 0; r < SFCACHE_SKETCH_ROWS; r++)
+      for (int i = 0; i < SFCACHE_SKETCH_WIDTH; i++)
+        sf.sketch[r][i] >>= 1;
+    sf.accesses = 0;
+  }
+  return freq;
+}
+
+static void sf_lru_unlink(SFCACHE_ENTRY *e)
+{
+  if (e->prev_lru != NULL)
+    e->prev_lru->next_lru = e->next_lru;
+  else
+    sf.lru_head = e->next_lru;
+  if (e->next_lru != NULL)
+    e->next_lru->prev_lru = e->prev_lru;
+  else
+    sf.lru_tail = e->prev_lru;
+}
+
+static void sf_lru_push(SFCACHE_ENTRY *e)
+{
+  e->prev_lru = NULL;
+  e->next_lru = sf.lru_head;
+  if (sf.lru_head != NULL)
+    sf.lru_head->prev_lru = e;
+  sf.lru_head = e;
+  if (sf.lru_tail == NULL)
+    sf.lru_tail = e;
+}
+
+/**
+ * @brief 从哈希表和LRU链表中删除并释放。调用者持有sf.lock。
+ */
+static void sf_remove(SFCACHE_ENTRY *e)
+{
+  SFCACHE_ENTRY **p = &sf.buckets[sf_bucket(e->first)];
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+  sf_lru_unlink(e);
+  sf.bytes -= e->size;
+  sf.entries--;
+  free(e);
+}
+
+/**
+ * @brief 查找首簇为first、大小为size的文件，命中时复制[offset, offset + len)到buf
+ *
+ * @param first   文件的首簇
+ * @param size    目录项中的文件大小
+ * @param buf     输出缓冲区
+ * @param offset  读取的起始位置，offset + len不超过size
+ * @param len     读取的字节数
+ * @param gen     输出参数，未命中时为当前的代数，读取整个文件后交给sfcache_insert
+ * @return int    命中返回1，否则返回0
+ */
+int sfcache_lookup(WORD first, DWORD size, void *buf, off_t offset, size_t len, DWORD *gen)
+{
+  DWORD b = sf_bucket(first);
+  *gen = __atomic_load_n(&sf.gens[b], __ATOMIC_ACQUIRE);
+
+  pthread_mutex_lock(&sf.lock);
+  sf_touch(first, 1);
+  SFCACHE_ENTRY *e = sf.buckets[b];
+  while (e != NULL && e->first != first)
+    e = e->next;
+  if (e != NULL && e->gen != *gen)
+  {
+    sf_remove(e);
+    sf.stale++;
+    e = NULL;
+  }
+  if (e == NULL || e->size != size)
+  {
+    sf.misses++;
+    pthread_mutex_unlock(&sf.lock);
+    return 0;
+  }
+  memcpy(buf, e->data + offset, len);
+  sf_lru_unlink(e);
+  sf_lru_push(e);
+  sf.hits++;
+  pthread_mutex_unlock(&sf.lock);
+  return 1;
+}
+
+/**
+ * @brief 插入读到的整个文件。缓存已满时只在它的访问次数多于被替换的文件时插入。
+ *
+ * @param first   文件的首簇
+ * @param gen     读取之前sfcache_lookup给出的代数
+ * @param data    文件的内容
+ * @param size    文件大小
+ */
+void sfcache_insert(WORD first, DWORD gen, const void *data, DWORD size)
+{
+  size_t limit = (size_t)fat16_opts.smallfile_cache << 20;
+  if (size == 0 || size > ((size_t)fat16_opts.smallfile_max << 10) || size > limit)
+    return;
+
+  pthread_mutex_lock(&sf.lock);
+  DWORD b = sf_bucket(first);
+  if (__atomic_load_n(&sf.gens[b], __ATOMIC_ACQUIRE) != gen)
+  {
+    pthread_mutex_unlock(&sf.lock);
+    return;
+  }
+  SFCACHE_ENTRY *old = sf.buckets[b];
+  while (old != NULL && old->first != first)
+    old = old->next;
+  if (old != NULL)
+    sf_remove(old);
+
+  /* 腾出空间：访问次数不多于LRU末尾的文件时放弃插入 */
+  uint freq = sf_touch(first, 0);
+  while (sf.bytes + size > limit)
+  {
+    SFCACHE_ENTRY *victim = sf.lru_tail;
+    if (sf_touch(victim->first, 0) >= freq)
+    {
+      sf.rejected++;
+      pthread_mutex_unlock(&sf.lock);
+      return;
+    }
+    sf_remove(victim);
+    sf.evicted++;
+  }
+
+  SFCACHE_ENTRY *e = malloc(sizeof(SFCACHE_ENTRY) + size);
+  e->first = first;
+  e->gen = gen;
+  e->size = size;
+  memcpy(e->data, data, size);
+  e->next = sf.buckets[b];
+  sf.buckets[b] = e;
+  sf_lru_push(e);
+  sf.bytes += size;
+  sf.entries++;
+  sf.admitted++;
+  pthread_mutex_unlock(&sf.lock);
+}
+
+/**
+ * @brief 首簇为first的文件被修改或簇被释放，之前缓存的内容作废。在修改完成之后调用。
+ *
+ * @param first 文件的首簇
+ */
+void sfcache_invalidate(WORD first)
+{
+  if (!fat16_opts.smallfile_cache)
+    return;
+  __atomic_add_fetch(&sf.gens[sf_bucket(first)], 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&sf.invalidations, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 输出小文件缓存的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int sfcache_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&sf.lock);
+  uint64_t lookups = sf.hits + sf.misses;
+  int n = snprintf(buf, size,
+                   "sfcache.limit_bytes %llu\n"
+                   "sfcache.bytes %zu\n"
+                   "sfcache.entries %u\n"
+                   "sfcache.hits %llu\n"
+                   "sfcache.misses %llu\n"
+                   "sfcache.hit_rate %.3f\n"
+                   "sfcache.admitted %llu\n"
+                   "sfcache.rejected %llu\n"
+                   "sfcache.evicted %llu\n"
+                   "sfcache.stale %llu\n"
+                   "sfcache.invalidations %llu\n",
+                   (unsigned long long)fat16_opts.smallfile_cache << 20,
+                   sf.bytes,
+                   sf.entries,
+                   (unsigned long long)sf.hits,
+                   (unsigned long long)sf.misses,
+                   lookups ? (double)sf.hits / lookups : 0.0,
+                   (unsigned long long)sf.admitted,
+                   (unsigned long long)sf.rejected,
+                   (unsigned long long)sf.evicted,
+                   (unsigned long long)sf.stale,
+                   (unsigned long long)__atomic_load_n(&sf.invalidations, __ATOMIC_RELAXED));
+  pthread_mutex_unlock(&sf.lock);
+  return n;
+}
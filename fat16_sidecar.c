@@ -0,0 +1,263 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fat16.h"
+
+/**
+ * 挂载索引文件（热启动）
+ *
+ * 挂载时要读入整个FAT表，目录的空闲目录项提示和路径查找缓存也要随着访问重新建立。开启sidecar挂载选项后，
+ * 正常卸载时（fat16_destroy）把这些内存结构写入镜像旁的索引文件（<镜像>.index），下次挂载时直接映射：
+ *   - 索引文件记录镜像的设备号、inode号、大小、修改时间（纳秒）和引导扇区的CRC32，
+ *     写入之前日志已经做完检查点，镜像已经fsync，之后镜像的任何修改都会使记录不再相符；
+ *   - 头部和内容各有CRC32校验和。任何一项不符时删除索引文件，按原来的方式读入FAT表；
+ *   - FAT镜像按页对齐，以MAP_PRIVATE映射后直接作为fat16_ins->FatCache，写入时才复制页面；
+ *   - 索引文件在挂载时读入后立即删除，进程异常退出后不会留下与镜像不一致的索引文件，
+ *     重放日志、回收队列修改镜像后修改时间也会改变；
+ *   - 分配组的空闲簇数由fat_cache_load从FAT镜像统计（与alloc_groups选项有关，不保存）。
+ */
+
+#define SIDECAR_MAGIC "FAT16IDX"
+#define SIDECAR_VERSION 1
+#define SIDECAR_ALIGN 4096 // FAT镜像在索引文件中的对齐
+
+typedef struct
+{
+  char magic[8];
+  DWORD version;
+  DWORD header_crc;       // 头部的CRC32（计算时该字段为0）
+  uint64_t image_dev;
+  uint64_t image_ino;
+  uint64_t image_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  DWORD bpb_crc;          // 引导扇区的CRC32
+  DWORD fat_size;         // FAT镜像的字节数
+  DWORD fat_offset;       // 各部分在索引文件中的偏移量和长度
+  DWORD slots_offset;
+  DWORD slots_size;
+  DWORD dcache_offset;
+  DWORD dcache_size;
+  DWORD payload_crc;      // fat_offset之后全部内容的CRC32
+} SIDECAR_HEADER;
+
+static struct
+{
+  char *path;
+  const char *state;      // 本次挂载是否使用了索引文件，或不能使用的原因
+  uint64_t load_us;       // 映射并校验索引文件的时间
+  uint64_t loaded_bytes;
+} sc = {
+    .state = "disabled",
+};
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 用镜像当前的状态填写头部中的镜像标识
+ */
+static int sc_identify(FAT16 *fat16_ins, SIDECAR_HEADER *h)
+{
+  struct stat st;
+  if (fstat(fileno(fat16_ins->fd), &st) != 0)
+    return -errno;
+  h->image_dev = st.st_dev;
+  h->image_ino = st.st_ino;
+  h->image_size = st.st_size;
+  h->mtime_sec = st.st_mtim.tv_sec;
+  h->mtime_nsec = st.st_mtim.tv_nsec;
+  h->bpb_crc = crc32_checksum(0, &fat16_ins->Bpb, sizeof(fat16_ins->Bpb));
+  h->fat_size = fat16_ins->FatSize;
+  return 0;
+}
+
+static DWORD sc_header_crc(const SIDECAR_HEADER *h)
+{
+  SIDECAR_HEADER copy = *h;
+  copy.header_crc = 0;
+  return crc32_checksum(0, &copy, sizeof(copy));
+}
+
+/**
+ * @brief 检查映射的索引文件是否与镜像相符
+ *
+ * @return const char* 相符返回NULL，否则返回原因
+ */
+static const char *sc_validate(FAT16 *fat16_ins, const BYTE *map, size_t size)
+{
+  const SIDECAR_HEADER *h = (const SIDECAR_HEADER *)map;
+  if (size < sizeof(SIDECAR_HEADER) || memcmp(h->magic, SIDECAR_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != SIDECAR_VERSION || sc_header_crc(h) != h->header_crc)
+    return "corrupt";
+
+  SIDECAR_HEADER cur;
+  if (sc_identify(fat16_ins, &cur) != 0)
+    return "stat";
+  if (h->image_dev != cur.image_dev || h->image_ino != cur.image_ino || h->image_size != cur.image_size ||
+      h->mtime_sec != cur.mtime_sec || h->mtime_nsec != cur.mtime_nsec ||
+      h->bpb_crc != cur.bpb_crc || h->fat_size != cur.fat_size)
+    return "stale";
+
+  if (h->fat_offset % SIDECAR_ALIGN != 0 || h->fat_offset + (uint64_t)h->fat_size > size ||
+      h->slots_offset + (uint64_t)h->slots_size > size || h->dcache_offset + (uint64_t)h->dcache_size > size ||
+      crc32_checksum(0, map + h->fat_offset, size - h->fat_offset) != h->payload_crc)
+    return "corrupt";
+  return NULL;
+}
+
+/**
+ * @brief 挂载时读入索引文件。需要在日志重放之后、fat_cache_load之前调用。
+ *        成功时fat16_ins->FatCache指向映射的FAT镜像，并恢复目录项提示和路径查找缓存。
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param imageFilePath 镜像文件路径，索引文件为"<imageFilePath>.index"
+ * @return int          成功返回0，没有索引文件或不能使用时返回-ENOENT、-ESTALE或-EIO
+ */
+int sidecar_load(FAT16 *fat16_ins, const char *imageFilePath)
+{
+  sc.path = malloc(strlen(imageFilePath) + sizeof(".index"));
+  sprintf(sc.path, "%s.index", imageFilePath);
+
+  uint64_t start = now_us();
+  int fd = open(sc.path, O_RDONLY);
+  if (fd < 0)
+  {
+    sc.state = "missing";
+    return -ENOENT;
+  }
+  struct stat st;
+  BYTE *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  /* 无论能否使用都删除，之后的修改不会再与它相符 */
+  unlink(sc.path);
+  if (map == MAP_FAILED)
+  {
+    sc.state = "corrupt";
+    return -EIO;
+  }
+
+  const char *reason = sc_validate(fat16_ins, map, st.st_size);
+  if (reason != NULL)
+  {
+    munmap(map, st.st_size);
+    sc.state = reason;
+    return strcmp(reason, "stale") == 0 ? -ESTALE : -EIO;
+  }
+
+  /* FAT镜像直接使用映射的页面，映射在整个挂载期间保留 */
+  const SIDECAR_HEADER *h = (const SIDECAR_HEADER *)map;
+  fat16_ins->FatCache = (WORD *)(map + h->fat_offset);
+  dir_slot_import(map + h->slots_offset, h->slots_size);
+  dcache_import(map + h->dcache_offset, h->dcache_size);
+
+  sc.state = "loaded";
+  sc.loaded_bytes = st.st_size;
+  sc.load_us = now_us() - start;
+  return 0;
+}
+
+/**
+ * @brief 卸载时写入索引文件（先写临时文件，再rename替换）。需要在所有后台线程停止、
+ *        journal_close做完检查点之后调用，之后不能再修改镜像。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @return int      成功返回0，失败返回POSIX错误代码的负值
+ */
+int sidecar_save(FAT16 *fat16_ins)
+{
+  if (sc.path == NULL || fat16_ins->FatCache == NULL)
+    return 0;
+
+  /* 镜像的内容和修改时间都固定之后再记录 */
+  fflush(fat16_ins->fd);
+  if (fsync(fileno(fat16_ins->fd)) != 0)
+    return -errno;
+
+  SIDECAR_HEADER h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SIDECAR_MAGIC, sizeof(h.magic));
+  h.version = SIDECAR_VERSION;
+  int ret = sc_identify(fat16_ins, &h);
+  if (ret != 0)
+    return ret;
+
+  size_t slotsSize, dcacheSize;
+  void *slots = dir_slot_export(&slotsSize);
+  void *records = dcache_export(&dcacheSize);
+  h.fat_offset = SIDECAR_ALIGN;
+  h.slots_offset = h.fat_offset + h.fat_size;
+  h.slots_size = slotsSize;
+  h.dcache_offset = h.slots_offset + slotsSize;
+  h.dcache_size = dcacheSize;
+  h.payload_crc = crc32_checksum(0, fat16_ins->FatCache, h.fat_size);
+  h.payload_crc = crc32_checksum(h.payload_crc, slots, slotsSize);
+  h.payload_crc = crc32_checksum(h.payload_crc, records, dcacheSize);
+  h.header_crc = sc_header_crc(&h);
+
+  BYTE *head = calloc(1, SIDECAR_ALIGN);
+  memcpy(head, &h, sizeof(h));
+
+  char *tmpPath = malloc(strlen(sc.path) + sizeof(".tmp"));
+  sprintf(tmpPath, "%s.tmp", sc.path);
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 ||
+      write(fd, head, SIDECAR_ALIGN) != SIDECAR_ALIGN ||
+      write(fd, fat16_ins->FatCache, h.fat_size) != (ssize_t)h.fat_size ||
+      write(fd, slots, slotsSize) != (ssize_t)slotsSize ||
+      write(fd, records, dcacheSize) != (ssize_t)dcacheSize ||
+      fdatasync(fd) != 0)
+  {
+    ret = -EIO;
+  }
+  if (fd >= 0)
+    close(fd);
+  if (ret == 0 && rename(tmpPath, sc.path) != 0)
+    ret = -errno;
+  if (ret != 0)
+    unlink(tmpPath);
+
+  free(tmpPath);
+  free(head);
+  free(slots);
+  free(records);
+  return ret;
+}
+
+/**
+ * @brief 本次挂载是否映射了索引文件
+ */
+int sidecar_loaded(void)
+{
+  return strcmp(sc.state, "loaded") == 0;
+}
+
+/**
+ * @brief 输出索引文件的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int sidecar_stats(char *buf, size_t size)
+{
+  return snprintf(buf, size,
+                  "sidecar.state %s\n"
+                  "sidecar.load_us %llu\n"
+                  "sidecar.loaded_bytes %llu\n",
+                  sc.state,
+                  (unsigned long long)sc.load_us,
+                  (unsigned long long)sc.loaded_bytes);
+}
@@ -0,0 +1,118 @@
+#include <string.h>
+#include <errno.h>
+
+#include "fat16.h"
+
+/**
+ * 挂载的运行统计
+ *
+ * 统计信息以文本形式通过根目录的扩展属性"user.fat16.stats"导出，每行为"名称 值"，例如：
+ *     getfattr --only-values -n user.fat16.stats <挂载点>
+ */
+
+#define STATS_XATTR_NAME "user.fat16.stats"
+#define STATS_MAX_SIZE 8192
+
+extern FAT16 *get_fat16_ins();
+
+/**
+ * @brief 汇总各模块的统计信息
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param buf       输出缓冲区
+ * @param size      缓冲区大小
+ * @return int      写入的字符数（不含结尾的'\0'）
+ */
+int stats_format(FAT16 *fat16_ins, char *buf, size_t size)
+{
+  int n = 0;
+  n += writeback_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += delalloc_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += prealloc_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += defrag_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += dircompact_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += dirslot_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += dirlock_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += dcache_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += readahead_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += uring_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += direct_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += kcache_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += iosched_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += sfcache_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += session_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += alloc_stats(fat16_ins, buf + n, size - n);
+  if ((size_t)n < size)
+    n += sidecar_stats(buf + n, size - n);
+  if ((size_t)n < size)
+    n += mountscan_stats(buf + n, size - n);
+  return n;
+}
+
+/**
+ * @brief 读取扩展属性，目前只有根目录的user.fat16.stats
+ *
+ * @param path  文件路径
+ * @param name  扩展属性名
+ * @param value 输出缓冲区，size为0时只返回所需长度
+ * @param size  缓冲区大小
+ * @return int  成功返回属性值的长度，失败返回POSIX错误代码的负值
+ */
+int fat16_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+  if (strcmp(path, "/") != 0 || strcmp(name, STATS_XATTR_NAME) != 0)
+    return -ENODATA;
+
+  char *text = malloc(STATS_MAX_SIZE);
+  int len = stats_format(get_fat16_ins(), text, STATS_MAX_SIZE);
+  if (len >= STATS_MAX_SIZE)
+    len = STATS_MAX_SIZE - 1;
+
+  int ret = len;
+  if (size > 0)
+  {
+    if ((size_t)len > size)
+      ret = -ERANGE;
+    else
+      memcpy(value, text, len);
+  }
+  free(text);
+  return ret;
+}
+
+/**
+ * @brief 列出扩展属性
+ *
+ * @param path  文件路径
+ * @param list  输出缓冲区，size为0时只返回所需长度
+ * @param size  缓冲区大小
+ * @return int  成功返回列表长度，失败返回POSIX错误代码的负值
+ */
+int fat16_listxattr(const char *path, char *list, size_t size)
+{
+  if (strcmp(path, "/") != 0)
+    return 0;
+
+  size_t len = sizeof(STATS_XATTR_NAME);
+  if (size == 0)
+    return len;
+  if (size < len)
+    return -ERANGE;
+  memcpy(list, STATS_XATTR_NAME, len);
+  return len;
+}
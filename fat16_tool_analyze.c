@@ -0,0 +1,285 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "fat16.h"
+
+/**
+ * 镜像布局分析工具，只读打开镜像，不做任何修改。镜像已被挂载或正在整理时，
+ * 或者日志中还有未重放的事务时拒绝运行（需要先挂载一次）：
+ *     fat16_analyze [-j] [-t top] <镜像文件>
+ * 输出每个文件的簇数和段数、平均连续段长度、空闲段长度分布、每个目录的大小和已删除目录项（0xE5）的比例，
+ * 以及段数最多的文件和已删除比例最高的目录。
+ * -j 以JSON格式输出；-t 列出最差的文件和目录的个数（默认10）。
+ */
+
+/* 一个文件的布局 */
+typedef struct
+{
+  char *path;
+  DWORD size;
+  DWORD clusters;
+  DWORD extents;
+} ANALYZE_FILE;
+
+/* 一个目录的布局 */
+typedef struct
+{
+  char *path;
+  DWORD clusters;  // 目录占用的簇数，根目录为0
+  DWORD slots;     // 结束标记之前的目录项数
+  DWORD used;      // 有效的目录项数
+  DWORD deleted;   // 已删除的目录项数
+} ANALYZE_DIR;
+
+typedef struct
+{
+  ANALYZE_FILE *files;
+  size_t file_count, file_cap;
+  ANALYZE_DIR *dirs;
+  size_t dir_count, dir_cap;
+} ANALYZE;
+
+static ANALYZE_DIR *analyze_dir_find(ANALYZE *an, const char *path)
+{
+  for (size_t i = 0; i < an->dir_count; i++)
+    if (strcmp(an->dirs[i].path, path) == 0)
+      return &an->dirs[i];
+  return NULL;
+}
+
+static ANALYZE_DIR *analyze_dir_add(ANALYZE *an, const char *path)
+{
+  if (an->dir_count == an->dir_cap)
+  {
+    an->dir_cap = an->dir_cap ? an->dir_cap * 2 : 64;
+    an->dirs = realloc(an->dirs, an->dir_cap * sizeof(ANALYZE_DIR));
+  }
+  ANALYZE_DIR *d = &an->dirs[an->dir_count++];
+  memset(d, 0, sizeof(*d));
+  d->path = strdup(path);
+  return d;
+}
+
+static int analyze_entry(FAT16 *fat16_ins, const char *path, DIR_ENTRY *Dir, off_t offset_dir, void *ctx)
+{
+  ANALYZE *an = ctx;
+  DWORD clusters, extents;
+  chain_extents(fat16_ins, Dir->DIR_FstClusLO, &clusters, &extents);
+
+  if (Dir->DIR_Attr & ATTR_DIRECTORY)
+  {
+    analyze_dir_add(an, path)->clusters = clusters;
+    return 0;
+  }
+
+  if (an->file_count == an->file_cap)
+  {
+    an->file_cap = an->file_cap ? an->file_cap * 2 : 64;
+    an->files = realloc(an->files, an->file_cap * sizeof(ANALYZE_FILE));
+  }
+  ANALYZE_FILE *f = &an->files[an->file_count++];
+  f->path = strdup(path);
+  f->size = Dir->DIR_FileSize;
+  f->clusters = clusters;
+  f->extents = extents;
+  return 0;
+}
+
+static int analyze_dir(FAT16 *fat16_ins, const char *path, DWORD slots, DWORD used, DWORD deleted, void *ctx)
+{
+  ANALYZE *an = ctx;
+  ANALYZE_DIR *d = analyze_dir_find(an, path);
+  if (d == NULL) // 根目录
+    d = analyze_dir_add(an, path);
+  d->slots = slots;
+  d->used = used;
+  d->deleted = deleted;
+  return 0;
+}
+
+static double ratio(DWORD a, DWORD b)
+{
+  return b == 0 ? 0.0 : (double)a / b;
+}
+
+static int file_cmp(const void *a, const void *b)
+{
+  const ANALYZE_FILE *x = a, *y = b;
+  if (x->extents != y->extents)
+    return x->extents < y->extents ? 1 : -1;
+  if (x->clusters != y->clusters)
+    return x->clusters < y->clusters ? 1 : -1;
+  return strcmp(x->path, y->path);
+}
+
+static int dir_cmp(const void *a, const void *b)
+{
+  const ANALYZE_DIR *x = a, *y = b;
+  double rx = ratio(x->deleted, x->slots), ry = ratio(y->deleted, y->slots);
+  if (rx != ry)
+    return rx < ry ? 1 : -1;
+  if (x->deleted != y->deleted)
+    return x->deleted < y->deleted ? 1 : -1;
+  return strcmp(x->path, y->path);
+}
+
+/**
+ * @brief 输出JSON字符串，转义引号、反斜杠和控制字符
+ */
+static void json_string(const char *s)
+{
+  putchar('"');
+  for (; *s; s++)
+  {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+  putchar('"');
+}
+
+static void print_text(FAT16 *fat16_ins, ANALYZE *an, const DEFRAG_REPORT *r, const DWORD *hist, size_t top)
+{
+  printf("volume: %u clusters of %u bytes\n", fat16_ins->ClusterCount - CLUSTER_MIN, fat16_ins->ClusterSize);
+  printf("files: %u, fragmented %u, %u clusters in %u extents, average run %.2f clusters\n",
+         r->files, r->fragmented, r->clusters, r->extents, ratio(r->clusters, r->extents));
+  printf("free: %u clusters in %u runs, largest %u, average run %.2f clusters\n",
+         r->free_clusters, r->free_runs, r->largest_free_run, ratio(r->free_clusters, r->free_runs));
+
+  printf("\nfree run histogram (clusters: runs)\n");
+  for (int b = 0; b < ALLOC_HIST_BUCKETS; b++)
+    if (hist[b] != 0)
+      printf("  %5u-%-5u %u\n", 1u << b, (2u << b) - 1, hist[b]);
+
+  printf("\nfiles (extents clusters size path)\n");
+  for (size_t i = 0; i < an->file_count; i++)
+    printf("  %5u %6u %10u %s\n", an->files[i].extents, an->files[i].clusters, an->files[i].size, an->files[i].path);
+
+  printf("\ndirectories (slots used deleted ratio clusters path)\n");
+  for (size_t i = 0; i < an->dir_count; i++)
+  {
+    ANALYZE_DIR *d = &an->dirs[i];
+    printf("  %5u %5u %5u %5.2f %4u %s\n", d->slots, d->used, d->deleted, ratio(d->deleted, d->slots), d->clusters, d->path);
+  }
+
+  printf("\nworst files\n");
+  for (size_t i = 0; i < an->file_count && i < top && an->files[i].extents > 1; i++)
+    printf("  %5u extents %s\n", an->files[i].extents, an->files[i].path);
+  printf("\nworst directories\n");
+  for (size_t i = 0; i < an->dir_count && i < top && an->dirs[i].deleted > 0; i++)
+    printf("  %5.2f deleted %s\n", ratio(an->dirs[i].deleted, an->dirs[i].slots), an->dirs[i].path);
+}
+
+static void print_json(FAT16 *fat16_ins, ANALYZE *an, const DEFRAG_REPORT *r, const DWORD *hist, size_t top)
+{
+  printf("{\n  \"cluster_size\": %u,\n  \"clusters\": %u,\n", fat16_ins->ClusterSize, fat16_ins->ClusterCount - CLUSTER_MIN);
+  printf("  \"summary\": {\"files\": %u, \"fragmented\": %u, \"clusters\": %u, \"extents\": %u, \"average_run\": %.3f, "
+         "\"free_clusters\": %u, \"free_runs\": %u, \"largest_free_run\": %u, \"average_free_run\": %.3f},\n",
+         r->files, r->fragmented, r->clusters, r->extents, ratio(r->clusters, r->extents),
+         r->free_clusters, r->free_runs, r->largest_free_run, ratio(r->free_clusters, r->free_runs));
+
+  printf("  \"free_run_histogram\": [");
+  int first = 1;
+  for (int b = 0; b < ALLOC_HIST_BUCKETS; b++)
+  {
+    if (hist[b] == 0)
+      continue;
+    printf("%s\n    {\"min\": %u, \"max\": %u, \"runs\": %u}", first ? "" : ",", 1u << b, (2u << b) - 1, hist[b]);
+    first = 0;
+  }
+  printf("\n  ],\n");
+
+  printf("  \"files\": [");
+  for (size_t i = 0; i < an->file_count; i++)
+  {
+    ANALYZE_FILE *f = &an->files[i];
+    printf("%s\n    {\"path\": ", i ? "," : "");
+    json_string(f->path);
+    printf(", \"size\": %u, \"clusters\": %u, \"extents\": %u, \"average_run\": %.3f}",
+           f->size, f->clusters, f->extents, ratio(f->clusters, f->extents));
+  }
+  printf("\n  ],\n");
+
+  printf("  \"directories\": [");
+  for (size_t i = 0; i < an->dir_count; i++)
+  {
+    ANALYZE_DIR *d = &an->dirs[i];
+    printf("%s\n    {\"path\": ", i ? "," : "");
+    json_string(d->path);
+    printf(", \"clusters\": %u, \"slots\": %u, \"used\": %u, \"deleted\": %u, \"deleted_ratio\": %.3f}",
+           d->clusters, d->slots, d->used, d->deleted, ratio(d->deleted, d->slots));
+  }
+  printf("\n  ],\n");
+
+  /* 文件和目录已按从差到好排序，最差的就是前top个 */
+  printf("  \"worst_files\": [");
+  for (size_t i = 0; i < an->file_count && i < top && an->files[i].extents > 1; i++)
+  {
+    printf("%s", i ? ", " : "");
+    json_string(an->files[i].path);
+  }
+  printf("],\n  \"worst_directories\": [");
+  for (size_t i = 0; i < an->dir_count && i < top && an->dirs[i].deleted > 0; i++)
+  {
+    printf("%s", i ? ", " : "");
+    json_string(an->dirs[i].path);
+  }
+  printf("]\n}\n");
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-j] [-t top] <image>\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int json = 0;
+  size_t top = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "jt:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'j':
+      json = 1;
+      break;
+    case 't':
+      top = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  /* 只读打开，不重放日志、不修改镜像和旁边的文件 */
+  fat16_opts.read_only = 1;
+  FAT16 *fat16_ins = pre_init_fat16(argv[optind]);
+
+  static const FAT16_WALKER walker = {.entry = analyze_entry, .dir = analyze_dir};
+  ANALYZE an;
+  memset(&an, 0, sizeof(an));
+  fat16_walk(fat16_ins, &walker, &an);
+  qsort(an.files, an.file_count, sizeof(ANALYZE_FILE), file_cmp);
+  qsort(an.dirs, an.dir_count, sizeof(ANALYZE_DIR), dir_cmp);
+
+  DEFRAG_REPORT report;
+  defrag_report(fat16_ins, &report);
+  DWORD hist[ALLOC_HIST_BUCKETS];
+  alloc_free_histogram(fat16_ins, hist);
+
+  if (json)
+    print_json(fat16_ins, &an, &report, hist, top);
+  else
+    print_text(fat16_ins, &an, &report, hist, top);
+
+  fclose(fat16_ins->fd);
+  return 0;
+}
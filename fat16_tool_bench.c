@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * 并发创建/查找基准测试，对已挂载的文件系统运行：
+ *     fat16_bench [-t threads] [-n files] [-s] <挂载点>
+ * 线程数从1开始每次翻倍直到threads（默认8），每一轮在挂载点下的BENCH目录中：
+ * 每个线程创建files个空文件（默认500），然后stat这些文件，最后删除它们，输出每个阶段的操作数/秒。
+ * 默认每个线程使用自己的子目录，目录锁互不冲突，用来观察创建的扩展性；
+ * -s 所有线程在同一个目录中创建，观察同一目录中查找的并行程度和创建的串行化。
+ */
+
+typedef struct
+{
+  const char *root;  // BENCH目录的路径
+  int id;
+  int files;
+  int shared;
+  int phase;         // 0:创建，1:stat，2:删除
+  int errors;
+} BENCH_THREAD;
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 文件名需要符合8.3格式 */
+static void bench_path(const BENCH_THREAD *t, int i, char *path, size_t size)
+{
+  if (t->shared)
+    snprintf(path, size, "%s/shared/t%02d%05d", t->root, t->id, i);
+  else
+    snprintf(path, size, "%s/d%d/f%d", t->root, t->id, i);
+}
+
+static void *bench_worker(void *arg)
+{
+  BENCH_THREAD *t = arg;
+  char path[4096];
+  struct stat st;
+  for (int i = 0; i < t->files; i++)
+  {
+    bench_path(t, i, path, sizeof(path));
+    int ok;
+    if (t->phase == 0)
+    {
+      int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+      ok = fd >= 0;
+      if (ok)
+        close(fd);
+    }
+    else if (t->phase == 1)
+    {
+      ok = stat(path, &st) == 0;
+    }
+    else
+    {
+      ok = unlink(path) == 0;
+    }
+    if (!ok)
+      t->errors++;
+  }
+  return NULL;
+}
+
+/**
+ * @brief 用nthreads个线程运行一个阶段
+ *
+ * @return double 每秒完成的操作数
+ */
+static double bench_phase(BENCH_THREAD *threads, int nthreads, int phase, int *errors)
+{
+  pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+  double start = now_sec();
+  for (int i = 0; i < nthreads; i++)
+  {
+    threads[i].phase = phase;
+    threads[i].errors = 0;
+    pthread_create(&tids[i], NULL, bench_worker, &threads[i]);
+  }
+  for (int i = 0; i < nthreads; i++)
+  {
+    pthread_join(tids[i], NULL);
+    *errors += threads[i].errors;
+  }
+  double elapsed = now_sec() - start;
+  free(tids);
+  return (double)nthreads * threads[0].files / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-t threads] [-n files] [-s] <mountpoint>\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int maxThreads = 8;
+  int files = 500;
+  int shared = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:s")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      maxThreads = atoi(optarg);
+      break;
+    case 'n':
+      files = atoi(optarg);
+      break;
+    case 's':
+      shared = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || maxThreads < 1 || maxThreads > 99 || files < 1 || files > 99999)
+    usage(argv[0]);
+
+  char root[4000], dir[4096];
+  snprintf(root, sizeof(root), "%s/BENCH", argv[optind]);
+  if (mkdir(root, 0755) != 0 && errno != EEXIST)
+  {
+    perror(root);
+    return EXIT_FAILURE;
+  }
+  snprintf(dir, sizeof(dir), "%s/shared", root);
+  mkdir(dir, 0755);
+  for (int i = 0; i < maxThreads; i++)
+  {
+    snprintf(dir, sizeof(dir), "%s/d%d", root, i);
+    mkdir(dir, 0755);
+  }
+
+  BENCH_THREAD *threads = calloc(maxThreads, sizeof(BENCH_THREAD));
+  for (int i = 0; i < maxThreads; i++)
+  {
+    threads[i].root = root;
+    threads[i].id = i;
+    threads[i].files = files;
+    threads[i].shared = shared;
+  }
+
+  printf("%s directory, %d file(s) per thread\n", shared ? "shared" : "per-thread", files);
+  printf("threads   create/s     stat/s   unlink/s  errors\n");
+  for (int n = 1;; n *= 2)
+  {
+    if (n > maxThreads)
+      n = maxThreads;
+    int errors = 0;
+    double create = bench_phase(threads, n, 0, &errors);
+    double lookup = bench_phase(threads, n, 1, &errors);
+    double remove = bench_phase(threads, n, 2, &errors);
+    printf("%7d %10.0f %10.0f %10.0f %7d\n", n, create, lookup, remove, errors);
+    if (n == maxThreads)
+      break;
+  }
+
+  for (int i = 0; i < maxThreads; i++)
+  {
+    snprintf(dir, sizeof(dir), "%s/d%d", root, i);
+    rmdir(dir);
+  }
+  snprintf(dir, sizeof(dir), "%s/shared", root);
+  rmdir(dir);
+  rmdir(root);
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "fat16.h"
+
+/**
+ * 离线碎片整理工具，用于未挂载的镜像：
+ *     fat16_defrag [-n] [-d] [-b batch] <镜像文件>
+ * 先重放日志、回收待回收的簇链，再整理一遍，输出整理前后的碎片情况。
+ * 镜像已被挂载（挂载进程持有镜像的flock）时拒绝运行。
+ * -n 只输出碎片情况，不整理，与fat16_analyze一样只读打开镜像（不重放日志、不回收簇链）；
+ * -d 同时压缩所有目录，清除已删除的目录项；
+ * -b 每个事务最多搬移的簇数（默认4096）。
+ */
+
+/* 需要压缩的目录的首簇 */
+typedef struct
+{
+  WORD *clusters;
+  uint count;
+  uint capacity;
+} DIR_LIST;
+
+static int collect_dir(FAT16 *fat16_ins, const char *path, DIR_ENTRY *Dir, off_t offset_dir, void *ctx)
+{
+  DIR_LIST *list = ctx;
+  if (!(Dir->DIR_Attr & ATTR_DIRECTORY) || !is_cluster_inuse(Dir->DIR_FstClusLO))
+    return 0;
+  if (list->count == list->capacity)
+  {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->clusters = realloc(list->clusters, list->capacity * sizeof(WORD));
+  }
+  list->clusters[list->count++] = Dir->DIR_FstClusLO;
+  return 0;
+}
+
+/**
+ * @brief 压缩根目录和所有子目录
+ *
+ * @return DWORD  清除的已删除目录项数
+ */
+static DWORD compact_all(FAT16 *fat16_ins)
+{
+  static const FAT16_WALKER walker = {.entry = collect_dir};
+  DIR_LIST list = {0};
+  fat16_walk(fat16_ins, &walker, &list);
+
+  DWORD total = 0, purged;
+  if (dir_compact(fat16_ins, 0, 0, &purged) == 0)
+    total += purged;
+  for (uint i = 0; i < list.count; i++)
+    if (dir_compact(fat16_ins, list.clusters[i], 0, &purged) == 0)
+      total += purged;
+  free(list.clusters);
+  return total;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-n] [-d] [-b batch] <image>\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int dryRun = 0;
+  int compact = 0;
+  DWORD batch = 4096;
+  int opt;
+  while ((opt = getopt(argc, argv, "ndb:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      dryRun = 1;
+      break;
+    case 'd':
+      compact = 1;
+      break;
+    case 'b':
+      batch = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  /* 只输出碎片情况时不能修改镜像 */
+  fat16_opts.read_only = dryRun;
+  FAT16 *fat16_ins = pre_init_fat16(argv[optind]);
+  if (!dryRun)
+    reclaim_drain(fat16_ins);
+
+  char text[256];
+  DEFRAG_REPORT before, after;
+  if (dryRun)
+  {
+    defrag_report(fat16_ins, &before);
+    defrag_format_report(&before, text, sizeof(text));
+    printf("%s\n", text);
+  }
+  else
+  {
+    DWORD moved = defrag_pass(fat16_ins, batch, 0, &before, &after);
+    defrag_format_report(&before, text, sizeof(text));
+    printf("before: %s\n", text);
+    defrag_format_report(&after, text, sizeof(text));
+    printf("after:  %s\n", text);
+    printf("moved %u cluster(s)\n", moved);
+    if (compact)
+      printf("purged %u deleted directory entries\n", compact_all(fat16_ins));
+  }
+
+  int ret = journal_close(fat16_ins);
+  fclose(fat16_ins->fd);
+  return ret == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,588 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * 镜像文件的批量I/O（io_uring）
+ *
+ * 开启uring挂载选项后，io_batch_begin与io_batch_end之间（日志事务的范围，即一个FUSE操作、
+ * 一批后台回收或整理）通过io_write写入镜像的数据不立即写出，而是复制到当前线程的批次中，
+ * 在io_batch_end时作为一次io_uring提交写出：
+ *   - 每个线程有自己的ring，第一次使用时建立，线程退出时释放；
+ *   - 与批次中某个写入范围完全相同或被其包含的写入直接覆盖该副本，紧接在上一个写入之后的写入合并为一个；
+ *     部分重叠的写入先提交之前的批次，同一次提交中的请求互不重叠，完成顺序不影响结果；
+ *   - io_read读取的范围与批次中的写入重叠时先提交批次，保证读到自己的写入；
+ *   - 在fdatasync镜像或splice写入镜像之前调用io_batch_flush。
+ * io_read_extents把多个互不相关的连续段的读取作为一次提交。
+ * 内核不支持io_uring（或被禁止）、编译环境没有io_uring头文件、或未开启uring时，一切退回pread/pwrite。
+ */
+
+/* 批次中的一个请求 */
+typedef struct
+{
+  int fd;
+  long offset;
+  size_t size;
+  BYTE *data;  // 写入时为数据的副本，读取时为调用者的缓冲区
+  int write;
+  int cls;     // iosched_class
+} URING_OP;
+
+#ifdef __NR_io_uring_setup
+/* 一个线程的ring */
+typedef struct
+{
+  int ring_fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+} URING_RING;
+#endif
+
+/* 当前线程的批次 */
+static __thread struct
+{
+  int depth;        // io_batch_begin的嵌套层数
+  int no_ring;      // 本线程建立ring失败
+  void *ring;       // URING_RING
+  URING_OP *ops;
+  uint count;
+  uint capacity;
+} batch;
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_once_t key_once;
+  pthread_key_t key;    // 线程退出时释放ring
+  int started;          // fat16_init之后才使用ring，避免ring被daemonize的fork继承
+  int unavailable;      // 内核不支持io_uring，不再尝试
+
+  /* 统计 */
+  uint64_t rings;         // 建立的ring数
+  uint64_t submissions;   // 提交次数（io_uring_enter）
+  uint64_t ops;           // 提交的请求数
+  uint64_t merged;        // 被合并或覆盖、没有单独提交的写入数
+  uint64_t bytes;         // 提交的字节数
+  uint64_t fallbacks;     // 退回pread/pwrite完成的请求数（出错或只完成一部分）
+  uint64_t errors;        // 最终失败的请求数
+} ur = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .key_once = PTHREAD_ONCE_INIT,
+};
+
+#ifdef __NR_io_uring_setup
+
+static void ring_destroy(void *arg)
+{
+  URING_RING *r = arg;
+  munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+  if (r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_size);
+  munmap(r->sq_ptr, r->sq_size);
+  close(r->ring_fd);
+  free(r);
+}
+
+static void ring_key_init(void)
+{
+  pthread_key_create(&ur.key, ring_destroy);
+}
+
+/**
+ * @brief 建立当前线程的ring
+ *
+ * @return URING_RING*  失败时返回NULL
+ */
+static URING_RING *ring_create(unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return NULL;
+
+  URING_RING *r = calloc(1, sizeof(URING_RING));
+  r->ring_fd = fd;
+  r->entries = p.sq_entries;
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (r->cq_size > r->sq_size)
+      r->sq_size = r->cq_size;
+    r->cq_size = r->sq_size;
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+    goto fail;
+  r->cq_ptr = r->sq_ptr;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED)
+    {
+      munmap(r->sq_ptr, r->sq_size);
+      goto fail;
+    }
+  }
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+  {
+    if (r->cq_ptr != r->sq_ptr)
+      munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    goto fail;
+  }
+
+  BYTE *sq = r->sq_ptr, *cq = r->cq_ptr;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return r;
+
+fail:
+  close(fd);
+  free(r);
+  return NULL;
+}
+
+/**
+ * @brief 返回当前线程的ring，需要时建立
+ */
+static URING_RING *ring_get(void)
+{
+  if (batch.ring != NULL)
+    return batch.ring;
+  if (batch.no_ring || ur.unavailable)
+    return NULL;
+
+  pthread_once(&ur.key_once, ring_key_init);
+  URING_RING *r = ring_create(fat16_opts.uring_depth);
+  if (r == NULL)
+  {
+    batch.no_ring = 1;
+    /* 没有这个系统调用或被禁止时，其它线程也不必再尝试 */
+    if (errno == ENOSYS || errno == EPERM)
+    {
+      pthread_mutex_lock(&ur.lock);
+      if (!ur.unavailable)
+        fprintf(stderr, "uring: io_uring unavailable (%s), using pread/pwrite\n", strerror(errno));
+      ur.unavailable = 1;
+      pthread_mutex_unlock(&ur.lock);
+    }
+    return NULL;
+  }
+  pthread_setspecific(ur.key, r);
+  batch.ring = r;
+
+  pthread_mutex_lock(&ur.lock);
+  ur.rings++;
+  pthread_mutex_unlock(&ur.lock);
+  return r;
+}
+
+/**
+ * @brief 把ops[0, n)作为一次提交，等待全部完成。n不超过ring的大小。
+ *
+ * @param res 输出参数，每个请求的结果（传输的字节数或错误代码的负值）
+ * @return int 成功返回0，io_uring_enter失败返回-1（此时没有请求被提交）
+ */
+static int ring_submit_wait(URING_RING *r, URING_OP *ops, uint n, int *res)
+{
+  unsigned tail = *r->sq_tail;
+  for (uint i = 0; i < n; i++)
+  {
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ops[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = ops[i].fd;
+    sqe->off = ops[i].offset;
+    sqe->addr = (unsigned long)ops[i].data;
+    sqe->len = ops[i].size;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  uint submitted = 0, completed = 0;
+  while (completed < n)
+  {
+    int ret = syscall(__NR_io_uring_enter, r->ring_fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (submitted == 0)
+      {
+        /* 收回尚未被内核取走的请求 */
+        __atomic_store_n(r->sq_tail, *r->sq_tail - n, __ATOMIC_RELEASE);
+        return -1;
+      }
+      continue;
+    }
+    submitted += ret;
+
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      res[cqe->user_data] = cqe->res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+#endif
+
+/**
+ * @brief 同步完成一个请求中从done开始的剩余部分
+ */
+static size_t op_sync(URING_OP *op, size_t done)
+{
+  while (done < op->size)
+  {
+    ssize_t ret = op->write ? pwrite(op->fd, op->data + done, op->size - done, op->offset + done)
+                            : pread(op->fd, op->data + done, op->size - done, op->offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    done += ret;
+  }
+  return done;
+}
+
+/**
+ * @brief 执行一组互不重叠的请求：可以使用ring时每ring大小个请求一次提交，否则依次pread/pwrite。
+ *        出错或只完成一部分的请求用pread/pwrite补完。
+ *
+ * @param done  输出参数，每个请求完成的字节数
+ */
+static void ops_run(URING_OP *ops, uint n, size_t *done)
+{
+  uint64_t submissions = 0, fallbacks = 0, errors = 0, bytes = 0;
+  uint i = 0;
+
+  /* 一次提交作为一个调度请求，其中有文件数据时按数据排队 */
+  int cls = IOSCHED_META;
+  size_t total = 0;
+  for (uint j = 0; j < n; j++)
+  {
+    if (ops[j].cls == IOSCHED_DATA)
+      cls = IOSCHED_DATA;
+    total += ops[j].size;
+  }
+  iosched_begin(cls, total);
+
+#ifdef __NR_io_uring_setup
+  URING_RING *r = n > 0 ? ring_get() : NULL;
+  if (r != NULL)
+  {
+    int *res = malloc(r->entries * sizeof(int));
+    while (i < n)
+    {
+      uint k = n - i < r->entries ? n - i : r->entries;
+      if (ring_submit_wait(r, ops + i, k, res) != 0)
+        break;
+      submissions++;
+      for (uint j = 0; j < k; j++)
+      {
+        done[i + j] = res[j] > 0 ? (size_t)res[j] : 0;
+        if (done[i + j] < ops[i + j].size)
+        {
+          fallbacks++;
+          done[i + j] = op_sync(&ops[i + j], done[i + j]);
+        }
+      }
+      i += k;
+    }
+    free(res);
+  }
+#endif
+
+  for (; i < n; i++)
+    done[i] = op_sync(&ops[i], 0);
+  iosched_end(cls);
+
+  for (uint j = 0; j < n; j++)
+  {
+    bytes += done[j];
+    errors += done[j] < ops[j].size;
+  }
+  pthread_mutex_lock(&ur.lock);
+  ur.submissions += submissions;
+  ur.ops += n;
+  ur.fallbacks += fallbacks;
+  ur.errors += errors;
+  ur.bytes += bytes;
+  pthread_mutex_unlock(&ur.lock);
+}
+
+/**
+ * @brief 开始当前线程的批次，可以嵌套，最外层的io_batch_end时提交
+ */
+void io_batch_begin(void)
+{
+  batch.depth++;
+}
+
+/**
+ * @brief 立即提交当前线程批次中的所有写入
+ *
+ * @return int 成功返回0，有写入失败时返回-EIO
+ */
+int io_batch_flush(void)
+{
+  if (batch.count == 0)
+    return 0;
+
+  uint n = batch.count;
+  size_t *done = malloc(n * sizeof(size_t));
+  ops_run(batch.ops, n, done);
+
+  int ret = 0;
+  for (uint i = 0; i < n; i++)
+  {
+    if (done[i] < batch.ops[i].size)
+    {
+      fprintf(stderr, "uring: write of %zu bytes at %ld failed\n", batch.ops[i].size, batch.ops[i].offset);
+      ret = -EIO;
+    }
+    /* 写入完成之后预读线程才能读到新内容，入队时已经失效过一次，这里再失效一次 */
+    readahead_invalidate(batch.ops[i].offset, batch.ops[i].size);
+    free(batch.ops[i].data);
+  }
+  free(done);
+  batch.count = 0;
+  return ret;
+}
+
+/**
+ * @brief 结束当前线程的批次，最外层时提交
+ *
+ * @return int 成功返回0，有写入失败时返回-EIO
+ */
+int io_batch_end(void)
+{
+  if (--batch.depth > 0)
+    return 0;
+  return io_batch_flush();
+}
+
+/**
+ * @brief io_write调用：在批次中时把写入加入批次
+ *
+ * @return int  已加入批次返回1，调用者应直接写入时返回0
+ */
+int io_batch_write(int fd, const void *buf, long offset, size_t size)
+{
+  if (batch.depth == 0 || !ur.started || batch.no_ring || ur.unavailable || size == 0)
+    return 0;
+  /* O_DIRECT下未对齐的写入需要read-modify-write，不放入批次 */
+  if (io_direct_unaligned(NULL, offset, size))
+    return 0;
+
+  for (uint i = 0; i < batch.count; i++)
+  {
+    URING_OP *op = &batch.ops[i];
+    if (op->fd != fd || offset + (long)size <= op->offset || offset >= op->offset + (long)op->size)
+      continue;
+    /* 被已有的写入包含（例如同一个FAT扇区被多次写入）时直接覆盖副本 */
+    if (offset >= op->offset && offset + size <= op->offset + op->size)
+    {
+      memcpy(op->data + (offset - op->offset), buf, size);
+      readahead_invalidate(offset, size);
+      pthread_mutex_lock(&ur.lock);
+      ur.merged++;
+      pthread_mutex_unlock(&ur.lock);
+      return 1;
+    }
+    /* 部分重叠的写入不能放在同一次提交中 */
+    io_batch_flush();
+    break;
+  }
+
+  /* 紧接在上一个写入之后时合并 */
+  URING_OP *last = batch.count > 0 ? &batch.ops[batch.count - 1] : NULL;
+  if (last != NULL && last->fd == fd && last->offset + (long)last->size == offset)
+  {
+    BYTE *data = io_alloc(last->size + size);
+    memcpy(data, last->data, last->size);
+    memcpy(data + last->size, buf, size);
+    free(last->data);
+    last->data = data;
+    last->size += size;
+    if (iosched_class(offset) == IOSCHED_DATA)
+      last->cls = IOSCHED_DATA;
+    pthread_mutex_lock(&ur.lock);
+    ur.merged++;
+    pthread_mutex_unlock(&ur.lock);
+  }
+  else
+  {
+    if (batch.count == fat16_opts.uring_depth)
+      io_batch_flush();
+    if (batch.count == batch.capacity)
+    {
+      batch.capacity = batch.capacity ? batch.capacity * 2 : 16;
+      batch.ops = realloc(batch.ops, batch.capacity * sizeof(URING_OP));
+    }
+    URING_OP *op = &batch.ops[batch.count++];
+    op->fd = fd;
+    op->offset = offset;
+    op->size = size;
+    op->write = 1;
+    op->cls = iosched_class(offset);
+    op->data = io_alloc(size);
+    memcpy(op->data, buf, size);
+  }
+  /* 使本线程之后的读取不会命中预读缓存中的旧内容，而是经过io_read并先提交批次 */
+  readahead_invalidate(offset, size);
+  return 1;
+}
+
+/**
+ * @brief io_read调用：读取的范围与批次中的写入重叠时先提交批次
+ */
+void io_batch_before_read(int fd, long offset, size_t size)
+{
+  for (uint i = 0; i < batch.count; i++)
+  {
+    URING_OP *op = &batch.ops[i];
+    if (op->fd == fd && offset < op->offset + (long)op->size && offset + (long)size > op->offset)
+    {
+      io_batch_flush();
+      return;
+    }
+  }
+}
+
+/**
+ * @brief 依次读取镜像中的多个连续段到buf中，开启uring时作为一次提交
+ *
+ * @param fd        镜像文件指针
+ * @param buf       数据要存储到的缓冲区，依次存放每一段
+ * @param extents   要读取的连续段
+ * @param count     连续段的个数
+ * @return size_t   从buf开头起连续读到的字节数
+ */
+size_t io_read_extents(FILE *fd, void *buf, const FAT16_EXTENT *extents, int count)
+{
+  size_t total = 0;
+  if (count <= 1 || !ur.started || batch.no_ring || ur.unavailable || io_direct_enabled())
+  {
+    for (int i = 0; i < count; i++)
+    {
+      size_t ret = io_read(fd, (BYTE *)buf + total, extents[i].offset, extents[i].size);
+      total += ret;
+      if (ret != extents[i].size)
+        break;
+    }
+    return total;
+  }
+
+  URING_OP *ops = malloc(count * sizeof(URING_OP));
+  size_t *done = malloc(count * sizeof(size_t));
+  for (int i = 0; i < count; i++)
+  {
+    io_batch_before_read(fileno(fd), extents[i].offset, extents[i].size);
+    ops[i].fd = fileno(fd);
+    ops[i].offset = extents[i].offset;
+    ops[i].size = extents[i].size;
+    ops[i].data = (BYTE *)buf + total;
+    ops[i].write = 0;
+    ops[i].cls = iosched_class(extents[i].offset);
+    total += extents[i].size;
+  }
+  ops_run(ops, count, done);
+
+  total = 0;
+  for (int i = 0; i < count; i++)
+  {
+    total += done[i];
+    if (done[i] != ops[i].size)
+      break;
+  }
+  free(ops);
+  free(done);
+  return total;
+}
+
+/**
+ * @brief 开始使用io_uring。需要在fat16_init中调用。
+ */
+void uring_start(void)
+{
+  ur.started = 1;
+}
+
+/**
+ * @brief 停止使用io_uring，之后的I/O直接使用pread/pwrite。各线程的ring在线程退出时释放。
+ */
+void uring_stop(void)
+{
+  io_batch_flush();
+  ur.started = 0;
+}
+
+/**
+ * @brief 输出批量I/O的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int uring_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&ur.lock);
+  double opsPerSubmit = ur.submissions ? (double)ur.ops / ur.submissions : 0;
+  int n = snprintf(buf, size,
+                   "uring.enabled %d\n"
+                   "uring.available %d\n"
+                   "uring.rings %llu\n"
+                   "uring.submissions %llu\n"
+                   "uring.ops %llu\n"
+                   "uring.ops_per_submission %.3f\n"
+                   "uring.merged_writes %llu\n"
+                   "uring.bytes %llu\n"
+                   "uring.fallbacks %llu\n"
+                   "uring.errors %llu\n",
+                   ur.started,
+                   !ur.unavailable,
+                   (unsigned long long)ur.rings,
+                   (unsigned long long)ur.submissions,
+                   (unsigned long long)ur.ops,
+                   opsPerSubmit,
+                   (unsigned long long)ur.merged,
+                   (unsigned long long)ur.bytes,
+                   (unsigned long long)ur.fallbacks,
+                   (unsigned long long)ur.errors);
+  pthread_mutex_unlock(&ur.lock);
+  return n;
+}
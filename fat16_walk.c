@@ -0,0 +1,140 @@
+#include <string.h>
+#include <errno.h>
+
+#include "fat16.h"
+
+/**
+ * 目录树遍历
+ *
+ * 从根目录开始深度优先遍历所有目录，对每个有效的目录项（不含"."、".."、已删除的目录项、长文件名项和卷标）
+ * 调用一次回调函数。整理工具和分析工具都基于这里的遍历。
+ */
+
+#define WALK_MAX_DEPTH 32  // 目录最大嵌套层数，防止损坏的镜像中目录成环
+
+#define ATTR_LONG_NAME 0x0F
+#define ATTR_VOLUME_ID 0x08
+
+/**
+ * @brief 遍历目录中的所有目录项。
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param dirPath       目录的路径
+ * @param firstCluster  目录的首簇，根目录为0
+ * @param depth         目录的嵌套层数
+ * @param fn            回调函数
+ * @param ctx           传给回调函数的参数
+ * @return int          回调函数返回非0时停止遍历并返回该值，否则返回0
+ */
+static int walk_dir(FAT16 *fat16_ins, const char *dirPath, WORD firstCluster, int depth,
+                    const FAT16_WALKER *fn, void *ctx)
+{
+  BYTE sector_buffer[BYTES_PER_SECTOR];
+  DWORD RootDirSectors = fat16_ins->Bpb.BPB_RootEntCnt * BYTES_PER_DIR / BYTES_PER_SECTOR;
+  DWORD SecPerClus = fat16_ins->Bpb.BPB_SecPerClus;
+
+  /* 根目录区域的扇区是连续的，子目录按簇链逐簇遍历 */
+  WORD cluster = firstCluster;
+  DWORD secIndex = 0;
+  DWORD clusterCnt = 0;
+  DWORD slots = 0, used = 0, deleted = 0; // 目录项总数、有效目录项数、已删除的目录项数
+  int ret = 0;
+
+  for (;;)
+  {
+    DWORD secnum;
+    if (firstCluster == 0)
+    {
+      if (secIndex == RootDirSectors)
+        break;
+      secnum = fat16_ins->FirstRootDirSecNum + secIndex;
+    }
+    else
+    {
+      if (secIndex == SecPerClus)
+      {
+        cluster = fat_entry_by_cluster(fat16_ins, cluster);
+        secIndex = 0;
+        if (++clusterCnt >= fat16_ins->ClusterCount)
+          break;
+      }
+      if (!is_cluster_inuse(cluster))
+        break;
+      secnum = fat16_ins->FirstDataSector + (cluster - 2) * SecPerClus + secIndex;
+    }
+    secIndex++;
+
+    sector_read(fat16_ins->fd, secnum, sector_buffer);
+    for (int i = 0; i < BYTES_PER_SECTOR / BYTES_PER_DIR; i++)
+    {
+      DIR_ENTRY *Dir = (DIR_ENTRY *)(sector_buffer + i * BYTES_PER_DIR);
+      if (Dir->DIR_Name[0] == 0x00) // 目录结束
+        goto done;
+      slots++;
+      if (Dir->DIR_Name[0] == 0xE5)
+      {
+        deleted++;
+        continue;
+      }
+      if (Dir->DIR_Attr == ATTR_LONG_NAME || (Dir->DIR_Attr & ATTR_VOLUME_ID) || Dir->DIR_Name[0] == '.')
+        continue;
+      used++;
+
+      BYTE *name = path_decode(Dir->DIR_Name);
+      char *path = malloc(strlen(dirPath) + strlen((char *)name) + 2);
+      sprintf(path, "%s%s%s", dirPath, strcmp(dirPath, "/") == 0 ? "" : "/", name);
+      free(name);
+
+      off_t offset_dir = (off_t)secnum * BYTES_PER_SECTOR + i * BYTES_PER_DIR;
+      DIR_ENTRY entry = *Dir;
+      if (fn->entry != NULL)
+        ret = fn->entry(fat16_ins, path, &entry, offset_dir, ctx);
+      if (ret == 0 && (entry.DIR_Attr & ATTR_DIRECTORY) && is_cluster_inuse(entry.DIR_FstClusLO) &&
+          depth < WALK_MAX_DEPTH)
+        ret = walk_dir(fat16_ins, path, entry.DIR_FstClusLO, depth + 1, fn, ctx);
+      free(path);
+      if (ret != 0)
+        return ret;
+    }
+  }
+
+done:
+  if (fn->dir != NULL)
+    ret = fn->dir(fat16_ins, dirPath, slots, used, deleted, ctx);
+  return ret;
+}
+
+/**
+ * @brief 深度优先遍历整个目录树。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param fn        回调函数，entry对每个有效目录项调用，dir在每个目录遍历完后调用，均可为NULL
+ * @param ctx       传给回调函数的参数
+ * @return int      回调函数返回非0时停止遍历并返回该值，否则返回0
+ */
+int fat16_walk(FAT16 *fat16_ins, const FAT16_WALKER *fn, void *ctx)
+{
+  return walk_dir(fat16_ins, "/", 0, 0, fn, ctx);
+}
+
+/**
+ * @brief 统计簇链的簇数和段数（簇号相邻的簇属于同一段）
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param first     簇链的首簇
+ * @param clusters  输出参数，簇链中的簇数
+ * @param extents   输出参数，簇链的段数
+ */
+void chain_extents(FAT16 *fat16_ins, WORD first, DWORD *clusters, DWORD *extents)
+{
+  *clusters = *extents = 0;
+  WORD prev = CLUSTER_END;
+  for (WORD cur = first; is_cluster_inuse(cur) && *clusters < fat16_ins->ClusterCount;
+       cur = fat_entry_by_cluster(fat16_ins, cur))
+  {
+    if (prev == CLUSTER_END || cur != prev + 1)
+      (*extents)++;
+    (*clusters)++;
+    prev = cur;
+  }
+}
@@ -0,0 +1,525 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "fat16.h"
+
+/**
+ * 文件数据的回写缓存
+ *
+ * 开启writeback挂载选项后，write_file和fat16_write_buf写入的文件数据先保存在内存中以簇为单位的缓存里，
+ * 由后台flusher线程写回镜像：
+ *   - 最早的脏簇超过dirty_expire毫秒，或脏数据超过dirty_limit的dirty_background_ratio%时开始回写；
+ *   - 回写前按簇号（即镜像中的偏移）升序排序，相邻的簇用一次pwritev写出，使磁盘看到顺序I/O；
+ *   - 脏数据达到dirty_limit时，写入者阻塞，直到flusher回写出空间。
+ * 缓存只保存脏簇，回写完成后即释放。簇被释放（free_chain）时，缓存中对应的数据被丢弃。
+ * 回写失败的簇保留在缓存中等待下次回写，错误记录下来，由下一次writeback_sync（fsync）返回。
+ * 读取先读镜像再用缓存中的脏簇覆盖，期间有簇回写完成并移出缓存时（flush_gen改变）重新读取。
+ * 未开启writeback时，writeback_read/writeback_write直接读写镜像。
+ */
+
+#define WRITEBACK_BUCKETS 4096
+#define WRITEBACK_INTERVAL_MS 100 // flusher在没有被唤醒时的检查间隔
+
+typedef struct WB_CLUSTER
+{
+  WORD cluster;
+  int flushing;            // 正在被flusher写回，写入者需等待
+  uint64_t dirty_since;    // 变脏的时间（毫秒）
+  BYTE *data;              // 整个簇的内容
+  struct WB_CLUSTER *next; // 哈希链
+} WB_CLUSTER;
+
+static struct
+{
+  FAT16 *fat16_ins;
+  WB_CLUSTER *buckets[WRITEBACK_BUCKETS];
+  uint count;              // 缓存中的簇数
+  uint64_t dirty_bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t flusher_wakeup;
+  pthread_cond_t space;    // 回写完成时广播，唤醒被节流的写入者和等待flushing的线程
+  pthread_t thread;
+  int running;
+  int stop;
+  int error;               // 上次writeback_sync之后回写失败的错误（POSIX错误代码的负值）
+  uint64_t flush_gen;      // 每次有回写完成的簇移出缓存时加一
+
+  /* 统计 */
+  uint64_t flushed_bytes;  // 累计回写的字节数
+  uint64_t throttled;      // 写入者被节流的次数
+  uint64_t errors;         // 回写失败的次数
+  uint64_t rate_bytes;     // 上一个统计窗口内回写的字节数
+  uint64_t rate_start;     // 当前统计窗口开始的时间
+  double flush_rate;       // 最近的回写速率（字节/秒）
+} wb = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .flusher_wakeup = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint64_t dirty_limit_bytes(void)
+{
+  return (uint64_t)fat16_opts.dirty_limit << 20;
+}
+
+static WB_CLUSTER *wb_lookup(WORD cluster)
+{
+  WB_CLUSTER *c = wb.buckets[cluster % WRITEBACK_BUCKETS];
+  while (c != NULL && c->cluster != cluster)
+    c = c->next;
+  return c;
+}
+
+static void wb_remove(WB_CLUSTER *target)
+{
+  WB_CLUSTER **link = &wb.buckets[target->cluster % WRITEBACK_BUCKETS];
+  while (*link != target)
+    link = &(*link)->next;
+  *link = target->next;
+  wb.count--;
+  wb.dirty_bytes -= wb.fat16_ins->ClusterSize;
+  free(target->data);
+  free(target);
+}
+
+static int wb_cluster_cmp(const void *a, const void *b)
+{
+  return (int)(*(WB_CLUSTER *const *)a)->cluster - (int)(*(WB_CLUSTER *const *)b)->cluster;
+}
+
+/**
+ * @brief 写出iov中的全部数据，短写时继续写剩下的部分。iov会被修改。
+ *
+ * @return int 成功返回0，失败返回POSIX错误代码的负值
+ */
+static int wb_pwritev_all(int fd, struct iovec *iov, int count, long pos)
+{
+  while (count > 0)
+  {
+    ssize_t ret = pwritev(fd, iov, count, pos);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return -errno;
+    if (ret == 0)
+      return -EIO;
+    pos += ret;
+    while (count > 0 && (size_t)ret >= iov->iov_len)
+    {
+      ret -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (BYTE *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief 回写一批脏簇。调用者持有wb.lock，函数内部在I/O期间释放锁。
+ *        写入失败的簇保留在缓存中，错误记入wb.error。
+ *
+ * @param expire_before 只回写在此时间之前变脏的簇；为UINT64_MAX时回写全部
+ * @return int          成功返回0，有簇写入失败时返回POSIX错误代码的负值
+ */
+static int wb_flush_locked(uint64_t expire_before)
+{
+  FAT16 *fat16_ins = wb.fat16_ins;
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+
+  WB_CLUSTER **batch = malloc((wb.count + 1) * sizeof(WB_CLUSTER *));
+  uint n = 0;
+  for (int b = 0; b < WRITEBACK_BUCKETS; b++)
+  {
+    for (WB_CLUSTER *c = wb.buckets[b]; c != NULL; c = c->next)
+    {
+      if (!c->flushing && c->dirty_since <= expire_before)
+      {
+        c->flushing = 1;
+        batch[n++] = c;
+      }
+    }
+  }
+  if (n == 0)
+  {
+    free(batch);
+    return 0;
+  }
+  pthread_mutex_unlock(&wb.lock);
+
+  /* 按簇号升序，相邻的簇合并为一次pwritev */
+  qsort(batch, n, sizeof(WB_CLUSTER *), wb_cluster_cmp);
+  struct iovec iov[64];
+  BYTE *failed = calloc(n, 1);
+  int err = 0;
+  for (uint i = 0; i < n;)
+  {
+    uint run = 0;
+    long pos = get_cluster_offset(fat16_ins, batch[i]->cluster);
+    do
+    {
+      iov[run].iov_base = batch[i + run]->data;
+      iov[run].iov_len = ClusterSize;
+      run++;
+    } while (i + run < n && run < 64 && batch[i + run]->cluster == batch[i + run - 1]->cluster + 1);
+    iosched_begin(IOSCHED_DATA, (size_t)run * ClusterSize);
+    int ret = wb_pwritev_all(fileno(fat16_ins->fd), iov, run, pos);
+    if (ret == -EINVAL)
+    {
+      /* O_DIRECT下簇小于对齐大小时pwritev失败，逐簇经过中转缓冲区写入 */
+      ret = 0;
+      for (uint k = 0; k < run; k++)
+      {
+        if (io_write(fat16_ins->fd, batch[i + k]->data, pos + (long)k * ClusterSize, ClusterSize) != ClusterSize)
+        {
+          failed[i + k] = 1;
+          err = -EIO;
+        }
+      }
+    }
+    else if (ret < 0)
+    {
+      memset(failed + i, 1, run);
+      err = ret;
+    }
+    iosched_end(IOSCHED_DATA);
+    readahead_invalidate(pos, (size_t)run * ClusterSize);
+    i += run;
+  }
+
+  pthread_mutex_lock(&wb.lock);
+  uint done = 0;
+  for (uint i = 0; i < n; i++)
+  {
+    if (failed[i])
+    {
+      batch[i]->flushing = 0;
+      continue;
+    }
+    wb_remove(batch[i]);
+    done++;
+  }
+  if (err != 0)
+  {
+    wb.error = err;
+    wb.errors++;
+  }
+  wb.flush_gen++;
+  wb.flushed_bytes += (uint64_t)done * ClusterSize;
+  wb.rate_bytes += (uint64_t)done * ClusterSize;
+  pthread_cond_broadcast(&wb.space);
+  free(failed);
+  free(batch);
+  return err;
+}
+
+static void *wb_flusher(void *arg)
+{
+  pthread_mutex_lock(&wb.lock);
+  wb.rate_start = now_ms();
+  while (!wb.stop)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WRITEBACK_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&wb.flusher_wakeup, &wb.lock, &deadline);
+
+    /* 变脏时间不晚于cutoff的簇已经过期；单调时钟小于dirty_expire时（刚开机）还没有簇过期 */
+    uint64_t now = now_ms();
+    uint64_t cutoff = now > fat16_opts.dirty_expire ? now - fat16_opts.dirty_expire : 0;
+    if (wb.dirty_bytes > dirty_limit_bytes() * fat16_opts.dirty_background_ratio / 100)
+      wb_flush_locked(UINT64_MAX);
+    else if (cutoff > 0)
+      wb_flush_locked(cutoff);
+
+    /* 每秒更新一次回写速率 */
+    now = now_ms();
+    if (now - wb.rate_start >= 1000)
+    {
+      wb.flush_rate = wb.rate_bytes * 1000.0 / (now - wb.rate_start);
+      wb.rate_bytes = 0;
+      wb.rate_start = now;
+    }
+  }
+  pthread_mutex_unlock(&wb.lock);
+  return NULL;
+}
+
+/**
+ * @brief 初始化回写缓存并启动flusher线程。需要在fat16_init中调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ */
+void writeback_start(FAT16 *fat16_ins)
+{
+  wb.fat16_ins = fat16_ins;
+  wb.stop = 0;
+  if (pthread_create(&wb.thread, NULL, wb_flusher, NULL) == 0)
+    wb.running = 1;
+}
+
+/**
+ * @brief 回写所有脏数据并停止flusher线程。
+ */
+void writeback_stop(void)
+{
+  if (!wb.running)
+    return;
+
+  writeback_sync();
+  pthread_mutex_lock(&wb.lock);
+  wb.stop = 1;
+  pthread_cond_signal(&wb.flusher_wakeup);
+  pthread_mutex_unlock(&wb.lock);
+  pthread_join(wb.thread, NULL);
+  wb.running = 0;
+}
+
+/**
+ * @brief 同步回写所有脏数据，并将镜像文件刷入磁盘（fsync时调用）。
+ *        上次调用之后flusher回写失败的错误也在这里返回。
+ *
+ * @return int 成功返回0，失败返回POSIX错误代码的负值
+ */
+int writeback_sync(void)
+{
+  int err = 0;
+  if (wb.running)
+  {
+    pthread_mutex_lock(&wb.lock);
+    while (wb.count > 0 && err == 0)
+    {
+      err = wb_flush_locked(UINT64_MAX);
+      /* 剩下的簇正被flusher写回，等它完成 */
+      if (wb.count > 0 && err == 0)
+      {
+        uint64_t gen = wb.flush_gen;
+        while (wb.flush_gen == gen)
+          pthread_cond_wait(&wb.space, &wb.lock);
+        err = wb.error;
+      }
+    }
+    if (err == 0)
+      err = wb.error;
+    wb.error = 0;
+    pthread_mutex_unlock(&wb.lock);
+  }
+  if (wb.fat16_ins != NULL && fdatasync(fileno(wb.fat16_ins->fd)) != 0 && err == 0)
+    err = -errno;
+  return err;
+}
+
+/**
+ * @brief 将数据写入镜像数据区的pos处。开启回写时写入缓存，脏数据达到上限时阻塞等待回写。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param buf       要写入的数据
+ * @param pos       镜像文件中的偏移量（字节），必须位于数据区
+ * @param size      数据长度（字节）
+ * @return size_t   写入的字节数
+ */
+size_t writeback_write(FAT16 *fat16_ins, const void *buf, long pos, size_t size)
+{
+  if (!wb.running)
+    return io_write(fat16_ins->fd, buf, pos, size);
+
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  size_t done = 0;
+
+  pthread_mutex_lock(&wb.lock);
+  while (done < size)
+  {
+    WORD cluster = (pos + done - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+    size_t inCluster = (pos + done - fat16_ins->DataOffset) % ClusterSize;
+    size_t len = ClusterSize - inCluster;
+    if (len > size - done)
+      len = size - done;
+
+    /* 簇正在写回时修改会与pwritev竞争，等待本批完成 */
+    WB_CLUSTER *c;
+    while ((c = wb_lookup(cluster)) != NULL && c->flushing)
+      pthread_cond_wait(&wb.space, &wb.lock);
+
+    if (c == NULL)
+    {
+      /* 脏数据达到上限，节流 */
+      if (wb.dirty_bytes + ClusterSize > dirty_limit_bytes())
+      {
+        wb.throttled++;
+        pthread_cond_signal(&wb.flusher_wakeup);
+        pthread_cond_wait(&wb.space, &wb.lock);
+        continue;
+      }
+
+      c = calloc(1, sizeof(WB_CLUSTER));
+      c->cluster = cluster;
+      c->data = io_alloc(ClusterSize);
+      c->dirty_since = now_ms();
+      /* 没有覆盖整个簇时，先读入簇的原内容 */
+      if (len < ClusterSize)
+        io_read(fat16_ins->fd, c->data, get_cluster_offset(fat16_ins, cluster), ClusterSize);
+      c->next = wb.buckets[cluster % WRITEBACK_BUCKETS];
+      wb.buckets[cluster % WRITEBACK_BUCKETS] = c;
+      wb.count++;
+      wb.dirty_bytes += ClusterSize;
+      if (wb.dirty_bytes > dirty_limit_bytes() * fat16_opts.dirty_background_ratio / 100)
+        pthread_cond_signal(&wb.flusher_wakeup);
+    }
+
+    memcpy(c->data + inCluster, (const BYTE *)buf + done, len);
+    done += len;
+  }
+  pthread_mutex_unlock(&wb.lock);
+  return done;
+}
+
+/**
+ * @brief 从镜像数据区的pos处读取数据，缓存中的脏数据优先。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param buf       数据要存储到的缓冲区
+ * @param pos       镜像文件中的偏移量（字节），必须位于数据区
+ * @param size      数据长度（字节）
+ * @return size_t   读取的字节数
+ */
+size_t writeback_read(FAT16 *fat16_ins, void *buf, long pos, size_t size)
+{
+  if (!wb.running)
+    return readahead_read(fat16_ins->fd, buf, pos, size);
+
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  size_t ret;
+
+  /* 读镜像期间有簇回写完成并移出缓存时，读到的可能是回写之前的旧数据，重新读取 */
+  pthread_mutex_lock(&wb.lock);
+  uint64_t gen;
+  do
+  {
+    gen = wb.flush_gen;
+    pthread_mutex_unlock(&wb.lock);
+    ret = readahead_read(fat16_ins->fd, buf, pos, size);
+    pthread_mutex_lock(&wb.lock);
+  } while (wb.flush_gen != gen);
+
+  if (wb.count > 0)
+  {
+    for (size_t done = 0; done < size;)
+    {
+      WORD cluster = (pos + done - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+      size_t inCluster = (pos + done - fat16_ins->DataOffset) % ClusterSize;
+      size_t len = ClusterSize - inCluster;
+      if (len > size - done)
+        len = size - done;
+      WB_CLUSTER *c = wb_lookup(cluster);
+      if (c != NULL)
+        memcpy((BYTE *)buf + done, c->data + inCluster, len);
+      done += len;
+    }
+    ret = size;
+  }
+  pthread_mutex_unlock(&wb.lock);
+  return ret;
+}
+
+/**
+ * @brief 同步回写镜像中[pos, pos + size)范围内的脏簇，read_buf直接从镜像splice数据前调用。
+ *
+ * @param fat16_ins 文件系统元数据指针
+ * @param pos       镜像文件中的偏移量（字节）
+ * @param size      长度（字节）
+ */
+void writeback_flush_range(FAT16 *fat16_ins, long pos, size_t size)
+{
+  if (!wb.running)
+    return;
+
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  WORD first = (pos - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+  WORD last = (pos + size - 1 - fat16_ins->DataOffset) / ClusterSize + CLUSTER_MIN;
+
+  pthread_mutex_lock(&wb.lock);
+  for (uint cluster = first; cluster <= last && wb.count > 0; cluster++)
+  {
+    WB_CLUSTER *c;
+    while ((c = wb_lookup(cluster)) != NULL && c->flushing)
+      pthread_cond_wait(&wb.space, &wb.lock);
+    if (c == NULL)
+      continue;
+    if (io_write(fat16_ins->fd, c->data, get_cluster_offset(fat16_ins, cluster), ClusterSize) != ClusterSize)
+    {
+      /* 保留脏簇，错误由下一次fsync返回 */
+      wb.error = -EIO;
+      wb.errors++;
+      continue;
+    }
+    wb.flushed_bytes += ClusterSize;
+    wb.flush_gen++;
+    wb_remove(c);
+  }
+  pthread_mutex_unlock(&wb.lock);
+}
+
+/**
+ * @brief 丢弃簇在缓存中的数据。簇被释放时调用，防止之后回写覆盖该簇的新主人。
+ *
+ * @param cluster 被释放的簇号
+ */
+void writeback_discard(WORD cluster)
+{
+  if (!wb.running)
+    return;
+
+  pthread_mutex_lock(&wb.lock);
+  WB_CLUSTER *c;
+  while ((c = wb_lookup(cluster)) != NULL && c->flushing)
+    pthread_cond_wait(&wb.space, &wb.lock);
+  if (c != NULL)
+    wb_remove(c);
+  pthread_mutex_unlock(&wb.lock);
+}
+
+/**
+ * @brief 输出回写缓存的统计信息
+ *
+ * @param buf   输出缓冲区
+ * @param size  缓冲区大小
+ * @return int  写入的字符数（不含结尾的'\0'）
+ */
+int writeback_stats(char *buf, size_t size)
+{
+  pthread_mutex_lock(&wb.lock);
+  int n = snprintf(buf, size,
+                   "writeback.enabled %d\n"
+                   "writeback.dirty_bytes %llu\n"
+                   "writeback.dirty_limit_bytes %llu\n"
+                   "writeback.flushed_bytes %llu\n"
+                   "writeback.flush_rate_bytes_per_sec %.0f\n"
+                   "writeback.throttled %llu\n"
+                   "writeback.errors %llu\n",
+                   wb.running,
+                   (unsigned long long)wb.dirty_bytes,
+                   (unsigned long long)dirty_limit_bytes(),
+                   (unsigned long long)wb.flushed_bytes,
+                   wb.flush_rate,
+                   (unsigned long long)wb.throttled,
+                   (unsigned long long)wb.errors);
+  pthread_mutex_unlock(&wb.lock);
+  return n;
+}
@@ -6,10 +6,53 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/timeb.h>
+#include <sys/file.h>
 
 #include "fat16.h"
 
-const char *FAT_FILE_NAME = "fat16.img";
+/* 挂载选项及其默认值 */
+FAT16_OPTIONS fat16_opts = {
+    .deferred_free = 0,
+    .reclaim_batch = 256,
+    .reclaim_delay = 1,
+    .writeback = 0,
+    .dirty_limit = 64,
+    .dirty_background_ratio = 10,
+    .dirty_expire = 3000,
+    .delalloc = 0,
+    .prealloc = 0,
+    .prealloc_max = 1024,
+    .defrag = 0,
+    .defrag_batch = 64,
+    .defrag_delay = 10,
+    .dircompact = 0,
+    .dircompact_ratio = 50,
+    .readahead = 0,
+    .readahead_max = 4096,
+    .readahead_cache = 64,
+    .uring = 0,
+    .uring_depth = 64,
+    .odirect = 0,
+    .odirect_align = 0,
+    .keep_cache = 0,
+    .attr_timeout = 1.0,
+    .entry_timeout = 1.0,
+    .direct_io_min = 0,
+    .workers = 0,
+    .pin_workers = 0,
+    .worker_queue = 0,
+    .bulk_workers = 0,
+    .iosched = 0,
+    .iosched_depth = 4,
+    .meta_latency = 2,
+    .alloc_groups = 0,
+    .smallfile_cache = 0,
+    .smallfile_max = 16,
+    .sidecar = 0,
+    .mount_scan = 0,
+    .scan_threads = 0,
+    .read_only = 0,
+};
 
 /**
  * @brief 读取扇区号为secnum的扇区，将数据存储到buffer中
@@ -20,8 +63,12 @@ const char *FAT_FILE_NAME = "fat16.img";
  */
 void sector_read(FILE *fd, unsigned int secnum, void *buffer)
 {
-  fseek(fd, BYTES_PER_SECTOR * secnum, SEEK_SET);
-  fread(buffer, BYTES_PER_SECTOR, 1, fd);
+  /* 尚未写回镜像的元数据扇区在日志的覆盖表中 */
+  if (journal_sector_read(secnum, buffer))
+    return;
+  iosched_meta_begin();
+  readahead_read(fd, buffer, (long)BYTES_PER_SECTOR * secnum, BYTES_PER_SECTOR);
+  iosched_meta_end();
 }
 
 /**
@@ -33,9 +80,89 @@ void sector_read(FILE *fd, unsigned int secnum, void *buffer)
  */
 void sector_write(FILE *fd, unsigned int secnum, const void *buffer)
 {
-  fseek(fd, BYTES_PER_SECTOR * secnum, SEEK_SET);
-  fwrite(buffer, BYTES_PER_SECTOR, 1, fd);
-  fflush(fd);
+  /* 开启日志时，元数据写入先记入当前事务，由日志负责持久化 */
+  if (journal_sector_write(secnum, buffer))
+    return;
+  iosched_meta_begin();
+  io_write(fd, buffer, (long)BYTES_PER_SECTOR * secnum, BYTES_PER_SECTOR);
+  iosched_meta_end();
+}
+
+/**
+ * @brief 从镜像文件的offset字节处读取size字节到buf中。
+ *        直接对底层文件描述符使用pread，不经过stdio缓冲区，
+ *        因此与read_buf/write_buf中内核splice的数据始终一致。
+ *
+ * @param fd      镜像文件指针
+ * @param buf     数据要存储到的缓冲区指针
+ * @param offset  镜像文件中的偏移量（字节）
+ * @param size    需要读取的字节数
+ * @return size_t 实际读取的字节数
+ */
+size_t io_read(FILE *fd, void *buf, long offset, size_t size)
+{
+  /* 读到本线程批次中尚未提交的写入时先提交 */
+  io_batch_before_read(fileno(fd), offset, size);
+  int cls = iosched_class(offset);
+  iosched_begin(cls, size);
+  if (io_direct_unaligned(buf, offset, size))
+  {
+    size_t got = io_direct_read(fd, buf, offset, size);
+    iosched_end(cls);
+    return got;
+  }
+
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t ret = pread(fileno(fd), (BYTE *)buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    done += ret;
+  }
+  iosched_end(cls);
+  return done;
+}
+
+/**
+ * @brief 将buf中的size字节写入镜像文件的offset字节处，使用pwrite，不经过stdio缓冲区。
+ *
+ * @param fd      镜像文件指针
+ * @param buf     需要写入的数据
+ * @param offset  镜像文件中的偏移量（字节）
+ * @param size    需要写入的字节数
+ * @return size_t 实际写入的字节数
+ */
+size_t io_write(FILE *fd, const void *buf, long offset, size_t size)
+{
+  /* 批次中的写入在io_batch_end时一次提交 */
+  if (io_batch_write(fileno(fd), buf, offset, size))
+    return size;
+  int cls = iosched_class(offset);
+  iosched_begin(cls, size);
+  if (io_direct_unaligned(buf, offset, size))
+  {
+    size_t written = io_direct_write(fd, buf, offset, size);
+    iosched_end(cls);
+    readahead_invalidate(offset, size);
+    return written;
+  }
+
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t ret = pwrite(fileno(fd), (const BYTE *)buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    done += ret;
+  }
+  iosched_end(cls);
+  readahead_invalidate(offset, size);
+  return done;
 }
 
 /**
@@ -102,14 +229,14 @@ char **path_split(const char *pathInputConst, int *pathDepth_ret)
   char **paths = malloc(pathDepth * sizeof(char *));
 
   const char token[] = "/";
-  char *slice;
+  char *slice, *saveptr;
 
-  /* Dividing the path into separated strings of file names */
-  slice = strtok(pathInput, token);
+  /* Dividing the path into separated strings of file names (strtok_r: lookups run concurrently) */
+  slice = strtok_r(pathInput, token, &saveptr);
   for (i = 0; i < pathDepth; i++)
   {
     paths[i] = slice;
-    slice = strtok(NULL, token);
+    slice = strtok_r(NULL, token, &saveptr);
   }
 
   char **pathFormatted = malloc(pathDepth * sizeof(char *));
@@ -261,7 +388,7 @@ char *get_prt_path(const char *path, const char **orgPaths, int pathDepth)
 FAT16 *pre_init_fat16(const char *imageFilePath)
 {
   /* Opening the FAT16 image file */
-  FILE *fd = fopen(imageFilePath, "rb+");
+  FILE *fd = io_open_image(imageFilePath);
 
   if (fd == NULL)
   {
@@ -269,9 +396,27 @@ FAT16 *pre_init_fat16(const char *imageFilePath)
     exit(EXIT_FAILURE);
   }
 
+  /* The mount and the offline tools rewrite the image in place, so only one
+   * of them may have it open. The lock stays with the open file (also across
+   * fuse's daemonizing fork); read-only users share it with each other */
+  if (flock(fileno(fd), (fat16_opts.read_only ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0)
+  {
+    fprintf(stderr, "%s is in use (mounted or being defragmented)\n", imageFilePath);
+    exit(EXIT_FAILURE);
+  }
+
   FAT16 *fat16_ins = malloc(sizeof(FAT16));
 
   fat16_ins->fd = fd;
+  fat16_ins->FatCache = NULL;
+
+  /* FAT updates may nest (alloc_clusters -> write_fat_entry) */
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&fat16_ins->FatLock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_rwlock_init(&fat16_ins->ChainLock, NULL);
 
   /* Reads the BPB */
   sector_read(fat16_ins->fd, 0, &fat16_ins->Bpb);
@@ -293,6 +438,40 @@ FAT16 *pre_init_fat16(const char *imageFilePath)
   fat16_ins->ClusterSize = fat16_ins->Bpb.BPB_BytsPerSec * fat16_ins->Bpb.BPB_SecPerClus;
   fat16_ins->DataOffset = fat16_ins->RootOffset + fat16_ins->Bpb.BPB_RootEntCnt * BYTES_PER_DIR;
 
+  /* O_DIRECT needs every block of the data region to belong to a single cluster */
+  io_direct_check_layout(fat16_ins);
+
+  /* A read-only open cannot replay the journal, so it refuses an image
+   * whose committed metadata has not been written back yet */
+  if (fat16_opts.read_only)
+  {
+    if (journal_pending(imageFilePath))
+    {
+      fprintf(stderr, "%s has an unreplayed metadata journal, mount it once first\n", imageFilePath);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* Replays committed metadata transactions left by a previous crash.
+   * The orphan queue must be loaded first, the journal may modify it. */
+  else
+  {
+    if (reclaim_load(fat16_ins, imageFilePath) != 0)
+    {
+      fprintf(stderr, "Orphan chain queue is corrupted, ignoring it\n");
+    }
+    if (journal_open(fat16_ins, imageFilePath) != 0)
+    {
+      fprintf(stderr, "Cannot open the metadata journal, writing metadata in place\n");
+    }
+  }
+
+  /* FAT lookups and allocation work on an in-memory copy of the first FAT,
+   * loaded after the journal replay so that it sees the recovered entries.
+   * A sidecar index left by a clean unmount of the unchanged image is mapped instead */
+  if (fat16_opts.sidecar && !fat16_opts.read_only)
+    sidecar_load(fat16_ins, imageFilePath);
+  fat_cache_load(fat16_ins);
+
   return fat16_ins;
 }
 
@@ -305,6 +484,10 @@ FAT16 *pre_init_fat16(const char *imageFilePath)
  */
 WORD fat_entry_by_cluster(FAT16 *fat16_ins, WORD ClusterN)
 {
+  /* 读取内存镜像不加锁，表项按WORD原子地读写 */
+  if (fat16_ins->FatCache != NULL)
+    return __atomic_load_n(&fat16_ins->FatCache[ClusterN], __ATOMIC_RELAXED);
+
   /* Buffer to store bytes from the image file and the FAT16 offset */
   BYTE sector_buffer[BYTES_PER_SECTOR];
   WORD FATOffset = ClusterN * 2;
@@ -364,6 +547,11 @@ int find_root(FAT16 *fat16_ins, DIR_ENTRY *Root, const char *path, off_t *offset
   int RootDirCnt = 1;
   BYTE buffer[BYTES_PER_SECTOR];
 
+  /* 查找缓存命中时不需要扫描目录 */
+  if (dcache_lookup(fat16_ins, path, Root, offset_dir))
+    return 0;
+  DWORD gen = dcache_generation();
+
   int pathDepth;
   char *path_dup = strdup(path);
   char **paths = path_split((char *)path_dup, &pathDepth);
@@ -393,6 +581,7 @@ int find_root(FAT16 *fat16_ins, DIR_ENTRY *Root, const char *path, off_t *offset
     if (is_valid && Root->DIR_Attr == ATTR_ARCHIVE)
     {
       *offset_dir = fat16_ins->RootOffset + (i - 1) * BYTES_PER_DIR;
+      dcache_insert(path, Root->DIR_Name, *offset_dir, gen);
       return 0;
     }
 
@@ -401,6 +590,7 @@ int find_root(FAT16 *fat16_ins, DIR_ENTRY *Root, const char *path, off_t *offset
     if (is_valid && Root->DIR_Attr == ATTR_DIRECTORY && pathDepth == 1)
     {
       *offset_dir = fat16_ins->RootOffset + (i - 1) * BYTES_PER_DIR;
+      dcache_insert(path, Root->DIR_Name, *offset_dir, gen);
       return 0;
     }
 
@@ -408,7 +598,10 @@ int find_root(FAT16 *fat16_ins, DIR_ENTRY *Root, const char *path, off_t *offset
      * in the root's sub-directories */
     if (is_valid && Root->DIR_Attr == ATTR_DIRECTORY)
     {
-      return find_subdir(fat16_ins, Root, paths, pathDepth, 1, offset_dir);
+      int ret = find_subdir(fat16_ins, Root, paths, pathDepth, 1, offset_dir);
+      if (ret == 0)
+        dcache_insert(path, Root->DIR_Name, *offset_dir, gen);
+      return ret;
     }
 
     /* End of bytes for this sector (1 sector == 512 bytes == 16 DIR entries)
@@ -470,7 +663,8 @@ int find_subdir(FAT16 *fat16_ins, DIR_ENTRY *Dir, char **paths, int pathDepth, i
     if ((is_valid && Dir->DIR_Attr == ATTR_ARCHIVE && curDepth + 1 == pathDepth) ||
         (is_valid && Dir->DIR_Attr == ATTR_DIRECTORY && curDepth + 1 == pathDepth))
     {
-      *offset_dir = get_cluster_offset(fat16_ins, ClusterN) + (DirSecCnt - 1) * BYTES_PER_SECTOR + (i - 1) * BYTES_PER_DIR;
+      /* i在簇内跨扇区连续计数，(i - 1) * BYTES_PER_DIR已经包含了扇区的偏移 */
+      *offset_dir = get_cluster_offset(fat16_ins, ClusterN) + (i - 1) * BYTES_PER_DIR;
       return 0;
     }
 
@@ -533,14 +727,14 @@ char **org_path_split(char *pathInput)
   }
   char **orgPaths = (char **)malloc(pathDepth * sizeof(char *));
   const char token[] = "/";
-  char *slice;
+  char *slice, *saveptr;
 
-  /* Dividing the path into separated strings of file names */
-  slice = strtok(pathInput, token);
+  /* Dividing the path into separated strings of file names (strtok_r: lookups run concurrently) */
+  slice = strtok_r(pathInput, token, &saveptr);
   for (uint i = 0; i < pathDepth; i++)
   {
     orgPaths[i] = slice;
-    slice = strtok(NULL, token);
+    slice = strtok_r(NULL, token, &saveptr);
   }
   return orgPaths;
 }
@@ -558,6 +752,28 @@ void *fat16_init(struct fuse_conn_info *conn)
   struct fuse_context *context;
   context = fuse_get_context();
 
+  /* read_buf返回的镜像文件区域可以直接splice到/dev/fuse，
+   * write_buf收到的数据也可以从/dev/fuse直接splice到镜像文件 */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ);
+
+  /* 后台线程需要在fuse_main完成daemonize之后启动；碎片整理搬走的旧簇也由回收线程释放 */
+  if (fat16_opts.deferred_free || fat16_opts.defrag)
+    reclaim_start(context->private_data);
+  if (fat16_opts.writeback)
+    writeback_start(context->private_data);
+  if (fat16_opts.delalloc)
+    delalloc_start(context->private_data);
+  if (fat16_opts.defrag)
+    defrag_start(context->private_data);
+  if (fat16_opts.dircompact)
+    dircompact_start(context->private_data);
+  if (fat16_opts.readahead)
+    readahead_start(context->private_data);
+  if (fat16_opts.uring)
+    uring_start();
+  if (fat16_opts.iosched)
+    iosched_start(context->private_data);
+
   return context->private_data;
 }
 
@@ -568,6 +784,17 @@ void *fat16_init(struct fuse_conn_info *conn)
  */
 void fat16_destroy(void *data)
 {
+  uring_stop();
+  dircompact_stop();
+  defrag_stop();
+  delalloc_stop();
+  prealloc_stop();
+  reclaim_stop();
+  writeback_stop();
+  readahead_stop();
+  /* 日志写入失败时镜像不是最新的，不能保存索引文件 */
+  if (journal_close(data) == 0 && fat16_opts.sidecar)
+    sidecar_save(data);
   free(data);
 }
 
@@ -615,7 +842,9 @@ int fat16_getattr(const char *path, struct stat *stbuf)
       {
         stbuf->st_mode = S_IFREG | 0755;
       }
-      stbuf->st_size = Dir.DIR_FileSize;
+      DWORD fileSize = Dir.DIR_FileSize;
+      delalloc_lookup(offset_dir, &fileSize, NULL);
+      stbuf->st_size = fileSize;
 
       /* Number of blocks */
       if (stbuf->st_size % stbuf->st_blksize != 0)
@@ -674,6 +903,7 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
      * 注意不需要遍历子目录
      **/
     // Hint: 读取根文件目录区域所在的第一个扇区
+    dirlock_lock(0, 0);
     sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum, sector_buffer);
     // Hint: 依次读取根目录中每个目录项，目录项的最大条数是RootEntCnt
     for (uint i = 1; i <= fat16_ins->Bpb.BPB_RootEntCnt; i++)
@@ -705,6 +935,7 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
         RootDirCnt++;
       }
     }
+    dirlock_unlock(0);
   }
   else // 要查询的目录不是根目录
   {
@@ -728,6 +959,9 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
     WORD FirstSectorofCluster; // 该簇的第一个扇区号
 
     ClusterN = Dir.DIR_FstClusLO; //目录项中存储了我们要读取的第一个簇的簇号
+    WORD DirCluster = ClusterN;
+    dirlock_lock(DirCluster, 0); // 持有目录的读锁，列出的目录项不会被同时创建或删除
+    readahead_dir(fat16_ins, ClusterN);
     first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
 
     /* Start searching the root's sub-directories starting from Dir */
@@ -769,7 +1003,7 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
           // 已经到达最后一个簇（0xFFFF代表什么？请参考文档中对FAT表项的说明）
           if (FatClusEntryVal == 0xffff)
           {
-            return 0;
+            break;
           }
 
           // TODO: 读取下一个簇（即簇号为FatClusEntryVal的簇）的第一个扇区
@@ -786,10 +1020,115 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
         }
       }
     }
+    dirlock_unlock(DirCluster);
   }
   return 0;
 }
 
+/**
+ * @brief 将文件中[offset, offset + size)的范围映射为镜像文件中的若干段连续区域。
+ *        簇号相邻的簇在镜像文件中也相邻，会被合并为同一段。
+ *
+ * @param fat16_ins     文件系统元数据指针
+ * @param firstCluster  文件的首簇簇号
+ * @param offset        文件内的起始偏移量（字节）
+ * @param size          需要映射的长度（字节），调用者需保证该范围已经分配了簇
+ * @param extents_ret   输出参数，malloc分配的段数组，由调用者free
+ * @return int          段的个数，簇链损坏时返回-EIO
+ */
+int file_extent_map(FAT16 *fat16_ins, WORD firstCluster, off_t offset, size_t size, FAT16_EXTENT **extents_ret)
+{
+  DWORD ClusterSize = fat16_ins->ClusterSize;
+  off_t clusterOffset = offset % ClusterSize;
+  size_t maxExtents = (clusterOffset + size + ClusterSize - 1) / ClusterSize;
+  FAT16_EXTENT *extents = malloc((maxExtents > 0 ? maxExtents : 1) * sizeof(FAT16_EXTENT));
+  int extentCnt = 0;
+
+  /* 沿簇链找到offset所在的簇 */
+  WORD ClusterN = firstCluster;
+  for (off_t skip = offset / ClusterSize; skip > 0; skip--)
+  {
+    if (!is_cluster_inuse(ClusterN))
+    {
+      free(extents);
+      return -EIO;
+    }
+    ClusterN = fat_entry_by_cluster(fat16_ins, ClusterN);
+  }
+
+  while (size > 0)
+  {
+    if (!is_cluster_inuse(ClusterN))
+    {
+      free(extents);
+      return -EIO;
+    }
+    size_t len = ClusterSize - clusterOffset;
+    if (len > size)
+      len = size;
+    long pos = get_cluster_offset(fat16_ins, ClusterN) + clusterOffset;
+
+    /* 与上一段在镜像文件中首尾相接，则合并 */
+    if (extentCnt > 0 && extents[extentCnt - 1].offset + extents[extentCnt - 1].size == pos)
+    {
+      extents[extentCnt - 1].size += len;
+    }
+    else
+    {
+      extents[extentCnt].offset = pos;
+      extents[extentCnt].size = len;
+      extentCnt++;
+    }
+
+    size -= len;
+    clusterOffset = 0;
+    if (size > 0)
+      ClusterN = fat_entry_by_cluster(fat16_ins, ClusterN);
+  }
+
+  *extents_ret = extents;
+  return extentCnt;
+}
+
+/**
+ * @brief 读取首簇为firstCluster的文件中[offset, offset + size)的数据，这部分必须已经分配了簇
+ *
+ * @param fat16_ins     文件系统实例
+ * @param firstCluster  文件的首簇
+ * @param buffer        结果缓冲区
+ * @param offset        要读取的数据所在偏移量
+ * @param size          需要读取的数据长度
+ * @return size_t       实际读取的字节数
+ */
+static size_t file_read_range(FAT16 *fat16_ins, WORD firstCluster, void *buffer, off_t offset, size_t size)
+{
+  /* 按连续簇段直接从镜像文件读入FUSE的缓冲区，不再经过中间缓冲 */
+  FAT16_EXTENT *extents;
+  int extentCnt = file_extent_map(fat16_ins, firstCluster, offset, size, &extents);
+  if (extentCnt < 0)
+  {
+    return 0;
+  }
+  size_t done = 0;
+  if (fat16_opts.writeback || fat16_opts.readahead)
+  {
+    for (int i = 0; i < extentCnt; i++)
+    {
+      size_t ret = writeback_read(fat16_ins, (BYTE *)buffer + done, extents[i].offset, extents[i].size);
+      done += ret;
+      if (ret != extents[i].size)
+        break;
+    }
+  }
+  else
+  {
+    /* 没有缓存时，不连续的各段作为一次提交读取 */
+    done = io_read_extents(fat16_ins->fd, buffer, extents, extentCnt);
+  }
+  free(extents);
+  return done;
+}
+
 /**
  * @brief 从path对应的文件的offset字节处开始读取size字节的数据到buffer中，并返回实际读取的字节数。
  * Hint: 文件大小属性是Dir.DIR_FileSize。
@@ -798,7 +1137,7 @@ int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
  * @param buffer  结果缓冲区
  * @param size    需要读取的数据长度
  * @param offset  要读取的数据所在偏移量
- * @param fi      忽略
+ * @param fi      fi->fh为fat16_open分配的顺序读状态，可以为NULL
  * @return int    成功返回实际读写的字符数，失败返回0。
  */
 int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
@@ -829,42 +1168,143 @@ int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
    **/
 
   /*** BEGIN ***/
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  BYTE all_sector_buffer[10000 * BYTES_PER_SECTOR] = {0};
   DIR_ENTRY Dir;
   off_t offset_dir;
-  find_root(fat16_ins, &Dir, path, &offset_dir);
-  WORD ClusterN;             // 当前读取的簇号
-  WORD FatClusEntryVal;      // 该簇的FAT表项（大部分情况下，代表下一个簇的簇号，请参考实验文档对FAT表项的说明）
-  WORD FirstSectorofCluster; // 该簇的第一个扇区号
-
-  int FileSecCnt = 1;
-  ClusterN = Dir.DIR_FstClusLO; //目录项中存储了我们要读取的第一个簇的簇号
-  first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-  for (int i = 0; i < 10000; i++)
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) != 0)
   {
-    memcpy(&all_sector_buffer[i * BYTES_PER_SECTOR], sector_buffer, BYTES_PER_SECTOR);
-    if (FileSecCnt < fat16_ins->Bpb.BPB_SecPerClus)
-    {
-      sector_read(fat16_ins->fd, FirstSectorofCluster + FileSecCnt, sector_buffer);
-      FileSecCnt++;
-    }
-    else
+    return 0;
+  }
+  iosched_set_stream(offset_dir);
+  DWORD fileSize = Dir.DIR_FileSize, pendingBase;
+  int pending = delalloc_lookup(offset_dir, &fileSize, &pendingBase);
+  if (offset >= fileSize)
+  {
+    return 0;
+  }
+  if (offset + size > fileSize)
+  {
+    size = fileSize - offset;
+  }
+
+  /* 尚未分配簇的部分从延迟分配的待分配区读取 */
+  size_t mapped = size;
+  if (pending && offset + size > pendingBase)
+  {
+    off_t pendingStart = offset > pendingBase ? offset : pendingBase;
+    if (delalloc_read(offset_dir, buffer + (pendingStart - offset), pendingStart, offset + size - pendingStart) == 0)
+      mapped = pendingStart - offset;
+  }
+
+  /* 小文件第一次读取时整个读入缓存，之后直接从缓存复制 */
+  if (!pending && fat16_opts.smallfile_cache && fileSize <= (DWORD)fat16_opts.smallfile_max << 10)
+  {
+    DWORD gen;
+    if (sfcache_lookup(Dir.DIR_FstClusLO, fileSize, buffer, offset, size, &gen))
+      return size;
+    BYTE *whole = malloc(fileSize);
+    if (file_read_range(fat16_ins, Dir.DIR_FstClusLO, whole, 0, fileSize) == fileSize)
     {
-      if (FatClusEntryVal == 0xffff)
-      {
-        memcpy(buffer, &all_sector_buffer[offset], size);
-        return size;
-      }
-      ClusterN = FatClusEntryVal;
-      first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-      FileSecCnt = 1;
+      sfcache_insert(Dir.DIR_FstClusLO, gen, whole, fileSize);
+      memcpy(buffer, whole + offset, size);
+      free(whole);
+      return size;
     }
+    free(whole);
   }
+
+  /* 顺序读时在读取之前提交之后的预读，与本次读取并行 */
+  readahead_note(fat16_ins, fi != NULL ? fi->fh : 0, offset_dir, Dir.DIR_FstClusLO, pending ? pendingBase : fileSize, offset, size);
+
+  size_t done = file_read_range(fat16_ins, Dir.DIR_FstClusLO, buffer, offset, mapped);
+  return done == mapped ? size : done;
   /*** END ***/
   return 0;
 }
 
+/**
+ * @brief fat16_read的零拷贝版本。不读取数据，而是返回一组指向镜像文件的缓冲区描述，
+ *        每段连续的簇对应一个FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK的缓冲区，
+ *        由libfuse通过splice将数据直接从镜像文件送入内核。
+ *
+ * @param path    要读取文件的路径
+ * @param bufp    输出参数，malloc分配的fuse_bufvec，由libfuse负责释放
+ * @param size    需要读取的数据长度
+ * @param offset  要读取的数据所在偏移量
+ * @param fi      忽略
+ * @return int    成功返回0，失败返回POSIX错误代码的负值
+ */
+int fat16_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = get_fat16_ins();
+  struct fuse_bufvec *src;
+
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) != 0)
+  {
+    return -ENOENT;
+  }
+
+  /* 有待分配数据时不能直接splice镜像文件，开启预读时数据在预读缓存中，O_DIRECT的镜像不能splice，
+   * 可以使用小文件缓存时也要经过fat16_read，都改为复制到内存缓冲区 */
+  DWORD fileSize = Dir.DIR_FileSize;
+  if (delalloc_lookup(offset_dir, &fileSize, NULL) || fat16_opts.readahead || io_direct_enabled() ||
+      (fat16_opts.smallfile_cache && fileSize <= (DWORD)fat16_opts.smallfile_max << 10))
+  {
+    src = malloc(sizeof(struct fuse_bufvec));
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].mem = malloc(size);
+    int res = fat16_read(path, src->buf[0].mem, size, offset, fi);
+    src->buf[0].size = res;
+    *bufp = src;
+    return 0;
+  }
+
+  if (offset >= Dir.DIR_FileSize)
+  {
+    size = 0;
+  }
+  else if (offset + size > Dir.DIR_FileSize)
+  {
+    size = Dir.DIR_FileSize - offset;
+  }
+
+  if (size == 0)
+  {
+    src = malloc(sizeof(struct fuse_bufvec));
+    *src = FUSE_BUFVEC_INIT(0);
+    *bufp = src;
+    return 0;
+  }
+
+  FAT16_EXTENT *extents;
+  int extentCnt = file_extent_map(fat16_ins, Dir.DIR_FstClusLO, offset, size, &extents);
+  if (extentCnt < 0)
+  {
+    return extentCnt;
+  }
+
+  src = malloc(sizeof(struct fuse_bufvec) + (extentCnt - 1) * sizeof(struct fuse_buf));
+  src->count = extentCnt;
+  src->idx = 0;
+  src->off = 0;
+  for (int i = 0; i < extentCnt; i++)
+  {
+    /* 回写缓存中的脏数据要先写回镜像，splice才能读到 */
+    writeback_flush_range(fat16_ins, extents[i].offset, extents[i].size);
+    src->buf[i].size = extents[i].size;
+    src->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[i].mem = NULL;
+    src->buf[i].fd = fileno(fat16_ins->fd);
+    src->buf[i].pos = extents[i].offset;
+  }
+  free(extents);
+
+  *bufp = src;
+  return 0;
+}
+
 // ------------------TASK2: 创建/删除文件-----------------------------------
 /**
  * @brief 在path对应的路径创建新文件
@@ -879,147 +1319,26 @@ int fat16_mknod(const char *path, mode_t mode, dev_t devNum)
   /* Gets volume data supplied in the context during the fat16_init function */
   FAT16 *fat16_ins = get_fat16_ins();
 
-  // 查找需要创建文件的父目录路径
   int pathDepth;
   char **paths = path_split((char *)path, &pathDepth);
-  char *copyPath = strdup(path);
-  const char **orgPaths = (const char **)org_path_split(copyPath);
-  char *prtPath = get_prt_path(path, orgPaths, pathDepth);
-
-  /** TODO:
-   * 查找可用的entry，注意区分根目录和子目录
-   * 下面提供了一些可能使用到的临时变量
-   * 如果觉得不够用，可以自己定义更多的临时变量
-   * 这块和前面有很多相似的地方，注意对照来实现
-   **/
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  DWORD sectorNum;
-  int offset, i, findFlag = 0, RootDirCnt = 1, DirSecCnt = 1;
-  WORD ClusterN, FatClusEntryVal, FirstSectorofCluster;
 
-  /* If parent directory is root */
-  if (strcmp(prtPath, "/") == 0)
-  {
-    /**
-     * 遍历根目录下的目录项
-     * 如果发现有同名文件，则直接中断，findFlag=0
-     * 找到可用的空闲目录项，即0x00位移处为0x00或者0xe5的项, findFlag=1
-     * 并记录对应的sectorNum, offset等可能会用得到的信息
-     **/
-    /*** BEGIN ***/
-    DIR_ENTRY Root;
-    BYTE *path_name = NULL;
-    sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum, sector_buffer);
-    for (uint i = 1; i <= fat16_ins->Bpb.BPB_RootEntCnt; i++)
-    {
-      memcpy(&Root, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-      if ((Root.DIR_Name[0] == 0x00) || (Root.DIR_Name[0] == 0xE5))
-      {
-        sectorNum = fat16_ins->FirstRootDirSecNum + RootDirCnt - 1;
-        offset = ((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR;
-        findFlag = 1;
-        break;
-      }
-      if (!(Root.DIR_Name[0] == 0x00) && !(Root.DIR_Name[0] == 0xE5))
-      {
-        if (Root.DIR_Attr == 0x10 || Root.DIR_Attr == 0x20)
-        {
-          path_name = path_decode(Root.DIR_Name);
-          if (strcmp((const char *)path_name, orgPaths[pathDepth - 1]) == 0)
-          {
-            findFlag = 0;
-            break;
-          }
-        }
-      }
-      if (i % 16 == 0 && i != fat16_ins->Bpb.BPB_RootEntCnt)
-      {
-        sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum + RootDirCnt, sector_buffer);
-        RootDirCnt++;
-      }
-    }
-    /*** END ***/
-  }
-  /* Else if parent directory is sub-directory */
-  else
+  /* 内核在调用mknod之前已经查找过path（lookup），不会有同名文件，
+   * 这里只需要在父目录中取得一个空闲目录项，子目录满了会自动扩展。
+   * 持有父目录的写锁，同一目录中的创建不会取得同一个目录项 */
+  int parent = dirlock_lock_parent(fat16_ins, path, 1);
+  if (parent < 0)
   {
-    /*** BEGIN ***/
-    DIR_ENTRY Dir;
-    off_t offset_dir;
-    BYTE *path_name = NULL;
-    int pathDepth;
-    char **paths = path_split((char *)path, &pathDepth);
-    char *copyPath = strdup(path);
-    const char **orgPaths = (const char **)org_path_split(copyPath);
-    char *prtPath = get_prt_path(path, orgPaths, pathDepth);
-    find_root(fat16_ins, &Dir, prtPath, &offset_dir);
-
-    /* Calculating the first cluster sector for the given path */
-    WORD ClusterN;             // 当前读取的簇号
-    WORD FatClusEntryVal;      // 该簇的FAT表项（大部分情况下，代表下一个簇的簇号，请参考实验文档对FAT表项的说明）
-    WORD FirstSectorofCluster; // 该簇的第一个扇区号
-
-    ClusterN = Dir.DIR_FstClusLO; //目录项中存储了我们要读取的第一个簇的簇号
-    first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-
-    /* Start searching the root's sub-directories starting from Dir */
-    for (uint i = 1; i < BYTES_PER_SECTOR / BYTES_PER_DIR - 1; i++)
-    {
-      memcpy(&Dir, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-      if (Dir.DIR_Name[0] == 0x00 || Dir.DIR_Name[0] == 0xe5)
-      {
-        sectorNum = FirstSectorofCluster + DirSecCnt - 1;
-        offset = ((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR;
-        findFlag = 1;
-        break;
-      }
-      if (!(Dir.DIR_Name[0] == 0x00) && !(Dir.DIR_Name[0] == 0xE5))
-      {
-        if (Dir.DIR_Attr == 0x10 || Dir.DIR_Attr == 0x20)
-        {
-          path_name = path_decode(Dir.DIR_Name);
-          if (strcmp((const char *)path_name, orgPaths[pathDepth - 1]) == 0)
-          {
-            findFlag = 0;
-            break;
-          }
-        }
-      }
-      // 当前扇区的所有目录项已经读完。
-      if (i % 16 == 0)
-      {
-        // 如果当前簇还有未读的扇区
-        if (DirSecCnt < fat16_ins->Bpb.BPB_SecPerClus)
-        {
-          sector_read(fat16_ins->fd, FirstSectorofCluster + DirSecCnt, sector_buffer);
-          DirSecCnt++;
-        }
-        else // 当前簇已经读完，需要读取下一个簇的内容
-        {
-          if (FatClusEntryVal == 0xffff)
-          {
-            return 0;
-          }
-          ClusterN = FatClusEntryVal;
-          first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-          i = 0;
-          DirSecCnt = 1;
-        }
-      }
-    }
-
-    /*** END ***/
+    return parent;
   }
-
-  //没有同名文件，且找到空闲表项时，调用函数创建目录项
-  /* Add the DIR ENTRY */
-  if (findFlag == 1)
+  off_t slot;
+  int ret = dir_alloc_slot(fat16_ins, parent, &slot);
+  if (ret < 0)
   {
-    // TODO: 正确调用dir_entry_create创建目录项
-    /*** BEGIN ***/
-    dir_entry_create(fat16_ins, sectorNum, offset, paths[pathDepth - 1], 0x20, 0xffff, 0);
-    /*** END ***/
+    dirlock_unlock(parent);
+    return ret;
   }
+  dir_entry_create(fat16_ins, slot / BYTES_PER_SECTOR, slot % BYTES_PER_SECTOR, paths[pathDepth - 1], 0x20, 0xffff, 0);
+  dirlock_unlock(parent);
   return 0;
 }
 
@@ -1093,9 +1412,11 @@ int dir_entry_create(FAT16 *fat16_ins, int sectorNum, int offset, char *Name, BY
   /* Write the above entry to specified location */
   /*** BEGIN ***/
   BYTE sector_buffer[BYTES_PER_SECTOR];
+  dirlock_sector_lock(sectorNum);
   sector_read(fat16_ins->fd, sectorNum, sector_buffer);
   memcpy(sector_buffer + offset, entry_info, BYTES_PER_DIR);
   sector_write(fat16_ins->fd, sectorNum, sector_buffer);
+  dirlock_sector_unlock(sectorNum);
   /*** END ***/
   free(entry_info);
   return 0;
@@ -1110,11 +1431,6 @@ int dir_entry_create(FAT16 *fat16_ins, int sectorNum, int offset, char *Name, BY
  */
 int free_cluster(FAT16 *fat16_ins, int ClusterNum)
 {
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  // WORD FATClusEntryval, FirstSectorofCluster;
-  // first_sector_by_cluster(fat16_ins, ClusterNum, &FATClusEntryval, &FirstSectorofCluster, sector_buffer);
-
-  FILE *fd = fat16_ins->fd;
   /** TODO:
    * 修改FAT表
    * 注意两个表都要修改
@@ -1122,24 +1438,16 @@ int free_cluster(FAT16 *fat16_ins, int ClusterNum)
    * 每个表项为2个字节
    **/
   /*** BEGIN ***/
-  uint FirstFatSecNum; // 第一个FAT表开始的扇区号
   uint ClusterOffset;  // clusterN这个簇对应的表项，在每个FAT表项的哪个偏移量
   uint ClusterSec;     // clusterN这个簇对应的表项，在每个FAT表中的第几个扇区（Hint: 这个值与ClusterSec的关系是？）
-  uint SecOffset;      // clusterN这个簇对应的表项，在所在扇区的哪个偏移量（Hint: 这个值与ClusterSec的关系是？）
-  FirstFatSecNum = fat16_ins->Bpb.BPB_RsvdSecCnt;
-  BYTE SectorBuffer[BYTES_PER_SECTOR];
   // Hint: 对系统中每个FAT表都进行写入
   ClusterOffset = ClusterNum * 2;
   ClusterSec = ClusterOffset / fat16_ins->Bpb.BPB_BytsPerSec;
-  SecOffset = ClusterOffset % fat16_ins->Bpb.BPB_BytsPerSec;
-  uint sec_num = FirstFatSecNum + ClusterSec;
-  sector_read(fat16_ins->fd, sec_num, SectorBuffer);
-  int FATClusEntryval;
-  memcpy( &FATClusEntryval,SectorBuffer + SecOffset, sizeof(WORD));
-  SectorBuffer[SecOffset] = 0;
-  SectorBuffer[SecOffset + 1] = 0;
-  for (uint i = 0; i < fat16_ins->Bpb.BPB_NumFATS; i++)
-    sector_write(fat16_ins->fd, sec_num + i * fat16_ins->FatSize / BYTES_PER_SECTOR, SectorBuffer);
+  pthread_mutex_lock(&fat16_ins->FatLock);
+  WORD FATClusEntryval = fat16_ins->FatCache[ClusterNum];
+  fat_cache_set(fat16_ins, ClusterNum, CLUSTER_FREE);
+  fat_cache_flush_sector(fat16_ins, ClusterSec);
+  pthread_mutex_unlock(&fat16_ins->FatLock);
   /*** END ***/
 
   return FATClusEntryval;
@@ -1156,11 +1464,19 @@ int fat16_unlink(const char *path)
   /* Gets volume data supplied in the context during the fat16_init function */
   FAT16 *fat16_ins = get_fat16_ins();
 
+  /* 持有父目录的写锁，删除目录项与同一目录中的创建互斥 */
+  int parent = dirlock_lock_parent(fat16_ins, path, 1);
+  if (parent < 0)
+  {
+    return parent;
+  }
+
   DIR_ENTRY Dir;
   off_t offset_dir;
   //释放使用过的簇
   if (find_root(fat16_ins, &Dir, path, &offset_dir) == 1)
   {
+    dirlock_unlock(parent);
     return 1;
   }
 
@@ -1170,150 +1486,80 @@ int fat16_unlink(const char *path)
    * 在完善了free_cluster函数后，此处代码量很小
    * 你也可以不使用free_cluster函数，通过自己的方式实现 */
   /*** BEGIN ***/
-  for (WORD cur_cluster = Dir.DIR_FstClusLO; cur_cluster != 0xFFFF;)
-  {
-    cur_cluster = free_cluster(fat16_ins, cur_cluster);
-  }
+  /* 尚未分配簇的待分配数据直接丢弃，缓存的簇链末尾也不再有效 */
+  delalloc_discard(offset_dir);
+  prealloc_forget(offset_dir);
+  readahead_forget(offset_dir);
+  kcache_forget(offset_dir);
+
+  /* 延迟释放模式下，删除目录项之后再将簇链加入待回收队列（见函数末尾） */
+  WORD first_cluster = Dir.DIR_FstClusLO;
+  int deferred = fat16_opts.deferred_free && is_cluster_inuse(first_cluster);
+  if (!deferred)
+    free_chain(fat16_ins, first_cluster);
 
   /*** END ***/
   
-  // 查找需要删除文件的父目录路径
-  int pathDepth;
-  char **paths = path_split((char *)path, &pathDepth);
-  char *copyPath = strdup(path);
-  const char **orgPaths = (const char **)org_path_split(copyPath);
-  char *prtPath = get_prt_path(path, orgPaths, pathDepth);
-
-  /** TODO:
-   * 定位文件在父目录中的entry，注意区分根目录和子目录
-   * 下面提供了一些可能使用到的临时变量
-   * 如果觉得不够用，可以自己定义更多的临时变量
-   * 这块和前面有很多相似的地方，注意对照来实现
-   * 流程类似，大量代码都和mknode一样，注意复用
-   **/
+  /* find_root已经给出了目录项的位置（父目录可以跨越多个簇），直接将其标记为已删除（0xE5） */
+  dir_entry_delete(fat16_ins, offset_dir);
+
+  // 被删除的目录项可以被之后的创建重新利用
+  dir_slot_freed(fat16_ins, parent, offset_dir);
+  dircompact_note(parent);
+  dirlock_unlock(parent);
+  sfcache_invalidate(first_cluster);
+
+  /* 与删除目录项处于同一个事务，提交后才会被后台线程回收 */
+  if (deferred)
+    journal_log_orphan(first_cluster, 1);
+  return 0;
+}
 
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  DWORD sectorNum;
-  int offset, i, findFlag = 0, RootDirCnt = 1, DirSecCnt = 1;
-  WORD FatClusEntryVal, FirstSectorofCluster;
+/**
+ * @brief 将文件数据和元数据刷入磁盘。延迟分配的数据在此时分配簇，回写缓存中的脏数据同步写回，最后强制提交日志中的复合事务。
+ *
+ * @param path      文件路径
+ * @param datasync  非0时只需同步数据
+ * @param fi        忽略
+ * @return int      成功返回0，失败返回POSIX错误代码的负值
+ */
+int fat16_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = get_fat16_ins();
 
-  /* If parent directory is root */
-  if (strcmp(prtPath, "/") == 0)
+  /* 先为延迟分配的数据分配簇 */
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) == 0)
   {
-    /**
-     * 遍历根目录下的目录项
-     * 查找是否有相同文件名的文件
-     * 存在则findFlag=1
-     * 并记录对应的sectorNum, offset等可能会用得到的信息
-     **/
-    /*** BEGIN ***/
-    DIR_ENTRY Root;
-    BYTE *path_name = NULL;
-    sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum, sector_buffer);
-    for (uint i = 1; i <= fat16_ins->Bpb.BPB_RootEntCnt; i++)
-    {
-      memcpy(&Root, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-      if (!(Root.DIR_Name[0] == 0x00) && !(Root.DIR_Name[0] == 0xE5))
-      {
-        if (Root.DIR_Attr == 0x10 || Root.DIR_Attr == 0x20)
-        {
-          path_name = path_decode(Root.DIR_Name);
-          if (strcmp((const char *)path_name, orgPaths[pathDepth - 1]) == 0)
-          {
-            sectorNum = fat16_ins->FirstRootDirSecNum + RootDirCnt - 1;
-            offset = ((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR;
-            findFlag = 1;
-            break;
-          }
-        }
-      }
-      if (i % 16 == 0 && i != fat16_ins->Bpb.BPB_RootEntCnt)
-      {
-        sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum + RootDirCnt, sector_buffer);
-        RootDirCnt++;
-      }
-    }
-    /*** END ***/
+    int ret = delalloc_flush_file(offset_dir);
+    if (ret < 0)
+      return ret;
   }
-  else /* Else if parent directory is sub-directory */
-  {
-    /*** BEGIN ***/
-    DIR_ENTRY Dir;
-    off_t offset_dir;
-    BYTE *path_name = NULL;
-    int pathDepth;
-    char **paths = path_split((char *)path, &pathDepth);
-    char *copyPath = strdup(path);
-    const char **orgPaths = (const char **)org_path_split(copyPath);
-    char *prtPath = get_prt_path(path, orgPaths, pathDepth);
-    find_root(fat16_ins, &Dir, prtPath, &offset_dir);
-
-    /* Calculating the first cluster sector for the given path */
-    WORD ClusterN;             // 当前读取的簇号
-    WORD FatClusEntryVal;      // 该簇的FAT表项（大部分情况下，代表下一个簇的簇号，请参考实验文档对FAT表项的说明）
-    WORD FirstSectorofCluster; // 该簇的第一个扇区号
-
-    ClusterN = Dir.DIR_FstClusLO; //目录项中存储了我们要读取的第一个簇的簇号
-    first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
+  int ret = writeback_sync();
+  if (ret < 0)
+    return ret;
+  /* 数据写出之后，提交还在等待其它事务的复合事务，文件的大小和簇链才持久化 */
+  return journal_sync();
+}
 
-    /* Start searching the root's sub-directories starting from Dir */
-    for (uint i = 1; i < BYTES_PER_SECTOR / BYTES_PER_DIR - 1; i++)
-    {
-      memcpy(&Dir, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-      if (!(Dir.DIR_Name[0] == 0x00) && !(Dir.DIR_Name[0] == 0xE5))
-      {
-        if (Dir.DIR_Attr == 0x10 || Dir.DIR_Attr == 0x20)
-        {
-          path_name = path_decode(Dir.DIR_Name);
-          if (strcmp((const char *)path_name, orgPaths[pathDepth - 1]) == 0)
-          {
-            sectorNum = FirstSectorofCluster + DirSecCnt - 1;
-            offset = ((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR;
-            findFlag = 1;
-            break;
-          }
-        }
-      }
-      // 当前扇区的所有目录项已经读完。
-      if (i % 16 == 0)
-      {
-        // 如果当前簇还有未读的扇区
-        if (DirSecCnt < fat16_ins->Bpb.BPB_SecPerClus)
-        {
-          sector_read(fat16_ins->fd, FirstSectorofCluster + DirSecCnt, sector_buffer);
-          DirSecCnt++;
-        }
-        else // 当前簇已经读完，需要读取下一个簇的内容
-        {
-          if (FatClusEntryVal == 0xffff)
-          {
-            return 0;
-          }
-          ClusterN = FatClusEntryVal;
-          first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-          i = 0;
-          DirSecCnt = 1;
-        }
-      }
-    }
-    /*** END ***/
-  }
+/**
+ * @brief 文件的最后一个文件描述符关闭时调用，释放追加写入时未用完的预分配簇和文件句柄的顺序读状态。
+ *
+ * @param path  文件路径
+ * @param fi    fi->fh为fat16_open分配的顺序读状态
+ * @return int  总是返回0
+ */
+int fat16_release(const char *path, struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = get_fat16_ins();
 
-  /** TODO:
-   * 删除文件，对相应entry做标记
-   * 思考要修改entry中的哪些域
-   * 注意目录项被删除时的标记为曾被使用但目前已删除
-   * 和一个完全没用过的目录项的标记是不一样的
-   **/
-  /* Update file entry, change its first byte of file name to 0xe5 */
-  if (findFlag == 1)
-  {
-    /*** BEGIN ***/
-    char *new_name = strdup(paths[pathDepth - 1]);
-    new_name[0] = 0xE5;
-    dir_entry_create(fat16_ins, sectorNum, offset, new_name, 0x20, 0xffff, 0);
-    /*** END ***/
-  }
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) == 0)
+    prealloc_release(offset_dir);
+  if (fi != NULL)
+    readahead_release(fi->fh);
   return 0;
 }
 
@@ -1328,37 +1574,3 @@ int fat16_utimens(const char *path, const struct timespec tv[2])
 {
   return 0;
 }
-
-struct fuse_operations fat16_oper = {
-    .init = fat16_init,
-    .destroy = fat16_destroy,
-    .getattr = fat16_getattr,
-
-    // TASK1: tree [dir] / ls [dir] ; cat [file] / tail [file] / head [file]
-    .readdir = fat16_readdir,
-    .read = fat16_read,
-
-    // TASK2: touch [file]; rm [file]
-    .mknod = fat16_mknod,
-    .unlink = fat16_unlink,
-    .utimens = fat16_utimens,
-
-    // TASK3: mkdir [dir] ; rm -r [dir]
-    .mkdir = fat16_mkdir,
-    .rmdir = fat16_rmdir,
-
-    // TASK4: echo "hello world!" > [file] ;  echo "hello world!" >> [file]
-    .write = fat16_write,
-    .truncate = fat16_truncate};
-
-int main(int argc, char *argv[])
-{
-  int ret;
-
-  /* Starting a pre-initialization of the FAT16 volume */
-  FAT16 *fat16_ins = pre_init_fat16(FAT_FILE_NAME);
-
-  ret = fuse_main(argc, argv, &fat16_oper, fat16_ins);
-
-  return ret;
-}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <linux/falloc.h>
 
 #include "fat16.h"
 
@@ -55,32 +56,99 @@ int is_cluster_inuse(uint16_t cluster_num)
 int write_fat_entry(FAT16 *fat16_ins, WORD clusterN, WORD data)
 {
   // Hint: 这个函数逻辑与fat_entry_by_cluster函数类似，但这个函数需要修改对应值并写回FAT表中
-  BYTE SectorBuffer[BYTES_PER_SECTOR];
   /** TODO: 计算下列值，当然，你也可以不使用这些变量*/
-  uint FirstFatSecNum; // 第一个FAT表开始的扇区号
   uint ClusterOffset;  // clusterN这个簇对应的表项，在每个FAT表项的哪个偏移量
   uint ClusterSec;     // clusterN这个簇对应的表项，在每个FAT表中的第几个扇区（Hint: 这个值与ClusterSec的关系是？）
-  uint SecOffset;      // clusterN这个簇对应的表项，在所在扇区的哪个偏移量（Hint: 这个值与ClusterSec的关系是？）
   /*** BEGIN ***/
-  FirstFatSecNum = fat16_ins->Bpb.BPB_RsvdSecCnt;
   ClusterOffset = clusterN * 2;
   ClusterSec = ClusterOffset / fat16_ins->Bpb.BPB_BytsPerSec;
-  SecOffset = ClusterOffset % fat16_ins->Bpb.BPB_BytsPerSec;
   /*** END ***/
   // Hint: 对系统中每个FAT表都进行写入
 
   /*** BEGIN ***/
   // Hint: 计算出当前要写入的FAT表扇区号
   // Hint: 读扇区，在正确偏移量将值修改为data，写回扇区
-  uint sec_num = FirstFatSecNum + ClusterSec;
-  sector_read(fat16_ins->fd, sec_num, SectorBuffer);
-  memcpy(SectorBuffer + SecOffset, &data, sizeof(WORD));
-  for (uint i = 0; i < fat16_ins->Bpb.BPB_NumFATS; i++)
+  // 先修改内存中的FAT镜像，再把所在扇区写入每个FAT表
+  pthread_mutex_lock(&fat16_ins->FatLock);
+  fat_cache_set(fat16_ins, clusterN, data);
+  fat_cache_flush_sector(fat16_ins, ClusterSec);
+  pthread_mutex_unlock(&fat16_ins->FatLock);
+  /*** END ***/
+  return 0;
+}
+
+static int cluster_cmp(const void *a, const void *b)
+{
+  return (int)*(const WORD *)a - (int)*(const WORD *)b;
+}
+
+/**
+ * @brief 释放从first开始的簇链的前max个簇。先沿簇链收集簇号，在FAT镜像中清零，
+ *        再按所在的FAT扇区分组，每个被涉及的FAT扇区对每个FAT表只写一次。
+ *        相比逐簇调用free_cluster，开销与涉及的FAT扇区数成正比，而不是与簇数成正比。
+ *
+ * @param fat16_ins 文件系统指针
+ * @param first     簇链的第一个簇号，不是合法数据簇号时什么都不做
+ * @param max       最多释放的簇数
+ * @param rest      输出参数，可以为NULL，设置为未释放部分的第一个簇号（整条链都已释放时为CLUSTER_END）
+ * @return int      释放的簇的个数
+ */
+int free_chain_partial(FAT16 *fat16_ins, WORD first, uint max, WORD *rest)
+{
+  uint BytsPerSec = fat16_ins->Bpb.BPB_BytsPerSec;
+  uint maxClusters = fat16_ins->ClusterCount;
+  if (max < maxClusters)
+    maxClusters = max;
+
+  uint count = 0, capacity = 64;
+  WORD *clusters = malloc(capacity * sizeof(WORD));
+
+  pthread_mutex_lock(&fat16_ins->FatLock);
+
+  /* 沿簇链收集簇号，同时在镜像中清零 */
+  WORD cur;
+  for (cur = first; is_cluster_inuse(cur) && count < maxClusters;)
   {
-    sector_write(fat16_ins->fd, sec_num + i * fat16_ins->FatSize / BYTES_PER_SECTOR, SectorBuffer);
-    /*** END ***/
+    if (count == capacity)
+    {
+      capacity *= 2;
+      clusters = realloc(clusters, capacity * sizeof(WORD));
+    }
+    clusters[count++] = cur;
+
+    WORD next = fat16_ins->FatCache[cur];
+    fat_cache_set(fat16_ins, cur, CLUSTER_FREE);
+    writeback_discard(cur);
+    cur = next;
   }
-  return 0;
+
+  /* 按簇号排序后，同一个FAT扇区中的表项相邻，每个扇区只写回一次 */
+  qsort(clusters, count, sizeof(WORD), cluster_cmp);
+  for (uint i = 0; i < count;)
+  {
+    uint ClusterSec = clusters[i] * 2 / BytsPerSec;
+    fat_cache_flush_sector(fat16_ins, ClusterSec);
+    while (i < count && clusters[i] * 2 / BytsPerSec == ClusterSec)
+      i++;
+  }
+
+  pthread_mutex_unlock(&fat16_ins->FatLock);
+  free(clusters);
+  if (rest != NULL)
+    *rest = is_cluster_inuse(cur) ? cur : CLUSTER_END;
+  return count;
+}
+
+/**
+ * @brief 释放从first开始的整条簇链，见free_chain_partial。
+ *
+ * @param fat16_ins 文件系统指针
+ * @param first     簇链的第一个簇号
+ * @return int      释放的簇的个数
+ */
+int free_chain(FAT16 *fat16_ins, WORD first)
+{
+  return free_chain_partial(fat16_ins, first, UINT32_MAX, NULL);
 }
 
 /**
@@ -91,43 +159,46 @@ int write_fat_entry(FAT16 *fat16_ins, WORD clusterN, WORD data)
  * @return WORD 分配的第一个簇，分配失败，将返回CLUSTER_END，若n==0，也将返回CLUSTER_END。
  */
 WORD alloc_clusters(FAT16 *fat16_ins, uint32_t n)
+{
+  return alloc_clusters_near(fat16_ins, n, 0);
+}
+
+/**
+ * @brief 同alloc_clusters，但优先从goal开始连续分配，其次选择能容纳n个簇的最短空闲段，
+ *        见fat16_alloc.c中的alloc_find_clusters。
+ * @param fat16_ins 文件系统指针
+ * @param n         要分配簇的个数
+ * @param goal      希望分配的第一个簇号，如文件当前最后一个簇的下一个簇；为0时不指定
+ * @return WORD 分配的第一个簇，分配失败，将返回CLUSTER_END，若n==0，也将返回CLUSTER_END。
+ */
+WORD alloc_clusters_near(FAT16 *fat16_ins, uint32_t n, WORD goal)
 {
   if (n == 0)
     return CLUSTER_END;
 
   // Hint: 用于保存找到的n个空闲簇，另外在末尾加上CLUSTER_END，共n+1个簇号
   WORD *clusters = malloc((n + 1) * sizeof(WORD));
-  uint allocated = 0; // 已找到的空闲簇个数
 
-  /** TODO: 扫描FAT表，找到n个空闲的簇，存入cluster数组。注意此时不需要修改对应的FAT表项 **/
-  /*** BEGIN ***/
-  uint FirstFatSecNum; // 第一个FAT表开始的扇区号
-  uint ClusterOffset;  // clusterN这个簇对应的表项，在每个FAT表项的哪个偏移量
-  uint ClusterSec;     // clusterN这个簇对应的表项，在每个FAT表中的第几个扇区（Hint: 这个值与ClusterSec的关系是？）
-  uint SecOffset;      // clusterN这个簇对应的表项，在所在扇区的哪个偏移量（Hint: 这个值与ClusterSec的关系是？）
-  FirstFatSecNum = fat16_ins->Bpb.BPB_RsvdSecCnt;
-  BYTE SectorBuffer[BYTES_PER_SECTOR];
-  // Hint: 对系统中每个FAT表都进行写入
-  for (uint clusterN = 0x04; clusterN < 0xFFEF; clusterN++)
+  /* 扫描和链接期间持有FAT锁（开启alloc_groups时为所在分配组的锁），防止与其它分配或后台回收交错。
+   * 等待后台回收的簇链在释放前仍是链接状态，不会被当作空闲簇。 */
+  uint64_t groups = 0;
+  uint allocated; // 已找到的空闲簇个数
+  if (fat16_opts.alloc_groups)
   {
-    WORD fat_entry = fat_entry_by_cluster(fat16_ins, clusterN);
-    // printf("fat_entry:%d\n", fat_entry);
-    // fflush(stdout);
-    if (fat_entry == 0)
-    {
-      clusters[allocated] = clusterN;
-      allocated++;
-      if (allocated == n)
-      {
-        clusters[allocated] = CLUSTER_END;
-        break;
-      }
-    }
+    allocated = alloc_group_find(fat16_ins, n, goal, clusters, &groups);
+  }
+  else
+  {
+    pthread_mutex_lock(&fat16_ins->FatLock);
+    allocated = alloc_find_clusters(fat16_ins, n, goal, clusters);
   }
-  /*** END ***/
 
   if (allocated != n)
   { // 找不到n个簇，分配失败
+    if (fat16_opts.alloc_groups)
+      alloc_group_unlock(groups);
+    else
+      pthread_mutex_unlock(&fat16_ins->FatLock);
     free(clusters);
     return CLUSTER_END;
   }
@@ -136,12 +207,23 @@ WORD alloc_clusters(FAT16 *fat16_ins, uint32_t n)
   clusters[n] = CLUSTER_END;
   /** TODO: 修改clusters中存储的N个簇对应的FAT表项，将每个簇与下一个簇连接在一起。同时清零每一个新分配的簇。**/
   /*** BEGIN ***/
+  /* 连续分配的簇的表项大多落在同一个FAT扇区中，每个扇区在改完其中的表项后写回一次 */
+  uint BytsPerSec = fat16_ins->Bpb.BPB_BytsPerSec;
   for (uint i = 0; i < n; i++)
   {
     uint clusterN = clusters[i];
     uint nextClusterN = clusters[i + 1];
-    write_fat_entry(fat16_ins, clusterN, nextClusterN);
+    fat_cache_set(fat16_ins, clusterN, nextClusterN);
+    if (i + 1 == n || nextClusterN * 2 / BytsPerSec != clusterN * 2 / BytsPerSec)
+      fat_cache_flush_sector(fat16_ins, clusterN * 2 / BytsPerSec);
+    /* 簇以前可能是目录，撤销日志中的旧目录项，避免重放时覆盖新数据 */
+    journal_revoke((clusterN - 2) * fat16_ins->Bpb.BPB_SecPerClus + fat16_ins->FirstDataSector,
+                   fat16_ins->Bpb.BPB_SecPerClus);
   }
+  if (fat16_opts.alloc_groups)
+    alloc_group_unlock(groups);
+  else
+    pthread_mutex_unlock(&fat16_ins->FatLock);
   /*** END ***/
 
   // 返回首个分配的簇
@@ -164,168 +246,39 @@ int fat16_mkdir(const char *path, mode_t mode)
   /* Gets volume data supplied in the context during the fat16_init function */
   FAT16 *fat16_ins = get_fat16_ins_fix();
 
-  // int findFlag = 0;  // 是否找到空闲的目录项
-  // int sectorNum = 0; // 找到的空闲目录项所在扇区号
-  // int offset = 0;    // 找到的空闲目录项在扇区中的偏移量
-  /** TODO: 模仿mknod，计算出findFlag, sectorNum和offset的值
-   *  你也可以选择不使用这些值，自己定义其它变量。注意本函数前半段和mknod前半段十分类似。
-   **/
-  /*** BEGIN ***/
-  // 查找需要创建文件的父目录路径
   int pathDepth;
   char **paths = path_split((char *)path, &pathDepth);
-  char *copyPath = strdup(path);
-  const char **orgPaths = (const char **)org_path_split(copyPath);
-  char *prtPath = get_prt_path(path, orgPaths, pathDepth);
-
-  /** TODO:
-   * 查找可用的entry，注意区分根目录和子目录
-   * 下面提供了一些可能使用到的临时变量
-   * 如果觉得不够用，可以自己定义更多的临时变量
-   * 这块和前面有很多相似的地方，注意对照来实现
-   **/
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  DWORD sectorNum;
-  int offset, i, findFlag = 0, RootDirCnt = 1, DirSecCnt = 1;
-  WORD ClusterN, FatClusEntryVal, FirstSectorofCluster;
 
-  /* If parent directory is root */
-  if (strcmp(prtPath, "/") == 0)
+  /* 与mknod相同，内核已经确认没有同名文件，持有父目录的写锁 */
+  int parent = dirlock_lock_parent(fat16_ins, path, 1);
+  if (parent < 0)
   {
-    /**
-     * 遍历根目录下的目录项
-     * 如果发现有同名文件，则直接中断，findFlag=0
-     * 找到可用的空闲目录项，即0x00位移处为0x00或者0xe5的项, findFlag=1
-     * 并记录对应的sectorNum, offset等可能会用得到的信息
-     **/
-    /*** BEGIN ***/
-    DIR_ENTRY Root;
-    BYTE *path_name = NULL;
-    sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum, sector_buffer);
-    for (uint i = 1; i <= fat16_ins->Bpb.BPB_RootEntCnt; i++)
-    {
-      memcpy(&Root, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-      if ((Root.DIR_Name[0] == 0x00) || (Root.DIR_Name[0] == 0xE5))
-      {
-        sectorNum = fat16_ins->FirstRootDirSecNum + RootDirCnt - 1;
-        offset = ((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR;
-        findFlag = 1;
-        break;
-      }
-      if (!(Root.DIR_Name[0] == 0x00) && !(Root.DIR_Name[0] == 0xE5))
-      {
-        if (Root.DIR_Attr == 0x10 || Root.DIR_Attr == 0x20)
-        {
-          path_name = path_decode(Root.DIR_Name);
-          if (strcmp((const char *)path_name, orgPaths[pathDepth - 1]) == 0)
-          {
-            findFlag = 0;
-            break;
-          }
-        }
-      }
-      if (i % 16 == 0 && i != fat16_ins->Bpb.BPB_RootEntCnt)
-      {
-        sector_read(fat16_ins->fd, fat16_ins->FirstRootDirSecNum + RootDirCnt, sector_buffer);
-        RootDirCnt++;
-      }
-    }
-    /*** END ***/
+    return parent;
   }
-  /* Else if parent directory is sub-directory */
-  else
-  {
-    /*** BEGIN ***/
-    DIR_ENTRY Dir;
-    off_t offset_dir;
-    BYTE *path_name = NULL;
-    int pathDepth;
-    char **paths = path_split((char *)path, &pathDepth);
-    char *copyPath = strdup(path);
-    const char **orgPaths = (const char **)org_path_split(copyPath);
-    char *prtPath = get_prt_path(path, orgPaths, pathDepth);
-    find_root(fat16_ins, &Dir, prtPath, &offset_dir);
-
-    /* Calculating the first cluster sector for the given path */
-    WORD ClusterN;             // 当前读取的簇号
-    WORD FatClusEntryVal;      // 该簇的FAT表项（大部分情况下，代表下一个簇的簇号，请参考实验文档对FAT表项的说明）
-    WORD FirstSectorofCluster; // 该簇的第一个扇区号
-
-    ClusterN = Dir.DIR_FstClusLO; //目录项中存储了我们要读取的第一个簇的簇号
-    first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-
-    /* Start searching the root's sub-directories starting from Dir */
-    for (uint i = 1; i < BYTES_PER_SECTOR / BYTES_PER_DIR - 1; i++)
-    {
-      memcpy(&Dir, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-      if (Dir.DIR_Name[0] == 0x00 || Dir.DIR_Name[0] == 0xe5)
-      {
-        sectorNum = FirstSectorofCluster + DirSecCnt - 1;
-        offset = ((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR;
-        findFlag = 1;
-        break;
-      }
-      if (!(Dir.DIR_Name[0] == 0x00) && !(Dir.DIR_Name[0] == 0xE5))
-      {
-        if (Dir.DIR_Attr == 0x10 || Dir.DIR_Attr == 0x20)
-        {
-          path_name = path_decode(Dir.DIR_Name);
-          if (strcmp((const char *)path_name, orgPaths[pathDepth - 1]) == 0)
-          {
-            findFlag = 0;
-            break;
-          }
-        }
-      }
-      // 当前扇区的所有目录项已经读完。
-      if (i % 16 == 0)
-      {
-        // 如果当前簇还有未读的扇区
-        if (DirSecCnt < fat16_ins->Bpb.BPB_SecPerClus)
-        {
-          sector_read(fat16_ins->fd, FirstSectorofCluster + DirSecCnt, sector_buffer);
-          DirSecCnt++;
-        }
-        else // 当前簇已经读完，需要读取下一个簇的内容
-        {
-          if (FatClusEntryVal == 0xffff)
-          {
-            return 0;
-          }
-          ClusterN = FatClusEntryVal;
-          first_sector_by_cluster(fat16_ins, ClusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-          i = 0;
-          DirSecCnt = 1;
-        }
-      }
-    }
 
-    /*** END ***/
+  /* 为新目录分配一个清零的簇，并在这个簇中创建"."和".."两个目录项 */
+  WORD dir_first_cluster = alloc_clusters(fat16_ins, 1);
+  if (dir_first_cluster == CLUSTER_END)
+  {
+    dirlock_unlock(parent);
+    return -ENOSPC;
   }
-  /*** END ***/
-
-  /** TODO: 在父目录的目录项中添加新建的目录。
-   *        同时，为新目录分配一个簇，并在这个簇中创建两个目录项，分别指向. 和 .. 。
-   *        目录的文件大小设置为0即可。
-   *  HINT: 使用正确参数调用dir_entry_create来创建上述三个目录项。
-   **/
-  if (findFlag == 1)
+  off_t slot;
+  int ret = dir_alloc_slot(fat16_ins, parent, &slot);
+  if (ret < 0)
   {
-    /*** BEGIN ***/
-    WORD dir_first_cluster = alloc_clusters(fat16_ins, 1);
-    if (dir_first_cluster == CLUSTER_END)
-    {
-      return 0;
-    }
-    dir_entry_create(fat16_ins, sectorNum, offset, paths[pathDepth - 1], 0x10, dir_first_cluster, fat16_ins->ClusterSize);
-    first_sector_by_cluster(fat16_ins, dir_first_cluster, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
+    free_chain(fat16_ins, dir_first_cluster);
+    dirlock_unlock(parent);
+    return ret;
+  }
+  dir_cluster_zero(fat16_ins, dir_first_cluster);
 
-    dir_entry_create(fat16_ins, FirstSectorofCluster, 0, ".", 0x10, 0xFFFF, 0);
-    dir_entry_create(fat16_ins, FirstSectorofCluster, BYTES_PER_DIR, "..", 0x10, 0xFFFF, 0);
+  DWORD FirstSectorofCluster = fat16_ins->FirstDataSector + (dir_first_cluster - 2) * fat16_ins->Bpb.BPB_SecPerClus;
+  dir_entry_create(fat16_ins, FirstSectorofCluster, 0, ".          ", 0x10, dir_first_cluster, 0);
+  dir_entry_create(fat16_ins, FirstSectorofCluster, BYTES_PER_DIR, "..         ", 0x10, parent, 0);
 
-    /*** END ***/
-  }
-  fflush(stdout);
+  dir_entry_create(fat16_ins, slot / BYTES_PER_SECTOR, slot % BYTES_PER_SECTOR, paths[pathDepth - 1], 0x10, dir_first_cluster, fat16_ins->ClusterSize);
+  dirlock_unlock(parent);
   return 0;
 }
 
@@ -342,7 +295,11 @@ void dir_entry_delete(FAT16 *fat16_ins, off_t offset)
    *  HINT: offset对应的扇区号和扇区的偏移量是？只需要读取扇区，修改offset处的一个字节，然后将扇区写回即可。
    */
   /*** BEGIN ***/
-
+  dirlock_sector_lock(offset / BYTES_PER_SECTOR);
+  sector_read(fat16_ins->fd, offset / BYTES_PER_SECTOR, buffer);
+  buffer[offset % BYTES_PER_SECTOR] = 0xe5;
+  sector_write(fat16_ins->fd, offset / BYTES_PER_SECTOR, buffer);
+  dirlock_sector_unlock(offset / BYTES_PER_SECTOR);
   /*** END ***/
 }
 
@@ -358,7 +315,11 @@ void dir_entry_write(FAT16 *fat16_ins, off_t offset, const DIR_ENTRY *Dir)
   BYTE buffer[BYTES_PER_SECTOR];
   // TODO: 修改目录项，和dir_entry_delete完全类似，只是需要将整个Dir写入offset所在的位置。
   /*** BEGIN ***/
-
+  dirlock_sector_lock(offset / BYTES_PER_SECTOR);
+  sector_read(fat16_ins->fd, offset / BYTES_PER_SECTOR, buffer);
+  memcpy(buffer + offset % BYTES_PER_SECTOR, Dir, BYTES_PER_DIR);
+  sector_write(fat16_ins->fd, offset / BYTES_PER_SECTOR, buffer);
+  dirlock_sector_unlock(offset / BYTES_PER_SECTOR);
   /*** END ***/
 }
 
@@ -378,6 +339,16 @@ int fat16_rmdir(const char *path)
     return -EBUSY; // 无法删除根目录，根目录是挂载点（可参考`man 2 rmdir`）
   }
 
+  /* 持有父目录的写锁，再持有目录自己的写锁（先父后子），
+   * 检查目录是否为空与在目录中创建文件互斥 */
+  int parent = dirlock_lock_parent(fat16_ins, path, 1);
+  if (parent < 0)
+  {
+    return parent;
+  }
+  int ret = 0;
+  int child = -1;
+
   DIR_ENTRY Dir;
   DIR_ENTRY curDir;
   off_t offset;
@@ -385,13 +356,17 @@ int fat16_rmdir(const char *path)
 
   if (res != 0)
   {
-    return -ENOENT; // 路径不存在
+    ret = -ENOENT; // 路径不存在
+    goto out;
   }
 
   if (Dir.DIR_Attr != ATTR_DIRECTORY)
   {
-    return ENOTDIR; // 路径不是目录
+    ret = ENOTDIR; // 路径不是目录
+    goto out;
   }
+  child = Dir.DIR_FstClusLO;
+  dirlock_lock(child, 1);
 
   /** TODO: 检查目录是否为空，如果目录不为空，直接返回-ENOTEMPTY。
    *        注意空目录也可能有"."和".."两个子目录。
@@ -401,7 +376,7 @@ int fat16_rmdir(const char *path)
 
   /*** BEGIN ***/
   BYTE sector_buffer[BYTES_PER_SECTOR];
-  int RootDirCnt = 1, DirSecCnt = 1;
+  int DirSecCnt = 1;
   off_t offset_dir;
   find_root(fat16_ins, &Dir, path, &offset_dir);
 
@@ -425,7 +400,8 @@ int fat16_rmdir(const char *path)
         }
         else
         {
-          return -ENOTEMPTY;
+          ret = -ENOTEMPTY;
+          goto out;
         }
       }
     }
@@ -456,27 +432,30 @@ int fat16_rmdir(const char *path)
   /*** BEGIN ***/
   if (find_root(fat16_ins, &Dir, path, &offset_dir) == 1)
   {
-    return 1;
-  }
-  int m = 0;
-  for (WORD cur_cluster = Dir.DIR_FstClusLO; cur_cluster != 0xFFFF;)
-  {
-    cur_cluster = free_cluster(fat16_ins, cur_cluster);
+    ret = 1;
+    goto out;
   }
+  /* 目录的簇释放后可能被其它目录重用，查找缓存中的偏移量不再可靠 */
+  dcache_invalidate();
+  free_chain(fat16_ins, Dir.DIR_FstClusLO);
   /*** END ***/
 
   // TODO: 删除父目录中的目录项
   // HINT: 如果你正确实现了dir_entry_delete，这里只需要一行代码调用它即可
   //       你也可以使用你在unlink使用的方法。
   /*** BEGIN ***/
-  fseek(fat16_ins->fd, offset_dir, SEEK_SET);
-  BYTE a[1];
-  a[0] = 0xE5;
-  fwrite(a, 1, 1, fat16_ins->fd);
+  dir_entry_delete(fat16_ins, offset_dir);
+  dir_slot_forget(Dir.DIR_FstClusLO);
+  dir_slot_freed(fat16_ins, parent, offset_dir);
+  dircompact_note(parent);
 
   /*** END ***/
 
-  return 0;
+out:
+  if (child >= 0)
+    dirlock_unlock(child);
+  dirlock_unlock(parent);
+  return ret;
 }
 
 // ------------------TASK4: 写文件-----------------------------------
@@ -497,25 +476,14 @@ size_t write_to_cluster_at_offset(FAT16 *fat16_ins, WORD clusterN, off_t offset,
   // printf("write to:%d %d %d \n", clusterN, offset, size);
   // fflush(stdout);
   assert(offset + size <= fat16_ins->ClusterSize); // offset + size 必须小于簇大小
-  BYTE sector_buffer[BYTES_PER_SECTOR];
   /** TODO: 将数据写入簇对应的偏移量上。
    *        你需要找到第一个需要写入的扇区，和要写入的偏移量，然后依次写入后续每个扇区，直到所有数据都写入完成。
    *        注意，offset对应的首个扇区和offset+size对应的最后一个扇区都可能只需要写入一部分。
    *        所以应该先将扇区读出，修改要写入的部分，再写回整个扇区。
    */
   /*** BEGIN ***/
-  int sector_offset = offset % BYTES_PER_SECTOR;
-  int sector_num = offset / BYTES_PER_SECTOR;
-  int sector_num_end = (offset + size) / BYTES_PER_SECTOR;
-  int sector_num_end_offset = (offset + size) % BYTES_PER_SECTOR;
-  // printf("sector_num :%d %d %d %d\n", sector_num, sector_offset, sector_num_end, sector_num_end_offset);
-  // fflush(stdout);
-  WORD FatClusEntryVal;
-  WORD FirstSectorofCluster; // 该簇的第一个扇区号
-  first_sector_by_cluster(fat16_ins, clusterN, &FatClusEntryVal, &FirstSectorofCluster, sector_buffer);
-  fseek(fat16_ins->fd, BYTES_PER_SECTOR * FirstSectorofCluster + offset, SEEK_SET);
-  fwrite(data, size, 1, fat16_ins->fd);
-  fflush(fat16_ins->fd);
+  /* O_DIRECT下首尾不完整的扇区（块）由io_write先读出再修改写回 */
+  io_write(fat16_ins->fd, data, get_cluster_offset(fat16_ins, clusterN) + offset, size);
   /*** END ***/
   return size;
 }
@@ -576,8 +544,14 @@ int file_new_cluster(FAT16 *fat16_ins, DIR_ENTRY *Dir, WORD last_cluster, DWORD
    *        否则修改Dir->DIR_FstClusLO值，使其指向第一个簇。
    */
   /*** BEGIN ***/
-  DWORD new_cluster = alloc_clusters(fat16_ins, count);
+  /* 优先紧接在原文件最后一个簇之后分配，使文件保持连续 */
+  WORD goal = is_cluster_inuse(last_cluster) ? last_cluster + 1 : 0;
+  DWORD new_cluster = alloc_clusters_near(fat16_ins, count, goal);
   // printf("new cluster", new_cluster);
+  if (new_cluster == CLUSTER_END)
+  {
+    return -ENOSPC;
+  }
   if (last_cluster == CLUSTER_END)
   {
     Dir->DIR_FstClusLO = new_cluster;
@@ -590,6 +564,55 @@ int file_new_cluster(FAT16 *fat16_ins, DIR_ENTRY *Dir, WORD last_cluster, DWORD
   return last_cluster;
 }
 
+/**
+ * @brief 为在文件offset处写入length字节做准备：若写入超出文件当前的簇，则分配新簇并连接到文件末尾，
+ *        并计算写入完成后的文件大小。write_file和fat16_write_buf共用这一步骤。
+ *
+ * @param fat16_ins   文件系统指针
+ * @param Dir         要写入的文件目录项，分配首簇时会修改其DIR_FstClusLO
+ * @param offset_dir  find_root返回的offset_dir值
+ * @param offset      文件要写入的位置
+ * @param length      要写入的数据长度（字节）
+ * @param new_size    输出参数，写入完成后的文件大小
+ * @return int        成功返回0，失败返回POSIX错误代码的负值
+ */
+int file_prepare_write(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, off_t offset, size_t length, DWORD *new_size)
+{
+  if (offset + length < offset) // 溢出了
+    return -EINVAL;
+
+  if (offset + length > 0xFFFFFFFF) // 超出了FAT16单个文件的大小上限
+    return -EFBIG;
+
+  if (offset + length <= Dir->DIR_FileSize)
+  {
+    *new_size = Dir->DIR_FileSize;
+    return 0;
+  }
+
+  int64_t new_cluster_count = (offset + length + fat16_ins->ClusterSize - 1) / fat16_ins->ClusterSize;
+  if (fat16_opts.prealloc)
+  {
+    /* 使用缓存的簇链末尾，连续追加时预分配 */
+    int ret = prealloc_extend(fat16_ins, Dir, offset_dir, offset, new_cluster_count);
+    if (ret < 0)
+      return ret;
+    *new_size = offset + length;
+    return 0;
+  }
+
+  int64_t cur_cluster_count;
+  WORD last_cluster = file_last_cluster(fat16_ins, Dir, &cur_cluster_count);
+  if (new_cluster_count > cur_cluster_count)
+  {
+    int ret = file_new_cluster(fat16_ins, Dir, last_cluster, new_cluster_count - cur_cluster_count);
+    if (ret < 0)
+      return ret;
+  }
+  *new_size = offset + length;
+  return 0;
+}
+
 /**
  * @brief 在文件offset的位置写入buff中的数据，数据长度为length。
  *
@@ -606,34 +629,25 @@ int write_file(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, const void *b
   if (length == 0)
     return 0;
 
-  if (offset + length < offset) // 溢出了
-    return -EINVAL;
-
   /** TODO: 通过offset和length，判断文件是否修改文件大小，以及是否需要分配新簇，并正确修改大小和分配簇。
    *  HINT: 可能用到的函数：file_last_cluster, file_new_cluster等
    */
   /*** BEGIN ***/
-  int new_size = offset + length;
-  int new_cluster_count = (new_size + fat16_ins->ClusterSize - 1) / fat16_ins->ClusterSize;
-  if (offset + length > Dir->DIR_FileSize)
+  /* 延迟分配模式下，超出已分配簇的部分先保存在内存中 */
+  if (fat16_opts.delalloc)
   {
-    int64_t cur_cluster_count;
-    WORD last_cluster = file_last_cluster(fat16_ins, Dir, &cur_cluster_count);
-    // printf("last_cluster:%d %d %d\n", last_cluster, cur_cluster_count, new_cluster_count);
-    // fflush(stdout);
-    if (new_cluster_count > cur_cluster_count)
+    int ret = delalloc_write(fat16_ins, Dir, offset_dir, buff, offset, length);
+    if (ret != 0)
     {
-      last_cluster = file_new_cluster(fat16_ins, Dir, last_cluster, new_cluster_count - cur_cluster_count);
-      // printf("new last cluster:%d\n", last_cluster);
+      sfcache_invalidate(Dir->DIR_FstClusLO);
+      return ret;
     }
-
-    // fflush(stdout);
-  }
-  else
-  {
-    new_size = Dir->DIR_FileSize;
   }
 
+  DWORD new_size;
+  int ret = file_prepare_write(fat16_ins, Dir, offset_dir, offset, length, &new_size);
+  if (ret < 0)
+    return ret;
   /*** END ***/
 
   /** TODO: 和read类似，找到对应的偏移，并写入数据。
@@ -641,43 +655,29 @@ int write_file(FAT16 *fat16_ins, DIR_ENTRY *Dir, off_t offset_dir, const void *b
    */
   /*** BEGIN ***/
   // HINT: 记得把修改过的Dir写回目录项（如果你之前没有写回）
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  WORD ClusterN;             // 当前读取的簇号
-  WORD FatClusEntryVal;      // 该簇的FAT表项（大部分情况下，代表下一个簇的簇号，请参考实验文档对FAT表项的说明）
-  WORD FirstSectorofCluster; // 该簇的第一个扇区号
-  int cur_length = 0;        // 当前写的偏移
-  for (ClusterN = Dir->DIR_FstClusLO; cur_length < offset; cur_length += fat16_ins->ClusterSize)
+  FAT16_EXTENT *extents;
+  int extentCnt = file_extent_map(fat16_ins, Dir->DIR_FstClusLO, offset, length, &extents);
+  if (extentCnt < 0)
+    return extentCnt;
+
+  /* 每段连续的簇只需一次写入 */
+  size_t done = 0;
+  for (int i = 0; i < extentCnt; i++)
   {
-    ClusterN = fat_entry_by_cluster(fat16_ins, ClusterN);
-  } //找到正确的第一个要写入的簇号
-  cur_length = 0;
-  for (int step = 0; cur_length < length; step++)
-  {
-    // printf("cur_length:%d\n", cur_length);
-    if (step == 0)
+    if (writeback_write(fat16_ins, (const BYTE *)buff + done, extents[i].offset, extents[i].size) != extents[i].size)
     {
-      int min_size = new_size;
-      if (min_size + offset % fat16_ins->ClusterSize > fat16_ins->ClusterSize)
-        min_size = fat16_ins->ClusterSize - offset % fat16_ins->ClusterSize;
-      write_to_cluster_at_offset(fat16_ins, ClusterN, offset % fat16_ins->ClusterSize, buff, min_size);
-      cur_length += min_size;
-    }
-    else
-    {
-      if (new_size - cur_length <= fat16_ins->ClusterSize)
-      {
-        write_to_cluster_at_offset(fat16_ins, ClusterN, 0, &buff[cur_length], new_size - cur_length);
-        cur_length = new_size;
-      }
-      else
-      {
-        write_to_cluster_at_offset(fat16_ins, ClusterN, 0, &buff[cur_length], fat16_ins->ClusterSize);
-        cur_length += fat16_ins->ClusterSize;
-      }
+      free(extents);
+      return -EIO;
     }
-    ClusterN = fat_entry_by_cluster(fat16_ins, ClusterN);
+    done += extents[i].size;
   }
-  dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, Dir->DIR_Name, 0x20, Dir->DIR_FstClusLO, new_size);
+  free(extents);
+  /* 延迟分配的后台线程可能同时更新目录项，在它的锁下重新读取后再写入大小 */
+  if (fat16_opts.delalloc)
+    delalloc_update_size(fat16_ins, Dir, offset_dir, offset + length);
+  else
+    dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, (char *)Dir->DIR_Name, 0x20, Dir->DIR_FstClusLO, new_size);
+  sfcache_invalidate(Dir->DIR_FstClusLO);
   /*** END ***/
   return length;
 }
@@ -703,12 +703,115 @@ int fat16_write(const char *path, const char *data, size_t size, off_t offset,
   DIR_ENTRY Dir;
   off_t offset_dir;
   find_root(fat16_ins, &Dir, path, &offset_dir);
+  kcache_changed(offset_dir);
+  iosched_set_stream(offset_dir);
   return write_file(fat16_ins, &Dir, offset_dir, data, offset, size);
 
   /*** END ***/
   return 0;
 }
 
+/**
+ * @brief fat16_write的零拷贝版本。簇的分配与目录项的更新和write_file相同，
+ *        数据则通过fuse_buf_copy按连续簇段直接写入镜像文件的对应位置，
+ *        当请求数据仍在/dev/fuse的管道中时，libfuse会使用splice，不经过用户态缓冲区。
+ *
+ * @param path    要写入的文件的路径
+ * @param buf     libfuse传入的数据缓冲区
+ * @param offset  文件中要写入数据的偏移量（字节）
+ * @param fi      本次实验可忽略该参数
+ * @return int    成功返回写入的字节数，失败返回POSIX错误代码的负值。
+ */
+int fat16_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                    struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = get_fat16_ins_fix();
+  size_t length = fuse_buf_size(buf);
+
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) != 0)
+    return -ENOENT;
+
+  if (length == 0)
+    return 0;
+  kcache_changed(offset_dir);
+  iosched_set_stream(offset_dir);
+
+  /* 延迟分配模式下先把数据复制到内存，由write_file决定写入簇还是待分配区 */
+  if (fat16_opts.delalloc)
+  {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(length);
+    dst.buf[0].mem = malloc(length);
+    ssize_t res = fuse_buf_copy(&dst, buf, 0);
+    if (res > 0)
+      res = write_file(fat16_ins, &Dir, offset_dir, dst.buf[0].mem, offset, res);
+    free(dst.buf[0].mem);
+    return res;
+  }
+
+  DWORD new_size;
+  int ret = file_prepare_write(fat16_ins, &Dir, offset_dir, offset, length, &new_size);
+  if (ret < 0)
+    return ret;
+
+  FAT16_EXTENT *extents;
+  int extentCnt = file_extent_map(fat16_ins, Dir.DIR_FstClusLO, offset, length, &extents);
+  if (extentCnt < 0)
+    return extentCnt;
+
+  /* fuse_buf_copy会推进buf中的位置，因此依次复制到每一段即可。
+   * 开启回写缓存时数据先复制到内存，再交给回写缓存；O_DIRECT的镜像不能splice，同样先复制到对齐的内存 */
+  ssize_t done = 0;
+  for (int i = 0; i < extentCnt; i++)
+  {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(extents[i].size);
+    if (fat16_opts.writeback || io_direct_enabled())
+    {
+      dst.buf[0].mem = io_alloc(extents[i].size);
+    }
+    else
+    {
+      /* splice直接写入镜像，不能被批次中尚未提交的写入（例如补零）覆盖 */
+      io_batch_flush();
+      dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst.buf[0].fd = fileno(fat16_ins->fd);
+      dst.buf[0].pos = extents[i].offset;
+    }
+
+    /* splice写入镜像同样经过调度器，复制到内存时由之后的io_write调度 */
+    int spliced = dst.buf[0].mem == NULL;
+    if (spliced)
+      iosched_begin(IOSCHED_DATA, extents[i].size);
+    ssize_t res = fuse_buf_copy(&dst, buf, 0);
+    if (spliced)
+      iosched_end(IOSCHED_DATA);
+    if (dst.buf[0].mem == NULL && res > 0)
+      readahead_invalidate(extents[i].offset, res);
+    if (dst.buf[0].mem != NULL)
+    {
+      if (res > 0)
+        writeback_write(fat16_ins, dst.buf[0].mem, extents[i].offset, res);
+      free(dst.buf[0].mem);
+    }
+    if (res < 0)
+    {
+      free(extents);
+      return res;
+    }
+    done += res;
+    if ((size_t)res < extents[i].size)
+      break;
+  }
+  free(extents);
+
+  /* 只写入了一部分时，文件大小以实际写入的数据为准 */
+  new_size = offset + done > Dir.DIR_FileSize ? offset + done : Dir.DIR_FileSize;
+  dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, (char *)Dir.DIR_Name, 0x20, Dir.DIR_FstClusLO, new_size);
+  sfcache_invalidate(Dir.DIR_FstClusLO);
+  return done;
+}
+
 /**
  * @brief 将path对应的文件大小改为size，注意size可以大于小于或等于原文件大小。
  *        若size大于原文件大小，需要将拓展的部分全部置为0，如有需要，需要分配新簇。
@@ -729,6 +832,14 @@ int fat16_truncate(const char *path, off_t size)
   off_t offset_dir;
   find_root(fat16_ins, &Dir, path, &offset_dir);
 
+  /* 先为延迟分配的数据分配簇，再按目录项中的大小截断 */
+  int flushed = delalloc_flush_file(offset_dir);
+  if (flushed < 0)
+    return flushed;
+  if (flushed > 0)
+    find_root(fat16_ins, &Dir, path, &offset_dir);
+  prealloc_forget(offset_dir);
+
   // 当前文件已有簇的数量，以及截断或增长后，文件所需的簇数量。
   int64_t cur_cluster_count;
   WORD last_cluster = file_last_cluster(fat16_ins, &Dir, &cur_cluster_count);
@@ -741,13 +852,16 @@ int fat16_truncate(const char *path, off_t size)
   {
     return 0;
   }
-  else if (old_size < new_size)
+  kcache_changed(offset_dir);
+  if (old_size < new_size)
   {
     /** TODO: 增大文件大小，注意是否需要分配新簇，以及往新分配的空间填充0等 **/
     /*** BEGIN ***/
     if (new_cluster_count > cur_cluster_count)
     {
-      last_cluster = file_new_cluster(fat16_ins, Dir, last_cluster, new_cluster_count - cur_cluster_count);
+      int ret = file_new_cluster(fat16_ins, &Dir, last_cluster, new_cluster_count - cur_cluster_count);
+      if (ret < 0)
+        return ret;
     }
     /*** END ***/
   }
@@ -755,22 +869,102 @@ int fat16_truncate(const char *path, off_t size)
   { // 截断文件
     /** TODO: 截断文件，注意是否需要释放簇等 **/
     /*** BEGIN ***/
+    /* 找到截断后保留的最后一个簇，之后的簇链整体释放 */
+    WORD prev_cluster = CLUSTER_END;
     WORD cur_cluster = Dir.DIR_FstClusLO;
-    for(int count=0; count<new_cluster_count; count++)
+    for (int count = 0; count < new_cluster_count && is_cluster_inuse(cur_cluster); count++)
     {
-      if(cur_cluster == 0 or cur_cluster == 0xFFFF)
-      {
-        break;
-      }
+      prev_cluster = cur_cluster;
       cur_cluster = fat_entry_by_cluster(fat16_ins, cur_cluster);
     }
-    while( cur_cluster != 0xFFFF)
+    if (is_cluster_inuse(cur_cluster))
     {
-      cur_cluster = free_cluster(fat16_ins, cur_cluster);
+      if (prev_cluster == CLUSTER_END)
+        Dir.DIR_FstClusLO = CLUSTER_END;
+      else
+        write_fat_entry(fat16_ins, prev_cluster, CLUSTER_END);
+      free_chain(fat16_ins, cur_cluster);
     }
     /*** END ***/
   }
-  dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, Dir->DIR_Name, 0x20, Dir->DIR_FstClusLO, new_size);
+  dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, (char *)Dir.DIR_Name, 0x20, Dir.DIR_FstClusLO, new_size);
+  sfcache_invalidate(Dir.DIR_FstClusLO);
+
+  return 0;
+}
+
+/**
+ * @brief 为path对应的文件预留[offset, offset + length)范围的簇。
+ *        mode为0时文件大小扩展到offset + length，扩展的部分以0填充；
+ *        mode为FALLOC_FL_KEEP_SIZE时只分配簇，文件大小不变，之后的写入直接使用这些簇。
+ *
+ * @param path    文件路径
+ * @param mode    0或FALLOC_FL_KEEP_SIZE，不支持打洞等其它模式
+ * @param offset  预留范围的起始位置
+ * @param length  预留范围的长度
+ * @param fi      忽略
+ * @return int    成功返回0，失败返回POSIX错误代码的负值
+ */
+int fat16_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi)
+{
+  FAT16 *fat16_ins = get_fat16_ins_fix();
+
+  if (mode & ~FALLOC_FL_KEEP_SIZE)
+    return -EOPNOTSUPP;
+  if (offset < 0 || length <= 0)
+    return -EINVAL;
+  if (offset + length > 0xFFFFFFFF) // 超出了FAT16单个文件的大小上限
+    return -EFBIG;
 
+  DIR_ENTRY Dir;
+  off_t offset_dir;
+  if (find_root(fat16_ins, &Dir, path, &offset_dir) != 0)
+    return -ENOENT;
+  if (Dir.DIR_Attr == ATTR_DIRECTORY)
+    return -EISDIR;
+
+  int flushed = delalloc_flush_file(offset_dir);
+  if (flushed < 0)
+    return flushed;
+  if (flushed > 0)
+    find_root(fat16_ins, &Dir, path, &offset_dir);
+  prealloc_forget(offset_dir);
+
+  DWORD end = offset + length;
+  int64_t cur_cluster_count;
+  WORD last_cluster = file_last_cluster(fat16_ins, &Dir, &cur_cluster_count);
+  int64_t new_cluster_count = (end + fat16_ins->ClusterSize - 1) / fat16_ins->ClusterSize;
+  if (new_cluster_count > cur_cluster_count)
+  {
+    int ret = file_new_cluster(fat16_ins, &Dir, last_cluster, new_cluster_count - cur_cluster_count);
+    if (ret < 0)
+      return ret;
+  }
+
+  DWORD new_size = Dir.DIR_FileSize;
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > Dir.DIR_FileSize)
+  {
+    /* 新分配的簇和原来最后一个簇的剩余部分可能有旧数据，扩展的范围全部写0 */
+    FAT16_EXTENT *extents;
+    int extentCnt = file_extent_map(fat16_ins, Dir.DIR_FstClusLO, Dir.DIR_FileSize, end - Dir.DIR_FileSize, &extents);
+    if (extentCnt < 0)
+      return extentCnt;
+    BYTE *zero = calloc(1, fat16_ins->ClusterSize);
+    for (int i = 0; i < extentCnt; i++)
+    {
+      for (size_t done = 0; done < extents[i].size; done += fat16_ins->ClusterSize)
+      {
+        size_t len = extents[i].size - done < fat16_ins->ClusterSize ? extents[i].size - done : fat16_ins->ClusterSize;
+        writeback_write(fat16_ins, zero, extents[i].offset + done, len);
+      }
+    }
+    free(zero);
+    free(extents);
+    new_size = end;
+    kcache_changed(offset_dir);
+  }
+  dir_entry_create(fat16_ins, offset_dir / BYTES_PER_SECTOR, offset_dir % BYTES_PER_SECTOR, (char *)Dir.DIR_Name, 0x20, Dir.DIR_FstClusLO, new_size);
+  sfcache_invalidate(Dir.DIR_FstClusLO);
   return 0;
 }